@@ -0,0 +1,298 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "archive.h"
+
+static void free_writer(archive_writer *writer) {
+    int i;
+    for (i = 0; i < writer -> module_count; i++)
+        free(writer -> modules[i].name);
+    free(writer -> modules);
+    free(writer -> path);
+    free(writer -> temporary_path);
+    pthread_mutex_destroy(&writer -> lock);
+}
+
+int archive_create(archive_writer *writer, const char *path, int module_count) {
+    static const unsigned char empty_header[ARCHIVE_HEADER_SIZE] = { 0 };
+
+    writer -> path = malloc(strlen(path) + 1);
+    writer -> temporary_path = malloc(strlen(path) + 32);
+    writer -> modules = calloc(module_count > 0 ? module_count : 1, sizeof(archive_module));
+    writer -> module_count = module_count;
+    writer -> file = NULL;
+    pthread_mutex_init(&writer -> lock, NULL);
+    if (!writer -> path || !writer -> temporary_path || !writer -> modules) {
+        free_writer(writer);
+        errno = ENOMEM;
+        return 0;
+    }
+    strcpy(writer -> path, path);
+    sprintf(writer -> temporary_path, "%s.tmp.%ld", path, (long) getpid());
+
+    /* the header is written again by archive_finish, once the index is known */
+    writer -> file = fopen(writer -> temporary_path, "wb");
+    if (!writer -> file || fwrite(empty_header, 1, ARCHIVE_HEADER_SIZE, writer -> file) != ARCHIVE_HEADER_SIZE) {
+        int error = errno;
+        archive_discard(writer);
+        errno = error;
+        return 0;
+    }
+    writer -> size = ARCHIVE_HEADER_SIZE;
+    return 1;
+}
+
+int archive_add(archive_writer *writer, int slot, const char *name, assembly_output *output) {
+    archive_module *module = &writer -> modules[slot];
+    char *copy;
+    int kind, success = 1;
+
+    for (kind = 0; kind < ARCHIVE_OUTPUT_KINDS && !produced_file(output, kind); kind++)
+        ;
+    if (kind == ARCHIVE_OUTPUT_KINDS)
+        return 1; /* nothing to keep, like a run that writes no files */
+
+    copy = malloc(strlen(name) + 1);
+    if (!copy) {
+        errno = ENOMEM;
+        return 0;
+    }
+    strcpy(copy, name);
+
+    pthread_mutex_lock(&writer -> lock);
+    for (kind = 0; kind < ARCHIVE_OUTPUT_KINDS; kind++) {
+        memory_file *contents = produced_file(output, kind);
+        module -> offsets[kind] = writer -> size;
+        if (!contents) {
+            module -> lengths[kind] = ARCHIVE_NOT_PRODUCED;
+            continue;
+        }
+        if (fwrite(contents -> data, 1, contents -> size, writer -> file) != contents -> size) {
+            success = 0;
+            break;
+        }
+        module -> lengths[kind] = contents -> size;
+        writer -> size += contents -> size;
+    }
+    if (success) {
+        free(module -> name);
+        module -> name = copy;
+    }
+    pthread_mutex_unlock(&writer -> lock);
+
+    if (!success)
+        free(copy);
+    return success;
+}
+
+/* this function puts every named module in the hash table. buckets hold slot + 1 while
+   it runs; a later slot with the same name takes the bucket and the earlier one is dropped */
+static void fill_buckets(archive_writer *writer, unsigned long *buckets, unsigned long bucket_count) {
+    int slot;
+    for (slot = 0; slot < writer -> module_count; slot++) {
+        const char *name = writer -> modules[slot].name;
+        unsigned long bucket;
+        if (!name)
+            continue;
+        bucket = hash_indexed_name(name, strlen(name)) & (bucket_count - 1);
+        while (buckets[bucket] && strcmp(writer -> modules[buckets[bucket] - 1].name, name) != 0)
+            bucket = (bucket + 1) & (bucket_count - 1);
+        if (buckets[bucket]) {
+            free(writer -> modules[buckets[bucket] - 1].name);
+            writer -> modules[buckets[bucket] - 1].name = NULL;
+        }
+        buckets[bucket] = slot + 1;
+    }
+}
+
+/* this function writes the index at the end of the data and the header at the start */
+static int write_index(archive_writer *writer) {
+    unsigned long *buckets, *numbers, bucket_count, module_count = 0, name_offset, i;
+    unsigned char header[ARCHIVE_HEADER_SIZE];
+    int slot, kind, success = 1;
+
+    for (slot = 0; slot < writer -> module_count; slot++)
+        if (writer -> modules[slot].name)
+            module_count++;
+    bucket_count = indexed_bucket_count(module_count);
+    buckets = calloc(bucket_count, sizeof(unsigned long));
+    numbers = calloc(writer -> module_count > 0 ? writer -> module_count : 1, sizeof(unsigned long));
+    if (!buckets || !numbers) {
+        free(buckets);
+        free(numbers);
+        errno = ENOMEM;
+        return 0;
+    }
+    fill_buckets(writer, buckets, bucket_count);
+
+    /* the modules are numbered in the order of the command line, without the dropped ones */
+    module_count = 0;
+    for (slot = 0; slot < writer -> module_count; slot++)
+        if (writer -> modules[slot].name)
+            numbers[slot] = ++module_count;
+    for (i = 0; i < bucket_count && success; i++)
+        success = write_indexed_number(writer -> file, buckets[i] ? numbers[buckets[i] - 1] : 0);
+
+    name_offset = writer -> size + bucket_count * ARCHIVE_NUMBER_SIZE + module_count * ARCHIVE_MODULE_SIZE;
+    for (slot = 0; slot < writer -> module_count && success; slot++) {
+        archive_module *module = &writer -> modules[slot];
+        if (!module -> name)
+            continue;
+        success = write_indexed_number(writer -> file, name_offset) && write_indexed_number(writer -> file, strlen(module -> name));
+        for (kind = 0; kind < ARCHIVE_OUTPUT_KINDS && success; kind++)
+            success = write_indexed_number(writer -> file, module -> offsets[kind]) && write_indexed_number(writer -> file, module -> lengths[kind]);
+        name_offset += strlen(module -> name);
+    }
+    for (slot = 0; slot < writer -> module_count && success; slot++) {
+        const char *name = writer -> modules[slot].name;
+        if (name)
+            success = fwrite(name, 1, strlen(name), writer -> file) == strlen(name);
+    }
+
+    memcpy(header, ARCHIVE_MAGIC, ARCHIVE_NUMBER_SIZE);
+    put_indexed_number(header + ARCHIVE_NUMBER_SIZE, writer -> size);
+    put_indexed_number(header + 2 * ARCHIVE_NUMBER_SIZE, module_count);
+    put_indexed_number(header + 3 * ARCHIVE_NUMBER_SIZE, bucket_count);
+    if (success)
+        success = fseek(writer -> file, 0, SEEK_SET) == 0 && fwrite(header, 1, ARCHIVE_HEADER_SIZE, writer -> file) == ARCHIVE_HEADER_SIZE;
+
+    free(buckets);
+    free(numbers);
+    return success;
+}
+
+int archive_finish(archive_writer *writer) {
+    int success, error;
+
+    success = write_index(writer);
+    error = errno;
+    if (ferror(writer -> file) | fclose(writer -> file)) {
+        if (success)
+            error = errno;
+        success = 0;
+    }
+    writer -> file = NULL;
+    if (success && rename(writer -> temporary_path, writer -> path) < 0) {
+        error = errno;
+        success = 0;
+    }
+    if (!success)
+        unlink(writer -> temporary_path);
+    free_writer(writer);
+    errno = error;
+    return success;
+}
+
+void archive_discard(archive_writer *writer) {
+    if (writer -> file) {
+        fclose(writer -> file);
+        unlink(writer -> temporary_path);
+    }
+    free_writer(writer);
+}
+
+static const unsigned char *module_record(const archive_reader *reader, unsigned long module) {
+    return reader -> data + reader -> index_offset + reader -> bucket_count * ARCHIVE_NUMBER_SIZE + module * ARCHIVE_MODULE_SIZE;
+}
+
+/* this function checks that the index and every part of every module is inside the archive */
+static int valid_archive(const archive_reader *reader) {
+    unsigned long module;
+    int kind;
+
+    if (reader -> bucket_count == 0 || (reader -> bucket_count & (reader -> bucket_count - 1)) != 0 || reader -> module_count >= reader -> bucket_count)
+        return 0;
+    if (!indexed_table_inside(reader -> size, reader -> index_offset, reader -> bucket_count, ARCHIVE_NUMBER_SIZE) ||
+        !indexed_table_inside(reader -> size, reader -> index_offset + reader -> bucket_count * ARCHIVE_NUMBER_SIZE, reader -> module_count, ARCHIVE_MODULE_SIZE))
+        return 0;
+    for (module = 0; module < reader -> module_count; module++) {
+        const unsigned char *record = module_record(reader, module);
+        if (!indexed_range_inside(reader -> size, get_indexed_number(record), get_indexed_number(record + ARCHIVE_NUMBER_SIZE)))
+            return 0;
+        for (kind = 0; kind < ARCHIVE_OUTPUT_KINDS; kind++) {
+            unsigned long length = get_indexed_number(record + (2 + 2 * kind + 1) * ARCHIVE_NUMBER_SIZE);
+            if (length != ARCHIVE_NOT_PRODUCED && !indexed_range_inside(reader -> size, get_indexed_number(record + (2 + 2 * kind) * ARCHIVE_NUMBER_SIZE), length))
+                return 0;
+        }
+    }
+    return 1;
+}
+
+int archive_open(archive_reader *reader, const char *path) {
+    struct stat info;
+    void *data;
+    int descriptor = open(path, O_RDONLY);
+
+    if (descriptor < 0)
+        return 0;
+    if (fstat(descriptor, &info) < 0) {
+        close(descriptor);
+        return 0;
+    }
+    if ((size_t) info.st_size < ARCHIVE_HEADER_SIZE) {
+        close(descriptor);
+        errno = EINVAL;
+        return 0;
+    }
+    data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (data == MAP_FAILED)
+        return 0;
+
+    reader -> data = data;
+    reader -> size = info.st_size;
+    reader -> index_offset = get_indexed_number(reader -> data + ARCHIVE_NUMBER_SIZE);
+    reader -> module_count = get_indexed_number(reader -> data + 2 * ARCHIVE_NUMBER_SIZE);
+    reader -> bucket_count = get_indexed_number(reader -> data + 3 * ARCHIVE_NUMBER_SIZE);
+    if (memcmp(reader -> data, ARCHIVE_MAGIC, ARCHIVE_NUMBER_SIZE) != 0 || !valid_archive(reader)) {
+        archive_close(reader);
+        errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
+
+void archive_close(archive_reader *reader) {
+    munmap((void *) reader -> data, reader -> size);
+    reader -> data = NULL;
+    reader -> size = 0;
+}
+
+long archive_find(const archive_reader *reader, const char *name) {
+    size_t length = strlen(name), name_length;
+    unsigned long bucket = hash_indexed_name(name, length) & (reader -> bucket_count - 1), probes;
+
+    for (probes = 0; probes < reader -> bucket_count; probes++) {
+        unsigned long number = get_indexed_number(reader -> data + reader -> index_offset + bucket * ARCHIVE_NUMBER_SIZE);
+        const char *module_name;
+        if (number == 0 || number > reader -> module_count)
+            return -1;
+        module_name = archive_module_name(reader, number - 1, &name_length);
+        if (name_length == length && memcmp(module_name, name, length) == 0)
+            return (long) (number - 1);
+        bucket = (bucket + 1) & (reader -> bucket_count - 1);
+    }
+    return -1;
+}
+
+const char *archive_module_name(const archive_reader *reader, unsigned long module, size_t *length) {
+    const unsigned char *record = module_record(reader, module);
+    *length = get_indexed_number(record + ARCHIVE_NUMBER_SIZE);
+    return (const char *) reader -> data + get_indexed_number(record);
+}
+
+int archive_module_output(const archive_reader *reader, unsigned long module, int kind, memory_file *contents) {
+    const unsigned char *record = module_record(reader, module);
+    unsigned long length = get_indexed_number(record + (2 + 2 * kind + 1) * ARCHIVE_NUMBER_SIZE);
+
+    if (length == ARCHIVE_NOT_PRODUCED)
+        return 0;
+    contents -> data = (char *) reader -> data + get_indexed_number(record + (2 + 2 * kind) * ARCHIVE_NUMBER_SIZE);
+    contents -> size = length;
+    return 1;
+}
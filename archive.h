@@ -0,0 +1,142 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "memory_file.h"
+#include "indexed_file.h"
+
+/*
+ * An archive (.asmar) holds the outputs of many modules in one file, so a big
+ * batch creates one file instead of one per output. All numbers are 8 byte
+ * little endian.
+ *
+ *   header   - ARCHIVE_MAGIC, the offset of the index, the number of modules
+ *              and the number of buckets.
+ *   data     - the outputs of the modules, one after the other.
+ *   index    - the buckets: a hash table of the modules by name, each bucket is
+ *              0 (empty) or the number of a module + 1. Collisions go on to the
+ *              next bucket, so a lookup reads about one bucket.
+ *              then the modules: the offset and length of the name, then the
+ *              offset and length of each output (.am, .ob, .ent, .ext), with
+ *              ARCHIVE_NOT_PRODUCED as the length of an output that does not exist.
+ *              then the names.
+ */
+#define ARCHIVE_MAGIC "ASMAR\n\001\000"       /* The first 8 bytes of every archive */
+#define ARCHIVE_NUMBER_SIZE INDEXED_NUMBER_SIZE /* Bytes in every number */
+#define ARCHIVE_HEADER_SIZE (4 * ARCHIVE_NUMBER_SIZE)
+#define ARCHIVE_MODULE_SIZE ((2 + 2 * ARCHIVE_OUTPUT_KINDS) * ARCHIVE_NUMBER_SIZE)
+#define ARCHIVE_NOT_PRODUCED 0xffffffffUL     /* The length of an output the module does not have */
+#define ARCHIVE_OUTPUT_KINDS 4                /* The outputs kept for a module: .am, .ob, .ent and .ext, never .d */
+
+/* Where the outputs of one module are in the archive */
+typedef struct {
+    char *name;                              /* The module name (the input file name without .as), NULL if absent */
+    unsigned long offsets[ARCHIVE_OUTPUT_KINDS]; /* Where each output starts */
+    unsigned long lengths[ARCHIVE_OUTPUT_KINDS]; /* Its length, or ARCHIVE_NOT_PRODUCED */
+} archive_module;
+
+/* An archive being written. Modules may be added from several threads. */
+typedef struct {
+    char *path;                   /* The archive */
+    char *temporary_path;         /* Where it is written until it is complete */
+    FILE *file;
+    unsigned long size;           /* Bytes written so far */
+    archive_module *modules;      /* One slot per input file, in the order of the command line */
+    int module_count;
+    pthread_mutex_t lock;         /* Guards the file and the modules */
+} archive_writer;
+
+/* An archive opened for reading, mapped into memory */
+typedef struct {
+    const unsigned char *data;    /* The whole archive */
+    size_t size;
+    unsigned long module_count;
+    unsigned long bucket_count;
+    unsigned long index_offset;
+} archive_reader;
+
+/*
+ * Starts writing an archive. It is written under a temporary name and only
+ * replaces path once archive_finish succeeded.
+ *
+ * Parameters:
+ *   writer - The archive to start.
+ *   path - Where the archive goes.
+ *   module_count - Number of input files, each one has a slot.
+ *
+ * Returns:
+ *   1 on success, 0 on failure (errno tells why).
+ */
+int archive_create(archive_writer *writer, const char *path, int module_count);
+
+/*
+ * Appends the outputs of one module. A module without any output is left out.
+ * If two slots have the same name, the later one wins, like a file written twice.
+ *
+ * Parameters:
+ *   writer - The archive.
+ *   slot - The index of the input file.
+ *   name - The module name.
+ *   output - Its outputs.
+ *
+ * Returns:
+ *   1 on success, 0 on failure (errno tells why).
+ */
+int archive_add(archive_writer *writer, int slot, const char *name, assembly_output *output);
+
+/*
+ * Writes the index and puts the archive in place. The writer is freed either way.
+ *
+ * Returns:
+ *   1 on success, 0 on failure (errno tells why).
+ */
+int archive_finish(archive_writer *writer);
+
+/*
+ * Drops an archive that is being written, the temporary file is removed.
+ */
+void archive_discard(archive_writer *writer);
+
+/*
+ * Opens an archive for reading.
+ *
+ * Returns:
+ *   1 on success, 0 if it can not be read or is not an archive (errno tells why).
+ */
+int archive_open(archive_reader *reader, const char *path);
+
+/*
+ * Closes an archive opened for reading.
+ */
+void archive_close(archive_reader *reader);
+
+/*
+ * Finds a module by name through the hash index.
+ *
+ * Returns:
+ *   The number of the module, or -1 if the archive does not have it.
+ */
+long archive_find(const archive_reader *reader, const char *name);
+
+/*
+ * Returns the name of a module (not null terminated) and its length.
+ */
+const char *archive_module_name(const archive_reader *reader, unsigned long module, size_t *length);
+
+/*
+ * Gets one output of a module, it points into the archive and is not copied.
+ *
+ * Parameters:
+ *   reader - The archive.
+ *   module - The number of the module.
+ *   kind - The kind of output, see output_extension.
+ *   contents - Receives the output.
+ *
+ * Returns:
+ *   1 if the module has this output, 0 otherwise.
+ */
+int archive_module_output(const archive_reader *reader, unsigned long module, int kind, memory_file *contents);
+
+#endif
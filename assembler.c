@@ -1,69 +1,881 @@
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "assembler.h"
 #include "intialize_data_struct.h"
+#include "console.h"
+#include "worker_pool.h"
+#include "jobserver.h"
+#include "batch.h"
+#include "io_backend.h"
+#include "server.h"
+#include "cache.h"
+#include "watch.h"
+#include "archive.h"
+#include "libasm.h"
+#include "macro_library.h"
 
-int main(int argc, char *argv[]) {
-    char *input_file_name, *as_file_name, *am_file_name;
-    int first_pass_success;
+/* The options of a run that decide how the files are assembled */
+typedef struct {
+    int job_count;                /* Number of workers (-j), 0 or 1 for one */
+    int io_batch_size;            /* Files read and written together (--io-batch) */
+    io_backend_kind backend_kind; /* How the files are read and written (--io-backend) */
+    output_cache *cache;          /* Outputs of sources assembled before (--cache), or NULL */
+    int mode;                     /* ASSEMBLE_FULL, ASSEMBLE_CHECK (--check) or ASSEMBLE_SIZES (--sizes) */
+    int emit_expanded;            /* 1 if the .am files are written too (--emit-am) */
+    int pipelined;                /* 1 if the extension and the first pass of a file run at the same time (--pipeline) */
+    const macro_library *macro_library; /* Macros the files may call without defining them (--macro-lib), or NULL */
+    char macro_library_key[HASH_TEXT_SIZE]; /* The hash of the macro library for the cache keys, "" if not needed */
+    long macro_budget;            /* Lines one macro call may expand to (--macro-budget) */
+    int emit_dependencies;        /* 1 if the .d files are written too (-MD) */
+    int macro_profile;            /* What is printed about the macros of each file (--macro-profile) */
+    archive_writer *archive;      /* Where the outputs go instead of separate files (--archive), or NULL */
+} assembly_options;
+
+/* A macro library opened for --macro-lib. It stays open after the run, so the requests of a server
+   that name the same library use it without mapping and checking it again, until its file changes */
+typedef struct opened_library {
+    char *path;                   /* The path it was opened with */
+    macro_library library;
+    dev_t device;                 /* Together with the rest, tells whether the file changed since */
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+    char key[HASH_TEXT_SIZE];     /* The hash of its contents, "" until a run with a cache needs it */
+    struct opened_library *next;  /* The next library opened before */
+} opened_library;
+
+static opened_library *opened_libraries = NULL; /* run_command is never run by two threads at once */
+
+/* The state of a run over all the input files: the outcome of each file
+   and the next file whose output should be printed. */
+typedef struct {
+    char **file_names;            /* The input file names (without extension) */
+    int file_count;               /* Number of input files */
+    int window_size;              /* Number of files read, assembled and written together */
+    io_backend_kind backend_kind; /* How the files are read and written */
+    output_cache *cache;          /* Outputs of sources assembled before, or NULL */
+    int mode;                     /* ASSEMBLE_FULL, ASSEMBLE_CHECK or ASSEMBLE_SIZES */
+    int emit_expanded;            /* 1 if the .am files are written too */
+    int pass_jobs;                /* Workers for the first pass of a file, more than 1 only for a single file */
+    int pipelined;                /* 1 if the extension and the first pass of a file run at the same time */
+    const macro_library *macro_library; /* Macros the files may call without defining them, or NULL */
+    const char *macro_library_key; /* The hash of the macro library, "" without one */
+    long macro_budget;            /* Lines one macro call may expand to */
+    int emit_dependencies;        /* 1 if the .d files are written too */
+    int macro_profile;            /* What is printed about the macros of each file */
+    archive_writer *archive;      /* Where the outputs go instead of separate files, or NULL */
+    console_buffer *outputs;      /* The captured console output of each file */
+    int *results;                 /* The outcome of each file (FILE_SUCCEEDED, FILE_HAS_ERRORS, ...) */
+    int *finished;                /* 1 once the file was assembled and its outputs written */
+    int next_to_print;            /* All files before this one were already printed */
+    pthread_mutex_t lock;         /* Guards finished and next_to_print */
+} assembly_run;
+
+/* A window of consecutive files. Its sources are read in one batch and its
+   outputs written in another, so the backend can keep many requests in flight. */
+typedef struct {
+    int first;                    /* The index of the window's first file in the run */
+    int count;                    /* Number of files in the window */
+    int failed;                   /* 1 if the window could not be set up (out of memory) */
+    int writes_failed;            /* 1 if the writes could not be set up (out of memory) */
+    io_file *sources;             /* The .as file of each file */
+    io_batch reads;               /* Reads all the sources */
+    assembly_output *products;    /* What the assembler produced for each file */
+    io_file *targets;             /* The output files to write, grouped by input file */
+    io_batch writes;              /* Writes all the targets */
+} file_window;
+
+/* this function returns a new string of the base name followed by the extension */
+static char *file_name_with_extension(const char *base_name, const char *extension) {
+    char *name = malloc(strlen(base_name) + strlen(extension) + 1);
+    if (!name)
+        return NULL;
+    strcpy(name, base_name);
+    strcat(name, extension);
+    return name;
+}
+
+/* this function frees everything a window holds */
+static void close_window(file_window *window) {
     int i;
 
-    /* Step 1: Check command-line arguments */
-    if (argc < 2) {
-        printf("Usage: %s <input_file_name(s)>\n", argv[0]);
-        return 1;
+    if (window -> sources) {
+        for (i = 0; i < window -> count; i++) {
+            free((char *) window -> sources[i].path);
+            free_memory_file(&window -> sources[i].contents);
+        }
+    }
+    if (window -> products) {
+        for (i = 0; i < window -> count; i++)
+            free_assembly_output(&window -> products[i]);
+    }
+    if (window -> targets) {
+        for (i = 0; i < window -> writes.count; i++)
+            free((char *) window -> targets[i].path);
     }
+    free(window -> sources);
+    free(window -> products);
+    free(window -> targets);
+    window -> sources = NULL;
+    window -> products = NULL;
+    window -> targets = NULL;
+}
 
-    /* Step 2: Loop over all input files provided as arguments */
-    for (i = 1; i < argc; i++) {
-        /* Get the input file name without an extension */
-        input_file_name = argv[i];
+/* this function sets up the window of count files starting at first, and starts reading their sources */
+static void open_window(assembly_run *run, file_window *window, io_backend *backend, int first, int count) {
+    int i;
 
-        /* Prepare the name for the .as file (for macro extension) */
-        as_file_name = malloc(strlen(input_file_name) + 4); /* Allocate space for ".as" extension */
-        if (!as_file_name) {
-            printf("Memory allocation failed\n");
-            return 1;
+    window -> first = first;
+    window -> count = count;
+    window -> failed = 0;
+    window -> writes_failed = 0;
+    window -> sources = calloc(count, sizeof(io_file));
+    window -> products = calloc(count, sizeof(assembly_output));
+    window -> targets = calloc(count * OUTPUT_KINDS, sizeof(io_file));
+    window -> writes.count = 0;
+    if (!window -> sources || !window -> products || !window -> targets) {
+        window -> failed = 1;
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        window -> sources[i].path = file_name_with_extension(run -> file_names[first + i], ".as");
+        if (!window -> sources[i].path)
+            window -> failed = 1;
+        initialize_assembly_output(&window -> products[i]);
+    }
+    if (window -> failed)
+        return;
+
+    window -> reads.files = window -> sources;
+    window -> reads.count = count;
+    io_batch_start_read(backend, &window -> reads);
+}
+
+/* this function writes the options that change the outputs of a file into flags (MAX_CACHE_FLAGS_LENGTH
+   characters), they are part of its cache key. a macro library is named by the hash of its contents,
+   and a macro budget only when it is not the default one */
+static void output_flags(const assembly_run *run, char *flags) {
+    switch (run -> mode) {
+        case ASSEMBLE_CHECK:
+            strcpy(flags, "check");
+            break;
+        case ASSEMBLE_SIZES:
+            strcpy(flags, "sizes");
+            break;
+        default:
+            strcpy(flags, run -> emit_expanded ? "am" : "");
+    }
+    if (*run -> macro_library_key)
+        sprintf(flags + strlen(flags), " mlib=%s", run -> macro_library_key);
+    if (run -> macro_budget != DEFAULT_MACRO_BUDGET)
+        sprintf(flags + strlen(flags), " budget=%ld", run -> macro_budget);
+    if (run -> emit_dependencies)
+        strcat(flags, " md");
+    if (run -> macro_profile != MACRO_PROFILE_OFF)
+        strcat(flags, run -> macro_profile == MACRO_PROFILE_JSON ? " profile=json" : " profile=text");
+}
+
+/* this function creates the context the files of a run are assembled with, returns NULL if memory allocation failed */
+static asm_ctx *create_run_context(const assembly_run *run) {
+    asm_ctx *ctx = asm_ctx_create();
+    if (ctx) {
+        asm_ctx_set_mode(ctx, run -> mode);
+        asm_ctx_set_emit_am(ctx, run -> emit_expanded);
+        asm_ctx_set_jobs(ctx, run -> pass_jobs);
+        asm_ctx_set_pipeline(ctx, run -> pipelined);
+        asm_ctx_set_macro_library(ctx, run -> macro_library);
+        asm_ctx_set_macro_budget(ctx, run -> macro_budget);
+        asm_ctx_set_dependencies(ctx, run -> emit_dependencies);
+        asm_ctx_set_macro_profile(ctx, run -> macro_profile);
+    }
+    return ctx;
+}
+
+/* this function assembles one source of a window, or restores its outputs and messages from the cache */
+static int assemble_cached_source(assembly_run *run, asm_ctx *ctx, int file, const memory_file *source, assembly_output *output) {
+    char key[HASH_TEXT_SIZE], flags[MAX_CACHE_FLAGS_LENGTH];
+    memory_file console_text = {NULL, 0};
+    size_t console_start = run -> outputs[file].length;
+    int result;
+
+    if (!ctx || !asm_ctx_set_name(ctx, run -> file_names[file])) {
+        console_printf("Memory allocation failed\n");
+        return FILE_ABORTED;
+    }
+    if (!run -> cache || may_include_files(source)) /* the key only covers the source, not the files it includes */
+        return asm_assemble_buffer(ctx, source -> data, source -> size, output);
+
+    output_flags(run, flags);
+    cache_compute_key(key, run -> file_names[file], source, flags);
+    if (cache_lookup(run -> cache, key, &result, &console_text, output)) {
+        if (console_text.data)
+            console_printf("%s", console_text.data);
+        free_memory_file(&console_text);
+        return result;
+    }
+
+    result = asm_assemble_buffer(ctx, source -> data, source -> size, output);
+    if (result == FILE_SUCCEEDED || result == FILE_HAS_ERRORS) /* an aborted file may do better next time */
+        cache_store(run -> cache, key, result, run -> outputs[file].text + console_start, run -> outputs[file].length - console_start, output);
+    return result;
+}
+
+/* this function waits for the sources of a window and assembles them with ctx, each file's console output is captured */
+static void assemble_window(assembly_run *run, file_window *window, io_backend *backend, asm_ctx *ctx) {
+    int i;
+
+    if (!window -> failed)
+        io_batch_finish(backend, &window -> reads);
+
+    for (i = 0; i < window -> count; i++) {
+        int file = window -> first + i;
+        console_capture_begin(&run -> outputs[file]);
+        if (window -> failed) {
+            console_printf("Memory allocation failed\n");
+            run -> results[file] = FILE_ABORTED;
+        } else if (window -> sources[i].error) {
+            console_printf("Starting macro extension for file: %s\n", window -> sources[i].path);
+            console_printf("Can not access source file. Stop!\n");
+            run -> results[file] = FILE_IO_ERROR;
+        } else {
+            run -> results[file] = assemble_cached_source(run, ctx, file, &window -> sources[i].contents, &window -> products[i]);
+        }
+        console_capture_end();
+        if (!window -> failed)
+            free_memory_file(&window -> sources[i].contents); /* the source is not needed anymore */
+    }
+}
+
+/* this function starts writing every file the window produced, an archive is written by finish_window */
+static void start_window_writes(assembly_run *run, file_window *window, io_backend *backend) {
+    int i, kind;
+
+    if (window -> failed || run -> archive)
+        return;
+
+    for (i = 0; i < window -> count; i++) {
+        for (kind = 0; kind < OUTPUT_KINDS; kind++) {
+            memory_file *contents = produced_file(&window -> products[i], kind);
+            io_file *target = &window -> targets[window -> writes.count];
+            if (!contents)
+                continue;
+            target -> path = file_name_with_extension(run -> file_names[window -> first + i], output_extension(kind));
+            if (!target -> path) {
+                window -> writes_failed = 1;
+                return;
+            }
+            target -> contents = *contents;
+            window -> writes.count++;
         }
+    }
 
-        strcpy(as_file_name, input_file_name);
-        strcat(as_file_name, ".as");
+    window -> writes.files = window -> targets;
+    io_batch_start_write(backend, &window -> writes);
+}
 
-        /* Print starting macro extension */
-        printf("Starting macro extension for file: %s\n", as_file_name);
+/* this function waits until the window's outputs are written (or adds them to the archive), reports the ones that failed
+   and prints the console output of every file that is ready, in the order of the command line */
+static void finish_window(assembly_run *run, file_window *window, io_backend *backend) {
+    int i, kind, target = 0;
 
-        /* Call macro_extender (assumed to be defined elsewhere) */
-        macro_extender(as_file_name);
-        /* Print success of macro extension */
-        printf("Macro extension succeeded for file: %s\n", as_file_name);
+    if (!window -> failed && !window -> writes_failed && !run -> archive)
+        io_batch_finish(backend, &window -> writes);
 
-        /* Prepare the name for the .am file (output from macro_extender) */
-        am_file_name = malloc(strlen(input_file_name) + 4); /* Allocate space for ".am" extension */
-        if (!am_file_name) {
-            printf("Memory allocation failed\n");
-            free(as_file_name);
-            return 1;
+    /* a window that could not be set up wrote nothing, its files were already reported */
+    for (i = 0; i < window -> count && !window -> failed; i++) {
+        int file = window -> first + i;
+        console_capture_begin(&run -> outputs[file]);
+        if (window -> writes_failed) {
+            console_printf("Memory allocation failed, the output files were not written\n");
+            run -> results[file] = FILE_ABORTED;
+        } else if (run -> archive && !archive_add(run -> archive, file, run -> file_names[file], &window -> products[i])) {
+            console_printf("Can not write to archive %s: %s\n", run -> archive -> path, strerror(errno));
+            run -> results[file] = FILE_WRITE_ERROR;
         }
+        for (kind = 0; kind < OUTPUT_KINDS && !window -> writes_failed && !run -> archive; kind++) {
+            if (!produced_file(&window -> products[i], kind))
+                continue;
+            if (window -> targets[target].error) {
+                console_printf("Can not create output file %s: %s\n", window -> targets[target].path, strerror(window -> targets[target].error));
+                run -> results[file] = FILE_WRITE_ERROR;
+            }
+            target++;
+        }
+        console_capture_end();
+    }
+    close_window(window);
 
-        strcpy(am_file_name, input_file_name);
-        strcat(am_file_name, ".am");
+    pthread_mutex_lock(&run -> lock);
+    for (i = 0; i < window -> count; i++)
+        run -> finished[window -> first + i] = 1;
+    while (run -> next_to_print < run -> file_count && run -> finished[run -> next_to_print]) /* flush the ready prefix */
+        console_buffer_flush(&run -> outputs[run -> next_to_print++]);
+    pthread_mutex_unlock(&run -> lock);
+}
 
-        /* Print starting first pass */
-        printf("Starting first pass for file: %s\n", am_file_name);
+/* this function returns the number of files in the window starting at first */
+static int window_length(const assembly_run *run, int first) {
+    int left = run -> file_count - first;
+    return left < run -> window_size ? left : run -> window_size;
+}
 
-        /* Execute the first pass on the .am file */
-        first_pass_success = execute_first_pass(am_file_name);
+/* this function assembles all the files on the calling thread. the sources of the
+   next window are read while the current one is assembled, and the outputs of the
+   previous window are written meanwhile, so at most three windows are held in memory */
+static void assemble_files_in_windows(assembly_run *run) {
+    file_window windows[3];
+    io_backend backend;
+    asm_ctx *ctx = create_run_context(run);
+    int window_count = (run -> file_count + run -> window_size - 1) / run -> window_size;
+    int w;
 
-        /* Print the result of the first pass */
-        if (first_pass_success) {
-            printf("First pass completed successfully for file: %s\n", am_file_name);
-        } else {
-            printf("First pass encountered errors for file: %s\n", am_file_name);
+    io_backend_open(&backend, run -> backend_kind);
+    open_window(run, &windows[0], &backend, 0, window_length(run, 0));
+    for (w = 0; w < window_count; w++) {
+        file_window *current = &windows[w % 3];
+        if (w + 1 < window_count) {
+            int next_first = (w + 1) * run -> window_size;
+            open_window(run, &windows[(w + 1) % 3], &backend, next_first, window_length(run, next_first));
+        }
+        assemble_window(run, current, &backend, ctx);
+        if (w > 0)
+            finish_window(run, &windows[(w - 1) % 3], &backend);
+        start_window_writes(run, current, &backend);
+    }
+    finish_window(run, &windows[(window_count - 1) % 3], &backend);
+    io_backend_close(&backend);
+    asm_ctx_destroy(ctx);
+}
+
+/* this function runs on a worker thread and handles one whole window.
+   each window has its own backend and assembler context, so neither is ever shared */
+static void assemble_window_job(void *context, int job) {
+    assembly_run *run = context;
+    file_window window;
+    io_backend backend;
+    asm_ctx *ctx = create_run_context(run);
+    int first = job * run -> window_size;
+
+    io_backend_open(&backend, run -> backend_kind);
+    open_window(run, &window, &backend, first, window_length(run, first));
+    assemble_window(run, &window, &backend, ctx);
+    start_window_writes(run, &window, &backend);
+    finish_window(run, &window, &backend);
+    io_backend_close(&backend);
+    asm_ctx_destroy(ctx);
+}
+
+/* this function estimates how long a file will take by the size of its .as file */
+static long source_file_size(const char *input_file_name) {
+    struct stat info;
+    char *as_file_name = file_name_with_extension(input_file_name, ".as");
+    long size = 0;
+
+    if (!as_file_name)
+        return 0;
+    if (stat(as_file_name, &info) == 0)
+        size = (long) info.st_size;
+    free(as_file_name);
+    return size;
+}
+
+/* the throttle callbacks that make the extra workers share make's job slots */
+static int acquire_job_slot(void *context) {
+    return jobserver_acquire((jobserver *) context);
+}
+
+static void release_job_slot(void *context) {
+    jobserver_release((jobserver *) context);
+}
+
+/* this function assembles the files and stores the outcome of each file in results.
+   with more than one job the windows are spread over the workers, and if a
+   throttle is given, every worker but the first needs a slot from it for each window */
+static void assemble_files(file_list *files, int *results, const assembly_options *options, const pool_throttle *throttle) {
+    int job_count = options -> job_count, io_batch_size = options -> io_batch_size;
+    assembly_run run;
+    long *weights = NULL;
+    int window_count, i, j;
+
+    run.file_names = files -> names;
+    run.file_count = files -> count;
+    run.window_size = io_batch_size;
+    run.backend_kind = options -> backend_kind;
+    run.cache = options -> cache;
+    run.mode = options -> mode;
+    run.emit_expanded = options -> emit_expanded;
+    run.pass_jobs = files -> count == 1 && job_count > 1 ? job_count : 1; /* one large file is split instead */
+    run.pipelined = options -> pipelined;
+    run.macro_library = options -> macro_library;
+    run.macro_library_key = options -> macro_library_key;
+    run.macro_budget = options -> macro_budget;
+    run.emit_dependencies = options -> emit_dependencies;
+    run.macro_profile = options -> macro_profile;
+    run.archive = options -> archive;
+    run.outputs = calloc(files -> count, sizeof(console_buffer));
+    run.results = results;
+    run.finished = calloc(files -> count, sizeof(int));
+    run.next_to_print = 0;
+    if (!run.outputs || !run.finished) {
+        console_printf("Memory allocation failed\n");
+        free(run.outputs);
+        free(run.finished);
+        for (i = 0; i < files -> count; i++)
+            results[i] = FILE_ABORTED;
+        return;
+    }
+    pthread_mutex_init(&run.lock, NULL);
+
+    if (job_count > 1 && files -> count > 1) {
+        /* small windows when there are few files, so every worker has something to do */
+        int balanced_size = files -> count / (job_count * WINDOWS_PER_JOB);
+        if (balanced_size < run.window_size)
+            run.window_size = balanced_size > 0 ? balanced_size : 1;
+        window_count = (files -> count + run.window_size - 1) / run.window_size;
+        weights = malloc(window_count * sizeof(long));
+    }
+
+    if (weights) {
+        for (i = 0; i < window_count; i++) {
+            weights[i] = 0;
+            for (j = i * run.window_size; j < files -> count && j < (i + 1) * run.window_size; j++)
+                weights[i] += source_file_size(files -> names[j]);
         }
+        if (!run_worker_pool(job_count, weights, window_count, assemble_window_job, &run, throttle)) {
+            /* could not set up the workers, fall back to one window after the other */
+            run.window_size = io_batch_size;
+            assemble_files_in_windows(&run);
+        }
+        free(weights);
+    } else {
+        run.window_size = io_batch_size;
+        assemble_files_in_windows(&run);
+    }
+
+    pthread_mutex_destroy(&run.lock);
+    free(run.outputs);
+    free(run.finished);
+}
+
+/* this function assembles the source on the standard input (the input file "-") and writes its
+   outputs to the standard output as frames (see server.h), followed by a status frame. the messages
+   go to the standard error, so a loader reading the standard output only sees frames. returns the exit code */
+static int assemble_standard_input(int mode, int emit_expanded, int jobs, int pipelined, const macro_library *library, long macro_budget, int macro_profile) {
+    memory_file source = {NULL, 0};
+    assembly_output output;
+    asm_ctx *ctx = asm_ctx_create();
+    char status[16];
+    int result;
+
+    console_set_stream(stderr);
+    initialize_assembly_output(&output);
+    if (!ctx || !asm_ctx_set_name(ctx, STANDARD_INPUT_NAME)) {
+        console_printf("Memory allocation failed\n");
+        result = FILE_ABORTED;
+    } else if (!read_memory_file(stdin, &source)) {
+        console_printf("Can not read the standard input\n");
+        result = FILE_IO_ERROR;
+    } else {
+        asm_ctx_set_mode(ctx, mode);
+        asm_ctx_set_emit_am(ctx, emit_expanded);
+        asm_ctx_set_jobs(ctx, jobs);
+        asm_ctx_set_pipeline(ctx, pipelined);
+        asm_ctx_set_macro_library(ctx, library);
+        asm_ctx_set_macro_budget(ctx, macro_budget);
+        asm_ctx_set_macro_profile(ctx, macro_profile);
+        result = asm_assemble_buffer(ctx, source.data, source.size, &output);
+    }
+    asm_ctx_destroy(ctx);
+    write_output_frames(stdout, STANDARD_INPUT_NAME, &output);
+    sprintf(status, "%d", result == FILE_SUCCEEDED ? 0 : 1);
+    write_frame(stdout, "status", NULL, status, strlen(status));
+    fflush(stdout);
+    console_set_stream(NULL);
+
+    free_assembly_output(&output);
+    free_memory_file(&source);
+    return result == FILE_SUCCEEDED ? 0 : 1;
+}
+
+/* this function reads the number of an option like "-j N" or "--io-batch K".
+   returns the number, or 0 if the value is not a number between 1 and limit */
+static int parse_count(const char *value, int limit) {
+    int count = 0;
+    if (!value || !*value)
+        return 0;
+    while (isdigit((unsigned char) *value)) {
+        count = count * 10 + (*value - '0');
+        if (count > limit)
+            return 0;
+        value++;
+    }
+    return *value == '\0' ? count : 0;
+}
+
+/* this function decides how many workers to use when make hands out the slots */
+static int default_job_count(void) {
+    long processors = sysconf(_SC_NPROCESSORS_ONLN);
+    if (processors < 1)
+        return 1;
+    return processors > MAX_JOB_COUNT ? MAX_JOB_COUNT : (int) processors;
+}
 
-        /* Free allocated memory */
-        free(as_file_name);
-        free(am_file_name);
+/* this function finds the macro library of --macro-lib for the options, opening it unless it is open
+   from an earlier run and did not change since. with a cache the library is hashed too, the cache keys
+   name it by its contents. returns 0 (after printing why) if it can not be read */
+static int open_macro_library(const char *path, assembly_options *options, int hash_contents) {
+    opened_library *opened, **link;
+    struct stat info;
+
+    if (stat(path, &info) < 0) {
+        console_printf("Can not read macro library %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    for (link = &opened_libraries; *link && strcmp((*link) -> path, path) != 0; link = &(*link) -> next)
+        ;
+    opened = *link;
+    if (opened && (opened -> device != info.st_dev || opened -> inode != info.st_ino || opened -> size != info.st_size ||
+                   opened -> modified.tv_sec != info.st_mtim.tv_sec || opened -> modified.tv_nsec != info.st_mtim.tv_nsec)) {
+        *link = opened -> next;
+        macro_library_close(&opened -> library);
+        free(opened -> path);
+        free(opened);
+        opened = NULL;
+    }
+    if (!opened) {
+        opened = calloc(1, sizeof(opened_library));
+        if (!opened || !(opened -> path = malloc(strlen(path) + 1))) {
+            console_printf("Memory allocation failed\n");
+            free(opened);
+            return 0;
+        }
+        strcpy(opened -> path, path);
+        if (!macro_library_open(&opened -> library, path)) {
+            console_printf("Can not read macro library %s: %s\n", path, errno == EINVAL ? "not a macro library or damaged" : strerror(errno));
+            free(opened -> path);
+            free(opened);
+            return 0;
+        }
+        opened -> device = info.st_dev;
+        opened -> inode = info.st_ino;
+        opened -> size = info.st_size;
+        opened -> modified = info.st_mtim;
+        opened -> next = opened_libraries;
+        opened_libraries = opened;
     }
+    options -> macro_library = &opened -> library;
+    if (hash_contents && !opened -> key[0]) {
+        hash_context context;
+        hash_begin(&context);
+        hash_update(&context, opened -> library.data, opened -> library.size);
+        hash_end(&context, opened -> key);
+    }
+    if (hash_contents)
+        strcpy(options -> macro_library_key, opened -> key);
+    return 1;
+}
+
+/* this function prints how to use the program */
+static void print_usage(const char *program_name) {
+    console_printf("Usage: %s [--server SOCKET | --client SOCKET] [-j N] [--manifest LIST] [--recursive DIR] [--io-batch K] [--io-backend B] [--cache DIR] [--cache-size SIZE] [--stats] [--archive FILE] [--watch DIR] [--emit-am] [--pipeline] [--macro-lib FILE] [--macro-budget N] [--macro-profile F] [-MD] [--check | --sizes] <input_file_name(s)>\n", program_name);
+    console_printf("  -j N             assemble up to N files at the same time, or a single large file on N threads\n");
+    console_printf("  --manifest LIST  assemble the files named in LIST, one per line (\"-\" reads the names from stdin)\n");
+    console_printf("  --recursive DIR  assemble every .as file in DIR and its sub directories\n");
+    console_printf("  --io-batch K     read and write the files K at a time (default %d)\n", DEFAULT_IO_BATCH);
+    console_printf("  --io-backend B   how the files are read and written: auto, sync or uring (default auto)\n");
+    console_printf("  --cache DIR      reuse the outputs of sources assembled before, kept in DIR (default $%s)\n", CACHE_ENVIRONMENT_VARIABLE);
+    console_printf("  --cache-size S   upper limit for the size of the cache, e.g. 500K, 64M or 1G (default 64M)\n");
+    console_printf("  --stats          print the cache hits and misses\n");
+    console_printf("  -                assemble the source on the standard input, the outputs go to the standard output as frames\n");
+    console_printf("  --archive FILE   put the output files of all the inputs in one archive, \"asmar\" extracts them\n");
+    console_printf("  --watch DIR      assemble every .as file in DIR, then each one again from scratch whenever it changes\n");
+    console_printf("  --emit-am        write the source after macro extension (.am) too\n");
+    console_printf("  -MD              write a .d file for make too, with the files each source includes\n");
+    console_printf("  --macro-lib FILE the files may call the macros of FILE, built by \"asmlib build\", without defining them\n");
+    console_printf("  --macro-budget N one macro call may expand to at most N lines, nested calls included (default %d)\n", DEFAULT_MACRO_BUDGET);
+    console_printf("  --macro-profile F print the calls and the lines and bytes written by every macro of each file, F is text or json\n");
+    console_printf("  --pipeline       extend the macros of a file on a thread of its own while its first pass reads the lines\n");
+    console_printf("  --check          only check the files: print the errors, write no output files\n");
+    console_printf("  --sizes          print IC, DC and the symbol table of each file instead of writing output files\n");
+}
 
+/* this function does everything the command line asks for, the server runs it for its clients too.
+   the names of "--manifest -" are read from names_input, and make's jobserver
+   is only joined if use_jobserver is set. returns the exit code */
+int run_command(int argc, char *argv[], FILE *names_input, int use_jobserver) {
+    file_list files;
+    int *results;
+    int batch_mode = 0, all_succeeded = 1;
+    assembly_options options;
+    const char *cache_directory = getenv(CACHE_ENVIRONMENT_VARIABLE);
+    unsigned long cache_size = DEFAULT_CACHE_SIZE;
+    int print_stats = 0;
+    const char *watch_directory = NULL, *archive_path = NULL, *macro_library_path = NULL;
+    output_cache cache;
+    archive_writer archive;
+    int i;
+    jobserver make_jobserver;
+    pool_throttle throttle;
+
+    /* Step 1: Check command-line arguments */
+    options.job_count = 0;
+    options.io_batch_size = DEFAULT_IO_BATCH;
+    options.backend_kind = IO_BACKEND_AUTO;
+    options.cache = NULL;
+    options.mode = ASSEMBLE_FULL;
+    options.emit_expanded = 0;
+    options.pipelined = 0;
+    options.macro_library = NULL;
+    options.macro_library_key[0] = '\0';
+    options.macro_budget = DEFAULT_MACRO_BUDGET;
+    options.emit_dependencies = 0;
+    options.macro_profile = MACRO_PROFILE_OFF;
+    options.archive = NULL;
+    initialize_file_list(&files);
+    for (i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "-j", 2) == 0) {
+            /* the number of jobs is either attached ("-j8") or the next argument ("-j 8") */
+            const char *value = argv[i][2] ? argv[i] + 2 : (i + 1 < argc ? argv[++i] : NULL);
+            options.job_count = parse_count(value, MAX_JOB_COUNT);
+            if (!options.job_count) {
+                console_printf("Illegal number of jobs for -j, expected a number between 1 and %d\n", MAX_JOB_COUNT);
+                free_file_list(&files);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--manifest") == 0 || strcmp(argv[i], "--recursive") == 0) {
+            int is_manifest = strcmp(argv[i], "--manifest") == 0;
+            if (i + 1 >= argc) {
+                console_printf("Missing value for %s\n", argv[i]);
+                free_file_list(&files);
+                return 1;
+            }
+            i++;
+            if (!(is_manifest ? add_manifest_files(&files, argv[i], names_input) : add_directory_files(&files, argv[i]))) {
+                free_file_list(&files);
+                return 1;
+            }
+            batch_mode = 1;
+        } else if (strcmp(argv[i], "--io-batch") == 0 || strcmp(argv[i], "--io-backend") == 0) {
+            int is_batch = strcmp(argv[i], "--io-batch") == 0;
+            if (i + 1 >= argc) {
+                console_printf("Missing value for %s\n", argv[i]);
+                free_file_list(&files);
+                return 1;
+            }
+            i++;
+            if (is_batch && !(options.io_batch_size = parse_count(argv[i], MAX_IO_BATCH))) {
+                console_printf("Illegal value for --io-batch, expected a number between 1 and %d\n", MAX_IO_BATCH);
+                free_file_list(&files);
+                return 1;
+            }
+            if (!is_batch && !parse_io_backend(argv[i], &options.backend_kind)) {
+                console_printf("Unknown I/O backend %s, expected auto, sync or uring\n", argv[i]);
+                free_file_list(&files);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--cache") == 0 || strcmp(argv[i], "--cache-size") == 0) {
+            int is_directory = strcmp(argv[i], "--cache") == 0;
+            if (i + 1 >= argc) {
+                console_printf("Missing value for %s\n", argv[i]);
+                free_file_list(&files);
+                return 1;
+            }
+            i++;
+            if (is_directory) {
+                cache_directory = argv[i];
+            } else if (!parse_cache_size(argv[i], &cache_size)) {
+                console_printf("Illegal value for --cache-size, expected a size like 500K, 64M or 1G\n");
+                free_file_list(&files);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--check") == 0 || strcmp(argv[i], "--sizes") == 0) {
+            int mode = strcmp(argv[i], "--check") == 0 ? ASSEMBLE_CHECK : ASSEMBLE_SIZES;
+            if (options.mode != ASSEMBLE_FULL && options.mode != mode) {
+                console_printf("--check and --sizes can not be combined\n");
+                free_file_list(&files);
+                return 1;
+            }
+            options.mode = mode;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            print_stats = 1;
+        } else if (strcmp(argv[i], "--emit-am") == 0) {
+            options.emit_expanded = 1;
+        } else if (strcmp(argv[i], "-MD") == 0) {
+            options.emit_dependencies = 1;
+        } else if (strcmp(argv[i], "--macro-profile") == 0) {
+            const char *format = i + 1 < argc ? argv[++i] : "";
+            if (strcmp(format, "text") != 0 && strcmp(format, "json") != 0) {
+                console_printf("Unknown macro profile format %s, expected text or json\n", format);
+                free_file_list(&files);
+                return 1;
+            }
+            options.macro_profile = strcmp(format, "json") == 0 ? MACRO_PROFILE_JSON : MACRO_PROFILE_TEXT;
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            options.pipelined = 1;
+        } else if (strcmp(argv[i], "--macro-budget") == 0) {
+            if (!(options.macro_budget = parse_count(i + 1 < argc ? argv[++i] : NULL, MAX_MACRO_BUDGET))) {
+                console_printf("Illegal value for --macro-budget, expected a number between 1 and %d\n", MAX_MACRO_BUDGET);
+                free_file_list(&files);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--watch") == 0 || strcmp(argv[i], "--archive") == 0 || strcmp(argv[i], "--macro-lib") == 0) {
+            if (i + 1 >= argc) {
+                console_printf("Missing value for %s\n", argv[i]);
+                free_file_list(&files);
+                return 1;
+            }
+            if (strcmp(argv[i], "--watch") == 0)
+                watch_directory = argv[++i];
+            else if (strcmp(argv[i], "--archive") == 0)
+                archive_path = argv[++i];
+            else
+                macro_library_path = argv[++i];
+        } else if (!add_file_name(&files, argv[i])) {
+            console_printf("Memory allocation failed\n");
+            free_file_list(&files);
+            return 1;
+        }
+    }
+    if (options.emit_dependencies && (watch_directory || archive_path)) {
+        console_printf("-MD can not be combined with --watch or --archive\n");
+        free_file_list(&files);
+        return 1;
+    }
+    if (watch_directory) {
+        /* the watcher finds its own files and keeps running, it does not mix with the other inputs */
+        if (files.count > 0 || batch_mode) {
+            console_printf("--watch can not be combined with other input files\n");
+            free_file_list(&files);
+            return 1;
+        }
+        if (archive_path) {
+            console_printf("--watch can not be combined with --archive\n");
+            free_file_list(&files);
+            return 1;
+        }
+        free_file_list(&files);
+        if (macro_library_path && !open_macro_library(macro_library_path, &options, 0))
+            return 1;
+        return run_watch(watch_directory, options.backend_kind, options.mode, options.emit_expanded, options.macro_library, options.macro_budget, options.macro_profile);
+    }
+    for (i = 0; i < files.count; i++) {
+        if (strcmp(files.names[i], "-") == 0) {
+            /* a filter: nothing is read from or written to the file system */
+            if (files.count > 1 || batch_mode || archive_path || options.emit_dependencies) {
+                console_printf("The standard input (-) can not be combined with other input files, --archive or -MD\n");
+                free_file_list(&files);
+                return 1;
+            }
+            free_file_list(&files);
+            if (macro_library_path && !open_macro_library(macro_library_path, &options, 0))
+                return 1;
+            return assemble_standard_input(options.mode, options.emit_expanded, options.job_count, options.pipelined, options.macro_library, options.macro_budget, options.macro_profile);
+        }
+    }
+    if (files.count < 1) {
+        if (!batch_mode)
+            print_usage(argv[0]);
+        else
+            console_printf("No input files were found\n");
+        free_file_list(&files);
+        return 1;
+    }
+
+    results = calloc(files.count, sizeof(int));
+    if (!results) {
+        console_printf("Memory allocation failed\n");
+        free_file_list(&files);
+        return 1;
+    }
+    if (cache_directory && *cache_directory) {
+        if (!cache_open(&cache, cache_directory, cache_size)) {
+            free(results);
+            free_file_list(&files);
+            return 1;
+        }
+        options.cache = &cache;
+    }
+    if (archive_path) {
+        if (!archive_create(&archive, archive_path, files.count)) {
+            console_printf("Can not create archive %s: %s\n", archive_path, strerror(errno));
+            if (options.cache)
+                cache_close(options.cache);
+            free(results);
+            free_file_list(&files);
+            return 1;
+        }
+        options.archive = &archive;
+    }
+    if (macro_library_path && !open_macro_library(macro_library_path, &options, options.cache != NULL)) {
+        if (options.archive)
+            archive_discard(options.archive);
+        if (options.cache)
+            cache_close(options.cache);
+        free(results);
+        free_file_list(&files);
+        return 1;
+    }
+
+    /* Step 2: Loop over all input files.
+       when started by "make -j", the files are assembled in parallel but
+       only as many at a time as make has free job slots for us */
+    if (use_jobserver && options.job_count != 1 && files.count > 1 && jobserver_connect(&make_jobserver)) {
+        throttle.acquire = acquire_job_slot;
+        throttle.release = release_job_slot;
+        throttle.context = &make_jobserver;
+        if (!options.job_count)
+            options.job_count = default_job_count();
+        assemble_files(&files, results, &options, &throttle);
+        jobserver_disconnect(&make_jobserver);
+    } else {
+        assemble_files(&files, results, &options, NULL);
+    }
+
+    /* the archive only appears once it holds the outputs of every file */
+    if (options.archive && !archive_finish(options.archive)) {
+        console_printf("Can not write to archive %s: %s\n", archive_path, strerror(errno));
+        all_succeeded = 0;
+    }
+
+    /* Step 3: in batch mode, tell which files failed so only they need another run */
+    for (i = 0; i < files.count; i++)
+        if (results[i] != FILE_SUCCEEDED)
+            all_succeeded = 0;
+    if (batch_mode)
+        print_batch_summary(&files, results);
+    if (options.cache) {
+        cache_trim(options.cache);
+        if (print_stats)
+            print_cache_stats(options.cache);
+        cache_close(options.cache);
+    } else if (print_stats) {
+        console_printf("Cache: disabled\n");
+    }
+
+    free(results);
+    free_file_list(&files);
     /* Return 0 if all files succeeded, 1 if any file failed */
-    return first_pass_success ? 0 : 1;
+    return all_succeeded ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    const char *server_socket = getenv(SERVER_ENVIRONMENT_VARIABLE);
+
+    /* the server and the client are picked by the first argument,
+       the client hands all the other arguments to the server */
+    if (argc > 1 && (strcmp(argv[1], "--server") == 0 || strcmp(argv[1], "--client") == 0)) {
+        int is_server = strcmp(argv[1], "--server") == 0;
+        if (argc < 3 || (is_server && argc > 3)) {
+            printf("Usage: %s --server SOCKET, or %s --client SOCKET <arguments>\n", argv[0], argv[0]);
+            return 1;
+        }
+        return is_server ? run_server(argv[2]) : run_client(argv[2], argc - 3, argv + 3);
+    }
+    if (server_socket && *server_socket)
+        return run_client(server_socket, argc - 1, argv + 1); /* a thin client with the usual command line */
+    return run_command(argc, argv, stdin, 1);
 }
@@ -4,9 +4,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
+#include "memory_file.h"
+#include "lexer.h"
 
-int execute_first_pass(char *am_file_name);
-FILE *macro_extender(const char *source_file_name);
+#define ASSEMBLER_VERSION "1.5" /* Part of the cache keys, change it whenever the outputs may change */
+#define MAX_JOB_COUNT 1024 /* Upper limit for the number of parallel jobs (-j) */
+#define WINDOWS_PER_JOB 4  /* With -j, split the files so every worker gets a few windows to balance the load */
+#define STANDARD_INPUT_NAME "stdin" /* The name of the source read from the standard input (the input file "-") */
+
+/* What the assembler does with a source */
+#define ASSEMBLE_FULL 0    /* Everything: the .am, .ob, .ent and .ext files */
+#define ASSEMBLE_CHECK 1   /* Every check, but no progress messages and no output files (--check) */
+#define ASSEMBLE_SIZES 2   /* Only the first pass, prints IC, DC and the symbol table instead of output files (--sizes) */
+
+int execute_first_pass(const token_list *tokens, char *am_file_name, assembly_output *output, int mode, int jobs);
+int macro_extender(const memory_file *source, FILE *output_file);
+int run_command(int argc, char *argv[], FILE *names_input, int use_jobserver);
 
 #endif
 
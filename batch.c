@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "batch.h"
+#include "util.h"
+#include "console.h"
+
+void initialize_file_list(file_list *list) {
+    list -> names = NULL;
+    list -> count = 0;
+    list -> capacity = 0;
+}
+
+void free_file_list(file_list *list) {
+    int i;
+    for (i = 0; i < list -> count; i++)
+        free(list -> names[i]);
+    free(list -> names);
+    initialize_file_list(list);
+}
+
+int add_file_name(file_list *list, const char *name) {
+    char *copy;
+    size_t len;
+
+    if (list -> count == list -> capacity) {
+        int new_capacity = list -> capacity ? list -> capacity * 2 : INITIAL_FILE_LIST_SIZE;
+        char **new_names = realloc(list -> names, new_capacity * sizeof(char *));
+        if (!new_names)
+            return 0;
+        list -> names = new_names;
+        list -> capacity = new_capacity;
+    }
+
+    copy = my_strdup(name);
+    if (!copy)
+        return 0;
+    len = strlen(copy);
+    if (len > 3 && strcmp(copy + len - 3, ".as") == 0)
+        copy[len - 3] = '\0'; /* the extension is added back when the file is opened */
+
+    list -> names[list -> count++] = copy;
+    return 1;
+}
+
+int add_manifest_files(file_list *list, const char *manifest_name, FILE *names_input) {
+    char line[FILENAME_MAX + 2];
+    FILE *manifest;
+    int line_number = 0, success = 1;
+
+    manifest = strcmp(manifest_name, "-") == 0 ? names_input : fopen(manifest_name, "r");
+    if (!manifest) {
+        console_printf("Can not open manifest %s\n", manifest_name);
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), manifest)) {
+        char *name;
+        line_number++;
+        if (strchr(line, '\n') == NULL && !feof(manifest)) {
+            console_printf("Manifest %s, line %d: file name is too long\n", manifest_name, line_number);
+            success = 0;
+            break;
+        }
+        name = trim_whitespace(line);
+        if (*name == '\0' || *name == '#') /* skip empty lines and comments */
+            continue;
+        if (!add_file_name(list, name)) {
+            console_printf("Memory allocation failed\n");
+            success = 0;
+            break;
+        }
+    }
+
+    if (manifest != names_input)
+        fclose(manifest);
+    return success;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* this function walks one directory, adding the .as files and descending into
+   sub directories. symbolic links are not followed, so a link loop can not trap us */
+static int walk_directory(file_list *list, const char *directory_name) {
+    DIR *directory = opendir(directory_name);
+    struct dirent *entry;
+    int success = 1;
+
+    if (!directory) {
+        console_printf("Can not open directory %s\n", directory_name);
+        return 0;
+    }
+
+    while (success && (entry = readdir(directory)) != NULL) {
+        struct stat info;
+        char *path;
+        size_t name_len = strlen(entry -> d_name);
+
+        if (strcmp(entry -> d_name, ".") == 0 || strcmp(entry -> d_name, "..") == 0)
+            continue;
+
+        path = malloc(strlen(directory_name) + name_len + 2); /* +2 for '/' and the null terminator */
+        if (!path) {
+            console_printf("Memory allocation failed\n");
+            success = 0;
+            break;
+        }
+        sprintf(path, "%s/%s", directory_name, entry -> d_name);
+
+        if (lstat(path, &info) == 0) {
+            if (S_ISDIR(info.st_mode))
+                success = walk_directory(list, path);
+            else if (S_ISREG(info.st_mode) && name_len > 3 && strcmp(entry -> d_name + name_len - 3, ".as") == 0 && !add_file_name(list, path)) {
+                console_printf("Memory allocation failed\n");
+                success = 0;
+            }
+        }
+        free(path);
+    }
+
+    closedir(directory);
+    return success;
+}
+
+int add_directory_files(file_list *list, const char *directory_name) {
+    int first_new = list -> count;
+    char *root = my_strdup(directory_name);
+    size_t len;
+    int success;
+
+    if (!root) {
+        console_printf("Memory allocation failed\n");
+        return 0;
+    }
+    len = strlen(root);
+    while (len > 1 && root[len - 1] == '/')
+        root[--len] = '\0'; /* "dir/" and "dir" give the same names */
+
+    success = walk_directory(list, root);
+    free(root);
+
+    /* readdir returns the files in no particular order */
+    qsort(list -> names + first_new, list -> count - first_new, sizeof(char *), compare_names);
+    return success;
+}
+
+/* a short description of each outcome, indexed by FILE_SUCCEEDED, FILE_HAS_ERRORS, ... */
+static const char *outcome_names[] = {
+    "ok",
+    "errors in source",
+    "can not read source",
+    "aborted (fatal error)",
+    "can not write output"
+};
+
+void print_batch_summary(const file_list *list, const int *results) {
+    int i, failed = 0;
+
+    for (i = 0; i < list -> count; i++)
+        if (results[i] != FILE_SUCCEEDED)
+            failed++;
+
+    console_printf("\nSummary: %d file(s), %d succeeded, %d failed\n", list -> count, list -> count - failed, failed);
+    console_printf("%-6s %-22s %s\n", "EXIT", "RESULT", "FILE");
+    for (i = 0; i < list -> count; i++)
+        console_printf("%-6d %-22s %s\n", results[i], outcome_names[results[i]], list -> names[i]);
+}
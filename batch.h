@@ -0,0 +1,68 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+
+#define INITIAL_FILE_LIST_SIZE 64
+
+/* The outcome of assembling a single file, also its exit code in the summary */
+#define FILE_SUCCEEDED 0     /* Assembled, output files were created */
+#define FILE_HAS_ERRORS 1    /* The source code has errors */
+#define FILE_IO_ERROR 2      /* The source file could not be read */
+#define FILE_ABORTED 3       /* Stopped by a fatal error (e.g. out of memory) */
+#define FILE_WRITE_ERROR 4   /* Assembled, but an output file could not be written */
+
+/* A list of input file names, without the .as extension */
+typedef struct {
+    char **names;     /* The file names (owned by the list) */
+    int count;        /* Number of file names */
+    int capacity;     /* Allocated size of names */
+} file_list;
+
+/*
+ * Initializes an empty file list.
+ */
+void initialize_file_list(file_list *list);
+
+/*
+ * Frees a file list and all of its names.
+ */
+void free_file_list(file_list *list);
+
+/*
+ * Adds a copy of a file name to the list. A trailing ".as" is removed,
+ * so both "prog" and "prog.as" refer to the same source.
+ *
+ * Returns:
+ *   1 on success, 0 if memory allocation failed.
+ */
+int add_file_name(file_list *list, const char *name);
+
+/*
+ * Adds every file named in a manifest: one name per line, empty lines and
+ * lines starting with '#' are skipped. The manifest "-" is read from names_input.
+ *
+ * Returns:
+ *   1 on success, 0 if the manifest could not be read.
+ */
+int add_manifest_files(file_list *list, const char *manifest_name, FILE *names_input);
+
+/*
+ * Adds every .as file found in a directory and its sub directories,
+ * in sorted order so repeated runs list the files the same way.
+ *
+ * Returns:
+ *   1 on success, 0 if the directory could not be read.
+ */
+int add_directory_files(file_list *list, const char *directory_name);
+
+/*
+ * Prints a table with the outcome and exit code of every file.
+ *
+ * Parameters:
+ *   list - The files that were assembled.
+ *   results - The outcome of each file (FILE_SUCCEEDED, FILE_HAS_ERRORS, ...).
+ */
+void print_batch_summary(const file_list *list, const int *results);
+
+#endif
@@ -0,0 +1,128 @@
+/* alloc_bench - counts the heap allocations of the assembler per source line.
+ *
+ * Usage: alloc_bench [-n BLOCKS]
+ *
+ * Assembles a generated source of BLOCKS blocks (2000 by default) and one of twice as
+ * many, each block a few lines of labels, instructions, data, comments and macro calls.
+ * The library is linked with malloc, calloc and realloc wrapped (see the Makefile), so
+ * every allocation it makes is counted. The allocations that do not depend on the
+ * number of lines (the tables, the outputs, the growth of the arrays) are the same for
+ * both sources; what is left over is the heap traffic per line, which should be 0.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../libasm.h"
+#include "../assembler.h"
+
+#define DEFAULT_BLOCK_COUNT 2000
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+static long allocation_count; /* Calls of malloc, calloc and realloc since the last reset */
+
+void *__wrap_malloc(size_t size) {
+    allocation_count++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    allocation_count++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    allocation_count++;
+    return __real_realloc(pointer, size);
+}
+
+/* The lines of one block, %d is the block number so every label is new */
+static const char *const block_lines[] = {
+    "; block %d\n",
+    "\n",
+    "L%d: mov r3, N%d\n",
+    "     add r2, L%d\n",
+    "     twice\n",
+    "     cmp #-5, *r1\n",
+    "     jmp L%d\n",
+    "N%d: .data 6, -9, 15\n",
+    "S%d: .string \"abc\"\n"
+};
+
+/* this function writes a source of count blocks into source, returns its length and the number of lines */
+static size_t create_source(char *source, int count, int *line_count) {
+    static const char header[] = "macr twice\n inc r1\n inc r1\nendmacr\n";
+    size_t length = 0;
+    int i, j;
+
+    strcpy(source, header);
+    length = strlen(header);
+    *line_count = 4;
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < (int) (sizeof(block_lines) / sizeof(block_lines[0])); j++) {
+            length += sprintf(source + length, block_lines[j], i, i);
+            (*line_count)++;
+        }
+    }
+    length += sprintf(source + length, "stop\n");
+    (*line_count)++;
+    return length;
+}
+
+/* this function assembles a source of count blocks, returns the number of allocations it took or -1 */
+static long count_allocations(asm_ctx *ctx, int count, int *line_count) {
+    char *source = malloc(count * 200 + 100);
+    assembly_output output;
+    size_t length;
+    long allocations;
+    int result;
+
+    if (!source)
+        return -1;
+    length = create_source(source, count, line_count);
+    allocation_count = 0;
+    result = asm_assemble_buffer(ctx, source, length, &output);
+    free_assembly_output(&output);
+    allocations = allocation_count;
+    free(source);
+    if (result != FILE_SUCCEEDED) {
+        fprintf(stderr, "alloc_bench: the generated source did not assemble\n");
+        return -1;
+    }
+    return allocations;
+}
+
+static void print_messages(void *data, const char *text, size_t length) {
+    (void) data;
+    (void) text;
+    (void) length; /* the progress messages are not interesting here */
+}
+
+int main(int argc, char *argv[]) {
+    int block_count = DEFAULT_BLOCK_COUNT, small_lines, large_lines;
+    long small, large;
+    asm_ctx *ctx;
+
+    if (argc == 3 && strcmp(argv[1], "-n") == 0)
+        block_count = atoi(argv[2]);
+    else if (argc != 1) {
+        fprintf(stderr, "Usage: %s [-n BLOCKS]\n", argv[0]);
+        return 1;
+    }
+    if (block_count < 1 || !(ctx = asm_ctx_create()))
+        return 1;
+    asm_ctx_set_sinks(ctx, NULL, NULL, print_messages, NULL);
+
+    small = count_allocations(ctx, block_count, &small_lines);
+    large = count_allocations(ctx, 2 * block_count, &large_lines);
+    asm_ctx_destroy(ctx);
+    if (small < 0 || large < 0)
+        return 1;
+
+    printf("%8d lines: %ld allocations\n", small_lines, small);
+    printf("%8d lines: %ld allocations\n", large_lines, large);
+    printf("allocations per added line: %.4f\n", (double) (large - small) / (large_lines - small_lines));
+    return 0;
+}
@@ -0,0 +1,177 @@
+/* io_bench - compares the I/O backends of the assembler on a corpus of many small files.
+ *
+ * Usage: io_bench [-n FILES] [-k BATCH] [-r ROUNDS] DIR
+ *
+ * Creates FILES source sized files in DIR (10000 by default), then reads them all
+ * and writes an output for each, BATCH files at a time, once with every backend.
+ * The best time of ROUNDS rounds is printed, so a cold first round does not count.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "../io_backend.h"
+
+#define DEFAULT_FILE_COUNT 10000
+#define DEFAULT_ROUNDS 3
+#define SOURCE_SIZE 1500    /* About the size of the example programs */
+#define OUTPUT_SIZE 600     /* About the size of their object files */
+
+static double now_ms(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+/* this function creates the corpus: file i is DIR/f<i>.as, filled with a few lines of code */
+static int create_corpus(const char *directory, int file_count, char **paths) {
+    static const char line[] = "LOOP: mov r3, LENGTH\n";
+    char contents[SOURCE_SIZE];
+    int i;
+
+    for (i = 0; i < SOURCE_SIZE; i++)
+        contents[i] = line[i % (sizeof(line) - 1)];
+
+    mkdir(directory, 0777);
+    for (i = 0; i < file_count; i++) {
+        FILE *file;
+        paths[i] = malloc(strlen(directory) + 32);
+        if (!paths[i])
+            return 0;
+        sprintf(paths[i], "%s/f%d.as", directory, i);
+        file = fopen(paths[i], "w");
+        if (!file) {
+            printf("Can not create %s\n", paths[i]);
+            return 0;
+        }
+        fwrite(contents, 1, SOURCE_SIZE - (i % 100), file); /* vary the sizes a little */
+        fclose(file);
+    }
+    return 1;
+}
+
+/* this function reads all the files and writes an output for each, batch files at a time.
+   reads of the next batch are in flight while the previous batch is written, like in the assembler.
+   returns the number of files that failed */
+static int run_round(io_backend *backend, char **paths, char **output_paths, int file_count, int batch_size, double *read_ms, double *write_ms) {
+    static char output[OUTPUT_SIZE];
+    io_file *reads = calloc(batch_size, sizeof(io_file));
+    io_file *writes = calloc(batch_size, sizeof(io_file));
+    io_batch read_batch, write_batch;
+    int first, i, failed = 0;
+    double start;
+
+    memset(output, '1', sizeof(output));
+    *read_ms = *write_ms = 0;
+    if (!reads || !writes) {
+        free(reads);
+        free(writes);
+        return file_count;
+    }
+
+    for (first = 0; first < file_count; first += batch_size) {
+        int count = file_count - first < batch_size ? file_count - first : batch_size;
+
+        start = now_ms();
+        for (i = 0; i < count; i++)
+            reads[i].path = paths[first + i];
+        read_batch.files = reads;
+        read_batch.count = count;
+        io_batch_start_read(backend, &read_batch);
+        io_batch_finish(backend, &read_batch);
+        *read_ms += now_ms() - start;
+
+        start = now_ms();
+        for (i = 0; i < count; i++) {
+            if (reads[i].error)
+                failed++;
+            free_memory_file(&reads[i].contents);
+            writes[i].path = output_paths[first + i];
+            writes[i].contents.data = output;
+            writes[i].contents.size = sizeof(output);
+        }
+        write_batch.files = writes;
+        write_batch.count = count;
+        io_batch_start_write(backend, &write_batch);
+        io_batch_finish(backend, &write_batch);
+        for (i = 0; i < count; i++)
+            if (writes[i].error)
+                failed++;
+        *write_ms += now_ms() - start;
+    }
+
+    free(reads);
+    free(writes);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    static const io_backend_kind kinds[] = {IO_BACKEND_SYNC, IO_BACKEND_URING};
+    int file_count = DEFAULT_FILE_COUNT, batch_size = DEFAULT_IO_BATCH, rounds = DEFAULT_ROUNDS;
+    const char *directory = NULL;
+    char **paths, **output_paths;
+    int i, k;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+            file_count = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+            batch_size = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+            rounds = atoi(argv[++i]);
+        else
+            directory = argv[i];
+    }
+    if (!directory || file_count < 1 || batch_size < 1 || rounds < 1) {
+        printf("Usage: %s [-n FILES] [-k BATCH] [-r ROUNDS] DIR\n", argv[0]);
+        return 1;
+    }
+
+    paths = calloc(file_count, sizeof(char *));
+    output_paths = calloc(file_count, sizeof(char *));
+    if (!paths || !output_paths || !create_corpus(directory, file_count, paths))
+        return 1;
+    for (i = 0; i < file_count; i++) {
+        output_paths[i] = malloc(strlen(paths[i]) + 1);
+        if (!output_paths[i])
+            return 1;
+        strcpy(output_paths[i], paths[i]);
+        strcpy(output_paths[i] + strlen(paths[i]) - 3, ".ob");
+    }
+
+    printf("%d files, %d per batch, best of %d rounds\n", file_count, batch_size, rounds);
+    printf("%-10s %10s %10s %10s\n", "BACKEND", "READ ms", "WRITE ms", "TOTAL ms");
+    for (k = 0; k < (int) (sizeof(kinds) / sizeof(kinds[0])); k++) {
+        io_backend backend;
+        double best_read = 0, best_write = 0;
+        int failed = 0;
+
+        io_backend_open(&backend, kinds[k]);
+        if (backend.kind != kinds[k]) {
+            printf("%-10s not available here\n", io_backend_name(kinds[k]));
+            io_backend_close(&backend);
+            continue;
+        }
+        for (i = 0; i < rounds; i++) {
+            double read_ms, write_ms;
+            failed += run_round(&backend, paths, output_paths, file_count, batch_size, &read_ms, &write_ms);
+            if (i == 0 || read_ms + write_ms < best_read + best_write) {
+                best_read = read_ms;
+                best_write = write_ms;
+            }
+        }
+        io_backend_close(&backend);
+        printf("%-10s %10.1f %10.1f %10.1f%s\n", io_backend_name(kinds[k]), best_read, best_write, best_read + best_write, failed ? "  (some files failed)" : "");
+    }
+
+    for (i = 0; i < file_count; i++) {
+        remove(paths[i]);
+        remove(output_paths[i]);
+        free(paths[i]);
+        free(output_paths[i]);
+    }
+    free(paths);
+    free(output_paths);
+    return 0;
+}
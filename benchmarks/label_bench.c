@@ -0,0 +1,104 @@
+/* label_bench - times the assembler on sources with more and more labels.
+ *
+ * Usage: label_bench [-n LABELS] [-r ROUNDS]
+ *
+ * Assembles generated sources of a quarter, half and all of LABELS labels (100000 by
+ * default), half of them code and half data, where every instruction uses one label
+ * defined before it and one defined anywhere in the file. The best time of ROUNDS rounds
+ * (3 by default) is printed for each source with the time per label: with the labels
+ * found through the hash index of the symbol table it stays about the same as the
+ * sources grow, a table that is searched label by label would double it every time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../libasm.h"
+#include "../assembler.h"
+
+#define DEFAULT_LABEL_COUNT 100000
+#define DEFAULT_ROUNDS 3
+#define MAX_BLOCK_LENGTH 80 /* Bytes of the longest block below */
+
+static double now_ms(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+/* this function writes a source with block_count code labels and as many data labels, returns its length.
+   block i uses the data label of block i and the code label of a block spread over the whole file */
+static size_t create_source(char *source, int block_count) {
+    size_t length = 0;
+    int i;
+
+    for (i = 0; i < block_count; i++)
+        length += sprintf(source + length, "C%d: mov D%d, r%d\n     jmp C%d\nD%d: .data %d\n",
+                          i, i, i % 8, (int) ((i * 7919L) % block_count), i, i % 1000);
+    length += sprintf(source + length, "stop\n");
+    return length;
+}
+
+/* this function returns the best time in milliseconds of assembling a source rounds times, or -1 */
+static double time_source(asm_ctx *ctx, const char *source, size_t length, int rounds) {
+    double best = -1;
+    int i;
+
+    for (i = 0; i < rounds; i++) {
+        assembly_output output;
+        double start = now_ms(), elapsed;
+        int result = asm_assemble_buffer(ctx, source, length, &output);
+        elapsed = now_ms() - start;
+        free_assembly_output(&output);
+        if (result != FILE_SUCCEEDED) {
+            fprintf(stderr, "label_bench: the generated source did not assemble\n");
+            return -1;
+        }
+        if (best < 0 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+static void print_messages(void *data, const char *text, size_t length) {
+    (void) data;
+    (void) text;
+    (void) length; /* the progress messages are not interesting here */
+}
+
+int main(int argc, char *argv[]) {
+    int label_count = DEFAULT_LABEL_COUNT, rounds = DEFAULT_ROUNDS, i, step;
+    asm_ctx *ctx;
+    char *source;
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-n") == 0)
+            label_count = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-r") == 0)
+            rounds = atoi(argv[i + 1]);
+        else
+            break;
+    }
+    if (i != argc || label_count < 8 || rounds < 1) {
+        fprintf(stderr, "Usage: %s [-n LABELS] [-r ROUNDS]\n", argv[0]);
+        return 1;
+    }
+    source = malloc((size_t) (label_count / 2) * MAX_BLOCK_LENGTH + 16);
+    if (!source || !(ctx = asm_ctx_create())) {
+        free(source);
+        return 1;
+    }
+    asm_ctx_set_sinks(ctx, NULL, NULL, print_messages, NULL);
+
+    for (step = 4; step >= 1; step /= 2) {
+        int labels = label_count / step / 2 * 2;
+        size_t length = create_source(source, labels / 2);
+        double elapsed = time_source(ctx, source, length, rounds);
+        if (elapsed < 0)
+            break;
+        printf("%8d labels: %9.1f ms, %.3f us per label\n", labels, elapsed, elapsed * 1000.0 / labels);
+    }
+    asm_ctx_destroy(ctx);
+    free(source);
+    return step >= 1;
+}
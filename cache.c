@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+#include "cache.h"
+#include "assembler.h"
+#include "console.h"
+#include "batch.h"
+
+/* One entry found while trimming the cache */
+typedef struct {
+    char *path;               /* The entry's file */
+    unsigned long size;       /* Its size in bytes */
+    time_t used;              /* When it was last stored or hit */
+} cache_entry;
+
+int cache_open(output_cache *cache, const char *directory, unsigned long max_size) {
+    if (mkdir(directory, 0777) < 0 && errno != EEXIST) {
+        console_printf("Can not create the cache directory %s: %s\n", directory, strerror(errno));
+        return 0;
+    }
+    cache -> directory = malloc(strlen(directory) + 1);
+    if (!cache -> directory) {
+        console_printf("Memory allocation failed\n");
+        return 0;
+    }
+    strcpy(cache -> directory, directory);
+    cache -> max_size = max_size;
+    cache -> hits = cache -> misses = cache -> stores = cache -> evictions = 0;
+    cache -> next_temporary = 0;
+    pthread_mutex_init(&cache -> lock, NULL);
+    return 1;
+}
+
+void cache_close(output_cache *cache) {
+    pthread_mutex_destroy(&cache -> lock);
+    free(cache -> directory);
+    cache -> directory = NULL;
+}
+
+void cache_compute_key(char *key, const char *file_name, const memory_file *source, const char *flags) {
+    hash_context context;
+
+    /* the null terminators keep the fields apart, so "ab" + "c" differs from "a" + "bc" */
+    hash_begin(&context);
+    hash_update(&context, CACHE_FORMAT, strlen(CACHE_FORMAT) + 1);
+    hash_update(&context, ASSEMBLER_VERSION, strlen(ASSEMBLER_VERSION) + 1);
+    hash_update(&context, flags, strlen(flags) + 1);
+    hash_update(&context, file_name, strlen(file_name) + 1);
+    hash_update(&context, source -> data, source -> size);
+    hash_end(&context, key);
+}
+
+/* this function returns the path of the entry of a key ("<directory>/ab/cdef..."),
+   or of its sub directory if entry_name is 0 */
+static char *entry_path(const output_cache *cache, const char *key, int entry_name) {
+    char *path = malloc(strlen(cache -> directory) + HASH_TEXT_SIZE + 2);
+    if (!path)
+        return NULL;
+    if (entry_name)
+        sprintf(path, "%s/%.2s/%s", cache -> directory, key, key + 2);
+    else
+        sprintf(path, "%s/%.2s", cache -> directory, key);
+    return path;
+}
+
+/* this function reads one "<name> <length>\n<bytes>" section of an entry, returns 0 at the end or on a damaged entry.
+   a length past the end of the file is damage, it is rejected before anything is allocated for it */
+static int read_section(FILE *file, char *name, memory_file *contents) {
+    char line[64];
+    unsigned long length;
+    struct stat info;
+    long position;
+
+    if (!fgets(line, sizeof(line), file) || sscanf(line, "%15s %lu", name, &length) != 2)
+        return 0;
+    position = ftell(file);
+    if (position < 0 || fstat(fileno(file), &info) < 0 || position > info.st_size || length > (unsigned long) (info.st_size - position))
+        return 0;
+    contents -> data = malloc(length + 1);
+    if (!contents -> data)
+        return 0;
+    if (fread(contents -> data, 1, length, file) != length) {
+        free(contents -> data);
+        contents -> data = NULL;
+        return 0;
+    }
+    contents -> data[length] = '\0';
+    contents -> size = length;
+    return 1;
+}
+
+/* this function reads a whole entry, returns 0 if it is damaged or of another format */
+static int read_entry(FILE *file, int *result, memory_file *console_text, assembly_output *output) {
+    char line[64], name[16];
+    memory_file contents, *target;
+
+    if (!fgets(line, sizeof(line), file) || strcmp(line, CACHE_FORMAT "\n") != 0)
+        return 0;
+    if (!fgets(line, sizeof(line), file) || sscanf(line, "result %d", result) != 1)
+        return 0;
+
+    while (read_section(file, name, &contents)) {
+        int kind;
+        if (strcmp(name, "console") == 0) {
+            free_memory_file(console_text);
+            *console_text = contents;
+            continue;
+        }
+        for (kind = 0; kind < OUTPUT_KINDS && strcmp(name, output_extension(kind)) != 0; kind++)
+            ;
+        if (kind == OUTPUT_KINDS) {
+            free(contents.data);
+            return 0;
+        }
+        target = mark_produced(output, kind);
+        free_memory_file(target);
+        *target = contents;
+    }
+    return feof(file) && !ferror(file);
+}
+
+int cache_lookup(output_cache *cache, const char *key, int *result, memory_file *console_text, assembly_output *output) {
+    char *path = entry_path(cache, key, 1);
+    FILE *file = path ? fopen(path, "rb") : NULL;
+    int hit = 0;
+
+    if (file) {
+        hit = read_entry(file, result, console_text, output);
+        fclose(file);
+        if (hit) {
+            utime(path, NULL); /* recently used, the last to be evicted */
+        } else {
+            free_memory_file(console_text);
+            free_assembly_output(output);
+        }
+    }
+    free(path);
+
+    pthread_mutex_lock(&cache -> lock);
+    if (hit)
+        cache -> hits++;
+    else
+        cache -> misses++;
+    pthread_mutex_unlock(&cache -> lock);
+    return hit;
+}
+
+void cache_store(output_cache *cache, const char *key, int result, const char *console_text, size_t console_length, assembly_output *output) {
+    char *directory = entry_path(cache, key, 0);
+    char *path = entry_path(cache, key, 1);
+    char *temporary_path = path ? malloc(strlen(path) + 64) : NULL;
+    unsigned long number;
+    FILE *file;
+    int kind;
+
+    if (!directory || !path || !temporary_path) {
+        free(directory);
+        free(path);
+        free(temporary_path);
+        return;
+    }
+
+    pthread_mutex_lock(&cache -> lock);
+    number = cache -> next_temporary++;
+    pthread_mutex_unlock(&cache -> lock);
+
+    /* the entry is written under a temporary name and renamed, so other
+       processes sharing the cache never see half of an entry */
+    mkdir(directory, 0777);
+    sprintf(temporary_path, "%s/.tmp.%ld.%lu", directory, (long) getpid(), number);
+    file = fopen(temporary_path, "wb");
+    if (file) {
+        fprintf(file, "%s\nresult %d\n", CACHE_FORMAT, result);
+        fprintf(file, "console %lu\n", (unsigned long) console_length);
+        fwrite(console_text, 1, console_length, file);
+        for (kind = 0; kind < OUTPUT_KINDS; kind++) {
+            memory_file *contents = produced_file(output, kind);
+            if (!contents)
+                continue;
+            fprintf(file, "%s %lu\n", output_extension(kind), (unsigned long) contents -> size);
+            fwrite(contents -> data, 1, contents -> size, file);
+        }
+        if (ferror(file) | fclose(file) || rename(temporary_path, path) < 0) {
+            unlink(temporary_path);
+        } else {
+            pthread_mutex_lock(&cache -> lock);
+            cache -> stores++;
+            pthread_mutex_unlock(&cache -> lock);
+        }
+    }
+
+    free(directory);
+    free(path);
+    free(temporary_path);
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const cache_entry *first = a, *second = b;
+    if (first -> used != second -> used)
+        return first -> used < second -> used ? -1 : 1;
+    return strcmp(first -> path, second -> path);
+}
+
+/* this function adds the entries of one sub directory of the cache to entries.
+   returns 0 if memory allocation failed */
+static int collect_entries(const char *directory, cache_entry **entries, int *count, int *capacity, unsigned long *total) {
+    DIR *sub_directory = opendir(directory);
+    struct dirent *item;
+    int success = 1;
+
+    if (!sub_directory)
+        return 1; /* not a directory, or removed by another process */
+
+    while (success && (item = readdir(sub_directory)) != NULL) {
+        struct stat info;
+        char *path;
+
+        if (item -> d_name[0] == '.') /* ".", ".." and the temporary files */
+            continue;
+        path = malloc(strlen(directory) + strlen(item -> d_name) + 2);
+        if (!path) {
+            success = 0;
+            break;
+        }
+        sprintf(path, "%s/%s", directory, item -> d_name);
+        if (stat(path, &info) < 0 || !S_ISREG(info.st_mode)) {
+            free(path);
+            continue;
+        }
+
+        if (*count == *capacity) {
+            int new_capacity = *capacity ? *capacity * 2 : INITIAL_FILE_LIST_SIZE;
+            cache_entry *new_entries = realloc(*entries, new_capacity * sizeof(cache_entry));
+            if (!new_entries) {
+                free(path);
+                success = 0;
+                break;
+            }
+            *entries = new_entries;
+            *capacity = new_capacity;
+        }
+        (*entries)[*count].path = path;
+        (*entries)[*count].size = (unsigned long) info.st_size;
+        (*entries)[*count].used = info.st_mtime;
+        (*count)++;
+        *total += (unsigned long) info.st_size;
+    }
+
+    closedir(sub_directory);
+    return success;
+}
+
+void cache_trim(output_cache *cache) {
+    DIR *directory;
+    struct dirent *item;
+    cache_entry *entries = NULL;
+    int count = 0, capacity = 0, i;
+    unsigned long total = 0, target;
+
+    if (cache -> stores == 0)
+        return; /* the cache did not grow */
+
+    directory = opendir(cache -> directory);
+    if (!directory)
+        return;
+    while ((item = readdir(directory)) != NULL) {
+        char *path;
+        if (strlen(item -> d_name) != 2 || item -> d_name[0] == '.')
+            continue;
+        path = malloc(strlen(cache -> directory) + 4);
+        if (!path)
+            break;
+        sprintf(path, "%s/%s", cache -> directory, item -> d_name);
+        i = collect_entries(path, &entries, &count, &capacity, &total);
+        free(path);
+        if (!i)
+            break;
+    }
+    closedir(directory);
+
+    /* least recently used first */
+    if (total > cache -> max_size) {
+        target = cache -> max_size / 100 * CACHE_TRIM_PERCENT;
+        qsort(entries, count, sizeof(cache_entry), compare_entries);
+        for (i = 0; i < count && total > target; i++) {
+            if (unlink(entries[i].path) == 0) {
+                total -= entries[i].size;
+                cache -> evictions++;
+            }
+        }
+    }
+
+    for (i = 0; i < count; i++)
+        free(entries[i].path);
+    free(entries);
+}
+
+void print_cache_stats(const output_cache *cache) {
+    console_printf("Cache: %lu hit(s), %lu miss(es), %lu stored, %lu evicted\n", cache -> hits, cache -> misses, cache -> stores, cache -> evictions);
+}
+
+int parse_cache_size(const char *value, unsigned long *size) {
+    char *end;
+    unsigned long number, unit = 1;
+
+    if (!isdigit((unsigned char) *value))
+        return 0;
+    number = strtoul(value, &end, 10);
+    switch (toupper((unsigned char) *end)) {
+        case 'K':
+            unit = 1024UL;
+            end++;
+            break;
+        case 'M':
+            unit = 1024UL * 1024;
+            end++;
+            break;
+        case 'G':
+            unit = 1024UL * 1024 * 1024;
+            end++;
+            break;
+    }
+    if (*end != '\0' || number == 0 || number > (unsigned long) -1 / unit)
+        return 0;
+    *size = number * unit;
+    return 1;
+}
@@ -0,0 +1,107 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <pthread.h>
+#include "memory_file.h"
+#include "hash.h"
+
+#define CACHE_ENVIRONMENT_VARIABLE "ASSEMBLER_CACHE"  /* The cache directory when --cache is not given */
+#define DEFAULT_CACHE_SIZE (64UL * 1024 * 1024)       /* Default upper limit for the size of the cache */
+#define CACHE_FORMAT "assembler-cache 1"              /* The first line of every entry */
+#define CACHE_TRIM_PERCENT 90                         /* Eviction goes on until the cache is this full */
+#define MAX_CACHE_FLAGS_LENGTH (32 + HASH_TEXT_SIZE)   /* Upper limit for the flags of a key, they may hold a hash and a number */
+
+/* A cache of assembled files, kept in a directory. Each entry is named by the hash of
+   everything that decides the outputs, and holds the outputs and the console messages.
+   The entries of a cache directory are in sub directories named by the first two digits. */
+typedef struct {
+    char *directory;              /* The cache directory */
+    unsigned long max_size;       /* Upper limit for the size of all entries, in bytes */
+    unsigned long hits;           /* Files restored from the cache */
+    unsigned long misses;         /* Files that had to be assembled */
+    unsigned long stores;         /* Entries added */
+    unsigned long evictions;      /* Entries removed to keep the cache small enough */
+    unsigned long next_temporary; /* Numbers the temporary files of this process */
+    pthread_mutex_t lock;         /* Guards the counters, the cache is used by all the workers */
+} output_cache;
+
+/*
+ * Opens a cache directory, creating it if needed.
+ *
+ * Parameters:
+ *   cache - The cache to open.
+ *   directory - The cache directory.
+ *   max_size - Upper limit for the size of the cache, in bytes.
+ *
+ * Returns:
+ *   1 on success, 0 if the directory could not be created (the error was printed).
+ */
+int cache_open(output_cache *cache, const char *directory, unsigned long max_size);
+
+/*
+ * Closes a cache.
+ */
+void cache_close(output_cache *cache);
+
+/*
+ * Computes the key of a source: the hash of the cache format, the assembler version,
+ * the options that change the outputs, the file name (it is part of the messages)
+ * and the source itself.
+ *
+ * Parameters:
+ *   key - Receives HASH_TEXT_SIZE characters.
+ *   file_name - The input file name, without extension.
+ *   source - The bytes of the .as file.
+ *   flags - The options that change the outputs.
+ */
+void cache_compute_key(char *key, const char *file_name, const memory_file *source, const char *flags);
+
+/*
+ * Looks up an entry. A hit also marks the entry as recently used.
+ *
+ * Parameters:
+ *   cache - The cache.
+ *   key - The key of the source.
+ *   result - Receives the outcome of the file (FILE_SUCCEEDED or FILE_HAS_ERRORS).
+ *   console_text - Receives the console messages of the file.
+ *   output - Receives the output files.
+ *
+ * Returns:
+ *   1 on a hit, 0 on a miss.
+ */
+int cache_lookup(output_cache *cache, const char *key, int *result, memory_file *console_text, assembly_output *output);
+
+/*
+ * Adds an entry. Failures are ignored, the cache only saves time.
+ *
+ * Parameters:
+ *   cache - The cache.
+ *   key - The key of the source.
+ *   result - The outcome of the file.
+ *   console_text - The console messages of the file.
+ *   console_length - Number of bytes in console_text.
+ *   output - The output files.
+ */
+void cache_store(output_cache *cache, const char *key, int result, const char *console_text, size_t console_length, assembly_output *output);
+
+/*
+ * Removes the least recently used entries while the cache is bigger than its limit.
+ * Does nothing if no entry was added since the cache was opened.
+ */
+void cache_trim(output_cache *cache);
+
+/*
+ * Prints the hit and miss counters.
+ */
+void print_cache_stats(const output_cache *cache);
+
+/*
+ * Parses a size like "500000", "512K", "64M" or "2G".
+ *
+ * Returns:
+ *   1 on success, 0 if the value is not a size.
+ */
+int parse_cache_size(const char *value, unsigned long *size);
+
+#endif
@@ -1,19 +1,39 @@
 #include "code_conversion.h"
 #include "globals.h"
 #include "parser.h"
+#include "console.h"
+#include "fatal.h"
+
+/* this function makes room for one more data word. the data array starts with room for INITIAL_CC_CAPACITY
+   words (initialize_code_conv) and doubles whenever it is full, so it is full exactly when DC is
+   INITIAL_CC_CAPACITY times a power of 2. returns 1 on success, 0 if memory reallocation failed */
+static int reserve_data_word(code_conv **data, int DC) {
+    int capacity = INITIAL_CC_CAPACITY;
+    code_conv *grown;
+
+    while (capacity < DC)
+        capacity *= 2;
+    if (DC < capacity)
+        return 1;
+    grown = realloc(*data, 2 * capacity * sizeof(code_conv));
+    if (!grown) {
+        console_printf("MEMORY REALLOCATION FAILED\n");
+        return 0;  /* Return 0 if memory reallocation fails */
+    }
+    *data = grown;
+    return 1;
+}
 
 /* Function to encode parsed data into memory */
 int encode_data_to_memory(code_conv **data, int *DC, location *am_file, const int *values, int count, label *label, int IC) {
     int i;
     for (i = 0; i < count; i++) {
-        /* Reallocate memory for data array to hold additional entry */
-        *data = realloc(*data, (*DC + 1) * sizeof(code_conv));
-        if (!*data) {
-            printf("MEMORY REALLOCATION FAILED\n");
-            return 0;  /* Return 0 if memory reallocation fails */
-        }
+        /* Make room in the data array for an additional entry */
+        if (!reserve_data_word(data, *DC))
+            return 0;
         /* Set the binary representation of the data */
         (*data)[*DC].binary_repres = (unsigned short)values[i];
+        (*data)[*DC].label[0] = NULL;  /* No label associated with this data */
         /* Set the assembly line from the location information */
         (*data)[*DC].assembly_line = am_file -> line;
         (*DC)++;  /* Increment data count */
@@ -22,48 +42,46 @@ int encode_data_to_memory(code_conv **data, int *DC, location *am_file, const in
 }
 
 /* Function to handle .data and .string directives */
-int add_machine_code_data(code_conv **data, int *DC, location *am_file, const char *directive, const char *operands, label *label, int IC) {
+int add_machine_code_data(code_conv **data, int *DC, location *am_file, const char *directive, const token_span *operands, label *label, int IC) {
     if (strcmp(directive, ".data") == 0) {
+        int values[MAX_LINE_LENGTH]; /* every number takes at least one character of the line */
         int count = 0;
-        int *values = parse_operands(operands, am_file, &count);
-        if (!values) {
+        if (!parse_operands(operands, am_file, values, &count)) {
             PRINT_ERROR(am_file -> file_name, am_file -> line, "Failed to parse operands for .data directive.");
             return 0;  /* Return 0 if parsing operands fails */
         }
 
         /* Encode the parsed data into memory */
-        if (!encode_data_to_memory(data, DC, am_file, values, count, label, IC)) {
-            free(values);  /* Free memory if encoding fails */
+        if (!encode_data_to_memory(data, DC, am_file, values, count, label, IC))
             return 0;
-        }
-        free(values);  /* Free memory after successful encoding */
     } else if (strcmp(directive, ".string") == 0) {
         /* Locate the starting and ending quotes */
-        const char *start_quote = strchr(operands, '"');
-        const char *end_quote = strrchr(operands, '"');
-        const char *p;
-        if (start_quote && end_quote) {
+        int start_quote = -1, end_quote = -1, i;
+        const char *p, *end;
+        for (i = 0; i < operands -> count; i++) {
+            if (operands -> tokens[i].kind == TOKEN_QUOTE) {
+                if (start_quote < 0)
+                    start_quote = i;
+                end_quote = i;
+            }
+        }
+        if (start_quote >= 0) {
             if (start_quote != end_quote) {
                 /* Move past the starting quote */
-                start_quote++;
+                p = operands -> text + operands -> tokens[start_quote].offset + 1;
+                end = operands -> text + operands -> tokens[end_quote].offset;
                 /* Store each character in the string, including the null terminator */
-                for (p = start_quote; p < end_quote; p++) {
-                    *data = realloc(*data, (*DC + 1) * sizeof(code_conv));
-                    if (!*data) {
-                        printf("MEMORY REALLOCATION FAILED\n");
-                        return 0;  /* Return 0 if memory reallocation fails */
-                    }
+                for (; p < end; p++) {
+                    if (!reserve_data_word(data, *DC))
+                        return 0;
                     (*data)[*DC].binary_repres = (unsigned short)(*p);
                     (*data)[*DC].label[0] = NULL;  /* No label associated with this data */
                     (*data)[*DC].assembly_line = am_file -> line;
                     (*DC)++;
                 }
                 /* Add null terminator to the data */
-                *data = realloc(*data, (*DC + 1) * sizeof(code_conv));
-                if (!*data) {
-                    printf("MEMORY REALLOCATION FAILED\n");
-                    return 0;  /* Return 0 if memory reallocation fails */
-                }
+                if (!reserve_data_word(data, *DC))
+                    return 0;
                 (*data)[*DC].binary_repres = 0;  /* Null terminator */
                 (*data)[*DC].label[0] = NULL;  /* No label associated with this data */
                 (*data)[*DC].assembly_line = am_file -> line;
@@ -77,102 +95,47 @@ int add_machine_code_data(code_conv **data, int *DC, location *am_file, const ch
     return 1;  /* Return 1 to indicate success */
 }
 
-int *parse_operands(const char *operands, location *am_file, int *count) {
-    const char *ptr = operands;
-    int values_size = INITIAL_VAL_BUF_SIZE, current_line = am_file -> line;
-    int *values = (int *) malloc(values_size * sizeof(int));
-    if (!values) {
-        printf("Memory allocation failed\n");
-        return 0;
-    }
-
-    while (*ptr) {
-        char *number_buffer;
-        int number_index, current_size;
-        /* Skip whitespace */
-        while (isspace(*ptr)) ptr++;
-
-        /* Handle empty operand */
-        if (*ptr == '\0') {
-            break;
-        }
-
-        number_buffer = (char *) malloc(INITIAL_VAL_BUF_SIZE);
-        if (!number_buffer) {
-            printf("MEMORY ALLOCATION FAILED\n");
-            free(values);
-            return 0;
-        }
+/* this function reads the numbers of a .data directive into values, which has room for one number
+   per character of the operands. a number is a token of digits and signs, read like atoi.
+   returns 1 on success, 0 if the operands are illegal (the error is printed) */
+int parse_operands(const token_span *operands, location *am_file, int *values, int *count) {
+    char text[MAX_LINE_LENGTH + 2]; /* an illegal operand as a string, for the error message */
+    int current_line = am_file -> line, i = 0;
 
-        current_size = INITIAL_VAL_BUF_SIZE;
-        number_index = 0;
+    while (i < operands -> count) {
+        const token *number = &operands -> tokens[i++];
 
         /* Parse the number */
-        while (isdigit(*ptr) || *ptr == '-' || *ptr == '+') {
-            if (number_index >= current_size - 1) {
-                current_size += ADDITIONAL_VAL_BUF_SIZE;
-                number_buffer = (char *) realloc(number_buffer, current_size);
-                if (!number_buffer) {
-                    printf("MEMORY ALLOCATION FAILED\n");
-                    free(values);
-                    return 0;
-                }
-            }
-            number_buffer[number_index++] = *ptr++;
-        }
-        number_buffer[number_index] = '\0';
-
-        if (number_index > 0) {
-            /* Check if values array needs to grow */
-            if (*count >= values_size) {
-                values_size += ADDITIONAL_VAL_BUF_SIZE;
-                values = (int *) realloc(values, values_size * sizeof(int));
-                if (!values) {
-                    printf("MEMORY ALLOCATION FAILED\n");
-                    free(number_buffer);
-                    return 0;
-                }
-            }
-            values[(*count)++] = atoi(number_buffer);
-        }
-        else {
-            PRINT_ERROR1(am_file -> file_name, current_line, "Invalid operand '%s' not an int", number_buffer);
-            free(number_buffer);
-            free(values);
+        if (number -> kind != TOKEN_NUMBER && number -> kind != TOKEN_NUMBER_PREFIX) {
+            word_view view;
+            view.text = operands -> text + number -> offset;
+            view.length = number -> length;
+            PRINT_ERROR1(am_file -> file_name, current_line, "Invalid operand '%s' not an int", copy_word(&view, view.length, text));
             return 0;
         }
+        values[(*count)++] = token_number(operands -> text, number, 0);
 
-        free(number_buffer);
-
-        /* Skip whitespace after the number */
-        while (isspace(*ptr)) ptr++;
-
-        /* Check for multiple commas */
-        if (*ptr == ',') {
-            ptr++;
-            /* Skip whitespace after the comma */
-            while (isspace(*ptr)) ptr++;
-            if (*ptr == ',') {
+        /* Check for multiple commas, the number must be followed by a comma or the end of the line */
+        if (number -> kind == TOKEN_NUMBER && i < operands -> count && operands -> tokens[i].kind == TOKEN_COMMA) {
+            i++;
+            if (i < operands -> count && operands -> tokens[i].kind == TOKEN_COMMA) {
                 PRINT_ERROR(am_file -> file_name, current_line, "Multiple consetive commas");
-                free(values);
                 return 0;
             }
         }
-        else if (*ptr != '\0') {
+        else if (number -> kind == TOKEN_NUMBER_PREFIX || i < operands -> count) {
             PRINT_ERROR(am_file -> file_name, current_line, "Expected comma or end of line");
-            free(values);
             return 0;
         }
     }
 
     /* Check for trailing comma */
-    if (*count > 0 && *(ptr - 1) == ',') {
+    if (*count > 0 && operands -> tokens[operands -> count - 1].kind == TOKEN_COMMA) {
         PRINT_ERROR(am_file -> file_name, current_line, "Trailing comma");
-        free(values);
         return 0;
     }
 
-    return values;
+    return 1;
 }
 
 void encode_instruction_first_word(instruction *instr) {
@@ -217,18 +180,52 @@ void encode_instruction_first_word(instruction *instr) {
     instr -> binary_repres = first_word;  /* Store the encoded first word in the instruction */
 }
 
-label *find_label(label_table *table, const char *label_name) {
-	int i;
-    for (i = 0; i < table->count; i++) {
-        if (strcmp(table->labels[i].name, label_name) == 0) {
-            return &table->labels[i];  /* Return pointer to the found label */
+/* this function makes room for the operand words of an instruction without encoding them,
+   for the modes that only need the sizes. the checks are the same as in encode_operands */
+void reserve_operand_words(operand *op1, operand *op2, code_conv **instructions, int *IC, int *cc_capacity, location *am_file) {
+    operand *ops[2];
+    int words = 0, i;
+
+    ops[0] = op1;
+    ops[1] = op2;
+    if (op1 && op2 && (op1->is_register && op2->is_register)) {
+        words = 1; /* both registers share one word */
+    } else {
+        for (i = 0; i < 2; i++) {
+            if (!ops[i])
+                continue;
+            if (ops[i]->type != IMMEDIATE && ops[i]->type != DIRECT && ops[i]->type != INDIRECT_REG && ops[i]->type != DIRECT_REG) {
+                PRINT_ERROR(am_file->file_name, am_file->line, "Illegal operand type.");
+                break;
+            }
+            words++;
+        }
+    }
+
+    for (i = 0; i < words; i++) {
+        if (*IC >= *cc_capacity) {
+            code_conv *new_instructions;
+            *cc_capacity *= 2;  /* Double the capacity to minimize realloc calls */
+            new_instructions = realloc(*instructions, (*cc_capacity) * sizeof(code_conv));
+            if (!new_instructions) {
+                PRINT_ERROR(am_file->file_name, am_file->line, "Memory allocation failed");
+                fatal_error();
+            }
+            *instructions = new_instructions;
         }
+        (*instructions)[*IC].binary_repres = 0;
+        (*instructions)[*IC].label[0] = NULL;
+        (*instructions)[*IC].assembly_line = am_file->line;
+        (*IC)++;
     }
-    return NULL;  /* Return NULL if the label is not found */
+}
+
+label *find_label(label_table *table, const char *label_name) {
+    return lookup_label(table, label_name);  /* NULL if the label is not found */
 }
 
 
-void encode_operands(operand *op1, operand *op2, code_conv **instructions, int *IC, int *cc_capacity, label_table *table, location *am_file, label *lbl) {
+void encode_operands(operand *op1, operand *op2, code_conv **instructions, int *IC, int *cc_capacity, label_table *table, location *am_file) {
     unsigned short operand_word = 0;
     int i;
     int is_destanation = 0;
@@ -257,22 +254,14 @@ void encode_operands(operand *op1, operand *op2, code_conv **instructions, int *
             new_instructions = realloc(*instructions, (*cc_capacity) * sizeof(code_conv));
             if (!new_instructions) {
                 PRINT_ERROR(am_file->file_name, am_file->line, "Memory allocation failed");
-                exit(1);
+                fatal_error();
             }
             *instructions = new_instructions;
         }
 
         /* Store the encoded word in the instructions array */
         (*instructions)[*IC].binary_repres = operand_word;
-        if (lbl) {
-    		(*instructions)[*IC].label[0] = my_strdup(lbl->name);
-    		if ((*instructions)[*IC].label[0] == NULL) {
-        		PRINT_ERROR(am_file->file_name, am_file->line, "Memory allocation failed");
-        		exit(1);
-    		}
-		} else {
-    		(*instructions)[*IC].label[0] = NULL;
-		}
+        (*instructions)[*IC].label[0] = NULL; /* the label of the line is kept in the label table only */
         (*instructions)[*IC].assembly_line = am_file->line;
         (*IC)++;  /* Increment IC after storing the instruction */
 
@@ -332,22 +321,14 @@ void encode_operands(operand *op1, operand *op2, code_conv **instructions, int *
             new_instructions = realloc(*instructions, (*cc_capacity) * sizeof(code_conv));
             if (!new_instructions) {
                 PRINT_ERROR(am_file->file_name, am_file->line, "Memory allocation failed");
-                exit(1);
+                fatal_error();
             }
-           
+            *instructions = new_instructions;
         }
 
         /* Store the encoded word in the instructions array */
         (*instructions)[*IC].binary_repres = operand_word;
-        if (lbl) {
-    		(*instructions)[*IC].label[0] = my_strdup(lbl->name);
-    		if ((*instructions)[*IC].label[0] == NULL) {
-        		PRINT_ERROR(am_file->file_name, am_file->line, "Memory allocation failed");
-        		exit(1);
-    		}
-		} else {
-    		(*instructions)[*IC].label[0] = NULL;
-		}
+        (*instructions)[*IC].label[0] = NULL; /* the label of the line is kept in the label table only */
         (*instructions)[*IC].assembly_line = am_file->line;
         (*IC)++;  /* Increment IC after storing the instruction */
     }
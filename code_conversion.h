@@ -3,9 +3,7 @@
 
 #include "first_pass.h"
 
-#define INITIAL_VAL_BUF_SIZE 64
-#define ADDITIONAL_VAL_BUF_SIZE 64
-
-int *parse_operands(const char *, location *, int *);
+/* Reads the numbers of a .data directive into an array with room for one number per character, returns 0 if they are illegal */
+int parse_operands(const token_span *, location *, int *, int *);
 
 #endif
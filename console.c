@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "console.h"
+
+#define INITIAL_CONSOLE_BUFFER_SIZE 256
+
+#ifndef va_copy
+#define va_copy(dest, src) __va_copy(dest, src) /* not declared in strict ANSI mode */
+#endif
+
+static pthread_key_t capture_key; /* the capture buffer of each thread */
+static pthread_once_t capture_key_once = PTHREAD_ONCE_INIT;
+static FILE *console_stream = NULL; /* where output that is not captured goes, NULL for stdout */
+
+static void create_capture_key(void) {
+    pthread_key_create(&capture_key, NULL);
+}
+
+/* this function makes sure there are at least extra free bytes in the buffer */
+static int reserve_console_buffer(console_buffer *buffer, size_t extra) {
+    size_t new_capacity;
+    char *new_text;
+
+    if (buffer -> length + extra <= buffer -> capacity)
+        return 1;
+
+    new_capacity = buffer -> capacity ? buffer -> capacity : INITIAL_CONSOLE_BUFFER_SIZE;
+    while (new_capacity < buffer -> length + extra)
+        new_capacity *= 2; /* grow geometrically so long outputs stay linear */
+
+    new_text = realloc(buffer -> text, new_capacity);
+    if (!new_text)
+        return 0;
+    buffer -> text = new_text;
+    buffer -> capacity = new_capacity;
+    return 1;
+}
+
+void console_vprintf(const char *format, va_list args) {
+    console_buffer *buffer;
+    va_list copy;
+    int needed;
+
+    pthread_once(&capture_key_once, create_capture_key);
+    buffer = pthread_getspecific(capture_key);
+    if (!buffer) { /* not capturing, print as usual */
+        vfprintf(console_stream ? console_stream : stdout, format, args);
+        return;
+    }
+
+    /* find out how long the message is, then format it into the buffer */
+    va_copy(copy, args);
+    needed = vsnprintf(NULL, 0, format, copy);
+    va_end(copy);
+    if (needed < 0)
+        return;
+    if (!reserve_console_buffer(buffer, (size_t) needed + 1)) {
+        vfprintf(console_stream ? console_stream : stdout, format, args); /* better out of order than lost */
+        return;
+    }
+    vsnprintf(buffer -> text + buffer -> length, (size_t) needed + 1, format, args);
+    buffer -> length += needed;
+}
+
+void console_printf(const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    console_vprintf(format, args);
+    va_end(args);
+}
+
+void console_capture_begin(console_buffer *buffer) {
+    pthread_once(&capture_key_once, create_capture_key);
+    pthread_setspecific(capture_key, buffer);
+}
+
+void console_capture_end(void) {
+    pthread_once(&capture_key_once, create_capture_key);
+    pthread_setspecific(capture_key, NULL);
+}
+
+console_buffer *console_capture_current(void) {
+    pthread_once(&capture_key_once, create_capture_key);
+    return pthread_getspecific(capture_key);
+}
+
+void console_buffer_flush(console_buffer *buffer) {
+    FILE *stream = console_stream ? console_stream : stdout;
+    if (buffer -> length > 0)
+        fwrite(buffer -> text, 1, buffer -> length, stream);
+    fflush(stream);
+    free(buffer -> text);
+    buffer -> text = NULL;
+    buffer -> length = 0;
+    buffer -> capacity = 0;
+}
+
+void console_set_stream(FILE *stream) {
+    console_stream = stream;
+}
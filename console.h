@@ -0,0 +1,66 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+/* A growing text buffer that collects the console output of one file
+   while it is being assembled on a worker thread. */
+typedef struct {
+    char *text;        /* The collected output (not null terminated) */
+    size_t length;     /* Number of bytes collected */
+    size_t capacity;   /* Allocated size of text */
+} console_buffer;
+
+/*
+ * Prints a formatted message to the console of the current thread.
+ * If the thread is capturing, the message is appended to its buffer,
+ * otherwise it is printed to the console stream (the standard output by default).
+ *
+ * Parameters:
+ *   format - printf style format string, followed by its arguments.
+ */
+void console_printf(const char *format, ...);
+
+/*
+ * Same as console_printf, but takes an initialized argument list.
+ */
+void console_vprintf(const char *format, va_list args);
+
+/*
+ * Starts capturing all console output of the calling thread into a buffer.
+ *
+ * Parameters:
+ *   buffer - An empty (zeroed) buffer that will receive the output.
+ */
+void console_capture_begin(console_buffer *buffer);
+
+/*
+ * Stops capturing the console output of the calling thread.
+ */
+void console_capture_end(void);
+
+/*
+ * Returns the buffer the calling thread is capturing into, or NULL if it is not capturing.
+ */
+console_buffer *console_capture_current(void);
+
+/*
+ * Writes the captured text to the console stream and frees the buffer.
+ *
+ * Parameters:
+ *   buffer - The buffer to flush.
+ */
+void console_buffer_flush(console_buffer *buffer);
+
+/*
+ * Sends everything that is not captured to another stream, e.g. the reply to
+ * a client of the server. Must not be called while files are being assembled.
+ *
+ * Parameters:
+ *   stream - The new console stream, or NULL for the standard output.
+ */
+void console_set_stream(FILE *stream);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include "libasm.h"
+#include "macro_library.h"
+#include "include_cache.h"
+
+#define MAX_DIAGNOSTIC_LENGTH 512 /* Upper limit for one error or warning handed to a sink */
+
+/* Everything a context holds. The library binds a context to the calling
+   thread while it assembles, the modules below find it with current_context. */
+struct asm_ctx {
+    char *name;                                /* The name of the sources, without extension */
+    int mode;                                  /* ASSEMBLE_FULL, ASSEMBLE_CHECK or ASSEMBLE_SIZES */
+    int emit_expanded;                         /* 1 if the extended source (.am) is one of the outputs */
+    int jobs;                                  /* Workers the first pass of a large source may use, 1 for none */
+    int pipelined;                             /* 1 if the extension and the first pass run at the same time */
+    const char *const *illegal_macro_names;    /* Names a macro can not have */
+    int illegal_macro_count;                   /* Number of illegal macro names */
+    const macro_library *macro_library;        /* Macros the sources may call without defining them, or NULL */
+    long macro_budget;                         /* Lines one macro call may expand to */
+    int macro_profile;                         /* MACRO_PROFILE_OFF, MACRO_PROFILE_TEXT or MACRO_PROFILE_JSON */
+    int emit_dependencies;                     /* 1 if the dependency file (.d) is one of the outputs */
+    memory_file dependencies;                  /* The files the source included, one per line, while it is assembled */
+    const included_file **held_files;          /* The included files the source holds in the include cache */
+    int held_count;                            /* After a fatal error, these are given back by the context */
+    int held_capacity;
+    asm_diagnostic_sink error_sink;            /* Receives the errors, NULL to print them */
+    asm_diagnostic_sink warning_sink;          /* Receives the warnings, NULL to print them */
+    asm_message_sink message_sink;             /* Receives the other messages, NULL to print them */
+    void *sink_data;                           /* Passed to the sinks */
+};
+
+/*
+ * Returns the context the calling thread is assembling with, or NULL outside of asm_assemble_buffer.
+ */
+asm_ctx *current_context(void);
+
+/*
+ * Makes a context the one the calling thread is assembling with, NULL for none.
+ */
+void bind_current_context(asm_ctx *ctx);
+
+/*
+ * Adds a file the source of a context included to its dependencies, unless it is there already
+ * or the context is NULL. Runs fatal_error if memory allocation fails.
+ */
+void add_context_dependency(asm_ctx *ctx, const char *path);
+
+/*
+ * Finds an included file with acquire_included_file, and keeps it in the files a context holds,
+ * so it is given back even if a fatal error stops the source before release_context_file does.
+ * The context may be NULL. Runs fatal_error if memory allocation fails (holding nothing new).
+ *
+ * Returns:
+ *   The file, or NULL if it can not be read (errno tells why).
+ */
+const included_file *acquire_context_file(asm_ctx *ctx, const char *path);
+
+/*
+ * Gives back the file acquire_context_file found last for a context.
+ */
+void release_context_file(asm_ctx *ctx, const included_file *file);
+
+/*
+ * Gives back every file a context still holds, the ones a fatal error left behind.
+ */
+void release_context_files(asm_ctx *ctx);
+
+#endif
@@ -0,0 +1,36 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "fatal.h"
+
+static pthread_key_t handler_key; /* the fatal_handler of each thread */
+static pthread_once_t handler_key_once = PTHREAD_ONCE_INIT;
+
+static void create_handler_key(void) {
+    pthread_key_create(&handler_key, NULL);
+}
+
+void fatal_handler_install(fatal_handler *handler) {
+    pthread_once(&handler_key_once, create_handler_key);
+    pthread_setspecific(handler_key, handler);
+}
+
+fatal_handler *fatal_handler_current(void) {
+    pthread_once(&handler_key_once, create_handler_key);
+    return pthread_getspecific(handler_key);
+}
+
+void fatal_handler_remove(void) {
+    pthread_once(&handler_key_once, create_handler_key);
+    pthread_setspecific(handler_key, NULL);
+}
+
+void fatal_error(void) {
+    fatal_handler *handler;
+
+    pthread_once(&handler_key_once, create_handler_key);
+    handler = pthread_getspecific(handler_key);
+    if (!handler)
+        exit(1);
+    pthread_setspecific(handler_key, NULL); /* a second fatal error in the same file should not loop */
+    longjmp(handler -> resume, 1);
+}
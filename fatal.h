@@ -0,0 +1,38 @@
+#ifndef FATAL_H
+#define FATAL_H
+
+#include <setjmp.h>
+
+/* A place to resume after a fatal error (such as running out of memory)
+   in the file that is currently being assembled. Each thread has its own,
+   so a fatal error only stops the file it happened in. */
+typedef struct {
+    jmp_buf resume;    /* Where fatal_error jumps to */
+} fatal_handler;
+
+/*
+ * Makes the handler the target of fatal errors on the calling thread.
+ * The handler's resume point must be set with setjmp beforehand.
+ *
+ * Parameters:
+ *   handler - The handler to install.
+ */
+void fatal_handler_install(fatal_handler *handler);
+
+/*
+ * Returns the handler of the calling thread, or NULL if it has none.
+ */
+fatal_handler *fatal_handler_current(void);
+
+/*
+ * Removes the handler of the calling thread.
+ */
+void fatal_handler_remove(void);
+
+/*
+ * Stops the current file by jumping to the calling thread's handler.
+ * If no handler is installed the program exits, as it always did.
+ */
+void fatal_error(void);
+
+#endif
@@ -2,230 +2,382 @@
 #include "globals.h"
 #include "util.h"
 #include "second_pass.h"
+#include "console.h"
+#include "fatal.h"
+#include "assembler.h"
+#include "worker_pool.h"
+
+/* A chunk of the lines of a large source, read by one of the workers */
+typedef struct {
+    int first;                  /* The index of the first token of the chunk */
+    int end;                    /* The index of the token after the chunk */
+    first_pass_state state;     /* What the chunk's lines define */
+    console_buffer messages;    /* The errors and warnings of the chunk's lines */
+    fatal_handler handler;      /* Stops the chunk if memory runs out */
+    int complete;               /* 1 if every line was read, 0 if a line stopped the chunk */
+    int aborted;                /* 1 if the chunk was stopped by a fatal error */
+} first_pass_chunk;
+
+/* What the workers of a chunked first pass share */
+typedef struct {
+    const token_list *tokens;
+    first_pass_chunk *chunks;
+    char *am_file_name;
+    int mode;
+} chunked_first_pass;
+
+void initialize_first_pass_state(first_pass_state *state, char *am_file_name) {
+    state -> IC = INTIAL_INSTRUCT_CNT_SIZE;
+    state -> DC = INTIAL_DATA_CNT_SIZE;
+    state -> cc_capacity = INITIAL_CC_CAPACITY;
+    initialize_location(&state -> am_file, am_file_name);
+    initialize_label_table(&state -> table);
+    initialize_label_table(&state -> extern_entry);
+    initialize_code_conv(&state -> data);
+    initialize_code_conv(&state -> instructions);
+}
 
-int execute_first_pass(char *am_file_name) {
-    /* step 1: define and intialize the needed variables */
-    int DC = INTIAL_DATA_CNT_SIZE, IC = INTIAL_INSTRUCT_CNT_SIZE; /* define and initialize the istruction and data counters */
-    FILE *fp;
-    char line[MAX_LINE_LENGTH + 2];
-    int line_counter = 0;
-    label_table table, extern_entry;
-    location *am_file;
-    code_conv *data;
-    code_conv *instructions;
-    int cc_capacity = INITIAL_CC_CAPACITY;
-    instruction *instr;
-	
-    fp = fopen(am_file_name, "r"); /* open the am file (the file after macro extension) for reading */
-    if (!fp) {
-        PRINT_ERROR1(am_file_name, line_counter, "Unable to open file '%s'.", am_file_name);
-        return 0;
+void free_first_pass_state(first_pass_state *state) {
+    free_label_table(&state -> table);
+    free_label_table(&state -> extern_entry);
+    free_code_conv_array(state -> instructions, state -> IC);
+    free_code_conv_array(state -> data, state -> DC);
+    free_location(state -> am_file);
+}
+
+/* this function prints the sizes and the symbol table of a file for --sizes, one item per line:
+     size <file> <IC> <DC>
+     symbol <file> <name> <address> <code|data|external>[ entry] */
+static void print_sizes(const char *am_file_name, int IC, int DC, label_table *table, label_table *extern_entry) {
+    int name_length = (int) strlen(am_file_name) - 3; /* without ".am" */
+    int i;
+
+    console_printf("size %.*s %d %d\n", name_length, am_file_name, IC, DC);
+    for (i = 0; i < table -> count; i++) {
+        label *declared = find_label(extern_entry, table -> labels[i].name);
+        console_printf("symbol %.*s %s %d %s%s\n", name_length, am_file_name, table -> labels[i].name, table -> labels[i].address,
+                       table -> labels[i].flags & LABEL_DATA ? "data" : "code", declared && declared -> flags & LABEL_ENTRY ? " entry" : "");
     }
+    for (i = 0; i < extern_entry -> count; i++)
+        if (extern_entry -> labels[i].flags & LABEL_EXTERNAL)
+            console_printf("symbol %.*s %s 0 external\n", name_length, am_file_name, extern_entry -> labels[i].name);
+}
 
-    initialize_location(&am_file, am_file_name);
-    initialize_label_table(&table);
-    initialize_label_table(&extern_entry);
-    initialize_code_conv(&data);
-    initialize_code_conv(&instructions);
+int read_statements(const token_list *tokens, int first, int end, first_pass_state *state, int mode) {
+    char label_name[MAX_LINE_LENGTH + 2], name[MAX_LINE_LENGTH + 2]; /* the words of the line that are needed as strings */
+    int line_counter = 0, next_token = first;
+    location *am_file = state -> am_file;
+    instruction instr;
 	
-    /* step 2: read the next line from the file */
-    while (fgets(line, MAX_LINE_LENGTH, fp)) {
-        char *first_word;
-        int first_word_len, label_flag = 0;
-		char *instruction_name;
-        char *operands, *after_directive;
-        label *curr_lbl = NULL;
+    /* step 2: take the tokens of the next line, empty lines have none */
+    while (next_token < end) {
+        token_span statement, operands;
+        word_view first_word, directive;
         
-        line_counter++;
-        am_file -> line++;
+        next_token = next_statement(tokens, next_token, &statement);
+        line_counter = am_file -> line = statement.tokens[0].line + 1;
 		
-		initialize_instruction(&instr);
+		initialize_instruction(&instr); /* the previous line's is not needed anymore */
 		
-        first_word = find_word(line, 0);
-        first_word_len = strlen(first_word) - 1;
+        /* the words of the line are its fields, only the names that are needed as strings are copied */
+        next_field(&statement, 0, &first_word);
 
         /* step 3: check if the first word is a label */
-        if (first_word[first_word_len] == ':') {
-            first_word[first_word_len] = '\0';
-            curr_lbl = (label *) malloc(sizeof(label));
-            if (!curr_lbl) {
-            	printf("MEMORY_ALLOCATION_FAILED");
-            	fclose(fp);
-                free_label_table(&table);
-                free_label_table(&extern_entry);
-                free(first_word);
-            }
-            strcpy(curr_lbl -> name, first_word);
-            label_flag = 1; /* step 4: turn on label definiton falg */
-        }
-        if (label_flag) { /* inside label definition */
-            char *directive = find_word(line, first_word_len + 2); /* find the directive */
-            char *operands, *instruction_name;
-			char *after_directive;
-            if (!directive) {
-                PRINT_ERROR1(am_file -> file_name, am_file -> line, "Missing directive after label '%s'.", first_word);
-                fclose(fp);
-                free_label_table(&table);
-                free_label_table(&extern_entry);
-                free(curr_lbl);
-                free(first_word);
+        if (first_word.text[first_word.length - 1] == ':') { /* step 4: inside label definition */
+            int first_word_len = first_word.length - 1;
+            copy_word(&first_word, first_word_len, label_name);
+
+            if (!next_field(&statement, first_word.end, &directive)) { /* find the directive */
+                PRINT_ERROR1(am_file -> file_name, am_file -> line, "Missing directive after label '%s'.", label_name);
                 return 0;
             }
+            copy_word(&directive, directive.length, name);
 			
-			after_directive = find_position_after_directive(line, directive);
-            if ((!after_directive || only_space_remain(after_directive)) && strcmp(directive, "stop") != 0 && strcmp (directive, "rts") != 0) {
-                PRINT_ERROR1(am_file -> file_name, am_file -> line, "Missing parameters after directive '%s' in label.", directive);
-                fclose(fp);
-                free_label_table(&table);
-                free_label_table(&extern_entry);
-                free(curr_lbl);
-                free(first_word);
-                free(directive);
+            sub_span(&statement, directive.end, statement.count, &operands);
+            if (operands.count == 0 && !word_is(&directive, "stop") && !word_is(&directive, "rts")) {
+                PRINT_ERROR1(am_file -> file_name, am_file -> line, "Missing parameters after directive '%s' in label.", name);
                 return 0;
             }
 
-            operands = after_directive;
             /* step 5: check if the directive is .data or .string */
-            if (strcmp(directive, ".data") == 0 || strcmp(directive, ".string") == 0) {
+            if (word_is(&directive, ".data") || word_is(&directive, ".string")) {
                 int label_index;
                 label *current_label;
                 /* step 6: add the label to the table with appropraite data */
-                if (!insert_label(&table, first_word, DC, line_counter, 1, 0,0, am_file)) {
-                    fclose(fp);
-                    free_label_table(&table);
-                    free_label_table(&extern_entry);
-                    free(curr_lbl);
-                    free(first_word);
-                	free(directive);
+                if (!insert_label(&state -> table, label_name, state -> DC, line_counter, 1, 0,0, am_file))
                     return 0;
-                }
 
-                label_index = table.count - 1;
-                current_label = &table.labels[label_index];
+                label_index = state -> table.count - 1;
+                current_label = &state -> table.labels[label_index];
                 /* step 7: Identify the data type, encode it in memory, and refine DC accordingly */
-                if (!add_machine_code_data(&data, &DC, am_file, directive, operands, current_label, IC)) {
-                    fclose(fp);
-                    free_label_table(&table);
-                    free_label_table(&extern_entry);
-                    free(curr_lbl);
-                    free(first_word);
-                	free(directive);
+                if (!add_machine_code_data(&state -> data, &state -> DC, am_file, name, &operands, current_label, state -> IC))
                     return 0;
-                }
                 /* step 7 complete. go back to step 2 */
-                free(first_word);
-                free(curr_lbl);
-                free(directive);
                 continue;
             }
             /* step 8: check if the directive is .extern or .entry */
-            else if (strcmp(directive, ".entry") == 0 || strcmp(directive, ".extern") == 0) {
+            else if (word_is(&directive, ".entry") || word_is(&directive, ".extern")) {
                 int is_extern, is_entry;
-                is_extern = (strcmp(directive, ".extern") == 0);
-                is_entry = (strcmp(directive, ".entry") == 0);
+                is_extern = word_is(&directive, ".extern");
+                is_entry = word_is(&directive, ".entry");
 
                 /* print a warning because the label has no effect */
-                PRINT_WARNING1(am_file_name, line_counter, "label '%s' has no effect", first_word);
+                PRINT_WARNING1(am_file -> file_name, line_counter, "label '%s' has no effect", label_name);
 
                 /* step 9: */
-                handle_directive_operands(operands, line_counter, is_extern, is_entry, fp, &extern_entry, line, am_file, DC);
-                free(first_word);
-                free(curr_lbl);
-                free(directive);
+                if (!handle_directive_operands(&operands, line_counter, is_extern, is_entry, &state -> extern_entry, am_file, state -> DC))
+                    return 0;
                 continue;
             }
             /* step 10: Insert the label with the code property */
-            if (!insert_label(&table, first_word, IC + 100, line_counter, 0, 0, 0, am_file)) {
-                fclose(fp);
-                free_label_table(&table);
-                free_label_table(&extern_entry);
-                free(first_word);
-                free(curr_lbl);
-                free(directive);
+            if (!insert_label(&state -> table, label_name, state -> IC + 100, line_counter, 0, 0, 0, am_file))
                 return 0;
 
-            }
-
             /* step 11: we will start to parse and process the instruction */
-            instruction_name = directive;
-            if (!is_valid_instr(instruction_name, am_file)) {
-                fclose(fp);
-                free_label_table(&table);
-                free_label_table(&extern_entry);
-                free(first_word);
-                free(curr_lbl);
-                free(instruction_name);
+            if (!is_valid_instr(name, am_file))
                 return 0;
-            }
 
             /* step 12: parse the instruction, calculate L, encode the first word */
-            parse_instruction(instruction_name, operands, instr, &table, am_file, &instructions, &IC, &cc_capacity, curr_lbl);
-		
-
-            free(first_word);
-            free(curr_lbl);
-            free(instruction_name);
+            parse_instruction(name, &operands, &instr, &state -> table, am_file, &state -> instructions, &state -> IC, &state -> cc_capacity, mode == ASSEMBLE_FULL);
             continue;
         }
         /* not a label, go to step 5 */
         /* step 5: check if the directive is .data or .string */
-        after_directive = find_position_after_directive(line, first_word);
-        operands = after_directive;
+        copy_word(&first_word, first_word.length, name);
+        sub_span(&statement, first_word.end, statement.count, &operands);
 
-        if (strcmp(first_word, ".data") == 0 || strcmp(first_word, ".string") == 0) {
-            int label_index = table.count - 1;
-            label *current_label = &table.labels[label_index];
+        if (word_is(&first_word, ".data") || word_is(&first_word, ".string")) {
+            int label_index = state -> table.count - 1;
+            label *current_label = &state -> table.labels[label_index];
             /* step 7: Identify the data type, encode it in memory, and refine DC accordingly */
-            if (!add_machine_code_data(&data, &DC, am_file, first_word, operands, current_label, IC)) {
-                fclose(fp);
-                free_label_table(&table);
-                free(first_word);
+            if (!add_machine_code_data(&state -> data, &state -> DC, am_file, name, &operands, current_label, state -> IC))
                 return 0;
-            }
             /* step 7 complete. go back to step 2 */
-            free(first_word);
             continue;
         }
         /* step 8: check if the directive is .extern or .entry */
-        else if (strcmp(first_word, ".entry") == 0 || strcmp(first_word, ".extern") == 0) {
+        else if (word_is(&first_word, ".entry") || word_is(&first_word, ".extern")) {
             int is_extern, is_entry;
-            is_extern = (strcmp(first_word, ".extern") == 0);
-            is_entry = (strcmp(first_word, ".entry") == 0);
+            is_extern = word_is(&first_word, ".extern");
+            is_entry = word_is(&first_word, ".entry");
 
-            handle_directive_operands(operands, line_counter, is_extern, is_entry, fp, &extern_entry, line, am_file, DC);
-            free(first_word);
+            if (!handle_directive_operands(&operands, line_counter, is_extern, is_entry, &state -> extern_entry, am_file, state -> DC))
+                return 0;
             continue;
         }
         /* step 11: we will start to parse and process the instruction */
-        instruction_name = first_word;
-        if (!is_valid_instr(instruction_name, am_file)) {
-            fclose(fp);
-            free_label_table(&table);
-            free(first_word);
+        if (!is_valid_instr(name, am_file))
             return 0;
-        }
 
         /* step 12: parse the instruction, calculate L, encode the first word */
-        parse_instruction(instruction_name, operands, instr, &table, am_file, &instructions, &IC, &cc_capacity, curr_lbl);
+        parse_instruction(name, &operands, &instr, &state -> table, am_file, &state -> instructions, &state -> IC, &state -> cc_capacity, mode == ASSEMBLE_FULL);
+    }
+    return 1;
+}
 
-        free(first_word);
-        continue;
+/* this function runs on a worker and reads the lines of one chunk into the chunk's own state.
+   its messages are kept until the chunks are merged, and running out of memory only stops the chunk */
+static void read_chunk_job(void *context, int job) {
+    chunked_first_pass *pass = context;
+    first_pass_chunk *chunk = &pass -> chunks[job];
+    console_buffer *outer_capture = console_capture_current(); /* the first worker is the thread of the file */
+    fatal_handler *outer_handler = fatal_handler_current();
+
+    console_capture_begin(&chunk -> messages);
+    if (setjmp(chunk -> handler.resume) == 0) {
+        fatal_handler_install(&chunk -> handler);
+        initialize_first_pass_state(&chunk -> state, pass -> am_file_name);
+        chunk -> complete = read_statements(pass -> tokens, chunk -> first, chunk -> end, &chunk -> state, pass -> mode);
+    } else {
+        chunk -> aborted = 1; /* the memory the chunk held is not recovered */
     }
-    
-    /* test_encoding_output(data, DC, instructions, IC); */
-    update_label_addresses(&table, IC);
-    execute_second_pass(fp, instructions, data, table, am_file, &cc_capacity, DC, extern_entry);
-    free_label_table(&table);
-    free_label_table(&extern_entry);
+    console_capture_end();
+    if (outer_capture)
+        console_capture_begin(outer_capture);
+    if (outer_handler)
+        fatal_handler_install(outer_handler);
+    else
+        fatal_handler_remove();
+}
+
+/* this function makes room for count words in an array with room for capacity words, doubling
+   the room like the passes do (see reserve_data_word). it stops the file if memory runs out */
+static void reserve_words(code_conv **words, int *capacity, int count) {
+    int new_capacity = *capacity;
+    code_conv *grown;
+
+    while (new_capacity < count)
+        new_capacity *= 2;
+    if (new_capacity == *capacity)
+        return;
+    grown = realloc(*words, new_capacity * sizeof(code_conv));
+    if (!grown) {
+        console_printf("MEMORY ALLOCATION FAILED\n");
+        fatal_error();
+    }
+    *words = grown;
+    *capacity = new_capacity;
+}
+
+/* this function adds the labels of a chunk to a table, moving them by the code and data words before the chunk */
+static void append_labels(label_table *table, const label_table *chunk_labels, int IC, int DC) {
+    int i;
+    for (i = 0; i < chunk_labels -> count; i++) {
+        label *appended;
+        if (table -> count >= table -> capacity) {
+            label *new_labels;
+            table -> capacity = table -> capacity ? table -> capacity * 2 : INTIAL_AMOUNT_OF_LABELS;
+            new_labels = (label *) realloc(table -> labels, sizeof(label) * table -> capacity);
+            if (!new_labels) {
+                console_printf("MEMORY ALLOCATION FAILED\n");
+                fatal_error();
+            }
+            table -> labels = new_labels;
+        }
+        appended = &table -> labels[table -> count++];
+        *appended = chunk_labels -> labels[i];
+        appended -> address += appended -> flags ? DC : IC;
+        index_label(table, table -> count - 1);
+    }
+}
+
+/* this function adds what a chunk defines to the state of the lines before it, as if its lines were read
+   right after them: the addresses are moved by the words before the chunk (the prefix sums of IC and DC).
+   a label that is already defined is an error the chunk could not see, the chunk is then left out.
+   returns 1 if the chunk was added, 0 if one of its labels is already defined */
+static int merge_chunk(first_pass_state *state, first_pass_chunk *chunk) {
+    first_pass_state *part = &chunk -> state;
+    int data_capacity = INITIAL_CC_CAPACITY, i;
+
+    for (i = 0; i < part -> table.count; i++)
+        if (label_exists(&state -> table, part -> table.labels[i].name))
+            return 0;
+    for (i = 0; i < part -> extern_entry.count; i++)
+        if (label_exists(&state -> extern_entry, part -> extern_entry.labels[i].name))
+            return 0;
+
+    /* the data array always has room for the smallest INITIAL_CC_CAPACITY times a power of 2 that is not below DC */
+    while (data_capacity < state -> DC)
+        data_capacity *= 2;
+    reserve_words(&state -> instructions, &state -> cc_capacity, state -> IC + part -> IC);
+    reserve_words(&state -> data, &data_capacity, state -> DC + part -> DC);
+    if (part -> IC > 0)
+        memcpy(state -> instructions + state -> IC, part -> instructions, part -> IC * sizeof(code_conv));
+    if (part -> DC > 0)
+        memcpy(state -> data + state -> DC, part -> data, part -> DC * sizeof(code_conv));
+    append_labels(&state -> table, &part -> table, state -> IC, state -> DC);
+    append_labels(&state -> extern_entry, &part -> extern_entry, state -> IC, state -> DC);
+    state -> IC += part -> IC;
+    state -> DC += part -> DC;
+
+    /* the words were moved, only their arrays are freed */
+    part -> IC = part -> DC = 0;
     return 1;
 }
 
+/* this function splits the lines of a large source into chunks at line boundaries and reads them
+   on up to jobs workers, then merges the chunks in order into state. the first chunk that can not be
+   merged as it is (it stopped on an error, ran out of memory or defines a label that is already defined)
+   and everything after it is read again on this thread, so the messages and the result are always
+   the same as when the whole source is read in order. returns like read_statements */
+static int read_statements_in_chunks(const token_list *tokens, first_pass_state *state, int mode, int jobs) {
+    chunked_first_pass pass;
+    long *weights;
+    int line_count = tokens -> count > 0 ? tokens -> tokens[tokens -> count - 1].line - tokens -> tokens[0].line + 1 : 0;
+    int chunk_count = line_count / MIN_CHUNK_LINES, resume = 0, i;
+
+    if (chunk_count > jobs)
+        chunk_count = jobs;
+    if (chunk_count < 2)
+        return read_statements(tokens, 0, tokens -> count, state, mode);
+
+    pass.tokens = tokens;
+    pass.am_file_name = state -> am_file -> file_name;
+    pass.mode = mode;
+    pass.chunks = calloc(chunk_count, sizeof(first_pass_chunk));
+    weights = malloc(chunk_count * sizeof(long));
+    if (!pass.chunks || !weights) {
+        free(pass.chunks);
+        free(weights);
+        return read_statements(tokens, 0, tokens -> count, state, mode);
+    }
+
+    /* step 1: about the same number of tokens in every chunk, a chunk starts with the first token of a line */
+    for (i = 0; i < chunk_count; i++) {
+        int first = i == 0 ? 0 : (int) ((long) tokens -> count * i / chunk_count);
+        while (first > 0 && first < tokens -> count && tokens -> tokens[first].line == tokens -> tokens[first - 1].line)
+            first++;
+        pass.chunks[i].first = i > 0 && first < pass.chunks[i - 1].first ? pass.chunks[i - 1].first : first;
+        if (i > 0)
+            pass.chunks[i - 1].end = pass.chunks[i].first;
+    }
+    pass.chunks[chunk_count - 1].end = tokens -> count;
+    for (i = 0; i < chunk_count; i++)
+        weights[i] = pass.chunks[i].end - pass.chunks[i].first;
+
+    /* step 2: read the chunks at the same time */
+    if (!run_worker_pool(chunk_count, weights, chunk_count, read_chunk_job, &pass, NULL)) {
+        free(pass.chunks);
+        free(weights);
+        return read_statements(tokens, 0, tokens -> count, state, mode);
+    }
+
+    /* step 3: merge them in order, with their messages, until one can not be merged */
+    for (i = 0; i < chunk_count; i++) {
+        first_pass_chunk *chunk = &pass.chunks[i];
+        if (chunk -> aborted || !chunk -> complete || !merge_chunk(state, chunk))
+            break;
+        if (chunk -> messages.length > 0)
+            console_printf("%.*s", (int) chunk -> messages.length, chunk -> messages.text);
+        resume = chunk -> end;
+    }
+    for (i = 0; i < chunk_count; i++) {
+        if (!pass.chunks[i].aborted)
+            free_first_pass_state(&pass.chunks[i].state);
+        free(pass.chunks[i].messages.text);
+    }
+    free(pass.chunks);
+    free(weights);
+
+    /* step 4: the rest is read in order */
+    return read_statements(tokens, resume, tokens -> count, state, mode);
+}
+
+/* this function runs the first pass on the extended source (.am), whose tokens are found once in tokens.
+   the second pass walks the same tokens, the output files are written into output by the second pass.
+   with ASSEMBLE_SIZES the operand words are not encoded and the second pass is skipped.
+   with more than one job a large source is read in chunks on that many workers.
+   returns 1 on success, 0 if errors were found */
+int execute_first_pass(const token_list *tokens, char *am_file_name, assembly_output *output, int mode, int jobs) {
+    /* step 1: define and intialize the needed variables */
+    first_pass_state state;
+    int success;
+
+    initialize_first_pass_state(&state, am_file_name);
+    if (jobs > 1)
+        success = read_statements_in_chunks(tokens, &state, mode, jobs);
+    else
+        success = read_statements(tokens, 0, tokens -> count, &state, mode);
+    if (!success) {
+        free_first_pass_state(&state);
+        return 0;
+    }
+    finish_first_pass(tokens, &state, output, mode);
+    return 1;
+}
+
+void finish_first_pass(const token_list *tokens, first_pass_state *state, assembly_output *output, int mode) {
+    /* test_encoding_output(data, DC, instructions, IC); */
+    update_label_addresses(&state -> table, state -> IC);
+    if (mode == ASSEMBLE_SIZES)
+        print_sizes(state -> am_file -> file_name, state -> IC, state -> DC, &state -> table, &state -> extern_entry);
+    else
+        execute_second_pass(tokens, state -> instructions, state -> data, state -> table, state -> am_file, &state -> cc_capacity, state -> DC, state -> extern_entry, output, mode);
+    free_first_pass_state(state);
+}
+
 int label_exists(label_table *table, const char *label_name) {
-    int i;
-    for (i = 0; i < table -> count; i++)
-        if (strcmp(table -> labels[i].name, label_name) == 0)
-            return 1;
-    return 0;
+    return lookup_label(table, label_name) != NULL;
 }
 
 /* Insert a new label into the label table. */
@@ -241,11 +393,11 @@ int insert_label(label_table *table, const char *label_name, int address, int as
     /* Reallocate space if needed */
     if (table->count >= table->capacity) {
         label *new_labels;
-        table->capacity += ADDITIONAL_AMOUNT_OF_LABELS;
+        table->capacity = table->capacity ? table->capacity * 2 : INTIAL_AMOUNT_OF_LABELS; /* doubled, so adding a label is not a realloc each time */
         new_labels = (label *) realloc(table->labels, sizeof(label) * table->capacity);
         if (!new_labels) {
-            printf("MEMORY ALLOCATION FAILED\n");
-            exit(1);
+            console_printf("MEMORY ALLOCATION FAILED\n");
+            fatal_error();
         }
         table->labels = new_labels;
     }
@@ -255,86 +407,68 @@ int insert_label(label_table *table, const char *label_name, int address, int as
     strcpy(label_to_insert->name, label_name);
     label_to_insert->address = address;
     label_to_insert->assembly_line = assembly_line;
-    label_to_insert->is_data = is_data;
-    label_to_insert->is_external = is_external;
-    label_to_insert->is_entry = is_entry;
+    label_to_insert->flags = (is_data ? LABEL_DATA : 0) | (is_external ? LABEL_EXTERNAL : 0) | (is_entry ? LABEL_ENTRY : 0);
+    index_label(table, table->count - 1);
 
     return 1;
 }
 
-void handle_directive_operands(char *operands, int line_counter, int is_extern, int is_entry, FILE *fp, label_table *table, char *line, location *am_file, int DC) {
-    while (*operands != '\0') {
-        char *symbol_start;
-        while (isspace(*operands)) operands++; /* skip whitespaces */
+/* this function adds the symbols of an .extern or .entry directive to the table, a symbol is
+   the tokens up to a white space or a comma. returns 1 on success, 0 if the operands are illegal (the error is printed) */
+int handle_directive_operands(const token_span *operands, int line_counter, int is_extern, int is_entry, label_table *table, location *am_file, int DC) {
+    int first = 0;
+    while (first < operands -> count) {
+        char symbol[MAX_LINE_LENGTH + 2]; /* a symbol is a part of one line */
+        token_span symbol_tokens;
+        word_view symbol_text;
+        int end = first;
+
+        while (end < operands -> count && operands -> tokens[end].kind != TOKEN_COMMA && (end == first || operands -> tokens[end].flags & TOKEN_GLUED))
+            end++; /* find end of operand */
+        if (end < operands -> count && operands -> tokens[end].kind != TOKEN_COMMA) {
+            PRINT_ERROR(am_file->file_name, am_file->line, "Missing comma.");
+            return 0;
+        }
+        sub_span(operands, first, end, &symbol_tokens);
+        span_text(&symbol_tokens, &symbol_text);
+        copy_word(&symbol_text, symbol_text.length, symbol);
+
+        /* Insert the label */
+        if (!insert_label(table, symbol, DC, line_counter, 0, is_extern, is_entry, am_file))
+            return 0;
 
-        symbol_start = operands; /* new operand */
-        while (*operands != ',' && *operands != '\0' && !isspace(*operands)) operands++; /* find end of operand */
-		
-		remove_leading_whitespace(operands);
-        if (*operands == ',' || *operands == '\0') {
-            char symbol[MAX_LABEL_LENGTH + 1];
-            int symbol_len = operands - symbol_start; /* calculate symbol len */
-            char *end;
-
-            strncpy(symbol, symbol_start, symbol_len); /* copy operand */
-            symbol[symbol_len] = '\0';
-
-            /* Trim trailing whitespaces from the symbol */
-            end = symbol + symbol_len - 1;
-            while (end > symbol && isspace(*end)) end--;
-            *(end + 1) = '\0';
-
-            /* Insert the label */
-            if (!insert_label(table, symbol, DC, line_counter, 0, is_extern, is_entry, am_file)) {
-                fclose(fp);
-                free_label_table(table);
-                exit(0);
-            }
+        /* If the operand is followed by a comma, proceed to the next operand */
+        if (end < operands -> count) {
+            end++;
 
-            /* If the operand is followed by a comma, proceed to the next operand */
-            if (*operands == ',') {
-                operands++;
-                while (isspace(*operands)) operands++; /* skip whitespaces after comma */
-
-                /* Check for multiple consecutive commas */
-                if (*operands == ',') {
-                    PRINT_ERROR(am_file->file_name, am_file->line, "Multiple consecutive commas.");
-                    fclose(fp);
-                    free_label_table(table);
-                    exit(0);
-                }
-
-                /* Check for a missing operand after the comma */
-                if (*operands == '\0') {
-                    PRINT_ERROR(am_file->file_name, am_file->line, "Missing operand.");
-                    fclose(fp);
-                    free_label_table(table);
-                    exit(0);
-                }
+            /* Check for multiple consecutive commas */
+            if (end < operands -> count && operands -> tokens[end].kind == TOKEN_COMMA) {
+                PRINT_ERROR(am_file->file_name, am_file->line, "Multiple consecutive commas.");
+                return 0;
             }
-            else if (*operands == '\0') {
-                break; /* End of string, exit the loop */
+
+            /* Check for a missing operand after the comma */
+            if (end == operands -> count) {
+                PRINT_ERROR(am_file->file_name, am_file->line, "Missing operand.");
+                return 0;
             }
-        } else {
-            PRINT_ERROR(am_file->file_name, am_file->line, "Missing comma.");
-            fclose(fp);
-            free_label_table(table);
-            exit(0);
         }
+        first = end;
     }
+    return 1;
 }
 
 void print_all_instructions(const char *opcode_names[], int num_instructions) {
     int i;
 
-    printf("\033[0;32m"); /* Set text color to green */
-    printf("List of all instructions: ");
+    console_printf("\033[0;32m"); /* Set text color to green */
+    console_printf("List of all instructions: ");
     for (i = 0; i < num_instructions; i++) {
-        printf("%s", opcode_names[i]);
+        console_printf("%s", opcode_names[i]);
         if (i < num_instructions - 1)
-            printf(", ");
+            console_printf(", ");
     }
-    printf("\033[0m\n"); /* Reset text color */
+    console_printf("\033[0m\n"); /* Reset text color */
 }
 
 /* Check if the provided instruction name is valid. */
@@ -360,26 +494,10 @@ int is_valid_instr(char *instr_name, location *am_file) {
     return 0; /* Instruction is not valid */
 }
 
-char *find_position_after_directive(char *line, char *directive) {
-    const char *directive_pos = strstr(line, directive);
-    
-    if (directive_pos != NULL) {
-        /* Move the pointer to the end of the directive */
-        char * position_after_directive = (char *)(directive_pos + strlen(directive));
-        /* Skip any whitespace after the directive */
-        while (*position_after_directive == ' ' || *position_after_directive == '\t') {
-            position_after_directive++;
-        }
-        return position_after_directive;
-    }
-    
-    return NULL;  /* Directive not found */
-}
-
 void update_label_addresses(label_table *table, int IC) {
     int i;
     for (i = 0; i < table->count; i++) {
-        if (table->labels[i].is_data) {
+        if (table->labels[i].flags & LABEL_DATA) {
             table->labels[i].address += IC + 100;
         }
     }
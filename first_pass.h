@@ -6,12 +6,46 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include "intialize_data_struct.h"
+#include "memory_file.h"
+#include "lexer.h"
 
 #define MAX_LINE_LENGTH 80  /* Maximum length for a line of input */
 #define INTIAL_INSTRUCT_CNT_SIZE 0  /* Initial size of instruction count */
 #define INTIAL_DATA_CNT_SIZE 0  /* Initial size of data count */
-#define ADDITIONAL_AMOUNT_OF_LABELS 5  /* Amount of labels to add when resizing */
 #define INTIAL_AMOUNT_OF_EXT_ENT_LABELS 5  /* Initial size for external and entry labels */
+#define MIN_CHUNK_LINES 4096  /* Fewest lines worth reading on a worker of their own */
+
+/* The state of the first pass over the lines read so far. A chunk of a large source has one of
+   its own, whose counters and addresses start at 0 as if the chunk was a source of its own,
+   and a pipelined source (see pipeline.h) adds its lines to one a batch at a time */
+typedef struct {
+    label_table table;          /* The labels, code ones at IC + 100 and data ones at DC */
+    label_table extern_entry;   /* The symbols of .extern and .entry */
+    code_conv *instructions;    /* The code words */
+    int IC;                     /* Number of code words */
+    int cc_capacity;            /* Room in instructions */
+    code_conv *data;            /* The data words */
+    int DC;                     /* Number of data words */
+    location *am_file;          /* The file name and the line being read */
+} first_pass_state;
+
+/* Runs the first pass (and then the second) on an extended source file, mode is ASSEMBLE_FULL, ASSEMBLE_CHECK or ASSEMBLE_SIZES,
+   the last argument is the number of workers that may read the chunks of a large source */
+int execute_first_pass(const token_list *, char *, assembly_output *, int, int);
+
+/* Sets up an empty first pass state for the extended source file of the given name */
+void initialize_first_pass_state(first_pass_state *, char *);
+
+/* Frees the labels, the code words and the other memory of a first pass state */
+void free_first_pass_state(first_pass_state *);
+
+/* Runs the first pass on the lines whose tokens are from first up to end (the 2nd and 3rd arguments),
+   adding what they define to the state. Returns 1 if every line was read, 0 if a line has an error that stops the pass */
+int read_statements(const token_list *, int, int, first_pass_state *, int);
+
+/* Finishes the first pass once every line was read into the state: the data labels are moved after
+   the code, then the second pass runs (or the sizes are printed for ASSEMBLE_SIZES). Frees the state */
+void finish_first_pass(const token_list *, first_pass_state *, assembly_output *, int);
 
 /* Finds a word in a string starting from a given position */
 char *find_word(const char *, int);
@@ -25,21 +59,20 @@ int label_exists(label_table *, const char *);
 /* Inserts a new label into the label table */
 int insert_label(label_table *, const char *, int, int, int, int, int, location *);
 
-/* Handles operands in directives */
-void handle_directive_operands(char *, int, int, int, FILE *, label_table *, char *, location *, int);
+/* Handles operands in directives, returns 0 if they are illegal */
+int handle_directive_operands(const token_span *, int, int, int, label_table *, location *, int);
 
 /* Adds machine code data to the given code_conv array */
-int add_machine_code_data(code_conv **, int *, location *, const char *, const char *, label *, int);
+int add_machine_code_data(code_conv **, int *, location *, const char *, const token_span *, label *, int);
 
 /* Validates if the instruction is valid */
 int is_valid_instr(char *, location *);
 
-/* Parses an instruction and updates the instruction struct */
-int parse_instruction(const char *, char *, instruction *, label_table *, location *, code_conv **, int *, int *, label *);
-
-/* Finds the position in the string after a directive */
-char *find_position_after_directive(char *, char *);
+/* Parses an instruction and updates the instruction struct, the operand words are only encoded if the last argument is set */
+int parse_instruction(const char *, const token_span *, instruction *, label_table *, location *, code_conv **, int *, int *, int);
 
+/* Finds a label in the label table by its name */
+label *find_label(label_table *, const char *);
 /* Updates label addresses in the label table */
 void update_label_addresses(label_table *, int);
 
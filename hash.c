@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include "hash.h"
+
+#define WORD_MASK 0xffffffffUL
+#define ROTATE_RIGHT(x, n) ((((x) >> (n)) | ((x) << (32 - (n)))) & WORD_MASK)
+
+static const unsigned long round_constants[64] = {
+    0x428a2f98UL, 0x71374491UL, 0xb5c0fbcfUL, 0xe9b5dba5UL, 0x3956c25bUL, 0x59f111f1UL, 0x923f82a4UL, 0xab1c5ed5UL,
+    0xd807aa98UL, 0x12835b01UL, 0x243185beUL, 0x550c7dc3UL, 0x72be5d74UL, 0x80deb1feUL, 0x9bdc06a7UL, 0xc19bf174UL,
+    0xe49b69c1UL, 0xefbe4786UL, 0x0fc19dc6UL, 0x240ca1ccUL, 0x2de92c6fUL, 0x4a7484aaUL, 0x5cb0a9dcUL, 0x76f988daUL,
+    0x983e5152UL, 0xa831c66dUL, 0xb00327c8UL, 0xbf597fc7UL, 0xc6e00bf3UL, 0xd5a79147UL, 0x06ca6351UL, 0x14292967UL,
+    0x27b70a85UL, 0x2e1b2138UL, 0x4d2c6dfcUL, 0x53380d13UL, 0x650a7354UL, 0x766a0abbUL, 0x81c2c92eUL, 0x92722c85UL,
+    0xa2bfe8a1UL, 0xa81a664bUL, 0xc24b8b70UL, 0xc76c51a3UL, 0xd192e819UL, 0xd6990624UL, 0xf40e3585UL, 0x106aa070UL,
+    0x19a4c116UL, 0x1e376c08UL, 0x2748774cUL, 0x34b0bcb5UL, 0x391c0cb3UL, 0x4ed8aa4aUL, 0x5b9cca4fUL, 0x682e6ff3UL,
+    0x748f82eeUL, 0x78a5636fUL, 0x84c87814UL, 0x8cc70208UL, 0x90befffaUL, 0xa4506cebUL, 0xbef9a3f7UL, 0xc67178f2UL
+};
+
+/* this function mixes one 64 byte block into the state */
+static void hash_block(hash_context *context, const unsigned char *block) {
+    unsigned long w[64], a, b, c, d, e, f, g, h;
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = ((unsigned long) block[i * 4] << 24) | ((unsigned long) block[i * 4 + 1] << 16) |
+               ((unsigned long) block[i * 4 + 2] << 8) | (unsigned long) block[i * 4 + 3];
+    for (i = 16; i < 64; i++) {
+        unsigned long s0 = ROTATE_RIGHT(w[i - 15], 7) ^ ROTATE_RIGHT(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        unsigned long s1 = ROTATE_RIGHT(w[i - 2], 17) ^ ROTATE_RIGHT(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = (w[i - 16] + s0 + w[i - 7] + s1) & WORD_MASK;
+    }
+
+    a = context -> state[0]; b = context -> state[1]; c = context -> state[2]; d = context -> state[3];
+    e = context -> state[4]; f = context -> state[5]; g = context -> state[6]; h = context -> state[7];
+    for (i = 0; i < 64; i++) {
+        unsigned long s1 = ROTATE_RIGHT(e, 6) ^ ROTATE_RIGHT(e, 11) ^ ROTATE_RIGHT(e, 25);
+        unsigned long choice = (e & f) ^ (~e & g);
+        unsigned long temp1 = (h + s1 + choice + round_constants[i] + w[i]) & WORD_MASK;
+        unsigned long s0 = ROTATE_RIGHT(a, 2) ^ ROTATE_RIGHT(a, 13) ^ ROTATE_RIGHT(a, 22);
+        unsigned long majority = (a & b) ^ (a & c) ^ (b & c);
+        unsigned long temp2 = (s0 + majority) & WORD_MASK;
+        h = g; g = f; f = e;
+        e = (d + temp1) & WORD_MASK;
+        d = c; c = b; b = a;
+        a = (temp1 + temp2) & WORD_MASK;
+    }
+    context -> state[0] = (context -> state[0] + a) & WORD_MASK;
+    context -> state[1] = (context -> state[1] + b) & WORD_MASK;
+    context -> state[2] = (context -> state[2] + c) & WORD_MASK;
+    context -> state[3] = (context -> state[3] + d) & WORD_MASK;
+    context -> state[4] = (context -> state[4] + e) & WORD_MASK;
+    context -> state[5] = (context -> state[5] + f) & WORD_MASK;
+    context -> state[6] = (context -> state[6] + g) & WORD_MASK;
+    context -> state[7] = (context -> state[7] + h) & WORD_MASK;
+}
+
+void hash_begin(hash_context *context) {
+    static const unsigned long initial_state[8] = {
+        0x6a09e667UL, 0xbb67ae85UL, 0x3c6ef372UL, 0xa54ff53aUL, 0x510e527fUL, 0x9b05688cUL, 0x1f83d9abUL, 0x5be0cd19UL
+    };
+    memcpy(context -> state, initial_state, sizeof(initial_state));
+    context -> length_low = 0;
+    context -> length_high = 0;
+    context -> block_used = 0;
+}
+
+void hash_update(hash_context *context, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+
+    while (size > 0) {
+        size_t take = 64 - context -> block_used;
+        if (take > size)
+            take = size;
+        memcpy(context -> block + context -> block_used, bytes, take);
+        context -> block_used += take;
+        bytes += take;
+        size -= take;
+
+        context -> length_low += take;
+        if (context -> length_low > WORD_MASK) { /* carry into the high part */
+            context -> length_high += context -> length_low >> 16 >> 16;
+            context -> length_low &= WORD_MASK;
+        }
+        if (context -> block_used == 64) {
+            hash_block(context, context -> block);
+            context -> block_used = 0;
+        }
+    }
+}
+
+void hash_end(hash_context *context, char *text) {
+    /* the message length in bits, as a 64 bit big endian number */
+    unsigned long bits_high = ((context -> length_high << 3) | (context -> length_low >> 29)) & WORD_MASK;
+    unsigned long bits_low = (context -> length_low << 3) & WORD_MASK;
+    unsigned char length[8];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        length[i] = (unsigned char) (bits_high >> (24 - i * 8));
+        length[i + 4] = (unsigned char) (bits_low >> (24 - i * 8));
+    }
+
+    /* pad with 0x80 and zeros up to 56 bytes in the last block, then the length */
+    context -> block[context -> block_used++] = 0x80;
+    if (context -> block_used > 56) {
+        memset(context -> block + context -> block_used, 0, 64 - context -> block_used);
+        hash_block(context, context -> block);
+        context -> block_used = 0;
+    }
+    memset(context -> block + context -> block_used, 0, 56 - context -> block_used);
+    memcpy(context -> block + 56, length, 8);
+    hash_block(context, context -> block);
+
+    for (i = 0; i < 8; i++)
+        sprintf(text + i * 8, "%08lx", context -> state[i]);
+}
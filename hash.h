@@ -0,0 +1,43 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+
+#define HASH_SIZE 32                       /* Bytes in a digest (SHA-256) */
+#define HASH_TEXT_SIZE (HASH_SIZE * 2 + 1) /* A digest as hex digits, with the null terminator */
+
+/* The state of a SHA-256 computation. The words are kept in unsigned long,
+   which has at least 32 bits, and masked after every operation. */
+typedef struct {
+    unsigned long state[8];     /* The intermediate hash value */
+    unsigned long length_low;   /* Number of bytes hashed so far (low 32 bits) */
+    unsigned long length_high;  /* Number of bytes hashed so far (high bits) */
+    unsigned char block[64];    /* Bytes waiting for a full block */
+    size_t block_used;          /* Number of bytes in block */
+} hash_context;
+
+/*
+ * Starts a new digest.
+ */
+void hash_begin(hash_context *context);
+
+/*
+ * Adds bytes to the digest.
+ *
+ * Parameters:
+ *   context - The digest being computed.
+ *   data - The bytes to add.
+ *   size - Number of bytes.
+ */
+void hash_update(hash_context *context, const void *data, size_t size);
+
+/*
+ * Finishes the digest and writes it as lowercase hex digits.
+ *
+ * Parameters:
+ *   context - The digest being computed.
+ *   text - Receives HASH_TEXT_SIZE characters, including the null terminator.
+ */
+void hash_end(hash_context *context, char *text);
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "include_cache.h"
+#include "pre_assembler.h"
+#include "console.h"
+#include "fatal.h"
+
+static included_file *cached_files = NULL;                 /* The files read so far, the most recently used first */
+static size_t cached_bytes = 0;                            /* The memory of the files in the list */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER; /* Guards the list, its bytes and the references */
+
+/* this function returns 1 if a file read before is still the one on disk */
+static int unchanged(const included_file *file, const struct stat *info) {
+    return file -> device == info -> st_dev && file -> inode == info -> st_ino && file -> size == info -> st_size &&
+           file -> modified.tv_sec == info -> st_mtim.tv_sec && file -> modified.tv_nsec == info -> st_mtim.tv_nsec;
+}
+
+/* this function returns about how much memory a file read into the cache takes */
+static size_t file_bytes(const included_file *file) {
+    return sizeof(included_file) + strlen(file -> path) + 1 + file -> source.size +
+           (file -> lines.count + 1) * (sizeof(size_t) + 1);
+}
+
+static void free_included_file(included_file *file) {
+    free_line_index(&file -> lines);
+    free_memory_file(&file -> source);
+    free(file -> path);
+    free(file);
+}
+
+/* this function reads a file and indexes its lines, returns NULL if it can not be read
+   or memory allocation failed (errno is ENOMEM) */
+static included_file *read_included_file(const char *path, const struct stat *info) {
+    included_file *file = calloc(1, sizeof(included_file));
+    FILE *stream = NULL;
+    int error;
+
+    if (!file || !(file -> path = malloc(strlen(path) + 1))) {
+        free(file);
+        errno = ENOMEM;
+        return NULL;
+    }
+    strcpy(file -> path, path);
+    stream = fopen(path, "rb");
+    if (!stream || !read_memory_file(stream, &file -> source) ||
+        !build_line_index(&file -> lines, file -> source.data, file -> source.size, MAX_LINE_LENGTH + 2)) {
+        error = stream && !ferror(stream) ? ENOMEM : errno;
+        if (stream)
+            fclose(stream);
+        free_memory_file(&file -> source);
+        free(file -> path);
+        free(file);
+        errno = error;
+        return NULL;
+    }
+    fclose(stream);
+    file -> device = info -> st_dev;
+    file -> inode = info -> st_ino;
+    file -> size = info -> st_size;
+    file -> modified = info -> st_mtim;
+    return file;
+}
+
+/* this function returns the cached file of a path and adds a reference to it, NULL if it is not there
+   or changed since. a changed file is taken out of the cache. runs with the lock held */
+static included_file *take_cached_file(const char *path, const struct stat *info) {
+    included_file *file, **link;
+
+    for (link = &cached_files; *link && strcmp((*link) -> path, path) != 0; link = &(*link) -> next)
+        ;
+    file = *link;
+    if (!file)
+        return NULL;
+    *link = file -> next;
+    if (!unchanged(file, info)) {
+        cached_bytes -= file_bytes(file); /* the users it still has keep it until they give it back */
+        if (file -> references == 0)
+            free_included_file(file);
+        return NULL;
+    }
+    file -> next = cached_files; /* the most recently used goes first */
+    cached_files = file;
+    file -> references++;
+    return file;
+}
+
+/* this function drops the files nobody uses that do not fit in INCLUDE_CACHE_BYTES after the ones
+   used more recently. runs with the lock held */
+static void trim_cached_files(void) {
+    included_file **link = &cached_files;
+    size_t kept = 0;
+
+    if (cached_bytes <= INCLUDE_CACHE_BYTES)
+        return;
+    while (*link) {
+        included_file *file = *link;
+        size_t bytes = file_bytes(file);
+        if (file -> references == 0 && kept + bytes > INCLUDE_CACHE_BYTES) {
+            *link = file -> next;
+            cached_bytes -= bytes;
+            free_included_file(file);
+        } else {
+            kept += bytes;
+            link = &file -> next;
+        }
+    }
+}
+
+const included_file *acquire_included_file(const char *path) {
+    included_file *file, *read;
+    struct stat info;
+
+    if (stat(path, &info) < 0)
+        return NULL;
+    pthread_mutex_lock(&cache_lock);
+    file = take_cached_file(path, &info);
+    pthread_mutex_unlock(&cache_lock);
+    if (file)
+        return file;
+
+    /* read without the lock, so the other threads go on with the files they include meanwhile */
+    read = read_included_file(path, &info);
+    if (!read) {
+        if (errno == ENOMEM) {
+            console_printf("Memory allocation failed\n");
+            fatal_error();
+        }
+        return NULL;
+    }
+    pthread_mutex_lock(&cache_lock);
+    file = take_cached_file(path, &info); /* another thread may have read it at the same time */
+    if (!file) {
+        file = read;
+        read = NULL;
+        file -> next = cached_files;
+        cached_files = file;
+        cached_bytes += file_bytes(file);
+        file -> references++;
+        trim_cached_files();
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (read)
+        free_included_file(read);
+    return file;
+}
+
+void release_included_file(const included_file *file) {
+    included_file *cached, *released = (included_file *) file;
+
+    pthread_mutex_lock(&cache_lock);
+    released -> references--;
+    for (cached = cached_files; cached && cached != released; cached = cached -> next)
+        ;
+    if (!cached && released -> references == 0) /* it changed on disk and was taken out of the cache */
+        free_included_file(released);
+    else if (released -> references == 0)
+        trim_cached_files(); /* it may not fit anymore */
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,46 @@
+#ifndef INCLUDE_CACHE_H
+#define INCLUDE_CACHE_H
+
+#include <sys/types.h>
+#include <time.h>
+#include "memory_file.h"
+#include "line_index.h"
+
+#define INCLUDE_CACHE_BYTES (64L * 1024 * 1024) /* Memory the cache keeps files in, beyond the ones in use */
+
+/* A file named by a .include directive, read and split into lines once per process.
+   The files of a batch that include it all share it, from any thread. Once the cache
+   holds more than INCLUDE_CACHE_BYTES, the files used least recently that nobody uses
+   are dropped, so a long running process does not keep every file it ever included. */
+typedef struct included_file {
+    char *path;                     /* The path it was read from, as the directive resolved it */
+    memory_file source;             /* Its contents */
+    line_index lines;               /* Its lines, found with the buffer of the pre assembler */
+    dev_t device;                   /* Together with the rest, tells whether the file changed since */
+    ino_t inode;
+    off_t size;
+    struct timespec modified;
+    int references;                 /* Users of the file, a changed or dropped file is freed once it has none */
+    struct included_file *next;     /* The next file in the cache, used less recently */
+} included_file;
+
+/*
+ * Finds an included file in the cache, reading it and indexing its lines if it is not
+ * there yet or if it changed on disk since it was read. Safe to call from several threads,
+ * a file is read without holding up the threads that include other ones.
+ *
+ * Parameters:
+ *   path - The path of the file.
+ *
+ * Returns:
+ *   The file, give it back with release_included_file. NULL if it can not be read
+ *   (errno tells why), runs fatal_error if memory allocation fails.
+ */
+const included_file *acquire_included_file(const char *path);
+
+/*
+ * Gives back a file found with acquire_included_file.
+ */
+void release_included_file(const included_file *file);
+
+#endif
@@ -0,0 +1,52 @@
+#include "indexed_file.h"
+
+unsigned long hash_indexed_name(const char *name, size_t length) {
+    unsigned long hash = 2166136261UL;
+    size_t i;
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char) name[i];
+        hash = (hash * 16777619UL) & 0xffffffffUL;
+    }
+    return hash;
+}
+
+void put_indexed_number(unsigned char *bytes, unsigned long value) {
+    int i;
+    for (i = 0; i < INDEXED_NUMBER_SIZE; i++) {
+        bytes[i] = (unsigned char) (value & 0xff);
+        value >>= 8;
+    }
+}
+
+/* the upper bytes must be 0 where unsigned long is 32 bits */
+unsigned long get_indexed_number(const unsigned char *bytes) {
+    unsigned long value = 0;
+    int i;
+    for (i = INDEXED_NUMBER_SIZE - 1; i >= 0; i--) {
+        if (value > ((unsigned long) -1 >> 8))
+            return (unsigned long) -1;
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+int write_indexed_number(FILE *file, unsigned long value) {
+    unsigned char bytes[INDEXED_NUMBER_SIZE];
+    put_indexed_number(bytes, value);
+    return fwrite(bytes, 1, INDEXED_NUMBER_SIZE, file) == INDEXED_NUMBER_SIZE;
+}
+
+unsigned long indexed_bucket_count(unsigned long count) {
+    unsigned long buckets = 2;
+    while (buckets < count * 2)
+        buckets *= 2;
+    return buckets;
+}
+
+int indexed_range_inside(size_t size, unsigned long offset, unsigned long length) {
+    return offset <= size && length <= size - offset;
+}
+
+int indexed_table_inside(size_t size, unsigned long offset, unsigned long count, unsigned long entry_size) {
+    return offset <= size && count <= (size - offset) / entry_size;
+}
@@ -0,0 +1,63 @@
+#ifndef INDEXED_FILE_H
+#define INDEXED_FILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+ * The numbers and the checks shared by the files that end with a hash index of
+ * what they hold, the archives (see archive.h) and the macro libraries (see
+ * macro_library.h). Every number is 8 byte little endian, and the index has a
+ * power of two of buckets.
+ */
+#define INDEXED_NUMBER_SIZE 8   /* Bytes in every number */
+
+/*
+ * Hashes a name (FNV-1a), the same for the writer and the reader of a file.
+ *
+ * Returns:
+ *   The hash, 32 bits.
+ */
+unsigned long hash_indexed_name(const char *name, size_t length);
+
+/*
+ * Writes a number as INDEXED_NUMBER_SIZE bytes.
+ */
+void put_indexed_number(unsigned char *bytes, unsigned long value);
+
+/*
+ * Reads a number written by put_indexed_number.
+ *
+ * Returns:
+ *   The number, or the largest unsigned long if it does not fit in one
+ *   (where unsigned long is 32 bits).
+ */
+unsigned long get_indexed_number(const unsigned char *bytes);
+
+/*
+ * Writes a number to a file.
+ *
+ * Returns:
+ *   1 on success, 0 if the write failed.
+ */
+int write_indexed_number(FILE *file, unsigned long value);
+
+/*
+ * Returns the number of buckets of an index of count entries: the smallest power
+ * of two with at least two buckets per entry.
+ */
+unsigned long indexed_bucket_count(unsigned long count);
+
+/*
+ * Returns 1 if length bytes at offset are inside a file of size bytes, 0 if not.
+ */
+int indexed_range_inside(size_t size, unsigned long offset, unsigned long length);
+
+/*
+ * Returns 1 if a table of count entries of entry_size bytes at offset is inside a
+ * file of size bytes, 0 if not. Unlike indexed_range_inside with count * entry_size,
+ * a count read from a damaged file can not wrap the size of the table around.
+ */
+int indexed_table_inside(size_t size, unsigned long offset, unsigned long count, unsigned long entry_size);
+
+#endif
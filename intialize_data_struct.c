@@ -1,44 +1,105 @@
 #include "intialize_data_struct.h"
+#include "console.h"
+#include "fatal.h"
+#include "pre_assembler.h"
 
 void initialize_label_table(label_table *table) {
     table -> labels = (label *) malloc(sizeof(label) * INTIAL_AMOUNT_OF_LABELS);
     if (!table -> labels) {
-        printf("MEMORY ALLOCATION FAILED");
-        exit(1);
+        console_printf("MEMORY ALLOCATION FAILED");
+        fatal_error();
     }
     table -> count = 0;
     table -> capacity = INTIAL_AMOUNT_OF_LABELS;
+    table -> slots = (int *) calloc(INITIAL_LABEL_SLOTS, sizeof(int));
+    if (!table -> slots) {
+        console_printf("MEMORY ALLOCATION FAILED");
+        fatal_error();
+    }
+    table -> slot_count = INITIAL_LABEL_SLOTS;
 }
 
 void free_label_table(label_table *table) {
     free(table -> labels);
+    free(table -> slots);
     table -> labels = NULL;
+    table -> slots = NULL;
     table -> count = 0;
     table -> capacity = 0;
+    table -> slot_count = 0;
+}
+
+/* this function returns the slot of a name: the one holding its label, or the empty one where it goes */
+static int *find_label_slot(const label_table *table, const char *name) {
+    unsigned long slot = hash_macro_name(name, strlen(name)) & (table -> slot_count - 1);
+    while (table -> slots[slot] && strcmp(table -> labels[table -> slots[slot] - 1].name, name) != 0)
+        slot = (slot + 1) & (table -> slot_count - 1);
+    return &table -> slots[slot];
+}
+
+/* this function makes the index twice as big and puts the labels in it again */
+static void grow_label_slots(label_table *table) {
+    int *old_slots = table -> slots, old_count = table -> slot_count, i;
+
+    table -> slot_count = old_count ? old_count * 2 : INITIAL_LABEL_SLOTS;
+    table -> slots = (int *) calloc(table -> slot_count, sizeof(int));
+    if (!table -> slots) {
+        console_printf("MEMORY ALLOCATION FAILED");
+        fatal_error();
+    }
+    for (i = 0; i < old_count; i++)
+        if (old_slots[i])
+            *find_label_slot(table, table -> labels[old_slots[i] - 1].name) = old_slots[i];
+    free(old_slots);
+}
+
+void index_label(label_table *table, int number) {
+    int *slot;
+    if (table -> count * 2 > table -> slot_count)
+        grow_label_slots(table);
+    slot = find_label_slot(table, table -> labels[number].name);
+    if (!*slot)
+        *slot = number + 1;
+}
+
+label *lookup_label(const label_table *table, const char *name) {
+    int number;
+    if (table -> slot_count == 0)
+        return NULL;
+    number = *find_label_slot(table, name);
+    return number ? &table -> labels[number - 1] : NULL;
 }
 
 void initialize_location(location **am_file, char *am_file_name) {
     *am_file = (location *)malloc(sizeof(location));
     if (*am_file == NULL) {
-         printf("MEMORY ALLOCATION FAILED");
-         exit(1);
+         console_printf("MEMORY ALLOCATION FAILED");
+         fatal_error();
     }
     
     (*am_file)->file_name = (char *)malloc(strlen(am_file_name) + 1);
     if ((*am_file)->file_name == NULL) {
-        printf("MEMORY ALLOCATION FAILED");
-        exit(1);
+        console_printf("MEMORY ALLOCATION FAILED");
+        fatal_error();
     }
     strcpy((*am_file)->file_name, am_file_name);
     
     (*am_file)->line = 0;
 }
+/* Function to free a location and its file name */
+void free_location(location *am_file) {
+    if (am_file) {
+        free(am_file -> file_name);
+        free(am_file);
+    }
+}
+
 void initialize_code_conv(code_conv **cc) {
     int i, j;
     *cc = (code_conv *)malloc(INITIAL_CC_CAPACITY * sizeof(code_conv));
     if (!(*cc)) {  
-        printf("MEMORY ALLOCATION FAILED");
-        exit(1);
+        console_printf("MEMORY ALLOCATION FAILED");
+        fatal_error();
     }
   
     for (i = 0; i < INITIAL_CC_CAPACITY; i++) {
@@ -59,35 +120,43 @@ void free_code_conv(code_conv *data) {
     }
 }
 
-void initialize_instruction(instruction **instr) {
-	int i;
-     *instr = (instruction *)malloc(sizeof(instruction));
-     if (*instr == NULL) {
-          printf("Memory allocation failed!\n");
-          exit(1);
+/* Function to free an array of count code words, with the label names they refer to.
+   Only the first label of a word is ever set, the others are not initialized after a realloc. */
+void free_code_conv_array(code_conv *cc, int count) {
+    int i;
+    if (!cc)
+        return;
+    for (i = 0; i < count; i++) {
+        free(cc[i].label[0]);
     }
-    
+    free(cc);
+}
 
-    (*instr)->opcode = 0;
-    (*instr)->operand_count = 0;
-    (*instr)->length = 0;
-    (*instr)->binary_repres = 0;
+/* Function to clear an instruction before a line is parsed into it, it is not allocated */
+void initialize_instruction(instruction *instr) {
+	int i;
+
+    instr->opcode = 0;
+    instr->operand_count = 0;
+    instr->length = 0;
+    instr->binary_repres = 0;
 
     for (i = 0; i < MAX_OPERANDS; i++) {
-        (*instr)->operands[i].type = 0;
-        (*instr)->operands[i].value = 0;
-        (*instr)->operands[i].is_label = 0;
-        (*instr)->operands[i].is_register = 0;
-        (*instr)->operands[i].register_index = -1;
+        instr->operands[i].type = 0;
+        instr->operands[i].value = 0;
+        instr->operands[i].is_label = 0;
+        instr->operands[i].is_register = 0;
+        instr->operands[i].register_index = -1;
     }
 }
 
 void initialize_external_label_table(external_label_table *externals) {
     externals->labels = malloc(10 * sizeof(label)); 
     if (externals->labels == NULL) {
-        printf("Memory allocation failed\n");
-        exit(1);
+        console_printf("Memory allocation failed\n");
+        fatal_error();
     }
     externals->count = 0;
     externals->capacity = 10;
 }
+
@@ -3,6 +3,12 @@
 
 #define MAX_LABEL_LENGTH 31
 #define INTIAL_AMOUNT_OF_LABELS 30
+#define INITIAL_LABEL_SLOTS 64 /* The slots of the hash index of a new label table, a power of two */
+
+/* The flags of a label */
+#define LABEL_DATA 1        /* Defined by .data or .string, its address counts from DC */
+#define LABEL_EXTERNAL 2    /* Named by .extern */
+#define LABEL_ENTRY 4       /* Named by .entry */
 #define MAX_OPERANDS 2
 #define INITIAL_CC_CAPACITY 5
 
@@ -35,15 +41,15 @@ typedef struct {
     char name[MAX_LABEL_LENGTH + 1];
     int address;
     int assembly_line;
-    int is_data;
-    int is_external;
-    int is_entry;
+    unsigned char flags; /* LABEL_DATA, LABEL_EXTERNAL and LABEL_ENTRY */
 } label;
 
 typedef struct {
     label *labels;
     int count;
     int capacity;
+    int *slots;          /* Open addressing index by name: the number of a label + 1, 0 for an empty slot */
+    int slot_count;      /* A power of two, kept over twice the number of labels */
 } label_table;
 
 typedef struct {
@@ -81,11 +87,30 @@ typedef struct {
 
 void initialize_label_table(label_table *);
 void free_label_table(label_table *);
+
+/*
+ * Adds a label that was just put at the end of a table to its hash index, growing the index
+ * by doubling when it gets half full. A name that is already in the index keeps its first label.
+ *
+ * Parameters:
+ *   table - The label table.
+ *   number - The index of the label in table -> labels.
+ */
+void index_label(label_table *table, int number);
+
+/*
+ * Finds a label by name through the hash index of a table.
+ *
+ * Returns:
+ *   The label, or NULL if the table has no label with this name.
+ */
+label *lookup_label(const label_table *table, const char *name);
 void initialize_location(location **, char *);
+void free_location(location *);
 void initialize_code_conv(code_conv **);
 void free_code_conv(code_conv *);
-void initialize_instruction(instruction **);
-void free_instruction(instruction *);
+void free_code_conv_array(code_conv *, int);
+void initialize_instruction(instruction *);
 void initialize_external_label_table(external_label_table *externals);
 
 #endif
@@ -0,0 +1,499 @@
+#define _GNU_SOURCE /* syscall() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "io_backend.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#ifdef IORING_FEAT_RW_CUR_POS /* the kernel headers know the READ and WRITE operations (Linux 5.6) */
+#define HAVE_IO_URING
+#endif
+#endif
+
+#define MAX_TRANSFER_CHUNK (1UL << 30) /* the length of a single read or write is 32 bits */
+
+static unsigned long temporary_counter = 0; /* numbers the temporary files of all the threads */
+
+/* this function opens a file of a batch. for reads the buffer for the whole
+   file is allocated too. returns 0 (and sets the file's error) on failure */
+static int open_batch_file(io_file *file, int is_write) {
+    struct stat info;
+
+    file -> done = 0;
+    file -> error = 0;
+    if (!is_write) {
+        file -> contents.data = NULL;
+        file -> contents.size = 0;
+    }
+
+    if (is_write) {
+        /* next to the target, so the rename stays on the same file system */
+        file -> temporary_path = malloc(strlen(file -> path) + 48);
+        if (!file -> temporary_path) {
+            file -> error = ENOMEM;
+            return 0;
+        }
+        sprintf(file -> temporary_path, "%s.tmp.%ld.%lu", file -> path, (long) getpid(),
+                __atomic_fetch_add(&temporary_counter, 1, __ATOMIC_RELAXED));
+        file -> fd = open(file -> temporary_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    } else {
+        file -> fd = open(file -> path, O_RDONLY);
+    }
+    if (file -> fd < 0) {
+        file -> error = errno;
+        free(file -> temporary_path);
+        file -> temporary_path = NULL;
+        return 0;
+    }
+    if (is_write)
+        return 1;
+
+    if (fstat(file -> fd, &info) < 0)
+        file -> error = errno;
+    else if (!S_ISREG(info.st_mode))
+        file -> error = S_ISDIR(info.st_mode) ? EISDIR : EINVAL; /* the whole file is read at once, its size must be known */
+    if (file -> error) {
+        close(file -> fd);
+        file -> fd = -1;
+        return 0;
+    }
+    file -> contents.size = info.st_size;
+    file -> contents.data = malloc(file -> contents.size + 1); /* +1 for a null terminator */
+    if (!file -> contents.data) {
+        file -> error = ENOMEM;
+        file -> contents.size = 0;
+        close(file -> fd);
+        file -> fd = -1;
+        return 0;
+    }
+    return 1;
+}
+
+/* this function reads or writes the rest of a file with plain system calls */
+static void sync_transfer(io_file *file, int is_write) {
+    while (file -> done < file -> contents.size) {
+        char *position = file -> contents.data + file -> done;
+        size_t left = file -> contents.size - file -> done;
+        ssize_t count = is_write ? pwrite(file -> fd, position, left, file -> done) : pread(file -> fd, position, left, file -> done);
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count < 0) {
+            file -> error = errno;
+            return;
+        }
+        if (count == 0) {
+            if (is_write)
+                file -> error = EIO;
+            else
+                file -> contents.size = file -> done; /* the file became shorter since fstat */
+            return;
+        }
+        file -> done += count;
+    }
+}
+
+/* this function finishes the contents of a file once no more data will be transferred.
+   a written file replaces the target only if all of it made it */
+static void end_transfer(io_file *file, int is_write) {
+    if (is_write) {
+        if (!file -> error && rename(file -> temporary_path, file -> path) < 0)
+            file -> error = errno;
+        if (file -> error)
+            unlink(file -> temporary_path);
+        free(file -> temporary_path);
+        file -> temporary_path = NULL;
+        return;
+    }
+    if (file -> error) {
+        free(file -> contents.data);
+        file -> contents.data = NULL;
+        file -> contents.size = 0;
+    } else {
+        file -> contents.data[file -> contents.size] = '\0';
+    }
+}
+
+/* this function closes a file once all of its data was transferred. the io_uring
+   backend closes with a plain call too, a close on the ring costs another round trip */
+static void close_file(io_file *file) {
+    if (close(file -> fd) < 0 && file -> batch -> is_write && !file -> error)
+        file -> error = errno; /* a failed close can mean the data never made it to the disk */
+    file -> fd = -1;
+    end_transfer(file, file -> batch -> is_write);
+}
+
+/* this function handles a whole file with the sync backend */
+static void sync_file(io_file *file, int is_write) {
+    if (!open_batch_file(file, is_write))
+        return;
+    sync_transfer(file, is_write);
+    close_file(file);
+}
+
+/* this function runs on the background writer thread and writes the queued batches in order */
+static void *writer_main(void *context) {
+    io_writer *writer = context;
+
+    pthread_mutex_lock(&writer -> lock);
+    for (;;) {
+        io_batch *batch;
+        int i;
+
+        while (!writer -> first && !writer -> stopping)
+            pthread_cond_wait(&writer -> changed, &writer -> lock);
+        if (!writer -> first)
+            break;
+        batch = writer -> first;
+        writer -> first = batch -> next;
+        if (!writer -> first)
+            writer -> last = NULL;
+        pthread_mutex_unlock(&writer -> lock);
+
+        for (i = 0; i < batch -> count; i++)
+            sync_file(&batch -> files[i], 1);
+
+        pthread_mutex_lock(&writer -> lock);
+        writer -> queued_bytes -= batch -> bytes;
+        batch -> pending = 0;
+        pthread_cond_broadcast(&writer -> changed);
+    }
+    pthread_mutex_unlock(&writer -> lock);
+    return NULL;
+}
+
+/* this function hands a write batch to the background writer, starting it if needed.
+   returns 0 if there is no writer, then the caller writes the batch itself */
+static int writer_submit(io_backend *backend, io_batch *batch) {
+    io_writer *writer = &backend -> writer;
+    int i;
+
+    if (!writer -> started) {
+        writer -> first = writer -> last = NULL;
+        writer -> queued_bytes = 0;
+        writer -> stopping = 0;
+        pthread_mutex_init(&writer -> lock, NULL);
+        pthread_cond_init(&writer -> changed, NULL);
+        if (pthread_create(&writer -> thread, NULL, writer_main, writer) != 0) {
+            pthread_cond_destroy(&writer -> changed);
+            pthread_mutex_destroy(&writer -> lock);
+            return 0;
+        }
+        writer -> started = 1;
+    }
+
+    batch -> bytes = 0;
+    for (i = 0; i < batch -> count; i++)
+        batch -> bytes += batch -> files[i].contents.size;
+    batch -> next = NULL;
+
+    pthread_mutex_lock(&writer -> lock);
+    /* backpressure: wait while the writer is behind, but a batch bigger than the limit still goes alone */
+    while (writer -> queued_bytes > 0 && writer -> queued_bytes + batch -> bytes > MAX_QUEUED_WRITES)
+        pthread_cond_wait(&writer -> changed, &writer -> lock);
+    if (writer -> last)
+        writer -> last -> next = batch;
+    else
+        writer -> first = batch;
+    writer -> last = batch;
+    writer -> queued_bytes += batch -> bytes;
+    batch -> pending = 1;
+    pthread_cond_broadcast(&writer -> changed);
+    pthread_mutex_unlock(&writer -> lock);
+    return 1;
+}
+
+#ifdef HAVE_IO_URING
+
+static int ring_setup(io_ring *ring) {
+    struct io_uring_params params;
+    int fd;
+
+    memset(&params, 0, sizeof(params));
+    fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+    if (fd < 0)
+        return 0; /* no io_uring in this kernel, or it is disabled */
+
+    ring -> ring_fd = fd;
+    ring -> sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring -> cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring -> cq_ring_size > ring -> sq_ring_size)
+            ring -> sq_ring_size = ring -> cq_ring_size;
+        ring -> cq_ring_size = ring -> sq_ring_size;
+    }
+    ring -> sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring -> sq_ring = mmap(NULL, ring -> sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQ_RING);
+    if (ring -> sq_ring == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring -> cq_ring = ring -> sq_ring;
+    } else {
+        ring -> cq_ring = mmap(NULL, ring -> cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_CQ_RING);
+        if (ring -> cq_ring == MAP_FAILED) {
+            munmap(ring -> sq_ring, ring -> sq_ring_size);
+            close(fd);
+            return 0;
+        }
+    }
+    ring -> sqes = mmap(NULL, ring -> sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, IORING_OFF_SQES);
+    if (ring -> sqes == MAP_FAILED) {
+        if (ring -> cq_ring != ring -> sq_ring)
+            munmap(ring -> cq_ring, ring -> cq_ring_size);
+        munmap(ring -> sq_ring, ring -> sq_ring_size);
+        close(fd);
+        return 0;
+    }
+
+    ring -> sq_head = (unsigned *) ((char *) ring -> sq_ring + params.sq_off.head);
+    ring -> sq_tail = (unsigned *) ((char *) ring -> sq_ring + params.sq_off.tail);
+    ring -> sq_mask = (unsigned *) ((char *) ring -> sq_ring + params.sq_off.ring_mask);
+    ring -> sq_array = (unsigned *) ((char *) ring -> sq_ring + params.sq_off.array);
+    ring -> cq_head = (unsigned *) ((char *) ring -> cq_ring + params.cq_off.head);
+    ring -> cq_tail = (unsigned *) ((char *) ring -> cq_ring + params.cq_off.tail);
+    ring -> cq_mask = (unsigned *) ((char *) ring -> cq_ring + params.cq_off.ring_mask);
+    ring -> cqes = (char *) ring -> cq_ring + params.cq_off.cqes;
+    ring -> entries = params.sq_entries;
+    ring -> to_submit = 0;
+    ring -> in_flight = 0;
+    return 1;
+}
+
+static void ring_cleanup(io_ring *ring) {
+    munmap(ring -> sqes, ring -> sqes_size);
+    if (ring -> cq_ring != ring -> sq_ring)
+        munmap(ring -> cq_ring, ring -> cq_ring_size);
+    munmap(ring -> sq_ring, ring -> sq_ring_size);
+    close(ring -> ring_fd);
+}
+
+static void ring_submit_and_wait(io_backend *backend, unsigned wait_for);
+
+/* this function adds a read or write of the rest of a file to the submission queue.
+   it is handed to the kernel by the next ring_submit_and_wait */
+static void queue_transfer(io_backend *backend, io_file *file) {
+    int opcode = file -> batch -> is_write ? IORING_OP_WRITE : IORING_OP_READ;
+    io_ring *ring = &backend -> ring;
+    struct io_uring_sqe *sqe;
+    unsigned tail, index;
+    size_t left;
+
+    while (ring -> to_submit + ring -> in_flight >= ring -> entries)
+        ring_submit_and_wait(backend, 1); /* the ring is full, make room */
+
+    tail = *ring -> sq_tail;
+    index = tail & *ring -> sq_mask;
+    sqe = (struct io_uring_sqe *) ring -> sqes + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe -> opcode = opcode;
+    sqe -> fd = file -> fd;
+    left = file -> contents.size - file -> done;
+    sqe -> addr = (unsigned long) (file -> contents.data + file -> done);
+    sqe -> len = left > MAX_TRANSFER_CHUNK ? MAX_TRANSFER_CHUNK : left;
+    sqe -> off = file -> done;
+    sqe -> user_data = (unsigned long) file;
+    ring -> sq_array[index] = index;
+    __atomic_store_n(ring -> sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring -> to_submit++;
+    file -> batch -> pending++;
+}
+
+
+/* this function handles one completed operation */
+static void complete_operation(io_backend *backend, unsigned long user_data, int result) {
+    io_file *file = (io_file *) user_data;
+    io_batch *batch = file -> batch;
+
+    batch -> pending--;
+
+    if (result == -EINTR || result == -EAGAIN) {
+        queue_transfer(backend, file);
+        return;
+    }
+    if (result == -EINVAL || result == -EOPNOTSUPP) {
+        sync_transfer(file, batch -> is_write); /* a kernel without the read and write operations */
+    } else if (result < 0) {
+        file -> error = -result;
+    } else if (result == 0) {
+        if (batch -> is_write)
+            file -> error = EIO;
+        else
+            file -> contents.size = file -> done; /* the file became shorter since fstat */
+    } else {
+        file -> done += result;
+        if (file -> done < file -> contents.size) {
+            queue_transfer(backend, file); /* a short read or write, continue where it stopped */
+            return;
+        }
+    }
+    close_file(file);
+}
+
+/* this function handles every completion the kernel posted so far */
+static void reap_completions(io_backend *backend) {
+    io_ring *ring = &backend -> ring;
+    unsigned head = *ring -> cq_head;
+
+    while (head != __atomic_load_n(ring -> cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = (struct io_uring_cqe *) ring -> cqes + (head & *ring -> cq_mask);
+        unsigned long user_data = cqe -> user_data;
+        int result = cqe -> res;
+
+        /* the entry is released before it is handled, since handling it may queue more work */
+        __atomic_store_n(ring -> cq_head, head + 1, __ATOMIC_RELEASE);
+        ring -> in_flight--;
+        complete_operation(backend, user_data, result);
+        head = *ring -> cq_head;
+    }
+}
+
+/* this function hands the queued operations to the kernel, waits for
+   wait_for of them to complete and then handles the completions */
+static void ring_submit_and_wait(io_backend *backend, unsigned wait_for) {
+    io_ring *ring = &backend -> ring;
+    int submitted;
+
+    if (wait_for > ring -> to_submit + ring -> in_flight)
+        wait_for = ring -> to_submit + ring -> in_flight;
+    if (ring -> to_submit == 0 && wait_for == 0) {
+        reap_completions(backend);
+        return;
+    }
+
+    submitted = syscall(__NR_io_uring_enter, ring -> ring_fd, ring -> to_submit, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (submitted > 0) {
+        ring -> to_submit -= submitted;
+        ring -> in_flight += submitted;
+    }
+    /* on EINTR, EAGAIN or EBUSY nothing was lost, the caller simply tries again */
+    reap_completions(backend);
+}
+
+static void uring_start(io_backend *backend, io_batch *batch) {
+    int i;
+
+    for (i = 0; i < batch -> count; i++) {
+        io_file *file = &batch -> files[i];
+        if (!open_batch_file(file, batch -> is_write))
+            continue;
+        if (file -> contents.size > 0)
+            queue_transfer(backend, file);
+        else
+            close_file(file);
+    }
+    ring_submit_and_wait(backend, 0); /* start the work, the caller collects it later */
+}
+
+#endif
+
+void io_backend_open(io_backend *backend, io_backend_kind kind) {
+    backend -> kind = IO_BACKEND_SYNC;
+    backend -> writer.started = 0;
+#ifdef HAVE_IO_URING
+    /* buffered writes are handed to kernel worker threads, which only pay
+       off when they have another processor to run on */
+    if (kind == IO_BACKEND_AUTO && sysconf(_SC_NPROCESSORS_ONLN) < 2)
+        return;
+    if (kind != IO_BACKEND_SYNC && ring_setup(&backend -> ring))
+        backend -> kind = IO_BACKEND_URING;
+#endif
+}
+
+void io_backend_close(io_backend *backend) {
+    io_writer *writer = &backend -> writer;
+
+    if (writer -> started) {
+        pthread_mutex_lock(&writer -> lock);
+        writer -> stopping = 1;
+        pthread_cond_broadcast(&writer -> changed);
+        pthread_mutex_unlock(&writer -> lock);
+        pthread_join(writer -> thread, NULL);
+        pthread_cond_destroy(&writer -> changed);
+        pthread_mutex_destroy(&writer -> lock);
+        writer -> started = 0;
+    }
+#ifdef HAVE_IO_URING
+    if (backend -> kind == IO_BACKEND_URING)
+        ring_cleanup(&backend -> ring);
+#endif
+    backend -> kind = IO_BACKEND_SYNC;
+}
+
+const char *io_backend_name(io_backend_kind kind) {
+    switch (kind) {
+        case IO_BACKEND_SYNC:
+            return "sync";
+        case IO_BACKEND_URING:
+            return "io_uring";
+        default:
+            return "auto";
+    }
+}
+
+int parse_io_backend(const char *name, io_backend_kind *kind) {
+    if (strcmp(name, "auto") == 0)
+        *kind = IO_BACKEND_AUTO;
+    else if (strcmp(name, "sync") == 0)
+        *kind = IO_BACKEND_SYNC;
+    else if (strcmp(name, "uring") == 0 || strcmp(name, "io_uring") == 0)
+        *kind = IO_BACKEND_URING;
+    else
+        return 0;
+    return 1;
+}
+
+/* this function starts a read or write batch on either backend */
+static void start_batch(io_backend *backend, io_batch *batch, int is_write) {
+    int i;
+
+    batch -> is_write = is_write;
+    batch -> pending = 0;
+    for (i = 0; i < batch -> count; i++) {
+        batch -> files[i].batch = batch;
+        batch -> files[i].temporary_path = NULL;
+    }
+
+#ifdef HAVE_IO_URING
+    if (backend -> kind == IO_BACKEND_URING) {
+        uring_start(backend, batch);
+        return;
+    }
+#endif
+    if (is_write && batch -> count > 0 && writer_submit(backend, batch))
+        return;
+    for (i = 0; i < batch -> count; i++)
+        sync_file(&batch -> files[i], is_write);
+}
+
+void io_batch_start_read(io_backend *backend, io_batch *batch) {
+    start_batch(backend, batch, 0);
+}
+
+void io_batch_start_write(io_backend *backend, io_batch *batch) {
+    start_batch(backend, batch, 1);
+}
+
+void io_batch_finish(io_backend *backend, io_batch *batch) {
+    if (backend -> kind == IO_BACKEND_SYNC && batch -> is_write && backend -> writer.started) {
+        pthread_mutex_lock(&backend -> writer.lock);
+        while (batch -> pending > 0)
+            pthread_cond_wait(&backend -> writer.changed, &backend -> writer.lock);
+        pthread_mutex_unlock(&backend -> writer.lock);
+        return;
+    }
+#ifdef HAVE_IO_URING
+    while (backend -> kind == IO_BACKEND_URING && batch -> pending > 0)
+        ring_submit_and_wait(backend, 1);
+#endif
+}
@@ -0,0 +1,124 @@
+#ifndef IO_BACKEND_H
+#define IO_BACKEND_H
+
+#include <pthread.h>
+#include "memory_file.h"
+
+#define IO_RING_ENTRIES 64      /* Size of the io_uring submission queue */
+#define DEFAULT_IO_BATCH 32     /* Files read or written together by default */
+#define MAX_IO_BATCH 4096       /* Upper limit for --io-batch */
+#define MAX_QUEUED_WRITES (16UL * 1024 * 1024) /* Bytes the background writer may hold before new batches wait */
+
+/* How the files are read and written */
+typedef enum {
+    IO_BACKEND_AUTO,    /* io_uring when the kernel supports it and there are several processors, sync otherwise */
+    IO_BACKEND_SYNC,    /* open, pread/pwrite and close, one file after the other (writes on a background thread) */
+    IO_BACKEND_URING    /* reads and writes of a whole batch are submitted together through io_uring */
+} io_backend_kind;
+
+struct io_batch;
+
+/* One file of a batch */
+typedef struct {
+    const char *path;         /* The file's path (not owned) */
+    memory_file contents;     /* Read: filled by the batch. Write: the bytes to write (not owned) */
+    int fd;                   /* The open descriptor while the file is in flight */
+    char *temporary_path;     /* Write: the file is written here and renamed to path once complete */
+    size_t done;              /* Bytes transferred so far */
+    int error;                /* 0, or the errno of the failure */
+    struct io_batch *batch;   /* The batch this file belongs to */
+} io_file;
+
+/* A group of files that are all read or all written together */
+typedef struct io_batch {
+    io_file *files;     /* The files */
+    int count;          /* Number of files */
+    int pending;        /* Operations submitted but not completed yet */
+    int is_write;       /* 1 for a write batch, 0 for a read batch */
+    size_t bytes;       /* Write: number of bytes in all the files */
+    struct io_batch *next; /* The next batch waiting for the background writer */
+} io_batch;
+
+/* The state of the io_uring ring (unused by the sync backend) */
+typedef struct {
+    int ring_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    void *sqes;                 /* The submission queue entries */
+    void *cqes;                 /* The completion queue entries */
+    void *sq_ring, *cq_ring;    /* The mapped rings */
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned entries;           /* Submission queue size */
+    unsigned to_submit;         /* Entries queued but not yet handed to the kernel */
+    unsigned in_flight;         /* Entries handed to the kernel and not completed */
+} io_ring;
+
+/* The thread that writes the batches of the sync backend, so the caller can go on
+   assembling the next files meanwhile. It is started by the first write batch. */
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;     /* Signaled when a batch is queued or written, or the writer should stop */
+    io_batch *first, *last;     /* The batches waiting to be written */
+    size_t queued_bytes;        /* Bytes in the batches that were not written yet */
+    int started;                /* 1 while the thread runs */
+    int stopping;               /* 1 once the thread should end */
+} io_writer;
+
+/* A backend instance. It is not thread safe, every thread uses its own. */
+typedef struct {
+    io_backend_kind kind;   /* IO_BACKEND_SYNC or IO_BACKEND_URING once opened */
+    io_ring ring;
+    io_writer writer;       /* Used by the sync backend */
+} io_backend;
+
+/*
+ * Opens a backend. IO_BACKEND_AUTO and IO_BACKEND_URING fall back to
+ * IO_BACKEND_SYNC when io_uring is not available.
+ *
+ * Parameters:
+ *   backend - The backend to open.
+ *   kind - The requested kind.
+ */
+void io_backend_open(io_backend *backend, io_backend_kind kind);
+
+/*
+ * Closes a backend, and stops its background writer. No batch may be in flight.
+ */
+void io_backend_close(io_backend *backend);
+
+/*
+ * Returns the name of a backend kind ("sync" or "io_uring").
+ */
+const char *io_backend_name(io_backend_kind kind);
+
+/*
+ * Parses a backend name given on the command line ("auto", "sync" or "uring").
+ *
+ * Returns:
+ *   1 if the name is known, 0 otherwise.
+ */
+int parse_io_backend(const char *name, io_backend_kind *kind);
+
+/*
+ * Starts reading every file of the batch into memory. The contents of each
+ * file are allocated with malloc and belong to the caller once the batch finished.
+ */
+void io_batch_start_read(io_backend *backend, io_batch *batch);
+
+/*
+ * Starts writing every file of the batch. Each file is written under a temporary
+ * name and renamed into place once it is complete, so a crash never leaves a
+ * truncated file behind. The contents must stay valid until the batch finished.
+ * If the background writer holds more than MAX_QUEUED_WRITES bytes already,
+ * this waits until it caught up.
+ */
+void io_batch_start_write(io_backend *backend, io_batch *batch);
+
+/*
+ * Waits until every file of the batch was read or written, and closed.
+ * Afterwards each file's error tells whether it succeeded.
+ */
+void io_batch_finish(io_backend *backend, io_batch *batch);
+
+#endif
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "jobserver.h"
+
+#define JOBSERVER_AUTH_OPTION "--jobserver-auth="
+#define JOBSERVER_FDS_OPTION "--jobserver-fds=" /* the name used by make before 4.2 */
+
+/* this function finds the value of the last jobserver option in MAKEFLAGS.
+   the value is copied into value, returns 1 if an option was found */
+static int find_jobserver_option(const char *makeflags, char *value, size_t value_size) {
+    const char *word = makeflags, *found = NULL;
+    size_t length = 0;
+
+    while (*word) {
+        const char *end;
+        while (*word == ' ' || *word == '\t')
+            word++;
+        end = word;
+        while (*end && *end != ' ' && *end != '\t')
+            end++;
+        if (strncmp(word, JOBSERVER_AUTH_OPTION, strlen(JOBSERVER_AUTH_OPTION)) == 0) {
+            found = word + strlen(JOBSERVER_AUTH_OPTION); /* the last one wins, like in make */
+            length = end - found;
+        } else if (strncmp(word, JOBSERVER_FDS_OPTION, strlen(JOBSERVER_FDS_OPTION)) == 0) {
+            found = word + strlen(JOBSERVER_FDS_OPTION);
+            length = end - found;
+        }
+        word = end;
+    }
+
+    if (!found || length == 0 || length >= value_size)
+        return 0;
+    memcpy(value, found, length);
+    value[length] = '\0';
+    return 1;
+}
+
+/* this function checks that an inherited descriptor really is the jobserver pipe.
+   make does not pass the descriptors to commands it does not consider recursive,
+   and the number may then belong to some other file */
+static int is_inherited_pipe(int fd) {
+    struct stat info;
+    if (fd < 0 || fcntl(fd, F_GETFD) < 0 || fstat(fd, &info) < 0)
+        return 0;
+    return S_ISFIFO(info.st_mode);
+}
+
+/* this function opens a private, non blocking reader of an inherited pipe.
+   setting O_NONBLOCK on the inherited descriptor itself would change it for
+   make and all of its other children, so on Linux the pipe is reopened instead.
+   if that is not possible the inherited descriptor is used as is */
+static void open_private_reader(jobserver *server) {
+    char path[64];
+    int fd;
+
+    sprintf(path, "/proc/self/fd/%d", server -> read_fd);
+    fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd >= 0) {
+        server -> read_fd = fd;
+        server -> close_read_fd = 1;
+    }
+}
+
+int jobserver_connect(jobserver *server) {
+    const char *makeflags = getenv("MAKEFLAGS");
+    char value[FILENAME_MAX];
+    int read_fd, write_fd;
+
+    server -> read_fd = server -> write_fd = -1;
+    server -> close_read_fd = server -> close_write_fd = 0;
+    server -> token_count = 0;
+
+    if (!makeflags || !find_jobserver_option(makeflags, value, sizeof(value)))
+        return 0;
+
+    if (strncmp(value, "fifo:", 5) == 0) {
+        /* make 4.4 and up: a named pipe, which we open for ourselves */
+        int fd = open(value + 5, O_RDWR | O_NONBLOCK);
+        if (fd < 0)
+            return 0;
+        server -> read_fd = server -> write_fd = fd;
+        server -> close_read_fd = 1;
+    } else if (sscanf(value, "%d,%d", &read_fd, &write_fd) == 2) {
+        /* the classic form: two descriptors of a pipe inherited from make */
+        if (!is_inherited_pipe(read_fd) || !is_inherited_pipe(write_fd))
+            return 0;
+        server -> read_fd = read_fd;
+        server -> write_fd = write_fd;
+        open_private_reader(server);
+    } else {
+        return 0;
+    }
+
+    pthread_mutex_init(&server -> lock, NULL);
+    return 1;
+}
+
+int jobserver_acquire(jobserver *server) {
+    struct pollfd ready;
+    char token;
+    ssize_t got;
+
+    ready.fd = server -> read_fd;
+    ready.events = POLLIN;
+    ready.revents = 0;
+    if (poll(&ready, 1, JOBSERVER_POLL_TIMEOUT) <= 0)
+        return 0; /* timed out (or interrupted), the caller will look for work and try again */
+
+    /* other clients of the same make may have taken the token in the meantime,
+       with a blocking inherited descriptor the read then waits for the next one */
+    do {
+        got = read(server -> read_fd, &token, 1);
+    } while (got < 0 && errno == EINTR);
+    if (got != 1)
+        return 0;
+
+    pthread_mutex_lock(&server -> lock);
+    if (server -> token_count < MAX_JOBSERVER_TOKENS) {
+        server -> tokens[server -> token_count++] = token;
+        pthread_mutex_unlock(&server -> lock);
+        return 1;
+    }
+    pthread_mutex_unlock(&server -> lock);
+    write(server -> write_fd, &token, 1); /* can not keep track of it, hand it right back */
+    return 0;
+}
+
+void jobserver_release(jobserver *server) {
+    char token;
+    ssize_t written;
+
+    pthread_mutex_lock(&server -> lock);
+    if (server -> token_count == 0) {
+        pthread_mutex_unlock(&server -> lock);
+        return;
+    }
+    token = server -> tokens[--server -> token_count];
+    pthread_mutex_unlock(&server -> lock);
+
+    do {
+        written = write(server -> write_fd, &token, 1); /* give back the same byte, make may care about it */
+    } while (written < 0 && errno == EINTR);
+}
+
+void jobserver_disconnect(jobserver *server) {
+    while (server -> token_count > 0)
+        jobserver_release(server);
+    if (server -> close_read_fd)
+        close(server -> read_fd);
+    if (server -> close_write_fd)
+        close(server -> write_fd);
+    pthread_mutex_destroy(&server -> lock);
+    server -> read_fd = server -> write_fd = -1;
+}
@@ -0,0 +1,53 @@
+#ifndef JOBSERVER_H
+#define JOBSERVER_H
+
+#include <pthread.h>
+
+#define JOBSERVER_POLL_TIMEOUT 50   /* Milliseconds to wait for a token before looking for work again */
+#define MAX_JOBSERVER_TOKENS 1024   /* Most tokens a single assembler may hold at once */
+
+/* A connection to the GNU make jobserver of the make that started us.
+   Every token read from the jobserver allows one more file to be
+   assembled in parallel, the token is written back once the file is done. */
+typedef struct {
+    int read_fd;                              /* Where the tokens are read from */
+    int write_fd;                             /* Where the tokens are given back */
+    int close_read_fd;                        /* 1 if read_fd was opened by us */
+    int close_write_fd;                       /* 1 if write_fd was opened by us */
+    char tokens[MAX_JOBSERVER_TOKENS];        /* The tokens we hold, given back as they were received */
+    int token_count;                          /* Number of tokens we hold */
+    pthread_mutex_t lock;                     /* Guards tokens and token_count */
+} jobserver;
+
+/*
+ * Connects to the jobserver described by the MAKEFLAGS environment variable.
+ * Both the "--jobserver-auth=fifo:PATH" form and the "--jobserver-auth=R,W"
+ * (or older "--jobserver-fds=R,W") pipe form are supported.
+ *
+ * Parameters:
+ *   server - The connection to initialize.
+ *
+ * Returns:
+ *   1 if a usable jobserver was found, 0 otherwise.
+ */
+int jobserver_connect(jobserver *server);
+
+/*
+ * Takes one token from the jobserver, waiting at most JOBSERVER_POLL_TIMEOUT.
+ *
+ * Returns:
+ *   1 if a token was taken, 0 if none was available in time.
+ */
+int jobserver_acquire(jobserver *server);
+
+/*
+ * Gives one token back to the jobserver.
+ */
+void jobserver_release(jobserver *server);
+
+/*
+ * Gives back any token still held and closes the connection.
+ */
+void jobserver_disconnect(jobserver *server);
+
+#endif
@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <limits.h>
+#include "lexer.h"
+
+#define INITIAL_TOKEN_COUNT 64
+#define TOKENS_PER_LINE 4  /* A guess for the first allocation: an instruction, two operands and a comma */
+
+/* The classes of the characters. A blank, a comma and a quote end a word, the others are a part of it */
+#define CC_BLANK 0   /* White space of the "C" locale, and the null character */
+#define CC_COMMA 1
+#define CC_QUOTE 2
+#define CC_LETTER 3  /* The first class of the characters of a word */
+#define CC_R 4
+#define CC_DIGIT 5
+#define CC_SIGN 6
+#define CC_HASH 7
+#define CC_STAR 8
+#define CC_DOT 9
+#define CC_OTHER 10
+#define WORD_CLASS_COUNT 8
+
+#define B CC_BLANK
+#define C CC_COMMA
+#define Q CC_QUOTE
+#define L CC_LETTER
+#define R CC_R
+#define D CC_DIGIT
+#define S CC_SIGN
+#define H CC_HASH
+#define X CC_STAR
+#define P CC_DOT
+#define O CC_OTHER
+
+/* The class of every character, so the lexer does not depend on the locale and calls no function per character */
+static const unsigned char char_classes[256] = {
+    B, O, O, O, O, O, O, O, O, B, B, B, B, B, O, O,  /* 0x00 */
+    O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,  /* 0x10 */
+    B, O, Q, H, O, O, O, O, O, O, X, S, C, S, P, O,  /* 0x20  !"#$%&'()*+,-./ */
+    D, D, D, D, D, D, D, D, D, D, O, O, O, O, O, O,  /* 0x30 0123456789:;<=>? */
+    O, L, L, L, L, L, L, L, L, L, L, L, L, L, L, L,  /* 0x40 @ABCDEFGHIJKLMNO */
+    L, L, L, L, L, L, L, L, L, L, L, O, O, O, O, O,  /* 0x50 PQRSTUVWXYZ[\]^_ */
+    O, L, L, L, L, L, L, L, L, L, L, L, L, L, L, L,  /* 0x60 `abcdefghijklmno */
+    L, L, R, L, L, L, L, L, L, L, L, O, O, O, O, O,  /* 0x70 pqrstuvwxyz{|}~ */
+    O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,  /* 0x80 */
+    O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,
+    O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,
+    O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,
+    O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,
+    O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,
+    O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O,
+    O, O, O, O, O, O, O, O, O, O, O, O, O, O, O, O
+};
+
+#undef B
+#undef C
+#undef Q
+#undef L
+#undef R
+#undef D
+#undef S
+#undef H
+#undef X
+#undef P
+#undef O
+
+/* The states of the automaton that reads a word, the state it ends in is the kind of the word */
+#define S_START 0
+#define S_IDENTIFIER 1
+#define S_R 2
+#define S_REGISTER 3
+#define S_HASH 4
+#define S_HASH_SIGN 5
+#define S_IMMEDIATE 6
+#define S_BAD_IMMEDIATE 7
+#define S_STAR 8
+#define S_STAR_R 9
+#define S_INDIRECT 10
+#define S_BAD_INDIRECT 11
+#define S_NUMBER 12
+#define S_NUMBER_PREFIX 13
+#define S_DIRECTIVE 14
+#define S_OTHER 15
+#define STATE_COUNT 16
+
+/* The next state for each state and class of a word character, the columns are
+   letter, r, digit, sign, #, *, dot and other */
+static const unsigned char transitions[STATE_COUNT][WORD_CLASS_COUNT] = {
+    /* S_START */         { S_IDENTIFIER, S_R, S_NUMBER, S_NUMBER, S_HASH, S_STAR, S_DIRECTIVE, S_OTHER },
+    /* S_IDENTIFIER */    { S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER },
+    /* S_R */             { S_IDENTIFIER, S_IDENTIFIER, S_REGISTER, S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER },
+    /* S_REGISTER */      { S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER, S_IDENTIFIER },
+    /* S_HASH */          { S_BAD_IMMEDIATE, S_BAD_IMMEDIATE, S_IMMEDIATE, S_HASH_SIGN, S_BAD_IMMEDIATE, S_BAD_IMMEDIATE, S_BAD_IMMEDIATE, S_BAD_IMMEDIATE },
+    /* S_HASH_SIGN */     { S_BAD_IMMEDIATE, S_BAD_IMMEDIATE, S_IMMEDIATE, S_BAD_IMMEDIATE, S_BAD_IMMEDIATE, S_BAD_IMMEDIATE, S_BAD_IMMEDIATE, S_BAD_IMMEDIATE },
+    /* S_IMMEDIATE */     { S_IMMEDIATE, S_IMMEDIATE, S_IMMEDIATE, S_IMMEDIATE, S_IMMEDIATE, S_IMMEDIATE, S_IMMEDIATE, S_IMMEDIATE },
+    /* S_BAD_IMMEDIATE */ { S_BAD_IMMEDIATE, S_BAD_IMMEDIATE, S_BAD_IMMEDIATE, S_BAD_IMMEDIATE, S_BAD_IMMEDIATE, S_BAD_IMMEDIATE, S_BAD_IMMEDIATE, S_BAD_IMMEDIATE },
+    /* S_STAR */          { S_BAD_INDIRECT, S_STAR_R, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT },
+    /* S_STAR_R */        { S_BAD_INDIRECT, S_BAD_INDIRECT, S_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT },
+    /* S_INDIRECT */      { S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT },
+    /* S_BAD_INDIRECT */  { S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT, S_BAD_INDIRECT },
+    /* S_NUMBER */        { S_NUMBER_PREFIX, S_NUMBER_PREFIX, S_NUMBER, S_NUMBER, S_NUMBER_PREFIX, S_NUMBER_PREFIX, S_NUMBER_PREFIX, S_NUMBER_PREFIX },
+    /* S_NUMBER_PREFIX */ { S_NUMBER_PREFIX, S_NUMBER_PREFIX, S_NUMBER_PREFIX, S_NUMBER_PREFIX, S_NUMBER_PREFIX, S_NUMBER_PREFIX, S_NUMBER_PREFIX, S_NUMBER_PREFIX },
+    /* S_DIRECTIVE */     { S_DIRECTIVE, S_DIRECTIVE, S_DIRECTIVE, S_DIRECTIVE, S_DIRECTIVE, S_DIRECTIVE, S_DIRECTIVE, S_DIRECTIVE },
+    /* S_OTHER */         { S_OTHER, S_OTHER, S_OTHER, S_OTHER, S_OTHER, S_OTHER, S_OTHER, S_OTHER }
+};
+
+/* The kind of a word that ends in each state */
+static const unsigned char state_kinds[STATE_COUNT] = {
+    TOKEN_OTHER, TOKEN_IDENTIFIER, TOKEN_IDENTIFIER, TOKEN_REGISTER,
+    TOKEN_BAD_IMMEDIATE, TOKEN_BAD_IMMEDIATE, TOKEN_IMMEDIATE, TOKEN_BAD_IMMEDIATE,
+    TOKEN_BAD_INDIRECT, TOKEN_BAD_INDIRECT, TOKEN_INDIRECT, TOKEN_BAD_INDIRECT,
+    TOKEN_NUMBER, TOKEN_NUMBER_PREFIX, TOKEN_DIRECTIVE, TOKEN_OTHER
+};
+
+/* this function adds a token to the list, growing it when it is full.
+   returns 1 on success, 0 if memory allocation failed */
+static int add_token(token_list *list, size_t start, size_t end, int kind, int flags, int line) {
+    token *added;
+    if (list -> count == list -> capacity) {
+        token *new_tokens = realloc(list -> tokens, list -> capacity * 2 * sizeof(token));
+        if (!new_tokens)
+            return 0;
+        list -> tokens = new_tokens;
+        list -> capacity *= 2;
+    }
+    added = &list -> tokens[list -> count++];
+    added -> offset = start;
+    added -> length = (unsigned short) (end - start);
+    added -> kind = (unsigned char) kind;
+    added -> flags = (unsigned char) flags;
+    added -> line = line;
+    return 1;
+}
+
+int tokenize_lines(token_list *list, const line_index *lines) {
+    list -> text = lines -> text;
+    list -> count = 0;
+    list -> capacity = lines -> count * TOKENS_PER_LINE + INITIAL_TOKEN_COUNT;
+    list -> tokens = malloc(list -> capacity * sizeof(token));
+    if (!list -> tokens)
+        return 0;
+    return tokenize_more_lines(list, lines, 0, 0);
+}
+
+int tokenize_more_lines(token_list *list, const line_index *lines, size_t offset, int first_line) {
+    const char *text = lines -> text;
+    int line;
+
+    for (line = 0; line < lines -> count; line++) {
+        size_t position = lines -> starts[line], end = lines -> starts[line + 1];
+        int flags = 0; /* the first token of a line follows nothing */
+        if ((lines -> kinds[line] & LINE_KIND_MASK) == LINE_BLANK)
+            continue;
+        while (position < end) {
+            size_t start = position;
+            int char_class = char_classes[(unsigned char) text[position]], kind;
+            if (char_class == CC_BLANK) {
+                flags = 0;
+                position++;
+                continue;
+            }
+            if (char_class < CC_LETTER) { /* a comma or a quote */
+                kind = char_class == CC_COMMA ? TOKEN_COMMA : TOKEN_QUOTE;
+                position++;
+            } else { /* a word, its kind is found while it is read */
+                int state = S_START;
+                do {
+                    state = transitions[state][char_class - CC_LETTER];
+                    if (++position == end)
+                        break;
+                    char_class = char_classes[(unsigned char) text[position]];
+                } while (char_class >= CC_LETTER);
+                kind = state_kinds[state];
+            }
+            if (!add_token(list, offset + start, offset + position, kind, flags, first_line + line)) {
+                free_token_list(list);
+                return 0;
+            }
+            flags = TOKEN_GLUED;
+        }
+    }
+    return 1;
+}
+
+void free_token_list(token_list *list) {
+    free(list -> tokens);
+    list -> tokens = NULL;
+    list -> count = 0;
+}
+
+int next_statement(const token_list *list, int first, token_span *statement) {
+    int end = first + 1;
+    while (end < list -> count && list -> tokens[end].line == list -> tokens[first].line)
+        end++;
+    statement -> text = list -> text;
+    statement -> tokens = list -> tokens + first;
+    statement -> count = end - first;
+    return end;
+}
+
+int next_field(const token_span *span, int first, word_view *field) {
+    int end = first + 1;
+    if (first >= span -> count)
+        return 0;
+    while (end < span -> count && (span -> tokens[end].flags & TOKEN_GLUED))
+        end++;
+    field -> text = span -> text + span -> tokens[first].offset;
+    field -> length = (int) (span -> tokens[end - 1].offset + span -> tokens[end - 1].length - span -> tokens[first].offset);
+    field -> end = end;
+    return 1;
+}
+
+void sub_span(const token_span *span, int first, int end, token_span *part) {
+    part -> text = span -> text;
+    part -> tokens = span -> tokens + first;
+    part -> count = end - first;
+}
+
+void span_text(const token_span *span, word_view *text) {
+    if (span -> count == 0) {
+        text -> text = "";
+        text -> length = 0;
+    } else {
+        const token *last = span -> tokens + span -> count - 1;
+        text -> text = span -> text + span -> tokens[0].offset;
+        text -> length = (int) (last -> offset + last -> length - span -> tokens[0].offset);
+    }
+    text -> end = span -> count;
+}
+
+int token_number(const char *text, const token *number, int skip) {
+    const char *digit = text + number -> offset + skip, *end = text + number -> offset + number -> length;
+    unsigned long value = 0, limit;
+    int negative = 0, overflow = 0;
+
+    if (digit < end && (*digit == '-' || *digit == '+'))
+        negative = *digit++ == '-';
+    limit = negative ? (unsigned long) LONG_MAX + 1 : (unsigned long) LONG_MAX;
+    for (; digit < end && *digit >= '0' && *digit <= '9'; digit++) {
+        if (value > (limit - (*digit - '0')) / 10)
+            overflow = 1;
+        else
+            value = value * 10 + (*digit - '0');
+    }
+    if (overflow) /* atoi reads the number as a long, which stops at its limit */
+        value = limit;
+    if (!negative)
+        return (int) (long) value;
+    return (int) (value == limit ? LONG_MIN : -(long) value);
+}
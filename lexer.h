@@ -0,0 +1,150 @@
+#ifndef LEXER_H
+#define LEXER_H
+
+#include <stddef.h>
+#include "line_index.h"
+#include "util.h"
+
+/* The kinds of tokens. A comma and a quote are tokens of their own, the other characters up to
+   a white space, a comma or a quote make a word, whose kind is what it can be as an operand */
+#define TOKEN_COMMA 0
+#define TOKEN_QUOTE 1
+#define TOKEN_IDENTIFIER 2      /* Starts with a letter: a label, an instruction or a macro */
+#define TOKEN_REGISTER 3        /* r and a digit */
+#define TOKEN_INDIRECT 4        /* * r and a digit */
+#define TOKEN_IMMEDIATE 5       /* # and a number, maybe followed by other characters */
+#define TOKEN_BAD_IMMEDIATE 6   /* # without a number */
+#define TOKEN_BAD_INDIRECT 7    /* * that is not followed by a register */
+#define TOKEN_NUMBER 8          /* Only digits and signs, like the numbers of .data */
+#define TOKEN_NUMBER_PREFIX 9   /* Digits and signs followed by other characters */
+#define TOKEN_DIRECTIVE 10      /* Starts with a dot */
+#define TOKEN_OTHER 11          /* Anything else, it is never a legal operand */
+
+/* The flag of a token that follows the token before it on its line without white space in between */
+#define TOKEN_GLUED 1
+
+/* A token of the extended source. It is not copied, offset is where it starts in the text. */
+typedef struct {
+    size_t offset;          /* The first character of the token in the text */
+    unsigned short length;  /* Number of characters, a token is a part of one line */
+    unsigned char kind;     /* TOKEN_COMMA ... TOKEN_OTHER */
+    unsigned char flags;    /* TOKEN_GLUED or 0 */
+    int line;               /* The number of the line of the token, from 0 */
+} token;
+
+/* The tokens of a whole text, in the order of the text */
+typedef struct {
+    const char *text;   /* The text the tokens point into, it is not copied */
+    token *tokens;      /* The tokens */
+    int count;          /* Number of tokens */
+    int capacity;       /* Room in tokens */
+} token_list;
+
+/* Some consecutive tokens of a list, like the tokens of one line or the operands of an instruction */
+typedef struct {
+    const char *text;     /* The text the tokens point into */
+    const token *tokens;  /* The first token */
+    int count;            /* Number of tokens */
+} token_span;
+
+/*
+ * Splits the lines of a text into tokens, once for both passes. A line that is cut by
+ * the index is tokenized as the pieces the passes read.
+ *
+ * Parameters:
+ *   list - Receives the tokens, free it with free_token_list.
+ *   lines - The lines of the text.
+ *
+ * Returns:
+ *   1 on success, 0 if memory allocation failed.
+ */
+int tokenize_lines(token_list *list, const line_index *lines);
+
+/*
+ * Adds the tokens of more lines to a list, for a text that is tokenized a piece at a time.
+ * The pieces must end at the end of a line. The caller keeps the list's text pointing
+ * at the whole text, which the lines are a part of.
+ *
+ * Parameters:
+ *   list - The tokens of the pieces before, started by tokenize_lines.
+ *   lines - The lines of the next piece.
+ *   offset - Where the piece starts in the list's text.
+ *   first_line - The number of the piece's first line in the whole text.
+ *
+ * Returns:
+ *   1 on success, 0 if memory allocation failed (the list is then freed).
+ */
+int tokenize_more_lines(token_list *list, const line_index *lines, size_t offset, int first_line);
+
+/*
+ * Frees the tokens of a list.
+ *
+ * Parameters:
+ *   list - The list.
+ */
+void free_token_list(token_list *list);
+
+/*
+ * Finds the tokens of the line that starts with a given token. Lines without tokens
+ * (empty lines) are not in the list, so every line found has at least one token.
+ *
+ * Parameters:
+ *   list - The tokens.
+ *   first - The index of the first token of the line.
+ *   statement - Receives the tokens of the line.
+ *
+ * Returns:
+ *   The index of the first token of the next line.
+ */
+int next_statement(const token_list *list, int first, token_span *statement);
+
+/*
+ * Finds the next field of a span: the tokens that are not separated by white space,
+ * which is what next_word finds in a line. The end of the field is the index of the
+ * token after it.
+ *
+ * Parameters:
+ *   span - The tokens to search within.
+ *   first - The index of the token to start from.
+ *   field - Receives the field.
+ *
+ * Returns:
+ *   1 if a field was found, 0 if there are no tokens from first on.
+ */
+int next_field(const token_span *span, int first, word_view *field);
+
+/*
+ * Takes some of the tokens of a span.
+ *
+ * Parameters:
+ *   span - The tokens.
+ *   first - The index of the first token to take.
+ *   end - The index of the token after the last one to take.
+ *   part - Receives the tokens from first up to end.
+ */
+void sub_span(const token_span *span, int first, int end, token_span *part);
+
+/*
+ * Finds the text of a span, from its first token to the end of its last one,
+ * with the white space in between.
+ *
+ * Parameters:
+ *   span - The tokens.
+ *   text - Receives the text, its end is the number of tokens.
+ */
+void span_text(const token_span *span, word_view *text);
+
+/*
+ * Reads the number at the start of a token like atoi, after skipping some of its characters.
+ *
+ * Parameters:
+ *   text - The text the token points into.
+ *   number - The token.
+ *   skip - The number of characters before the number, 1 for the # of an immediate.
+ *
+ * Returns:
+ *   The number.
+ */
+int token_number(const char *text, const token *number, int skip);
+
+#endif
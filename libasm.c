@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "context.h"
+#include "assembler.h"
+#include "pre_assembler.h"
+#include "first_pass.h"
+#include "console.h"
+#include "fatal.h"
+#include "pipeline.h"
+
+#define PIPELINE_UNAVAILABLE -1 /* assemble_source_pipelined could not set up its stages */
+
+static pthread_key_t context_key; /* the context each thread is assembling with */
+static pthread_once_t context_key_once = PTHREAD_ONCE_INIT;
+
+static void create_context_key(void) {
+    pthread_key_create(&context_key, NULL);
+}
+
+asm_ctx *current_context(void) {
+    pthread_once(&context_key_once, create_context_key);
+    return pthread_getspecific(context_key);
+}
+
+void bind_current_context(asm_ctx *ctx) {
+    pthread_once(&context_key_once, create_context_key);
+    pthread_setspecific(context_key, ctx);
+}
+
+/* this function returns a new string of the base name followed by the extension */
+static char *file_name_with_extension(const char *base_name, const char *extension) {
+    char *name = malloc(strlen(base_name) + strlen(extension) + 1);
+    if (!name)
+        return NULL;
+    strcpy(name, base_name);
+    strcat(name, extension);
+    return name;
+}
+
+/* this function prints the result of the first pass and frees the names of the files.
+   returns the outcome of the source */
+static int report_first_pass(int first_pass_success, int verbose, char *as_file_name, char *am_file_name) {
+    /* Print the result of the first pass, the fast modes print only the errors and warnings themselves */
+    if (verbose && first_pass_success)
+        console_printf("First pass completed successfully for file: %s\n", am_file_name);
+    else if (verbose)
+        console_printf("First pass encountered errors for file: %s\n", am_file_name);
+
+    /* Free allocated memory */
+    free(as_file_name);
+    free(am_file_name);
+    return first_pass_success ? FILE_SUCCEEDED : FILE_HAS_ERRORS;
+}
+
+/* this function runs the whole pipeline (macro extension, first and second pass) on a source kept in memory.
+   the files it produces are stored in output, the caller writes them.
+   the fast modes (ASSEMBLE_CHECK and ASSEMBLE_SIZES) print only errors and warnings and produce no files.
+   the extended source is only one of the files if emit_expanded is set, both passes read it from memory.
+   the first pass of a large source may use up to jobs workers.
+   returns FILE_SUCCEEDED, or the reason the file failed */
+static int assemble_source(const char *input_file_name, const memory_file *source, assembly_output *output, int mode, int emit_expanded, int jobs) {
+    int verbose = mode == ASSEMBLE_FULL;
+    char *as_file_name, *am_file_name;
+    FILE *expanded_stream;
+    line_index lines;
+    token_list tokens;
+    int extended, tokenized, first_pass_success;
+
+    /* Prepare the name for the .as file (for macro extension) */
+    as_file_name = file_name_with_extension(input_file_name, ".as");
+    if (!as_file_name) {
+        console_printf("Memory allocation failed\n");
+        return FILE_ABORTED;
+    }
+
+    /* Print starting macro extension */
+    if (verbose)
+        console_printf("Starting macro extension for file: %s\n", as_file_name);
+
+    /* Call macro_extender, the .am file is kept even if it failed, as a hint where it stopped */
+    expanded_stream = open_memory_file_for_writing(&output -> expanded);
+    if (!expanded_stream) {
+        console_printf("Memory allocation failed\n");
+        free(as_file_name);
+        return FILE_ABORTED;
+    }
+    extended = macro_extender(source, expanded_stream);
+    fclose(expanded_stream);
+    output -> has_expanded = verbose && emit_expanded;
+    if (!extended) { /* the error was already printed */
+        free(as_file_name);
+        return FILE_HAS_ERRORS;
+    }
+    /* Print success of macro extension */
+    if (verbose)
+        console_printf("Macro extension succeeded for file: %s\n", as_file_name);
+
+    /* Prepare the name for the .am file (output from macro_extender) */
+    am_file_name = file_name_with_extension(input_file_name, ".am");
+    if (!am_file_name) {
+        console_printf("Memory allocation failed\n");
+        free(as_file_name);
+        return FILE_ABORTED;
+    }
+
+    /* Print starting first pass */
+    if (verbose)
+        console_printf("Starting first pass for file: %s\n", am_file_name);
+
+    /* Execute the first pass on the .am file, its tokens are found once for both passes */
+    if (!build_line_index(&lines, output -> expanded.data, output -> expanded.size, MAX_LINE_LENGTH)) {
+        console_printf("Memory allocation failed\n");
+        free(as_file_name);
+        free(am_file_name);
+        return FILE_ABORTED;
+    }
+    tokenized = tokenize_lines(&tokens, &lines);
+    free_line_index(&lines);
+    if (!tokenized) {
+        console_printf("Memory allocation failed\n");
+        free(as_file_name);
+        free(am_file_name);
+        return FILE_ABORTED;
+    }
+    first_pass_success = execute_first_pass(&tokens, am_file_name, output, mode, jobs);
+    free_token_list(&tokens);
+    if (!output -> has_expanded)
+        free_memory_file(&output -> expanded); /* only needed by the passes */
+    return report_first_pass(first_pass_success, verbose, as_file_name, am_file_name);
+}
+
+/* this function prints what a stage printed while it ran on another thread (or ahead of its turn) and frees it */
+static void print_stage_messages(console_buffer *messages) {
+    if (messages -> length > 0)
+        console_printf("%.*s", (int) messages -> length, messages -> text);
+    free(messages -> text);
+}
+
+/* this function is assemble_source with the macro extension and the first pass running at the same
+   time, on two threads connected by rings of line batches (see pipeline.h). the messages are printed
+   in the same order as by assemble_source, and the outputs are the same.
+   returns like assemble_source, or PIPELINE_UNAVAILABLE if the stages could not be set up (nothing was printed) */
+static int assemble_source_pipelined(const char *input_file_name, const memory_file *source, assembly_output *output, int mode, int emit_expanded) {
+    int verbose = mode == ASSEMBLE_FULL;
+    char *as_file_name, *am_file_name;
+    first_pass_state state;
+    pipeline_result stages;
+    token_list tokens;
+
+    as_file_name = file_name_with_extension(input_file_name, ".as");
+    am_file_name = file_name_with_extension(input_file_name, ".am");
+    if (!as_file_name || !am_file_name) {
+        free(as_file_name);
+        free(am_file_name);
+        return PIPELINE_UNAVAILABLE;
+    }
+    initialize_first_pass_state(&state, am_file_name);
+    if (!run_pipeline(source, &output -> expanded, &tokens, &state, mode, &stages)) {
+        free_first_pass_state(&state);
+        free(as_file_name);
+        free(am_file_name);
+        return PIPELINE_UNAVAILABLE;
+    }
+
+    /* the messages of the extension come first, as if the source was extended before it was read */
+    if (verbose)
+        console_printf("Starting macro extension for file: %s\n", as_file_name);
+    print_stage_messages(&stages.extension_messages);
+    if (stages.aborted) {
+        free(stages.pass_messages.text);
+        fatal_error();
+    }
+    output -> has_expanded = verbose && emit_expanded;
+    if (!stages.extended) { /* what the first pass found does not count */
+        free(stages.pass_messages.text);
+        free_first_pass_state(&state);
+        free_token_list(&tokens);
+        free(as_file_name);
+        free(am_file_name);
+        return FILE_HAS_ERRORS;
+    }
+    if (verbose) {
+        console_printf("Macro extension succeeded for file: %s\n", as_file_name);
+        console_printf("Starting first pass for file: %s\n", am_file_name);
+    }
+    print_stage_messages(&stages.pass_messages);
+
+    /* the second pass needs every label, it starts once all the lines were read */
+    if (stages.parsed)
+        finish_first_pass(&tokens, &state, output, mode);
+    else
+        free_first_pass_state(&state);
+    free_token_list(&tokens);
+    if (!output -> has_expanded)
+        free_memory_file(&output -> expanded);
+    return report_first_pass(stages.parsed, verbose, as_file_name, am_file_name);
+}
+
+/* this function assembles one source so that a fatal error (like running out of memory)
+   only stops this source. the memory the aborted source held is not recovered and
+   none of its outputs are kept */
+static int assemble_source_isolated(const char *input_file_name, const memory_file *source, assembly_output *output, int mode, int emit_expanded, int jobs, int pipelined) {
+    fatal_handler handler;
+    volatile int result = FILE_ABORTED; /* volatile, so the value survives the longjmp */
+
+    if (setjmp(handler.resume) == 0) {
+        fatal_handler_install(&handler);
+        result = pipelined ? assemble_source_pipelined(input_file_name, source, output, mode, emit_expanded) : PIPELINE_UNAVAILABLE;
+        if (result == PIPELINE_UNAVAILABLE)
+            result = assemble_source(input_file_name, source, output, mode, emit_expanded, jobs);
+    } else {
+        console_printf("Fatal error, stopped assembling file: %s\n", input_file_name);
+        initialize_assembly_output(output); /* the streams may still point into it, leave it alone */
+    }
+    fatal_handler_remove();
+    return result;
+}
+
+asm_ctx *asm_ctx_create(void) {
+    asm_ctx *ctx = malloc(sizeof(asm_ctx));
+    if (!ctx)
+        return NULL;
+    ctx -> name = NULL;
+    ctx -> dependencies.data = NULL;
+    ctx -> held_files = NULL;
+    ctx -> held_count = 0;
+    ctx -> held_capacity = 0;
+    asm_ctx_reset(ctx);
+    return ctx;
+}
+
+void asm_ctx_destroy(asm_ctx *ctx) {
+    if (!ctx)
+        return;
+    free(ctx -> name);
+    free_memory_file(&ctx -> dependencies);
+    release_context_files(ctx);
+    free(ctx -> held_files);
+    free(ctx);
+}
+
+void asm_ctx_reset(asm_ctx *ctx) {
+    free(ctx -> name);
+    ctx -> name = NULL;
+    ctx -> mode = ASSEMBLE_FULL;
+    ctx -> emit_expanded = 0;
+    ctx -> jobs = 1;
+    ctx -> pipelined = 0;
+    ctx -> macro_library = NULL;
+    ctx -> macro_budget = DEFAULT_MACRO_BUDGET;
+    ctx -> macro_profile = MACRO_PROFILE_OFF;
+    ctx -> emit_dependencies = 0;
+    free_memory_file(&ctx -> dependencies);
+    ctx -> illegal_macro_names = default_illegal_macro_names;
+    ctx -> illegal_macro_count = DEFAULT_ILLEGAL_MACRO_COUNT;
+    ctx -> error_sink = ctx -> warning_sink = NULL;
+    ctx -> message_sink = NULL;
+    ctx -> sink_data = NULL;
+}
+
+int asm_ctx_set_name(asm_ctx *ctx, const char *name) {
+    char *copy = malloc(strlen(name) + 1);
+    if (!copy)
+        return 0;
+    strcpy(copy, name);
+    free(ctx -> name);
+    ctx -> name = copy;
+    return 1;
+}
+
+void asm_ctx_set_mode(asm_ctx *ctx, int mode) {
+    ctx -> mode = mode;
+}
+
+void asm_ctx_set_emit_am(asm_ctx *ctx, int emit) {
+    ctx -> emit_expanded = emit;
+}
+
+void asm_ctx_set_jobs(asm_ctx *ctx, int jobs) {
+    ctx -> jobs = jobs > 0 ? jobs : 1;
+}
+
+void asm_ctx_set_pipeline(asm_ctx *ctx, int pipelined) {
+    ctx -> pipelined = pipelined;
+}
+
+void asm_ctx_set_macro_library(asm_ctx *ctx, const struct macro_library *library) {
+    ctx -> macro_library = library;
+}
+
+void asm_ctx_set_macro_budget(asm_ctx *ctx, long budget) {
+    ctx -> macro_budget = budget;
+}
+
+void asm_ctx_set_macro_profile(asm_ctx *ctx, int format) {
+    ctx -> macro_profile = format;
+}
+
+void asm_ctx_set_dependencies(asm_ctx *ctx, int emit) {
+    ctx -> emit_dependencies = emit;
+}
+
+void asm_ctx_set_sinks(asm_ctx *ctx, asm_diagnostic_sink error_sink, asm_diagnostic_sink warning_sink, asm_message_sink message_sink, void *data) {
+    ctx -> error_sink = error_sink;
+    ctx -> warning_sink = warning_sink;
+    ctx -> message_sink = message_sink;
+    ctx -> sink_data = data;
+}
+
+void add_context_dependency(asm_ctx *ctx, const char *path) {
+    size_t length = strlen(path), start;
+    char *grown;
+
+    if (!ctx)
+        return;
+    for (start = 0; start < ctx -> dependencies.size; start += strcspn(ctx -> dependencies.data + start, "\n") + 1)
+        if (strncmp(ctx -> dependencies.data + start, path, length) == 0 && ctx -> dependencies.data[start + length] == '\n')
+            return; /* included before */
+    grown = realloc(ctx -> dependencies.data, ctx -> dependencies.size + length + 2);
+    if (!grown) {
+        console_printf("Memory allocation failed\n");
+        fatal_error();
+    }
+    sprintf(grown + ctx -> dependencies.size, "%s\n", path);
+    ctx -> dependencies.data = grown;
+    ctx -> dependencies.size += length + 1;
+}
+
+const included_file *acquire_context_file(asm_ctx *ctx, const char *path) {
+    const included_file *file;
+
+    if (ctx && ctx -> held_count == ctx -> held_capacity) { /* room first, a failure then holds nothing */
+        int capacity = ctx -> held_capacity ? ctx -> held_capacity * 2 : MAX_INCLUDE_DEPTH;
+        const included_file **grown = realloc(ctx -> held_files, capacity * sizeof(included_file *));
+        if (!grown) {
+            console_printf("Memory allocation failed\n");
+            fatal_error();
+        }
+        ctx -> held_files = grown;
+        ctx -> held_capacity = capacity;
+    }
+    file = acquire_included_file(path);
+    if (ctx && file)
+        ctx -> held_files[ctx -> held_count++] = file;
+    return file;
+}
+
+void release_context_file(asm_ctx *ctx, const included_file *file) {
+    if (ctx && ctx -> held_count > 0 && ctx -> held_files[ctx -> held_count - 1] == file)
+        ctx -> held_count--;
+    release_included_file(file);
+}
+
+void release_context_files(asm_ctx *ctx) {
+    while (ctx -> held_count > 0)
+        release_included_file(ctx -> held_files[--ctx -> held_count]);
+}
+
+/* this function writes a name of a .d file, with the characters make would take apart escaped */
+static void write_dependency_name(FILE *stream, const char *name, size_t length) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        if (name[i] == ' ' || name[i] == '#')
+            fputc('\\', stream);
+        else if (name[i] == '$')
+            fputc('$', stream);
+        fputc(name[i], stream);
+    }
+}
+
+/* this function produces the .d output of a source: a rule that makes its .ob depend on the .as and the
+   files it included, and a rule without prerequisites for each included file, so make does not stop
+   when one of them is removed. returns 1 on success, 0 if memory allocation failed */
+static int produce_dependencies(const asm_ctx *ctx, assembly_output *out) {
+    const char *name = ctx -> name ? ctx -> name : ASM_DEFAULT_NAME, *included = ctx -> dependencies.data;
+    const char *end = included + ctx -> dependencies.size, *next;
+    FILE *stream = open_memory_file_for_writing(mark_produced(out, OUTPUT_DEPENDENCIES));
+
+    if (!stream)
+        return 0;
+    write_dependency_name(stream, name, strlen(name));
+    fputs(".ob: ", stream);
+    write_dependency_name(stream, name, strlen(name));
+    fputs(".as", stream);
+    for (next = included; next < end; next = strchr(next, '\n') + 1) {
+        fputc(' ', stream);
+        write_dependency_name(stream, next, strchr(next, '\n') - next);
+    }
+    fputc('\n', stream);
+    for (next = included; next < end; next = strchr(next, '\n') + 1) {
+        fputc('\n', stream);
+        write_dependency_name(stream, next, strchr(next, '\n') - next);
+        fputs(":\n", stream);
+    }
+    return fclose(stream) == 0;
+}
+
+int asm_assemble_buffer(asm_ctx *ctx, const char *source, size_t length, assembly_output *out) {
+    memory_file contents;
+    console_buffer messages = {NULL, 0, 0};
+    console_buffer *outer_capture = NULL;
+    asm_ctx *outer_context;
+    int result, threaded;
+
+    contents.data = (char *) source; /* only read */
+    contents.size = length;
+    initialize_assembly_output(out);
+
+    /* the context is bound to the thread, a context used from inside a sink is put back afterwards */
+    outer_context = current_context();
+    bind_current_context(ctx);
+    if (ctx -> message_sink) {
+        outer_capture = console_capture_current();
+        console_capture_begin(&messages);
+    }
+
+    /* the sinks are only called from the thread of the context */
+    threaded = !ctx -> error_sink && !ctx -> warning_sink;
+    free_memory_file(&ctx -> dependencies); /* the files included by the last source */
+    result = assemble_source_isolated(ctx -> name ? ctx -> name : ASM_DEFAULT_NAME, &contents, out, ctx -> mode, ctx -> emit_expanded,
+                                      threaded ? ctx -> jobs : 1, threaded && ctx -> pipelined);
+    release_context_files(ctx); /* the included files a fatal error did not let it give back */
+    if (result == FILE_SUCCEEDED && ctx -> emit_dependencies && ctx -> mode == ASSEMBLE_FULL && !produce_dependencies(ctx, out)) {
+        console_printf("Memory allocation failed\n");
+        free_assembly_output(out);
+        result = FILE_ABORTED;
+    }
+
+    if (ctx -> message_sink) {
+        console_capture_end();
+        if (outer_capture)
+            console_capture_begin(outer_capture);
+        ctx -> message_sink(ctx -> sink_data, messages.text ? messages.text : "", messages.length);
+        free(messages.text);
+    }
+    bind_current_context(outer_context);
+    return result;
+}
+
+const char *asm_ctx_included_files(const asm_ctx *ctx, size_t *length) {
+    *length = ctx -> dependencies.size;
+    return ctx -> dependencies.size > 0 ? ctx -> dependencies.data : NULL;
+}
@@ -0,0 +1,161 @@
+#ifndef LIBASM_H
+#define LIBASM_H
+
+#include <stddef.h>
+#include "memory_file.h"
+#include "batch.h"
+
+/*
+ * The assembler as a library (libasm.a). Everything one run needs is kept in a
+ * context, so several contexts can assemble at the same time on different
+ * threads. A context must only be used by one thread at a time.
+ *
+ *   asm_ctx *ctx = asm_ctx_create();
+ *   assembly_output out;
+ *   asm_ctx_set_name(ctx, "prog");
+ *   if (asm_assemble_buffer(ctx, source, length, &out) == FILE_SUCCEEDED)
+ *       ... out.object holds what would be prog.ob, see memory_file.h ...
+ *   free_assembly_output(&out);
+ *   asm_ctx_destroy(ctx);
+ */
+
+#define ASM_DEFAULT_NAME "source" /* The name of the source until asm_ctx_set_name is called */
+
+/* An assembler context, see context.h */
+typedef struct asm_ctx asm_ctx;
+
+/* A macro library opened with macro_library_open, see macro_library.h */
+struct macro_library;
+
+/* Receives one error or warning: the file and line it is about, and the message */
+typedef void (*asm_diagnostic_sink)(void *data, const char *file, int line, const char *message);
+
+/* Receives all the other messages of one source (progress, and errors without an error sink) */
+typedef void (*asm_message_sink)(void *data, const char *text, size_t length);
+
+/*
+ * Creates a context with the defaults: a full assembly (ASSEMBLE_FULL) without
+ * the .am output, named ASM_DEFAULT_NAME, and every message printed to the console.
+ *
+ * Returns:
+ *   The context, or NULL if memory allocation failed.
+ */
+asm_ctx *asm_ctx_create(void);
+
+/*
+ * Frees a context.
+ */
+void asm_ctx_destroy(asm_ctx *ctx);
+
+/*
+ * Puts a context back to the defaults of asm_ctx_create, so it can be reused
+ * for an unrelated source.
+ */
+void asm_ctx_reset(asm_ctx *ctx);
+
+/*
+ * Sets the name of the next sources, it is used in the messages
+ * ("<name>.as", "<name>.am") like the input file name of the command line.
+ *
+ * Returns:
+ *   1 on success, 0 if memory allocation failed (the name is not changed).
+ */
+int asm_ctx_set_name(asm_ctx *ctx, const char *name);
+
+/*
+ * Sets what is done with the sources: ASSEMBLE_FULL, ASSEMBLE_CHECK or ASSEMBLE_SIZES (see assembler.h).
+ */
+void asm_ctx_set_mode(asm_ctx *ctx, int mode);
+
+/*
+ * Makes the extended source (what would be the .am file) one of the outputs, or not (the default).
+ */
+void asm_ctx_set_emit_am(asm_ctx *ctx, int emit);
+
+/*
+ * Lets the first pass of a large source run on up to jobs threads (1, the default, for none):
+ * its lines are split into chunks that are read at the same time and then merged in order.
+ * The outputs and the messages are the same either way. With an error or a warning sink
+ * the pass always runs on the calling thread, so the sinks are never called from another thread.
+ */
+void asm_ctx_set_jobs(asm_ctx *ctx, int jobs);
+
+/*
+ * Runs the macro extension of each source on a thread of its own, while the calling thread
+ * reads the extended lines in the first pass as they come (0, the default, for one after the
+ * other). The outputs and the messages are the same either way. A large source is then not
+ * split for asm_ctx_set_jobs, and with an error or a warning sink it is never pipelined.
+ */
+void asm_ctx_set_pipeline(asm_ctx *ctx, int pipelined);
+
+/*
+ * Lets the sources call the macros of a library (see macro_library.h) without defining
+ * them, NULL (the default) for none. A macro the source defines itself is called instead
+ * of the library one with the same name, from its definition on. The library is not copied,
+ * it must stay open while the context uses it, and several contexts may share it.
+ */
+void asm_ctx_set_macro_library(asm_ctx *ctx, const struct macro_library *library);
+
+/*
+ * Sets how many lines one macro call may expand to, the lines of the macros it calls
+ * included (DEFAULT_MACRO_BUDGET in pre_assembler.h by default). A call that expands
+ * to more is an error, so a few macros that call each other can not grow the source
+ * exponentially.
+ */
+void asm_ctx_set_macro_budget(asm_ctx *ctx, long budget);
+
+/*
+ * Prints a profile of the macros after the macro extension of each source: for every macro,
+ * where it is defined, the lines of the source that call it, the lines and characters those
+ * calls wrote to the extended source (the macros they call included) and their share of it,
+ * then the characters of its own lines alone and their share, which add up to at most 100%
+ * over the macros. The macros that wrote the most come first. format is MACRO_PROFILE_TEXT,
+ * MACRO_PROFILE_JSON or MACRO_PROFILE_OFF (the default), see pre_assembler.h. It goes to the
+ * messages of the source.
+ */
+void asm_ctx_set_macro_profile(asm_ctx *ctx, int format);
+
+/*
+ * Makes a dependency file (.d, like the one of "cc -MD") one of the outputs of a source that
+ * assembled without errors, or not (the default). It makes the .ob depend on the .as and on
+ * every file the source included with .include.
+ */
+void asm_ctx_set_dependencies(asm_ctx *ctx, int emit);
+
+/*
+ * Sends the messages of the context to callbacks instead of the console.
+ * Any of them may be NULL, the messages it would get are then printed as usual.
+ *
+ * Parameters:
+ *   ctx - The context.
+ *   error_sink - Receives the errors.
+ *   warning_sink - Receives the warnings.
+ *   message_sink - Receives the other messages, once per source.
+ *   data - Passed to every callback.
+ */
+void asm_ctx_set_sinks(asm_ctx *ctx, asm_diagnostic_sink error_sink, asm_diagnostic_sink warning_sink, asm_message_sink message_sink, void *data);
+
+/*
+ * Assembles a source kept in memory. Nothing is read from or written to disk.
+ * A fatal error (like running out of memory) only stops this source.
+ *
+ * Parameters:
+ *   ctx - The context.
+ *   source - The source code, as in a .as file.
+ *   length - Number of bytes in source.
+ *   out - Receives the outputs, free them with free_assembly_output.
+ *
+ * Returns:
+ *   FILE_SUCCEEDED, FILE_HAS_ERRORS or FILE_ABORTED (see batch.h).
+ */
+int asm_assemble_buffer(asm_ctx *ctx, const char *source, size_t length, assembly_output *out);
+
+/*
+ * Returns the files the last source assembled with the context included with .include
+ * (the one that could not be read too), one path per line, and sets length to the bytes
+ * of the list. The paths are relative to the directory the source was named from.
+ * NULL if it included none. The list is valid until the next source is assembled.
+ */
+const char *asm_ctx_included_files(const asm_ctx *ctx, size_t *length);
+
+#endif
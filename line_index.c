@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "line_index.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(LINE_INDEX_SCALAR)
+#define LINE_INDEX_SIMD
+#include <immintrin.h>
+#endif
+
+#define INITIAL_LINE_COUNT 64
+#define SCAN_BLOCK 32  /* Bytes behind one mask, bit i is byte i */
+#define SCAN_GROUP 64  /* Blocks scanned in one call of the scanner */
+
+/* isspace of the "C" locale, without a call per character */
+#define IS_WHITE_SPACE(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+
+/* Finds the new lines and null characters of count blocks of SCAN_BLOCK bytes, one mask per block.
+   a null character hides the new line after it from strchr, so such a line counts as too long */
+typedef void (*new_line_scanner)(const char *text, size_t count, unsigned long *masks);
+
+static new_line_scanner scan_new_lines;
+static pthread_once_t scanner_once = PTHREAD_ONCE_INIT;
+
+static void scan_new_lines_scalar(const char *text, size_t count, unsigned long *masks) {
+    size_t block;
+    int i;
+    for (block = 0; block < count; block++, text += SCAN_BLOCK) {
+        unsigned long mask = 0;
+        for (i = 0; i < SCAN_BLOCK; i++)
+            if (text[i] == '\n' || text[i] == '\0')
+                mask |= 1UL << i;
+        masks[block] = mask;
+    }
+}
+
+#ifdef LINE_INDEX_SIMD
+__attribute__((target("sse2")))
+static void scan_new_lines_sse2(const char *text, size_t count, unsigned long *masks) {
+    const __m128i new_line = _mm_set1_epi8('\n'), null = _mm_setzero_si128();
+    size_t block;
+    for (block = 0; block < count; block++, text += SCAN_BLOCK) {
+        __m128i low = _mm_loadu_si128((const __m128i *) text), high = _mm_loadu_si128((const __m128i *) (text + 16));
+        unsigned int low_mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(low, new_line), _mm_cmpeq_epi8(low, null)));
+        unsigned int high_mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(high, new_line), _mm_cmpeq_epi8(high, null)));
+        masks[block] = (unsigned long) low_mask | (unsigned long) high_mask << 16;
+    }
+}
+
+__attribute__((target("avx2")))
+static void scan_new_lines_avx2(const char *text, size_t count, unsigned long *masks) {
+    const __m256i new_line = _mm256_set1_epi8('\n'), null = _mm256_setzero_si256();
+    size_t block;
+    for (block = 0; block < count; block++, text += SCAN_BLOCK) {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *) text);
+        masks[block] = (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(bytes, new_line), _mm256_cmpeq_epi8(bytes, null)));
+    }
+}
+#endif
+
+/* this function picks the fastest scanner the processor supports, once per process */
+static void choose_scanner(void) {
+    scan_new_lines = scan_new_lines_scalar;
+#ifdef LINE_INDEX_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        scan_new_lines = scan_new_lines_avx2;
+    else if (__builtin_cpu_supports("sse2"))
+        scan_new_lines = scan_new_lines_sse2;
+#endif
+}
+
+/* this function returns the number of the lowest bit set in a mask which is not 0 */
+static int lowest_bit(unsigned long mask) {
+#ifdef __GNUC__
+    return __builtin_ctzl(mask);
+#else
+    int bit = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+/* this function decides what a line is from its first character after the white space,
+   the way the pre assembler reads it: a null character ends the line as it ends the string */
+static unsigned char classify_line(const char *line, const char *end) {
+    while (line < end && IS_WHITE_SPACE(*line))
+        line++;
+    if (line == end || *line == '\0')
+        return LINE_BLANK;
+    return *line == ';' ? LINE_COMMENT : LINE_TEXT;
+}
+
+/* this function adds the line from start to end, its kind is found here.
+   returns 1 on success, 0 if memory allocation failed */
+static int add_line(line_index *index, int *capacity, size_t start, size_t end, int too_long) {
+    if (index -> count == *capacity) {
+        size_t *new_starts = realloc(index -> starts, (*capacity * 2 + 1) * sizeof(size_t));
+        unsigned char *new_kinds;
+        if (!new_starts)
+            return 0;
+        index -> starts = new_starts;
+        new_kinds = realloc(index -> kinds, *capacity * 2);
+        if (!new_kinds)
+            return 0;
+        index -> kinds = new_kinds;
+        *capacity *= 2;
+    }
+    index -> kinds[index -> count] = classify_line(index -> text + start, index -> text + end);
+    if (too_long) {
+        index -> kinds[index -> count] |= LINE_TOO_LONG;
+        if (index -> first_long_line < 0)
+            index -> first_long_line = index -> count;
+    }
+    index -> starts[index -> count++] = start;
+    return 1;
+}
+
+/* this function adds the lines from start up to end, just after a new line or at the end of the text (at_end).
+   a line longer than the buffer is cut in pieces like fgets would. null_end is just after the last
+   null character seen, or 0. returns 0 if memory allocation failed */
+static int add_lines_until(line_index *index, int *capacity, size_t *start, size_t end, int at_end, size_t null_end) {
+    size_t limit = index -> buffer_size - 1;
+    while (end - *start > limit) { /* does not fit: fgets stops before the new line */
+        if (!add_line(index, capacity, *start, *start + limit, 1))
+            return 0;
+        *start += limit;
+    }
+    if (end > *start) {
+        /* the last piece is only too long if it filled the buffer without a new line,
+           or if strchr would not find its new line */
+        if (!add_line(index, capacity, *start, end, at_end ? end - *start == limit : null_end > *start))
+            return 0;
+        *start = end;
+    }
+    return 1;
+}
+
+int build_line_index(line_index *index, const char *text, size_t size, size_t buffer_size) {
+    unsigned long masks[SCAN_GROUP];
+    char tail[SCAN_BLOCK];
+    size_t start = 0, position = 0, full_blocks = size / SCAN_BLOCK, block = 0, null_end = 0;
+    int capacity = INITIAL_LINE_COUNT;
+
+    pthread_once(&scanner_once, choose_scanner);
+    index -> text = text;
+    index -> count = 0;
+    index -> buffer_size = buffer_size;
+    index -> first_long_line = -1;
+    index -> starts = malloc((capacity + 1) * sizeof(size_t));
+    index -> kinds = malloc(capacity);
+    if (!index -> starts || !index -> kinds) {
+        free_line_index(index);
+        return 0;
+    }
+
+    /* the new lines are found a group of blocks at a time, the last partial block from a padded copy */
+    while (position < size) {
+        size_t count, i;
+        if (block < full_blocks) {
+            count = full_blocks - block < SCAN_GROUP ? full_blocks - block : SCAN_GROUP;
+            scan_new_lines(text + position, count, masks);
+        } else {
+            memset(tail, 0, sizeof(tail));
+            memcpy(tail, text + position, size - position);
+            count = 1;
+            scan_new_lines(tail, count, masks);
+            masks[0] &= (1UL << (size - position)) - 1; /* not the padding */
+        }
+        for (i = 0; i < count; i++, position += SCAN_BLOCK) {
+            unsigned long mask = masks[i];
+            while (mask) {
+                size_t found = position + lowest_bit(mask);
+                if (text[found] == '\0') {
+                    null_end = found + 1;
+                } else if (!add_lines_until(index, &capacity, &start, found + 1, 0, null_end)) {
+                    free_line_index(index);
+                    return 0;
+                }
+                mask &= mask - 1;
+            }
+        }
+        block += count;
+    }
+    /* the text does not have to end with a new line */
+    if (!add_lines_until(index, &capacity, &start, size, 1, null_end)) {
+        free_line_index(index);
+        return 0;
+    }
+    index -> starts[index -> count] = size;
+    return 1;
+}
+
+void free_line_index(line_index *index) {
+    free(index -> starts);
+    free(index -> kinds);
+    index -> starts = NULL;
+    index -> kinds = NULL;
+    index -> count = 0;
+}
+
+size_t read_indexed_line(const line_index *index, int number, char *buffer) {
+    size_t length = index -> starts[number + 1] - index -> starts[number];
+    memcpy(buffer, index -> text + index -> starts[number], length);
+    buffer[length] = '\0';
+    return length;
+}
@@ -0,0 +1,60 @@
+#ifndef LINE_INDEX_H
+#define LINE_INDEX_H
+
+#include <stddef.h>
+
+/* The lines of a text kept in memory. The text is scanned once, then any
+   line can be read without going through the ones before it, so several
+   passes share one index. A line is cut where fgets with a buffer of
+   buffer_size bytes would cut it, so a reader sees exactly what fgets returned.
+   The scan that finds the new lines also sorts out the lines the pre
+   assembler skips and the ones that do not fit the buffer. */
+typedef struct {
+    const char *text;         /* The text (not owned) */
+    size_t *starts;           /* Where each line starts, starts[count] is the end of the text */
+    unsigned char *kinds;     /* The kind of each line (LINE_TEXT, LINE_BLANK or LINE_COMMENT) and LINE_TOO_LONG */
+    int count;                /* Number of lines */
+    int first_long_line;      /* The first line with LINE_TOO_LONG, -1 if none */
+    size_t buffer_size;       /* A line is at most buffer_size - 1 bytes */
+} line_index;
+
+/* The kinds of lines */
+#define LINE_TEXT 0           /* Anything else */
+#define LINE_BLANK 1          /* Only white space */
+#define LINE_COMMENT 2        /* The first character after the white space is ';' */
+#define LINE_KIND_MASK 3      /* The bits of the kind */
+#define LINE_TOO_LONG 4       /* Did not fit the buffer: fgets would neither have reached a new line nor the end of the text */
+
+/*
+ * Finds the lines of a text in one scan, with SSE2 or AVX2 when the processor has them.
+ *
+ * Parameters:
+ *   index - Receives the lines.
+ *   text - The text, it must stay unchanged while the index is used.
+ *   size - Number of bytes in the text.
+ *   buffer_size - The size of the buffer a line is read into, at least 2.
+ *
+ * Returns:
+ *   1 on success, 0 if memory allocation failed.
+ */
+int build_line_index(line_index *index, const char *text, size_t size, size_t buffer_size);
+
+/*
+ * Frees the lines of an index.
+ */
+void free_line_index(line_index *index);
+
+/*
+ * Copies a line into a buffer of the index's buffer_size bytes and null terminates it, like fgets.
+ *
+ * Parameters:
+ *   index - The lines.
+ *   number - The line, from 0.
+ *   buffer - Receives the line.
+ *
+ * Returns:
+ *   The number of bytes copied.
+ */
+size_t read_indexed_line(const line_index *index, int number, char *buffer);
+
+#endif
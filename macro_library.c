@@ -0,0 +1,226 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "macro_library.h"
+
+/* this function returns the lines of a macro as a call writes them: flattened if flatten_macros ran */
+static const char *macro_lines(const MacroTable *table, const Macro *macro, size_t *length) {
+    if (macro -> expanded) {
+        *length = macro -> expanded_length;
+        return table -> bodies + macro -> expanded_offset;
+    }
+    *length = macro -> length;
+    return table -> bodies + macro -> offset;
+}
+
+/* this function writes the whole library: the header, the filter, the bodies and the index.
+   the macros are numbered in the order of their definitions, a name defined again is left out */
+static int write_library(FILE *file, const MacroTable *table) {
+    unsigned long bucket_count, macro_count = 0, name_offset, body_offset, i;
+    unsigned char header[MACRO_LIBRARY_HEADER_SIZE], filter[MACRO_FILTER_BITS / 8];
+    const Macro **buckets, **macros, *macro;
+    unsigned long *numbers;
+    size_t length;
+    int success;
+
+    for (macro = table -> head; macro; macro = macro -> next)
+        macro_count++;
+    bucket_count = indexed_bucket_count(macro_count);
+    buckets = calloc(bucket_count, sizeof(Macro *));
+    numbers = calloc(bucket_count, sizeof(unsigned long));
+    macros = calloc(macro_count > 0 ? macro_count : 1, sizeof(Macro *));
+    if (!buckets || !numbers || !macros) {
+        free(buckets);
+        free(numbers);
+        free(macros);
+        errno = ENOMEM;
+        return 0;
+    }
+
+    /* the hash table, the buckets hold the number of the macro + 1 */
+    memset(filter, 0, sizeof(filter));
+    macro_count = 0;
+    for (macro = table -> head; macro; macro = macro -> next) {
+        unsigned long hash = hash_macro_name(macro -> name, strlen(macro -> name)), bucket = hash & (bucket_count - 1);
+        while (buckets[bucket] && strcmp(buckets[bucket] -> name, macro -> name) != 0)
+            bucket = (bucket + 1) & (bucket_count - 1);
+        if (buckets[bucket])
+            continue;
+        buckets[bucket] = macro;
+        macros[macro_count] = macro;
+        numbers[bucket] = ++macro_count;
+        add_to_macro_filter(filter, hash);
+    }
+
+    body_offset = MACRO_LIBRARY_BODIES_OFFSET;
+    for (i = 0; i < macro_count; i++) {
+        macro_lines(table, macros[i], &length);
+        body_offset += length;
+    }
+    memcpy(header, MACRO_LIBRARY_MAGIC, MACRO_LIBRARY_NUMBER_SIZE);
+    put_indexed_number(header + MACRO_LIBRARY_NUMBER_SIZE, body_offset);
+    put_indexed_number(header + 2 * MACRO_LIBRARY_NUMBER_SIZE, macro_count);
+    put_indexed_number(header + 3 * MACRO_LIBRARY_NUMBER_SIZE, bucket_count);
+    success = fwrite(header, 1, sizeof(header), file) == sizeof(header) && fwrite(filter, 1, sizeof(filter), file) == sizeof(filter);
+    for (i = 0; i < macro_count && success; i++) {
+        const char *lines = macro_lines(table, macros[i], &length);
+        success = fwrite(lines, 1, length, file) == length;
+    }
+    for (i = 0; i < bucket_count && success; i++)
+        success = write_indexed_number(file, numbers[i]);
+
+    name_offset = body_offset + bucket_count * MACRO_LIBRARY_NUMBER_SIZE + macro_count * MACRO_LIBRARY_MACRO_SIZE;
+    body_offset = MACRO_LIBRARY_BODIES_OFFSET;
+    for (i = 0; i < macro_count && success; i++) {
+        macro_lines(table, macros[i], &length);
+        success = write_indexed_number(file, name_offset) && write_indexed_number(file, strlen(macros[i] -> name)) &&
+                  write_indexed_number(file, body_offset) && write_indexed_number(file, length);
+        name_offset += strlen(macros[i] -> name);
+        body_offset += length;
+    }
+    for (i = 0; i < macro_count && success; i++)
+        success = fwrite(macros[i] -> name, 1, strlen(macros[i] -> name), file) == strlen(macros[i] -> name);
+
+    free(buckets);
+    free(numbers);
+    free(macros);
+    return success;
+}
+
+int macro_library_write(const char *path, const MacroTable *table) {
+    char *temporary_path = malloc(strlen(path) + 32);
+    FILE *file;
+    int success, error;
+
+    if (!temporary_path) {
+        errno = ENOMEM;
+        return 0;
+    }
+    sprintf(temporary_path, "%s.tmp.%ld", path, (long) getpid());
+    file = fopen(temporary_path, "wb");
+    if (!file) {
+        free(temporary_path);
+        return 0;
+    }
+    success = write_library(file, table);
+    error = errno;
+    if (ferror(file) | fclose(file)) {
+        if (success)
+            error = errno;
+        success = 0;
+    }
+    if (success && rename(temporary_path, path) < 0) {
+        error = errno;
+        success = 0;
+    }
+    if (!success)
+        unlink(temporary_path);
+    free(temporary_path);
+    errno = error;
+    return success;
+}
+
+static const unsigned char *macro_record(const macro_library *library, unsigned long macro) {
+    return library -> data + library -> index_offset + library -> bucket_count * MACRO_LIBRARY_NUMBER_SIZE + macro * MACRO_LIBRARY_MACRO_SIZE;
+}
+
+/* this function checks that the index and the name and body of every macro are inside the library */
+static int valid_library(const macro_library *library) {
+    unsigned long macro;
+
+    if (library -> bucket_count == 0 || (library -> bucket_count & (library -> bucket_count - 1)) != 0 || library -> macro_count >= library -> bucket_count)
+        return 0;
+    if (!indexed_table_inside(library -> size, library -> index_offset, library -> bucket_count, MACRO_LIBRARY_NUMBER_SIZE) ||
+        !indexed_table_inside(library -> size, library -> index_offset + library -> bucket_count * MACRO_LIBRARY_NUMBER_SIZE, library -> macro_count, MACRO_LIBRARY_MACRO_SIZE))
+        return 0;
+    for (macro = 0; macro < library -> macro_count; macro++) {
+        const unsigned char *record = macro_record(library, macro);
+        if (!indexed_range_inside(library -> size, get_indexed_number(record), get_indexed_number(record + MACRO_LIBRARY_NUMBER_SIZE)) ||
+            !indexed_range_inside(library -> size, get_indexed_number(record + 2 * MACRO_LIBRARY_NUMBER_SIZE), get_indexed_number(record + 3 * MACRO_LIBRARY_NUMBER_SIZE)))
+            return 0;
+    }
+    return 1;
+}
+
+int macro_library_open(macro_library *library, const char *path) {
+    struct stat info;
+    void *data;
+    int descriptor = open(path, O_RDONLY);
+
+    if (descriptor < 0)
+        return 0;
+    if (fstat(descriptor, &info) < 0) {
+        close(descriptor);
+        return 0;
+    }
+    if ((size_t) info.st_size < MACRO_LIBRARY_BODIES_OFFSET) {
+        close(descriptor);
+        errno = EINVAL;
+        return 0;
+    }
+    data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    close(descriptor);
+    if (data == MAP_FAILED)
+        return 0;
+
+    library -> data = data;
+    library -> size = info.st_size;
+    library -> index_offset = get_indexed_number(library -> data + MACRO_LIBRARY_NUMBER_SIZE);
+    library -> macro_count = get_indexed_number(library -> data + 2 * MACRO_LIBRARY_NUMBER_SIZE);
+    library -> bucket_count = get_indexed_number(library -> data + 3 * MACRO_LIBRARY_NUMBER_SIZE);
+    if (memcmp(library -> data, MACRO_LIBRARY_MAGIC, MACRO_LIBRARY_NUMBER_SIZE) != 0 || !valid_library(library)) {
+        macro_library_close(library);
+        errno = EINVAL;
+        return 0;
+    }
+    return 1;
+}
+
+void macro_library_close(macro_library *library) {
+    munmap((void *) library -> data, library -> size);
+    library -> data = NULL;
+    library -> size = 0;
+}
+
+const unsigned char *macro_library_filter(const macro_library *library) {
+    return library -> data + MACRO_LIBRARY_HEADER_SIZE;
+}
+
+unsigned long macro_library_number(const macro_library *library, const char *name, int length, unsigned long hash) {
+    unsigned long bucket = hash & (library -> bucket_count - 1), probes;
+    size_t name_length;
+
+    for (probes = 0; probes < library -> bucket_count; probes++) {
+        unsigned long number = get_indexed_number(library -> data + library -> index_offset + bucket * MACRO_LIBRARY_NUMBER_SIZE);
+        const char *macro_name;
+        if (number == 0 || number > library -> macro_count)
+            return 0;
+        macro_name = macro_library_name(library, number - 1, &name_length);
+        if (name_length == (size_t) length && memcmp(macro_name, name, length) == 0)
+            return number;
+        bucket = (bucket + 1) & (library -> bucket_count - 1);
+    }
+    return 0;
+}
+
+const char *macro_library_find(const macro_library *library, const char *name, int length, unsigned long hash, size_t *body_length) {
+    unsigned long number = macro_library_number(library, name, length, hash);
+    return number ? macro_library_body(library, number - 1, body_length) : NULL;
+}
+
+const char *macro_library_name(const macro_library *library, unsigned long macro, size_t *length) {
+    const unsigned char *record = macro_record(library, macro);
+    *length = get_indexed_number(record + MACRO_LIBRARY_NUMBER_SIZE);
+    return (const char *) library -> data + get_indexed_number(record);
+}
+
+const char *macro_library_body(const macro_library *library, unsigned long macro, size_t *length) {
+    const unsigned char *record = macro_record(library, macro);
+    *length = get_indexed_number(record + 3 * MACRO_LIBRARY_NUMBER_SIZE);
+    return (const char *) library -> data + get_indexed_number(record + 2 * MACRO_LIBRARY_NUMBER_SIZE);
+}
@@ -0,0 +1,109 @@
+#ifndef MACRO_LIBRARY_H
+#define MACRO_LIBRARY_H
+
+#include <stddef.h>
+#include "pre_assembler.h"
+#include "indexed_file.h"
+
+/*
+ * A macro library (.mlib) holds macro definitions compiled ahead of time, so the
+ * sources that use them do not define them again. It is mapped into memory and
+ * used as it is, nothing is parsed when it is opened. All numbers are 8 byte
+ * little endian.
+ *
+ *   header   - MACRO_LIBRARY_MAGIC, the offset of the index, the number of macros
+ *              and the number of buckets.
+ *   filter   - the prefilter of the names (see MacroTable), MACRO_FILTER_BITS bits.
+ *   bodies   - the lines of the macros as a call writes them to the extended source,
+ *              one macro after the other. The macros they call are already expanded.
+ *   index    - the buckets: a hash table of the macros by name, each bucket is
+ *              0 (empty) or the number of a macro + 1. Collisions go on to the
+ *              next bucket, so a lookup reads about one bucket.
+ *              then the macros: the offset and length of the name, then the
+ *              offset and length of the body.
+ *              then the names.
+ */
+#define MACRO_LIBRARY_MAGIC "ASMMLB\n\001"    /* The first 8 bytes of every macro library */
+#define MACRO_LIBRARY_NUMBER_SIZE INDEXED_NUMBER_SIZE /* Bytes in every number */
+#define MACRO_LIBRARY_HEADER_SIZE (4 * MACRO_LIBRARY_NUMBER_SIZE)
+#define MACRO_LIBRARY_BODIES_OFFSET (MACRO_LIBRARY_HEADER_SIZE + MACRO_FILTER_BITS / 8)
+#define MACRO_LIBRARY_MACRO_SIZE (4 * MACRO_LIBRARY_NUMBER_SIZE)
+
+/* A macro library opened for reading, mapped into memory */
+typedef struct macro_library {
+    const unsigned char *data;    /* The whole library */
+    size_t size;
+    unsigned long macro_count;
+    unsigned long bucket_count;
+    unsigned long index_offset;
+} macro_library;
+
+/*
+ * Writes the macros of a table as a library. A name defined twice keeps its first
+ * definition, like a call in the source does. The library is written under a
+ * temporary name and only replaces path once it is complete, so an assembler that
+ * has the old one open is not disturbed.
+ *
+ * Parameters:
+ *   path - Where the library goes.
+ *   table - The macros, filled by collect_macros. If flatten_macros ran on it, the
+ *           flattened lines are written.
+ *
+ * Returns:
+ *   1 on success, 0 on failure (errno tells why).
+ */
+int macro_library_write(const char *path, const MacroTable *table);
+
+/*
+ * Opens a macro library for reading.
+ *
+ * Returns:
+ *   1 on success, 0 if it can not be read or is not a macro library (errno tells why).
+ */
+int macro_library_open(macro_library *library, const char *path);
+
+/*
+ * Closes a macro library opened for reading.
+ */
+void macro_library_close(macro_library *library);
+
+/*
+ * Returns the prefilter of the names in a library, see may_be_macro.
+ */
+const unsigned char *macro_library_filter(const macro_library *library);
+
+/*
+ * Finds a macro by name through the hash index.
+ *
+ * Parameters:
+ *   library - The library.
+ *   name - The name, it does not have to be null terminated.
+ *   length - Number of characters in the name.
+ *   hash - hash_macro_name of the name.
+ *   body_length - Receives the length of the body.
+ *
+ * Returns:
+ *   The body of the macro (it points into the library and is not null terminated),
+ *   or NULL if the library does not have it.
+ */
+const char *macro_library_find(const macro_library *library, const char *name, int length, unsigned long hash, size_t *body_length);
+
+/*
+ * Finds the number of a macro by name, like macro_library_find.
+ *
+ * Returns:
+ *   The number of the macro + 1, or 0 if the library does not have it.
+ */
+unsigned long macro_library_number(const macro_library *library, const char *name, int length, unsigned long hash);
+
+/*
+ * Returns the name of a macro (not null terminated) and its length.
+ */
+const char *macro_library_name(const macro_library *library, unsigned long macro, size_t *length);
+
+/*
+ * Returns the body of a macro (not null terminated) and its length.
+ */
+const char *macro_library_body(const macro_library *library, unsigned long macro, size_t *length);
+
+#endif
@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include "memory_file.h"
+
+static char empty_file[1]; /* what an empty memory file is read from */
+
+/* the extension of each output file, in the order they are written */
+static const char *output_extensions[OUTPUT_KINDS] = {".am", ".ob", ".ent", ".ext", ".d"};
+
+FILE *open_memory_file_for_reading(const memory_file *file) {
+    /* fmemopen may refuse a NULL buffer, even for an empty file */
+    if (!file -> data || file -> size == 0)
+        return fmemopen(empty_file, 0, "r");
+    return fmemopen(file -> data, file -> size, "r");
+}
+
+FILE *open_memory_file_for_writing(memory_file *file) {
+    free_memory_file(file);
+    return open_memstream(&file -> data, &file -> size);
+}
+
+int read_memory_file(FILE *stream, memory_file *file) {
+    char chunk[4096];
+    size_t count;
+    FILE *contents = open_memory_file_for_writing(file);
+
+    if (!contents)
+        return 0;
+    while ((count = fread(chunk, 1, sizeof(chunk), stream)) > 0)
+        fwrite(chunk, 1, count, contents);
+    return (fclose(contents) == 0) & !ferror(stream);
+}
+
+void free_memory_file(memory_file *file) {
+    free(file -> data);
+    file -> data = NULL;
+    file -> size = 0;
+}
+
+void initialize_assembly_output(assembly_output *output) {
+    output -> expanded.data = output -> object.data = output -> entries.data = output -> externals.data = output -> dependencies.data = NULL;
+    output -> expanded.size = output -> object.size = output -> entries.size = output -> externals.size = output -> dependencies.size = 0;
+    output -> has_expanded = output -> has_object = output -> has_entries = output -> has_externals = output -> has_dependencies = 0;
+}
+
+void free_assembly_output(assembly_output *output) {
+    free_memory_file(&output -> expanded);
+    free_memory_file(&output -> object);
+    free_memory_file(&output -> entries);
+    free_memory_file(&output -> externals);
+    free_memory_file(&output -> dependencies);
+    initialize_assembly_output(output);
+}
+
+const char *output_extension(int kind) {
+    return output_extensions[kind];
+}
+
+memory_file *produced_file(assembly_output *output, int kind) {
+    switch (kind) {
+        case 0:
+            return output -> has_expanded ? &output -> expanded : NULL;
+        case 1:
+            return output -> has_object ? &output -> object : NULL;
+        case 2:
+            return output -> has_entries ? &output -> entries : NULL;
+        case 3:
+            return output -> has_externals ? &output -> externals : NULL;
+        default:
+            return output -> has_dependencies ? &output -> dependencies : NULL;
+    }
+}
+
+memory_file *mark_produced(assembly_output *output, int kind) {
+    switch (kind) {
+        case 0:
+            output -> has_expanded = 1;
+            return &output -> expanded;
+        case 1:
+            output -> has_object = 1;
+            return &output -> object;
+        case 2:
+            output -> has_entries = 1;
+            return &output -> entries;
+        case 3:
+            output -> has_externals = 1;
+            return &output -> externals;
+        default:
+            output -> has_dependencies = 1;
+            return &output -> dependencies;
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef MEMORY_FILE_H
+#define MEMORY_FILE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define OUTPUT_KINDS 5 /* .am, .ob, .ent, .ext and .d */
+#define OUTPUT_DEPENDENCIES 4 /* The kind of the .d file */
+
+/* The contents of a file, kept in memory */
+typedef struct {
+    char *data;    /* The bytes of the file (allocated with malloc) */
+    size_t size;   /* Number of bytes */
+} memory_file;
+
+/* Everything the assembler produces for one source file. A file that was
+   not produced (e.g. no .ent because there are no entries) is marked as such. */
+typedef struct {
+    memory_file expanded;     /* The .am file, the source after macro extension */
+    memory_file object;       /* The .ob file */
+    memory_file entries;      /* The .ent file */
+    memory_file externals;    /* The .ext file */
+    memory_file dependencies; /* The .d file, the files the .ob depends on in the syntax of make */
+    int has_expanded;         /* 1 if the .am file was produced */
+    int has_object;           /* 1 if the .ob file was produced */
+    int has_entries;          /* 1 if the .ent file was produced */
+    int has_externals;        /* 1 if the .ext file was produced */
+    int has_dependencies;     /* 1 if the .d file was produced */
+} assembly_output;
+
+/*
+ * Opens a memory file as a read only stream.
+ *
+ * Returns:
+ *   The stream, or NULL on failure.
+ */
+FILE *open_memory_file_for_reading(const memory_file *file);
+
+/*
+ * Opens a stream whose contents end up in the memory file.
+ * The file's data and size are valid after the stream is closed.
+ *
+ * Returns:
+ *   The stream, or NULL on failure.
+ */
+FILE *open_memory_file_for_writing(memory_file *file);
+
+/*
+ * Reads a whole stream, e.g. the standard input, into a memory file.
+ *
+ * Returns:
+ *   1 on success, 0 if the stream could not be read or memory allocation failed.
+ */
+int read_memory_file(FILE *stream, memory_file *file);
+
+/*
+ * Frees the contents of a memory file and makes it empty.
+ */
+void free_memory_file(memory_file *file);
+
+/*
+ * Initializes an output with no files.
+ */
+void initialize_assembly_output(assembly_output *output);
+
+/*
+ * Frees all the files of an output.
+ */
+void free_assembly_output(assembly_output *output);
+
+/*
+ * Returns the extension of an output file kind (".am", ".ob", ".ent", ".ext" or ".d").
+ *
+ * Parameters:
+ *   kind - A number between 0 and OUTPUT_KINDS - 1.
+ */
+const char *output_extension(int kind);
+
+/*
+ * Returns one of the files of an output by its kind.
+ *
+ * Returns:
+ *   The file, or NULL if the assembler did not produce it.
+ */
+memory_file *produced_file(assembly_output *output, int kind);
+
+/*
+ * Marks one of the files of an output as produced.
+ *
+ * Returns:
+ *   The file, to be filled by the caller.
+ */
+memory_file *mark_produced(assembly_output *output, int kind);
+
+#endif
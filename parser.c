@@ -1,4 +1,7 @@
 #include "parser.h"
+#include "first_pass.h"
+#include "console.h"
+#include "fatal.h"
 
 int find_opcode_index(const char *instruction_name) {
     /* Array of valid instruction names corresponding to the opcodes enum */
@@ -21,10 +24,10 @@ int find_opcode_index(const char *instruction_name) {
     return -1;  /* Return -1 if the instruction name is not found */
 }
 
-int parse_two_operands(char *operands, instruction *instr, label_table *table, location *am_file, const char *instruction_name);
-int parse_one_operand(char *operand, instruction *instr, label_table *table, location *am_file);
+int parse_two_operands(const token_span *operands, instruction *instr, label_table *table, location *am_file, const char *instruction_name);
+int parse_one_operand(const token_span *operands, instruction *instr, label_table *table, location *am_file);
 
-int parse_instruction(const char *instruction_name, char *operands, instruction *instr, label_table *table, location *am_file, code_conv **instructions, int *IC, int *cc_capacity, label *label) {
+int parse_instruction(const char *instruction_name, const token_span *operands, instruction *instr, label_table *table, location *am_file, code_conv **instructions, int *IC, int *cc_capacity, int encode) {
     int opcode_index, L;
 
     /* Step 1: Validate the instruction name */
@@ -64,7 +67,7 @@ int parse_instruction(const char *instruction_name, char *operands, instruction
         new_instructions = realloc(*instructions, (*cc_capacity) * sizeof(code_conv));
         if (!new_instructions) {
             PRINT_ERROR(am_file->file_name, am_file->line, "Memory allocation failed");
-            exit(1);
+            fatal_error();
         }
         *instructions = new_instructions;
     }
@@ -75,49 +78,51 @@ int parse_instruction(const char *instruction_name, char *operands, instruction
     (*instructions)[*IC].assembly_line = am_file->line;
     (*IC)++;  /* Increment IC after storing the instruction */
 
-    /* Step 4: Encode and store the operands using the new encode_operands function */
-    encode_operands(instr->operand_count > 0 ? &instr->operands[0] : NULL, 
-                    instr->operand_count > 1 ? &instr->operands[1] : NULL, 
-                    instructions, IC, cc_capacity, table, am_file, label);
+    /* Step 4: Encode and store the operands using the new encode_operands function.
+       the fast modes only need to know how many words there are */
+    if (encode)
+        encode_operands(instr->operand_count > 0 ? &instr->operands[0] : NULL, 
+                        instr->operand_count > 1 ? &instr->operands[1] : NULL, 
+                        instructions, IC, cc_capacity, table, am_file);
+    else
+        reserve_operand_words(instr->operand_count > 0 ? &instr->operands[0] : NULL,
+                              instr->operand_count > 1 ? &instr->operands[1] : NULL,
+                              instructions, IC, cc_capacity, am_file);
 
     return L;
 }
 
 
-operand parse_operand(char *operand_str, label_table *table, location *am_file);
+operand parse_operand(const token_span *operand_tokens, label_table *table, location *am_file);
 int calculate_instruction_length(operand *operands, int operand_count);
 
-/* Parse and handle two operands for an instruction. */
-int parse_two_operands(char *operands, instruction *instr, label_table *table, location *am_file, const char *instruction_name) {
-    char *operand1 = NULL, *operand2 = NULL;
-    int i, len = strlen(operands), comma_found = 0, L;
+/* Parse and handle two operands for an instruction, they are the tokens before and after the comma. */
+int parse_two_operands(const token_span *operands, instruction *instr, label_table *table, location *am_file, const char *instruction_name) {
+    token_span operand1, operand2;
+    int i, comma = -1, L;
 
-    /* Find and split at comma */
-    for (i = 0; i < len; i++) {
-        if (operands[i] == ',') {
-            if (comma_found) {
+    /* Find the comma, there must be exactly one */
+    for (i = 0; i < operands -> count; i++) {
+        if (operands -> tokens[i].kind == TOKEN_COMMA) {
+            if (comma >= 0) {
                 PRINT_ERROR1(am_file->file_name, am_file->line, "Multiple consecutive commas in '%s' instruction", instruction_name);
                 return 0;
             }
-            comma_found = 1;
-            operands[i] = '\0';
-            operand2 = operands + i + 1;
-        } else if (!comma_found) {
-            operand1 = operands;
+            comma = i;
         }
     }
 
-    /* Check for valid operands */
-    if (!comma_found || !operand1 || !operand2) {
+    /* Check for valid operands, the second may be empty (it is reported as illegal) */
+    if (comma <= 0) {
         PRINT_ERROR1(am_file->file_name, am_file->line, "Illegal operand amount! Expected 2 operands for '%s' instruction", instruction_name);
         return 0;
     }
 
-    /* Trim whitespace and parse operands */
-    operand1 = trim_whitespace(operand1);
-    operand2 = trim_whitespace(operand2);
-    instr->operands[0] = parse_operand(operand1, table, am_file);
-    instr->operands[1] = parse_operand(operand2, table, am_file);
+    /* Parse operands */
+    sub_span(operands, 0, comma, &operand1);
+    sub_span(operands, comma + 1, operands -> count, &operand2);
+    instr->operands[0] = parse_operand(&operand1, table, am_file);
+    instr->operands[1] = parse_operand(&operand2, table, am_file);
 
     /* Calculate and return instruction length */
     instr->length = calculate_instruction_length(instr->operands, 2);
@@ -126,36 +131,25 @@ int parse_two_operands(char *operands, instruction *instr, label_table *table, l
 }
 
 /* Parse and handle a single operand for an instruction. */
-int parse_one_operand(char *operand_str, instruction *instr, label_table *table, location *am_file) {
-    char *operand = NULL;
-    int i, len = strlen(operand_str), L;
+int parse_one_operand(const token_span *operands, instruction *instr, label_table *table, location *am_file) {
+    int i, L;
 
-    /* Trim leading and trailing whitespace */
-    operand_str = trim_whitespace(operand_str);
-
-    /* Find the start of the operand, check for illegal commas */
-    for (i = 0; i < len; i++) {
-        if (operand_str[i] == ',') {
+    /* Check for illegal commas */
+    for (i = 0; i < operands -> count; i++) {
+        if (operands -> tokens[i].kind == TOKEN_COMMA) {
             PRINT_ERROR(am_file->file_name, am_file->line, "Illegal comma found in instruction");
             return 0;
         }
-        if (!isspace(operand_str[i])) {
-            if (operand) {
-                break;
-            }
-            operand = operand_str + i;
-        }
     }
 
     /* Check if operand was found */
-    if (!operand) {
+    if (operands -> count == 0) {
         PRINT_ERROR(am_file->file_name, am_file->line, "Illegal operand amount! Expected 1 operand for this instruction");
         return 0;
     }
 
-    /* Trim whitespace and parse operand */
-    operand = trim_whitespace(operand);
-    instr->operands[0] = parse_operand(operand, table, am_file);
+    /* Parse operand */
+    instr->operands[0] = parse_operand(operands, table, am_file);
 
     /* Calculate and return instruction length */
     instr->length = calculate_instruction_length(instr->operands, 1);
@@ -168,11 +162,22 @@ int parse_one_operand(char *operand_str, instruction *instr, label_table *table,
 #define FIRST_REG_INDEX 0
 #define LAST_REG_INDEX 7
 
-char *find_label(label_table *, const char *);
 void print_regs(int);
 void print_labels(label_table *);
 
-operand parse_operand(char *operand_str, label_table *table, location *am_file) {
+/* this function copies the text of an operand into text, for the error messages. returns text */
+static char *operand_text(const token_span *operand_tokens, char *text) {
+    word_view view;
+    span_text(operand_tokens, &view);
+    return copy_word(&view, view.length, text);
+}
+
+/* this function decides what an operand is from the kind of its first token. an operand of
+   more than one token can only be a number followed by other text, or a label (which is not found later) */
+operand parse_operand(const token_span *operand_tokens, label_table *table, location *am_file) {
+    char text[MAX_LINE_LENGTH + 2]; /* the operand as a string, it is a part of one line */
+    const token *first = operand_tokens -> tokens;
+    int kind = operand_tokens -> count > 0 ? first -> kind : TOKEN_OTHER, single = operand_tokens -> count == 1;
     operand opr;
     opr.is_label = 0;
     opr.value = 0;
@@ -181,74 +186,60 @@ operand parse_operand(char *operand_str, label_table *table, location *am_file)
     opr.type = 0;
 
     /* Check if operand is a number with # prefix */
-    if (operand_str[0] == '#') {
-        char *number_str = operand_str + 1;
-        /* Check if the number is valid */
-        if (!number_str)
-            PRINT_ERROR(am_file -> file_name, am_file -> line, "Missing number");
-        if (isdigit(number_str[0]) || (number_str[0] == '-' && isdigit(number_str[1])) || (number_str[0] == '+' && isdigit(number_str[1]))) {
-            opr.value = atoi(number_str);
-            opr.type = IMMEDIATE;
-        }
-        else
-            PRINT_ERROR1(am_file -> file_name, am_file -> line, "Illegal number format '%s'", operand_str);
+    if (kind == TOKEN_IMMEDIATE) {
+        opr.value = token_number(operand_tokens -> text, first, 1);
+        opr.type = IMMEDIATE;
     }
-    else if (operand_str[0] == '*') {
-        if (operand_str[1] == 'r' && isdigit(operand_str[2]) && operand_str[3] == '\0') {
-            int reg_num = operand_str[2] - '0';
-            if (reg_num >= FIRST_REG_INDEX && reg_num <= LAST_REG_INDEX) {
-                opr.is_register = 1;
-                opr.register_index = reg_num;
-                opr.type = INDIRECT_REG;
-            }
-            else {
-                PRINT_ERROR1(am_file -> file_name, am_file -> line, "Illegal register '%s', the legal registers are:", operand_str);
-                print_regs(FIRST_REG_INDEX);
-            }
+    else if (kind == TOKEN_BAD_IMMEDIATE)
+        PRINT_ERROR1(am_file -> file_name, am_file -> line, "Illegal number format '%s'", operand_text(operand_tokens, text));
+    else if (kind == TOKEN_INDIRECT && single) {
+        int reg_num = operand_tokens -> text[first -> offset + 2] - '0';
+        if (reg_num >= FIRST_REG_INDEX && reg_num <= LAST_REG_INDEX) {
+            opr.is_register = 1;
+            opr.register_index = reg_num;
+            opr.type = INDIRECT_REG;
         }
         else {
-            PRINT_ERROR1(am_file -> file_name, am_file -> line, "Illegal pointer format '%s'", operand_str);
+            PRINT_ERROR1(am_file -> file_name, am_file -> line, "Illegal register '%s', the legal registers are:", operand_text(operand_tokens, text));
+            print_regs(FIRST_REG_INDEX);
         }
     }
+    else if (kind == TOKEN_INDIRECT || kind == TOKEN_BAD_INDIRECT) {
+        PRINT_ERROR1(am_file -> file_name, am_file -> line, "Illegal pointer format '%s'", operand_text(operand_tokens, text));
+    }
     /* Check if operand is a register */
-    else if (operand_str[0] == 'r' && isdigit(operand_str[1]) && operand_str[2] == '\0') {
-        int reg_num = operand_str[1] - '0';
+    else if (kind == TOKEN_REGISTER && single) {
+        int reg_num = operand_tokens -> text[first -> offset + 1] - '0';
         if (reg_num >= FIRST_REG_INDEX && reg_num <= LAST_REG_INDEX) {
             opr.is_register = 1;
             opr.register_index = reg_num;
             opr.type = DIRECT_REG;
         }
         else {
-            PRINT_ERROR1(am_file -> file_name, am_file -> line, "Illegal register '%s', the legal registers are:", operand_str);
+            PRINT_ERROR1(am_file -> file_name, am_file -> line, "Illegal register '%s', the legal registers are:", operand_text(operand_tokens, text));
             print_regs(FIRST_REG_INDEX);
         }
     }
     /* Check if operand is a label */
-    else if (isalpha(operand_str[0])) {
+    else if (kind == TOKEN_IDENTIFIER || kind == TOKEN_REGISTER) {
+        word_view name;
+        span_text(operand_tokens, &name);
     	opr.type = DIRECT;
     	opr.is_label = 1;
-    	if (!(strlen(operand_str) < MAX_LABEL_LENGTH)) 
-        	PRINT_ERROR1(am_file->file_name, am_file->line, "Label name '%s' is too long. Max length is 31", operand_str); 
+    	if (!(name.length < MAX_LABEL_LENGTH)) 
+        	PRINT_ERROR1(am_file->file_name, am_file->line, "Label name '%s' is too long. Max length is 31", operand_text(operand_tokens, text)); 
     }
     /* Operand is illegal */
     else {
-        PRINT_ERROR1(am_file -> file_name, am_file -> line, "Illegal operand '%s'", operand_str);
+        PRINT_ERROR1(am_file -> file_name, am_file -> line, "Illegal operand '%s'", operand_text(operand_tokens, text));
     }
 
     return opr;
 }
 
 char *find_label_name(label_table *table, const char *label_name) {
-    int i;
-
-    /* Iterate through the label table to find the label */
-    for (i = 0; i < table -> count; i++) {
-        if (strcmp(table -> labels[i].name, label_name) == 0) {
-            return table -> labels[i].name;  /* Return the name of the found label */
-        }
-    }
-
-    return NULL;  /* Return NULL if the label is not found */
+    label *found = lookup_label(table, label_name);
+    return found ? found -> name : NULL;  /* Return NULL if the label is not found */
 }
 
 void print_regs(int reg_num) {
@@ -257,11 +248,11 @@ void print_regs(int reg_num) {
     }
 
     /* Print current register */
-    printf("\033[0;32mr%d\033[0m", reg_num);
+    console_printf("\033[0;32mr%d\033[0m", reg_num);
 
     /* If it's not the last register, print a comma */
     if (reg_num < 7) {
-        printf(", ");
+        console_printf(", ");
     }
 
     /* Recursive call for the next register */
@@ -276,11 +267,11 @@ void print_labels_recursive(label *labels, int index, int total) {
     }
 
     /* Print the label's name */
-    printf("\033[0;32m%s\033[0m", labels[index].name);
+    console_printf("\033[0;32m%s\033[0m", labels[index].name);
 
     /* Print a comma if it's not the last label */
     if (index < total - 1) {
-        printf(", ");
+        console_printf(", ");
     }
     /* Recursive call to print the next label */
     print_labels_recursive(labels, index + 1, total);
@@ -292,7 +283,7 @@ void print_labels_recursive(label *labels, int index, int total) {
 void print_labels(label_table *table) {
     if (table -> count > 0) {
         print_labels_recursive(table -> labels, 0, table -> count);
-        printf("\n"); /* New line after all labels are printed */
+        console_printf("\n"); /* New line after all labels are printed */
     }
 }
 
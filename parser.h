@@ -8,6 +8,7 @@
 #include "intialize_data_struct.h"
 #include "globals.h"
 #include "util.h"
+#include "lexer.h"
 
 #define IMMEDIATE 1
 #define DIRECT 2
@@ -15,7 +16,8 @@
 #define DIRECT_REG 4
 
 void encode_instruction_first_word(instruction *instr);
-void encode_operands(operand *op1, operand *op2, code_conv **instructions, int *IC, int *cc_capacity, label_table *table, location *am_file, label *lbl);
+void encode_operands(operand *op1, operand *op2, code_conv **instructions, int *IC, int *cc_capacity, label_table *table, location *am_file);
+void reserve_operand_words(operand *op1, operand *op2, code_conv **instructions, int *IC, int *cc_capacity, location *am_file);
 
 #endif
 
@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "pipeline.h"
+#include "pre_assembler.h"
+#include "line_index.h"
+#include "fatal.h"
+
+/* The state the two stages of one source share. The extension fills batches and
+   hands them over in filled, the first pass reads them and gives them back in empty. */
+typedef struct {
+    const memory_file *source;        /* The source (.as) */
+    asm_ctx *ctx;                     /* The context of the source */
+    batch_ring filled;                /* Batches of extended lines, for the first pass */
+    batch_ring empty;                 /* Batches that were read, for the extension to fill again */
+    text_batch batches[PIPELINE_RING_SIZE];
+    text_batch *current;              /* The batch the extension is filling, or NULL */
+    fatal_handler extension_handler;  /* Stops the extension if memory runs out */
+    int extended;                     /* What macro_extender returned */
+    int extension_aborted;            /* 1 if the extension ran out of memory */
+    memory_file *expanded;            /* The extended source read so far */
+    size_t expanded_capacity;         /* Allocated size of expanded */
+    token_list *tokens;               /* The tokens of the extended source read so far */
+    int line_count;                   /* The number of lines of the extended source read so far */
+    first_pass_state *state;          /* What the lines read so far define */
+    int mode;                         /* ASSEMBLE_FULL, ASSEMBLE_CHECK or ASSEMBLE_SIZES */
+    int reading;                      /* 1 until a line stops the first pass */
+    int pass_aborted;                 /* 1 if the first pass ran out of memory */
+    pipeline_result *result;          /* Receives the messages of the stages */
+} pipeline;
+
+/* this function adds a batch to a ring, waiting while the ring is full */
+static void ring_push(batch_ring *ring, text_batch *batch) {
+    unsigned long tail = ring -> tail;
+
+    while (tail - __atomic_load_n(&ring -> head, __ATOMIC_ACQUIRE) == PIPELINE_RING_SIZE)
+        sched_yield(); /* the consumer is behind */
+    ring -> slots[tail % PIPELINE_RING_SIZE] = batch;
+    __atomic_store_n(&ring -> tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* this function takes the next batch from a ring, waiting while the ring is empty.
+   returns NULL once the ring is closed and empty */
+static text_batch *ring_pop(batch_ring *ring) {
+    unsigned long head = ring -> head;
+    text_batch *batch;
+
+    while (head == __atomic_load_n(&ring -> tail, __ATOMIC_ACQUIRE)) {
+        /* closed is set after the last push, so the tail is looked at again once it is seen */
+        if (__atomic_load_n(&ring -> closed, __ATOMIC_ACQUIRE) && head == __atomic_load_n(&ring -> tail, __ATOMIC_ACQUIRE))
+            return NULL;
+        sched_yield(); /* the producer is behind */
+    }
+    batch = ring -> slots[head % PIPELINE_RING_SIZE];
+    __atomic_store_n(&ring -> head, head + 1, __ATOMIC_RELEASE);
+    return batch;
+}
+
+/* this function tells the consumer of a ring that nothing more will be added */
+static void ring_close(batch_ring *ring) {
+    __atomic_store_n(&ring -> closed, 1, __ATOMIC_RELEASE);
+}
+
+/* this function is the writer of the extension: it adds a line to the current batch, and hands the batch
+   over once the line does not fit. a batch is only handed over after a whole line */
+static void write_to_batches(void *data, const char *text, size_t length) {
+    pipeline *stages = data;
+    text_batch *batch = stages -> current;
+
+    if (!batch)
+        batch = stages -> current = ring_pop(&stages -> empty);
+    if (batch -> length > 0 && batch -> length + length > batch -> capacity && batch -> text[batch -> length - 1] == '\n') {
+        ring_push(&stages -> filled, batch);
+        batch = stages -> current = ring_pop(&stages -> empty);
+    }
+    if (batch -> length + length > batch -> capacity) { /* a line that is longer than a whole batch */
+        size_t capacity = batch -> capacity;
+        char *grown;
+        while (capacity < batch -> length + length)
+            capacity *= 2;
+        grown = realloc(batch -> text, capacity);
+        if (!grown) {
+            console_printf("Memory allocation failed\n");
+            fatal_error();
+        }
+        batch -> text = grown;
+        batch -> capacity = capacity;
+    }
+    memcpy(batch -> text + batch -> length, text, length);
+    batch -> length += length;
+}
+
+/* this function runs on the extension thread: it extends the macros of the source into batches.
+   the context is bound to the thread for the illegal macro names, the messages are kept apart */
+static void *extension_stage(void *arg) {
+    pipeline *stages = arg;
+
+    bind_current_context(stages -> ctx);
+    console_capture_begin(&stages -> result -> extension_messages);
+    if (setjmp(stages -> extension_handler.resume) == 0) {
+        fatal_handler_install(&stages -> extension_handler);
+        stages -> extended = macro_extender_with_writer(stages -> source, write_to_batches, stages);
+        if (stages -> current && stages -> current -> length > 0)
+            ring_push(&stages -> filled, stages -> current); /* the last lines */
+    } else {
+        stages -> extension_aborted = 1;
+    }
+    fatal_handler_remove();
+    console_capture_end();
+    bind_current_context(NULL);
+    ring_close(&stages -> filled);
+    return NULL;
+}
+
+/* this function adds a batch of extended lines to the extended source, then finds their tokens and
+   runs the first pass on them. once a line stopped the first pass the lines are only kept */
+static void read_batch(pipeline *stages, const text_batch *batch) {
+    memory_file *expanded = stages -> expanded;
+    size_t offset = expanded -> size;
+    int first_token = stages -> tokens -> count, tokenized;
+    line_index lines;
+
+    /* step 1: keep the lines, null terminated like the contents of a closed memory stream */
+    if (offset + batch -> length + 1 > stages -> expanded_capacity) {
+        size_t capacity = stages -> expanded_capacity;
+        char *grown;
+        while (capacity < offset + batch -> length + 1)
+            capacity *= 2;
+        grown = realloc(expanded -> data, capacity);
+        if (!grown) {
+            console_printf("Memory allocation failed\n");
+            fatal_error();
+        }
+        expanded -> data = grown;
+        stages -> expanded_capacity = capacity;
+    }
+    memcpy(expanded -> data + offset, batch -> text, batch -> length);
+    expanded -> size += batch -> length;
+    expanded -> data[expanded -> size] = '\0';
+    if (!stages -> reading)
+        return;
+
+    /* step 2: the lines and the tokens of the batch, numbered as in the whole extended source */
+    if (!build_line_index(&lines, expanded -> data + offset, batch -> length, MAX_LINE_LENGTH)) {
+        console_printf("Memory allocation failed\n");
+        fatal_error();
+    }
+    stages -> tokens -> text = expanded -> data; /* it may have moved */
+    tokenized = tokenize_more_lines(stages -> tokens, &lines, offset, stages -> line_count);
+    stages -> line_count += lines.count;
+    free_line_index(&lines);
+    if (!tokenized) {
+        console_printf("Memory allocation failed\n");
+        fatal_error();
+    }
+
+    /* step 3: the first pass reads them */
+    stages -> reading = read_statements(stages -> tokens, first_token, stages -> tokens -> count, stages -> state, stages -> mode);
+}
+
+/* this function frees the batches of a pipeline and the pipeline */
+static void free_pipeline(pipeline *stages) {
+    int i;
+    for (i = 0; i < PIPELINE_RING_SIZE; i++)
+        free(stages -> batches[i].text);
+    free(stages);
+}
+
+int run_pipeline(const memory_file *source, memory_file *expanded, token_list *tokens, first_pass_state *state, int mode, pipeline_result *result) {
+    console_buffer *outer_capture = console_capture_current();
+    fatal_handler *outer_handler = fatal_handler_current();
+    pipeline *stages = calloc(1, sizeof(pipeline)); /* not on the stack, it is changed between setjmp and longjmp */
+    fatal_handler handler;
+    pthread_t extension_thread;
+    line_index no_lines;
+    text_batch *batch;
+    int i;
+
+    memset(result, 0, sizeof(pipeline_result));
+    if (!stages)
+        return 0;
+
+    /* step 1: set up the batches (all of them start empty), the extended source and its tokens */
+    for (i = 0; i < PIPELINE_RING_SIZE; i++) {
+        stages -> batches[i].text = malloc(PIPELINE_BATCH_SIZE);
+        stages -> batches[i].capacity = PIPELINE_BATCH_SIZE;
+        if (!stages -> batches[i].text) {
+            free_pipeline(stages);
+            return 0;
+        }
+        ring_push(&stages -> empty, &stages -> batches[i]);
+    }
+    expanded -> size = 0;
+    expanded -> data = malloc(PIPELINE_BATCH_SIZE);
+    if (!expanded -> data) {
+        free_pipeline(stages);
+        return 0;
+    }
+    expanded -> data[0] = '\0';
+    if (!build_line_index(&no_lines, expanded -> data, 0, MAX_LINE_LENGTH)) {
+        free_memory_file(expanded);
+        free_pipeline(stages);
+        return 0;
+    }
+    i = tokenize_lines(tokens, &no_lines); /* an empty list that grows with every batch */
+    free_line_index(&no_lines);
+    if (!i) {
+        free_memory_file(expanded);
+        free_pipeline(stages);
+        return 0;
+    }
+    stages -> source = source;
+    stages -> ctx = current_context();
+    stages -> expanded = expanded;
+    stages -> expanded_capacity = PIPELINE_BATCH_SIZE;
+    stages -> tokens = tokens;
+    stages -> state = state;
+    stages -> mode = mode;
+    stages -> reading = 1;
+    stages -> result = result;
+
+    /* step 2: start the extension */
+    if (pthread_create(&extension_thread, NULL, extension_stage, stages) != 0) {
+        free_token_list(tokens);
+        free_memory_file(expanded);
+        free_pipeline(stages);
+        return 0;
+    }
+
+    /* step 3: read the batches as they come. if memory runs out, the batches are still
+       given back until the extension is done, so it never waits for them forever */
+    console_capture_begin(&result -> pass_messages);
+    if (setjmp(handler.resume) == 0) {
+        fatal_handler_install(&handler);
+        while ((batch = ring_pop(&stages -> filled)) != NULL) {
+            read_batch(stages, batch);
+            batch -> length = 0;
+            ring_push(&stages -> empty, batch);
+        }
+    } else {
+        stages -> pass_aborted = 1;
+        while ((batch = ring_pop(&stages -> filled)) != NULL) {
+            batch -> length = 0;
+            ring_push(&stages -> empty, batch);
+        }
+    }
+    console_capture_end();
+    if (outer_capture)
+        console_capture_begin(outer_capture);
+    if (outer_handler)
+        fatal_handler_install(outer_handler);
+    else
+        fatal_handler_remove();
+    pthread_join(extension_thread, NULL);
+
+    result -> extended = stages -> extended;
+    result -> parsed = stages -> reading;
+    result -> aborted = stages -> extension_aborted || stages -> pass_aborted;
+    free_pipeline(stages);
+    return 1;
+}
@@ -0,0 +1,59 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stddef.h>
+#include "memory_file.h"
+#include "console.h"
+#include "first_pass.h"
+#include "context.h"
+
+#define PIPELINE_RING_SIZE 8         /* Batches in flight between the stages, a power of 2 */
+#define PIPELINE_BATCH_SIZE 65536    /* Bytes of extended source in a batch, a batch only ends at the end of a line */
+
+/* A piece of the extended source: whole lines, handed from one stage to the next */
+typedef struct {
+    char *text;          /* The lines (not null terminated) */
+    size_t length;       /* Number of bytes in the lines */
+    size_t capacity;     /* Allocated size of text */
+} text_batch;
+
+/* A bounded queue of batches between one producer thread and one consumer thread.
+   It takes no lock: the producer only moves tail and the consumer only moves head. */
+typedef struct {
+    text_batch *slots[PIPELINE_RING_SIZE];
+    unsigned long head;  /* The next batch to take, written by the consumer */
+    unsigned long tail;  /* The next slot to fill, written by the producer */
+    int closed;          /* Set by the producer after its last batch */
+} batch_ring;
+
+/* What the stages of a pipelined source produced */
+typedef struct {
+    int extended;                      /* 1 if the macros were extended, 0 if the source has errors */
+    int parsed;                        /* 1 if the first pass read every line, 0 if a line stopped it */
+    int aborted;                       /* 1 if a stage ran out of memory */
+    console_buffer extension_messages; /* What the macro extension printed */
+    console_buffer pass_messages;      /* What the first pass printed */
+} pipeline_result;
+
+/*
+ * Extends the macros of a source on a thread of its own while the calling thread
+ * indexes, tokenizes and runs the first pass on the extended lines, a batch at a time.
+ * The two are connected by a pair of rings: one carries the filled batches, the other
+ * gives them back to be filled again. The messages of each stage are kept apart, so the
+ * caller can print them in the order of a source that is extended before it is read.
+ * The context of the calling thread is bound to the extension thread too.
+ *
+ * Parameters:
+ *   source - The source (.as).
+ *   expanded - Receives the extended source (.am), also as far as it got if the extension failed.
+ *   tokens - Receives the tokens of the extended source, free them with free_token_list.
+ *   state - The first pass state, set up by the caller. It is only complete if parsed is set.
+ *   mode - ASSEMBLE_FULL, ASSEMBLE_CHECK or ASSEMBLE_SIZES.
+ *   result - Receives what happened and the messages, the caller frees the messages.
+ *
+ * Returns:
+ *   1 if the stages ran, 0 if they could not be set up (nothing was done).
+ */
+int run_pipeline(const memory_file *source, memory_file *expanded, token_list *tokens, first_pass_state *state, int mode, pipeline_result *result);
+
+#endif
@@ -1,26 +1,402 @@
+#include <errno.h>
 #include "pre_assembler.h"
 #include "util.h"
+#include "console.h"
+#include "fatal.h"
+#include "context.h"
+#include "line_index.h"
+#include "macro_library.h"
+#include "include_cache.h"
+#include "indexed_file.h"
+
+/* reserved names that are not allowed as macro names */
+const char *const default_illegal_macro_names[DEFAULT_ILLEGAL_MACRO_COUNT] = {
+    "mov",
+    "cmp",
+    "add",
+    "sub",
+    "lea",
+    "not",
+    "clr",
+    "inc",
+    "dec",
+    "jmp",
+    "bne",
+    "red",
+    "prn",
+    "jsr",
+    "rts",
+    "stop",
+    ".data",
+    ".string",
+    ".extern",
+    ".entry",
+    INCLUDE_DIRECTIVE
+};
+
+/* A file whose lines are extended: the source, or a file it includes */
+typedef struct extended_file {
+    const char *path;                      /* Its path, the files it includes are found next to it */
+    const struct extended_file *includer;  /* The file with the .include, NULL for the source */
+    int depth;                             /* Number of .include directives that led to it */
+} extended_file;
+
+/* What the lines of every file of a source are extended with */
+typedef struct {
+    MacroTable *table;
+    const macro_library *library;
+    long budget;
+    expanded_text_writer write;
+    void *data;
+} extension;
+
+/* this function reports an error or a warning of the macro extension. it is printed
+   as "error: on line N <message>", or handed to the sink of the current context
+   without the trailing new line, with the .as file of the context as its file.
+   a problem in an included file (file is not NULL and has an includer) names that file instead */
+static void report_macro_problem(int is_error, const extended_file *file, int line_number, const char *format, ...) {
+    asm_ctx *ctx = current_context();
+    asm_diagnostic_sink sink = ctx ? (is_error ? ctx -> error_sink : ctx -> warning_sink) : NULL;
+    char message[MAX_DIAGNOSTIC_LENGTH], file_name[MAX_DIAGNOSTIC_LENGTH];
+    size_t length;
+    va_list args;
+
+    va_start(args, format);
+    if (!sink) {
+        if (file && file -> includer)
+            console_printf("%s: in %s on line %d ", is_error ? "error" : "warning", file -> path, line_number);
+        else
+            console_printf("%s: on line %d ", is_error ? "error" : "warning", line_number);
+        console_vprintf(format, args);
+        va_end(args);
+        return;
+    }
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    length = strlen(message);
+    if (length > 0 && message[length - 1] == '\n')
+        message[length - 1] = '\0';
+    if (file && file -> includer)
+        sprintf(file_name, "%.*s", MAX_DIAGNOSTIC_LENGTH - 1, file -> path);
+    else
+        sprintf(file_name, "%.*s.as", MAX_DIAGNOSTIC_LENGTH - 4, ctx -> name ? ctx -> name : ASM_DEFAULT_NAME);
+    sink(ctx -> sink_data, file_name, line_number, message);
+}
+
+/* this function returns the FNV-1a hash of a name */
+unsigned long hash_macro_name(const char *name, int length) {
+    return hash_indexed_name(name, (size_t) length);
+}
+
+void add_to_macro_filter(unsigned char *filter, unsigned long hash) {
+    filter[(hash % MACRO_FILTER_BITS) / 8] |= 1 << (hash % 8);
+    filter[((hash >> 16) % MACRO_FILTER_BITS) / 8] |= 1 << ((hash >> 16) % 8);
+}
+
+int may_be_macro(const unsigned char *filter, unsigned long hash) {
+    return (filter[(hash % MACRO_FILTER_BITS) / 8] & (1 << (hash % 8))) &&
+           (filter[((hash >> 16) % MACRO_FILTER_BITS) / 8] & (1 << ((hash >> 16) % 8)));
+}
+
+/* the prefilter of the first words of the flattened lines of a macro works like the one of the names */
+static void add_line_word(unsigned char *line_words, unsigned long hash) {
+    line_words[(hash % MACRO_WORD_FILTER_BITS) / 8] |= 1 << (hash % 8);
+    line_words[((hash >> 16) % MACRO_WORD_FILTER_BITS) / 8] |= 1 << ((hash >> 16) % 8);
+}
+
+static int may_be_line_word(const unsigned char *line_words, unsigned long hash) {
+    return (line_words[(hash % MACRO_WORD_FILTER_BITS) / 8] & (1 << (hash % 8))) &&
+           (line_words[((hash >> 16) % MACRO_WORD_FILTER_BITS) / 8] & (1 << ((hash >> 16) % 8)));
+}
+
+/* this function returns the slot of a name in a macro table, or the empty slot where it would go */
+static macro_slot *find_macro_slot(const MacroTable *table, const char *name, int length, unsigned long hash) {
+    int mask = table -> capacity - 1, i = (int) (hash & mask);
+    macro_slot *slot;
+    while ((slot = &table -> slots[i]) -> name) {
+        if (slot -> hash == hash && slot -> length == length && memcmp(slot -> name, name, length) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return slot;
+}
+
+/* this function puts a name in a macro table that does not have it yet, the table grows once it is half full */
+static void add_macro_slot(MacroTable *table, const char *name, int length, unsigned long hash, Macro *macro) {
+    macro_slot *slot;
+    if ((table -> count + 1) * 2 > table -> capacity) {
+        macro_slot *old_slots = table -> slots;
+        int old_capacity = table -> capacity, i;
+        table -> slots = calloc(old_capacity * 2, sizeof(macro_slot));
+        if (!table -> slots) {
+            table -> slots = old_slots; /* so the table can still be freed */
+            console_printf("Memory allocation failed\n");
+            fatal_error();
+        }
+        table -> capacity = old_capacity * 2;
+        for (i = 0; i < old_capacity; i++)
+            if (old_slots[i].name)
+                *find_macro_slot(table, old_slots[i].name, old_slots[i].length, old_slots[i].hash) = old_slots[i];
+        free(old_slots);
+    }
+    slot = find_macro_slot(table, name, length, hash);
+    slot -> name = name;
+    slot -> length = length;
+    slot -> hash = hash;
+    slot -> macro = macro;
+    table -> count++;
+    if (macro) { /* reserved names are never called, they stay out of the prefilter */
+        Macro *flattened;
+        add_to_macro_filter(table -> filter, hash);
+        /* a flattened macro with a line that starts with the name calls it now, it has to be flattened again */
+        for (flattened = table -> head; flattened; flattened = flattened -> next)
+            if (flattened -> expanded && may_be_line_word(flattened -> line_words, hash))
+                flattened -> expanded = 0;
+    }
+}
+
+void initialize_macro_table(MacroTable *table) {
+    asm_ctx *ctx = current_context();
+    const char *const *illegal_macro_names = ctx ? ctx -> illegal_macro_names : default_illegal_macro_names;
+    int num_illegal_macros = ctx ? ctx -> illegal_macro_count : DEFAULT_ILLEGAL_MACRO_COUNT, i;
+
+    memset(table, 0, sizeof(MacroTable));
+    table -> slots = calloc(MACRO_TABLE_INITIAL_CAPACITY, sizeof(macro_slot));
+    if (!table -> slots) {
+        console_printf("Memory allocation failed\n");
+        fatal_error();
+    }
+    table -> capacity = MACRO_TABLE_INITIAL_CAPACITY;
+    for (i = 0; i < num_illegal_macros; i++) {
+        int length = strlen(illegal_macro_names[i]);
+        unsigned long hash = hash_macro_name(illegal_macro_names[i], length);
+        if (!find_macro_slot(table, illegal_macro_names[i], length, hash) -> name)
+            add_macro_slot(table, illegal_macro_names[i], length, hash, NULL);
+    }
+}
+
+/* this function returns the macro of the source a word calls, or NULL. if the word calls a macro of the
+   library instead, its lines (flattened when the library was built) and their length are set.
+   a macro of the source comes before one of the library with the same name, once it is defined.
+   a word that misses one of its bits in a prefilter is not looked up in that table at all */
+static Macro *find_macro(const MacroTable *table, const macro_library *library, const char *word, int length,
+                         const char **library_body, size_t *library_body_length) {
+    unsigned long hash = hash_macro_name(word, length);
+    macro_slot *slot = NULL;
+
+    *library_body = NULL;
+    if (may_be_macro(table -> filter, hash)) {
+        slot = find_macro_slot(table, word, length, hash);
+        if (slot -> macro)
+            return slot -> macro;
+    }
+    if (!library || !may_be_macro(macro_library_filter(library), hash))
+        return NULL;
+    if (!slot)
+        slot = find_macro_slot(table, word, length, hash);
+    if (!slot -> name) /* a reserved name of the context is never a call */
+        *library_body = macro_library_find(library, word, length, hash, library_body_length);
+    return NULL;
+}
+
+/* this function makes room for more characters at the end of the bodies of a table.
+   the bodies may move, spans of them are kept as offsets */
+static void reserve_bodies(MacroTable *table, size_t length) {
+    if (table -> bodies_length + length > table -> bodies_capacity) {
+        size_t capacity = table -> bodies_capacity ? table -> bodies_capacity : MACRO_BODIES_INITIAL_CAPACITY;
+        char *grown;
+        while (capacity < table -> bodies_length + length)
+            capacity *= 2;
+        grown = realloc(table -> bodies, capacity);
+        if (!grown) {
+            console_printf("Memory allocation failed\n");
+            fatal_error();
+        }
+        table -> bodies = grown;
+        table -> bodies_capacity = capacity;
+    }
+}
+
+/* this function adds a line to the lines of the macro that is being defined, the last one in the list */
+static void add_macro_line(MacroTable *table, const char *line, size_t length) {
+    reserve_bodies(table, length);
+    memcpy(table -> bodies + table -> bodies_length, line, length);
+    table -> bodies_length += length;
+    table -> tail -> length += length;
+}
+
+/* this function returns the number of lines in some text, the last one may have no new line */
+static long count_lines(const char *text, size_t length) {
+    long lines = 0;
+    size_t i;
+    for (i = 0; i < length; i++)
+        if (text[i] == '\n')
+            lines++;
+    return length > 0 && text[length - 1] != '\n' ? lines + 1 : lines;
+}
+
+/* this function returns the length of the first word of a line of a macro (it starts at the line,
+   the leading white space was removed) and sets the length of the line, new line included */
+static int first_word_of_body_line(const char *line, size_t rest, size_t *line_length) {
+    const char *end = memchr(line, '\n', rest);
+    int length = 0;
+    *line_length = end ? (size_t) (end - line) + 1 : rest;
+    while ((size_t) length < *line_length && !isspace((unsigned char) line[length]))
+        length++;
+    return length;
+}
+
+/* this function adds the uses of a macro (a library macro when macro is NULL) to the nested uses of a
+   macro that is being flattened, one entry per macro */
+static void add_nested_use(MacroTable *table, Macro *flattened, const nested_use *use) {
+    int *mark = use -> macro ? &use -> macro -> nested_mark : &table -> library_uses[use -> library_macro].nested_mark;
+    if (*mark) {
+        flattened -> nested[*mark - 1].times += use -> times;
+        return;
+    }
+    if (flattened -> nested_count == flattened -> nested_capacity) {
+        int capacity = flattened -> nested_capacity ? flattened -> nested_capacity * 2 : 4;
+        nested_use *grown = realloc(flattened -> nested, capacity * sizeof(nested_use));
+        if (!grown) {
+            console_printf("Memory allocation failed\n");
+            fatal_error();
+        }
+        flattened -> nested = grown;
+        flattened -> nested_capacity = capacity;
+    }
+    flattened -> nested[flattened -> nested_count] = *use;
+    *mark = ++flattened -> nested_count;
+}
+
+/* this function flattens a macro: every line that calls a macro is replaced with the flattened lines of
+   that macro, the result is kept as the expanded span of the macro. the first words of the lines that are
+   not calls to a macro of the source go in the prefilter of the macro, so defining one of them later makes
+   only this macro (and the ones that copied its lines) flatten again; the new lines are written over the
+   old span when they fit. a macro without calls is its own expanded span. a macro that calls itself, or
+   that grows past the budget (so a few macros calling each other can not expand exponentially), is
+   reported on the line of the call. returns 1 on success, 0 on error */
+static int flatten_macro(MacroTable *table, const macro_library *library, Macro *macro, long budget, const extended_file *file, int line_number) {
+    size_t position, end = macro -> offset + macro -> length, line_length, library_length, bytes = 0, own = 0, written = 0;
+    const char *library_body;
+    long lines = 0;
+    int pass, calls = 0, i;
+
+    if (macro -> expanded)
+        return 1;
+    macro -> flattening = 1;
+    memset(macro -> line_words, 0, sizeof(macro -> line_words));
+
+    /* pass 0 flattens the macros it calls and counts the lines, pass 1 writes them (only if there are calls) */
+    for (pass = 0; pass < 2 && (pass == 0 || calls > 0); pass++) {
+        if (pass == 1) {
+            if (bytes > macro -> expanded_room) {
+                reserve_bodies(table, bytes);
+                macro -> expanded_offset = table -> bodies_length;
+                macro -> expanded_room = bytes;
+                table -> bodies_length += bytes;
+            }
+            written = macro -> expanded_offset;
+            macro -> nested_count = 0;
+        }
+        for (position = macro -> offset; position < end; position += line_length) {
+            int word_length = first_word_of_body_line(table -> bodies + position, end - position, &line_length);
+            Macro *callee = find_macro(table, library, table -> bodies + position, word_length, &library_body, &library_length);
+            if (pass == 1) {
+                /* the room was reserved before, the bodies do not move while the lines are copied */
+                size_t length = callee ? callee -> expanded_length : library_body ? library_length : line_length;
+                memcpy(table -> bodies + written, callee ? table -> bodies + callee -> expanded_offset : library_body ? library_body : table -> bodies + position, length);
+                written += length;
+                if (table -> profiled && (callee || library_body)) { /* the callee, and what its own lines come from */
+                    nested_use use;
+                    use.macro = callee;
+                    use.library_macro = callee ? 0 : macro_library_number(library, table -> bodies + position, word_length,
+                                                                          hash_macro_name(table -> bodies + position, word_length)) - 1;
+                    use.times = 1;
+                    use.lines = callee ? callee -> expanded_lines : count_lines(library_body, library_length);
+                    use.bytes = length;
+                    use.own_bytes = callee ? callee -> own_length : length; /* a library macro has no macros inside left */
+                    add_nested_use(table, macro, &use);
+                    for (i = 0; callee && i < callee -> nested_count; i++)
+                        add_nested_use(table, macro, &callee -> nested[i]);
+                }
+                continue;
+            }
+            if (callee && callee -> flattening) {
+                if (callee == macro)
+                    report_macro_problem(1, file, line_number, "Macro %s calls itself! The program will stop now.\n", macro -> name);
+                else
+                    report_macro_problem(1, file, line_number, "Macro %s calls itself through macro %s! The program will stop now.\n", callee -> name, macro -> name);
+                return 0;
+            }
+            if (callee && !flatten_macro(table, library, callee, budget, file, line_number))
+                return 0;
+            if (callee || library_body)
+                calls++;
+            if (callee) /* its lines are copied, and with them the words they start with */
+                for (i = 0; i < MACRO_WORD_FILTER_BITS / 8; i++)
+                    macro -> line_words[i] |= callee -> line_words[i];
+            else /* a library macro it calls becomes a call to a macro of the source defined with its name */
+                add_line_word(macro -> line_words, hash_macro_name(table -> bodies + position, word_length));
+            bytes += callee ? callee -> expanded_length : library_body ? library_length : line_length;
+            own += callee || library_body ? 0 : line_length;
+            lines += callee ? callee -> expanded_lines : library_body ? count_lines(library_body, library_length) : 1;
+            if (lines > budget) {
+                report_macro_problem(1, file, line_number, "Macro %s expands to more than %ld lines! The program will stop now.\n", macro -> name, budget);
+                return 0;
+            }
+        }
+    }
+    for (i = 0; i < macro -> nested_count; i++) {
+        nested_use *use = &macro -> nested[i];
+        if (use -> macro)
+            use -> macro -> nested_mark = 0;
+        else
+            table -> library_uses[use -> library_macro].nested_mark = 0;
+    }
+    if (calls == 0)
+        macro -> expanded_offset = macro -> offset;
+    macro -> expanded_length = calls == 0 ? macro -> length : bytes;
+    macro -> expanded_lines = lines;
+    macro -> own_length = own;
+    macro -> expanded = 1;
+    macro -> flattening = 0;
+    return 1;
+}
+
+int flatten_macros(MacroTable *table, long budget) {
+    Macro *macro;
+    for (macro = table -> head; macro; macro = macro -> next) {
+        int length = strlen(macro -> name);
+        if (find_macro_slot(table, macro -> name, length, hash_macro_name(macro -> name, length)) -> macro != macro)
+            continue; /* a name defined again is never called */
+        if (!flatten_macro(table, NULL, macro, budget, NULL, macro -> line_number))
+            return 0;
+    }
+    return 1;
+}
 
 /* this function will extend the macros in the assembly code
-   by iterating through the source file after opening it.
-   after creating the output file, with each iteration
+   by iterating through the source file and handing the result
+   to the writer, a line at a time. with each iteration
    the function identifies one of this case:
    1) new macro declaration. in this case the function checks
       if the name is legal and if there is no text after the macro
       definition. if so, the function adds the macro to the
-      macro table and updates the macros name and allocates
-      memory for the macro lines(which will be set in the next
+      macro table and updates the macros name and where
+      the macro lines start (they will be added in the next
       iterations). the declaration and the line of the macro are
       not copied to the output file .am.
    2) currently inside of a macro. after a macro definition was
       encounetrd, the lines of the macro need to be copied into
       the macro table one by one until the end of macro. it is
       exactly what the function does. checks for end of macro,
-      copies the line and then continues.
+      adds the line to the end of the lines of the macro and then continues.
    3) a macro call. the function checks if a macro call
-      was encounterd by comparing the first word in the senctence
-      to all of the macros in the macro table. if a call is indeed
-      found, the call is replaced with the macro lines.
+      was encounterd by looking the first word in the senctence
+      up in the macro table. if a call is indeed
+      found, the call is replaced with the macro lines, written at once.
+      the lines of a macro may call other macros, they are expanded
+      too (see flatten_macro).
    4) non of the mentiond above. if a simple line encounterd
       (a line that has nothing to do with macros) it is just copied
       to the output file as is.
@@ -29,228 +405,496 @@
    so in the .am file they will not be present.
 */
 
-FILE *macro_extender(const char *source_file_name) {
-    FILE *source_file = fopen(source_file_name, "r"); /* open source file for reading */
-    FILE *output_file; /* the output file which wilol store the end result */
-    char next_line[MAX_LINE_LENGTH + 2]; /* the line that we will read from the source file */
-    MacroTable macro_table = {NULL}; /* the macro_table */
-    Macro *current_macro = NULL;
-    int inside_macro = 0; /* a flag for when inside a macro */
-    int line_number = 0; /* line counter */
+/* this function writes a piece of the extended source to the stream given as data */
+static void write_to_stream(void *data, const char *text, size_t length) {
+    fwrite(text, 1, length, (FILE *) data);
+}
 
-    if (!source_file) {
-        printf("Can not access source file. Stop!\n");
-        return NULL;
+int macro_extender(const memory_file *source, FILE *output_file) {
+    return macro_extender_with_writer(source, write_to_stream, output_file);
+}
+
+/* this function writes nothing, the macro definitions of a source are all collect_macros keeps */
+static void discard_text(void *data, const char *text, size_t length) {
+    (void) data;
+    (void) text;
+    (void) length;
+}
+
+/* this function counts, for the profile, the calls a call of a flattened macro makes inside its lines
+   and what they write, the macros its callees call included */
+static void count_nested_uses(MacroTable *table, const Macro *called) {
+    int i;
+    for (i = 0; i < called -> nested_count; i++) {
+        const nested_use *use = &called -> nested[i];
+        if (use -> macro) {
+            use -> macro -> nested_calls += use -> times;
+            use -> macro -> emitted_lines += use -> times * use -> lines;
+            use -> macro -> emitted_bytes += use -> times * use -> bytes;
+            use -> macro -> self_bytes += use -> times * use -> own_bytes;
+        } else {
+            library_macro_use *library_use = &table -> library_uses[use -> library_macro];
+            library_use -> nested_calls += use -> times;
+            library_use -> emitted_lines += use -> times * use -> lines;
+            library_use -> emitted_bytes += use -> times * use -> bytes;
+        }
     }
+}
 
-	macro_table.head = malloc(sizeof(Macro));
-    if (!macro_table.head) {
-        printf("Memory allocation failed\n");
-        exit(1);
+static int extend_lines(const extension *ext, const line_index *lines, const extended_file *file);
+
+/* this function returns the path of a file named by a .include, it is relative to the directory of the
+   file with the directive (unless it starts with /). runs fatal_error if memory allocation fails */
+static char *included_path(const extended_file *file, const char *name, int length) {
+    const char *slash = name[0] != '/' && file -> path ? strrchr(file -> path, '/') : NULL;
+    int directory_length = slash ? (int) (slash - file -> path) + 1 : 0;
+    char *path = malloc(directory_length + length + 1);
+
+    if (!path) {
+        console_printf("Memory allocation failed\n");
+        fatal_error();
     }
-    macro_table.head -> next = NULL;
-    macro_table.head -> name = NULL;
-    macro_table.head -> lines = NULL;
-    macro_table.head -> line_count = 0;
-    macro_table.head -> capacity = 0;
+    memcpy(path, file -> path, directory_length);
+    memcpy(path + directory_length, name, length);
+    path[directory_length + length] = '\0';
+    return path;
+}
 
-    output_file = create_output_file(source_file_name);
-    if (!output_file) {
-    	fclose(source_file);
-        return NULL;
+/* this function extends the lines of the file named by a .include directive in place of the directive.
+   arguments is the text after the directive, it must be a name in double quotes. a file is read and its
+   lines found once for the whole process (see include_cache.h). returns 1 on success, 0 on error */
+static int include_file(const extension *ext, const extended_file *file, int line_number, const char *arguments) {
+    const extended_file *includer;
+    const included_file *included;
+    extended_file inner;
+    const char *name, *end;
+    char *path;
+    int extended;
+
+    while (isspace((unsigned char) *arguments))
+        arguments++;
+    name = arguments + 1;
+    end = *arguments == '"' ? strchr(name, '"') : NULL;
+    if (!end || end == name) {
+        report_macro_problem(1, file, line_number, "Missing file name in double quotes after .include! The program will stop now.\n");
+        return 0;
     }
-    if (check_line_lengths(source_file_name)) {
-        fclose(source_file);
-        fclose(output_file);
-        return NULL;
+    if (!only_space_remain(end + 1)) {
+        report_macro_problem(1, file, line_number, "Extraneous text after .include! The program will stop now.\n");
+        return 0;
+    }
+    path = included_path(file, name, end - name);
+    for (includer = file; includer; includer = includer -> includer) {
+        if (includer -> path && strcmp(includer -> path, path) == 0) {
+            report_macro_problem(1, file, line_number, "File %s includes itself! The program will stop now.\n", path);
+            free(path);
+            return 0;
+        }
+    }
+    if (file -> depth >= MAX_INCLUDE_DEPTH) {
+        report_macro_problem(1, file, line_number, "More than %d nested .include files! The program will stop now.\n", MAX_INCLUDE_DEPTH);
+        free(path);
+        return 0;
+    }
+    add_context_dependency(current_context(), path); /* before it is read, so a watch sees a missing file appear */
+    included = acquire_context_file(current_context(), path);
+    if (!included) {
+        report_macro_problem(1, file, line_number, "Can not read included file %s: %s! The program will stop now.\n", path, strerror(errno));
+        free(path);
+        return 0;
     }
+    inner.path = included -> path;
+    inner.includer = file;
+    inner.depth = file -> depth + 1;
+    if (included -> lines.first_long_line >= 0) {
+        report_macro_problem(1, &inner, included -> lines.first_long_line + 1, "to much charchters. the maximum line length is 80!\n");
+        extended = 0;
+    } else {
+        extended = extend_lines(ext, &included -> lines, &inner);
+    }
+    release_context_file(current_context(), included);
+    free(path);
+    return extended;
+}
 
-    while (fgets(next_line, sizeof(next_line), source_file)) { /* get line from file till EOF reached */
-    	char *first_word;
-    	int len, j, macro_flag = 0;
-        line_number++;
-    	if (is_empty_line(next_line)) /* check if line empty, ignore it */
-    		continue;
+/* this function extends the lines of one file: the source, or a file it includes. the macros defined in
+   an included file stay defined after it, like the lines were part of the source */
+static int extend_lines(const extension *ext, const line_index *lines, const extended_file *file) {
+    char next_line[MAX_LINE_LENGTH + 2]; /* the line that we will read from the source file */
+    MacroTable *table = ext -> table;
+    const macro_library *library = ext -> library;
+    Macro *current_macro = NULL;
+    int inside_macro = 0; /* a flag for when inside a macro */
+    int line_number = 0; /* line counter */
 
-    	remove_leading_whitespace(next_line);
-    	if (next_line[0] == ';') /* check if line is a comment, ignore it */
+    while (line_number < lines -> count) { /* get the next line till the end of the source */
+    	word_view first_word; /* found in the line, not copied */
+    	const char *library_body; /* the lines of a library macro that is called */
+    	size_t library_body_length;
+    	Macro *called;
+    	int has_word;
+    	if ((lines -> kinds[line_number] & LINE_KIND_MASK) != LINE_TEXT) { /* empty lines and comments are ignored */
+    		line_number++;
     		continue;
+    	}
+        read_indexed_line(lines, line_number++, next_line);
+    	remove_leading_whitespace(next_line);
 
-    	first_word = find_word(next_line, 0); /* identify the first word */
+    	has_word = next_word(next_line, 0, &first_word); /* identify the first word */
 
         if (inside_macro) { /* if we are reading macro line after def */
-            if (first_word && strcmp(first_word, "endmacr") == 0) {
+            if (has_word && word_is(&first_word, "endmacr")) {
                 /* if found ending of macro */
-                char *pos = strstr(next_line, first_word) + strlen(first_word); /* find first position after "endmacr" */
+                char *pos = next_line + first_word.end; /* find first position after "endmacr" */
                 if (only_space_remain(pos)) { /* check if there is no text after the "endmacr" */
                     inside_macro = 0; /* if there is not, continue to next line */
                     current_macro = NULL;
-                    free(first_word); /* free memory allocated */
                     continue;
                 }
                 /* extraneous text */
-                printf("error: on line %d extraneous text after macro def. the program will stop now!\n", line_number);
-                free(first_word); /* free memory allocated */
-                fclose(source_file); /* close files */
-                fclose(output_file);
-                free_macro_table(&macro_table); /* free the macro table list */
-                return NULL; /* found error, now point in continuing. indicate main to go to next file */
+                report_macro_problem(1, file, line_number, "extraneous text after macro def. the program will stop now!\n");
+                return 0; /* found error, now point in continuing. indicate main to go to next file */
             }
 
-            /* Inside a macro definition, add the line to the current macro */
-            if (current_macro -> line_count == current_macro -> capacity) {
-                /* Reallocate memory for macro lines if needed */
-                current_macro -> capacity *= 2;
-                current_macro -> lines = realloc(current_macro -> lines, current_macro -> capacity * sizeof(char *));
-                if (!current_macro -> lines) {
-                    printf("Memory allocation failed\n");
-                    exit(1);
-                }
+            if (has_word && word_is(&first_word, INCLUDE_DIRECTIVE)) {
+                report_macro_problem(1, file, line_number, "A file can not be included inside a macro! The program will stop now.\n");
+                return 0;
             }
 
-			remove_leading_whitespace(next_line);
-            len = strlen(next_line) + 1; /* +1 for the null terminator */
-            current_macro -> lines[current_macro ->line_count] = malloc(len); /* allocate memory for current line */
-            if (!current_macro -> lines[current_macro -> line_count]) {
-                printf("Memory allocation failed\n");
-                exit(1);
-            }
-            memcpy(current_macro -> lines[current_macro -> line_count++], next_line, len); /* copy the line */
-            free(first_word);
+            /* Inside a macro definition, add the line to the current macro */
+            add_macro_line(table, next_line, strlen(next_line));
             continue;
         }
 
-        if (first_word && strcmp(first_word, "macr") == 0) { /* found new macro definition */
-            char *macro_name, *pos;
+        if (has_word && word_is(&first_word, "macr")) { /* found new macro definition */
+            char macro_name[MAX_LINE_LENGTH + 2], *pos;
+            word_view name_word;
+            macro_slot *slot;
+            unsigned long hash;
             int name_len;
             remove_leading_whitespace(next_line);
-            if (!only_space_remain(next_line + 4))
-                macro_name = find_word(next_line, 4);
+            if (!only_space_remain(next_line + 4) && next_word(next_line, 4, &name_word))
+                copy_word(&name_word, name_word.length, macro_name);
             else {
                 /* if the macro doesnt have a name, it is useless. so we just continue iterating */
-                printf("warning: on line %d macro defintion has no effect. no name was provided.", line_number);
-                free(first_word);
+                report_macro_problem(0, file, line_number, "macro defintion has no effect. no name was provided.");
                 continue;
             }
 
-            if (!is_legal_macro(macro_name)) { /* cheak if the macro is not named after a directive or an instruction */
-                printf("error: on line %d Illegal macro name %s! The program will stop now.\n", line_number, macro_name);
-                free(first_word); /* free all the memory allocated */
-                free(macro_name);
-                fclose(source_file); /* close the files */
-                fclose(output_file);
-                free_macro_table(&macro_table); /* free the macro table list */
-                return NULL;  /* indicate main that macro extension failed, go on to next file */
+            name_len = strlen(macro_name);
+            hash = hash_macro_name(macro_name, name_len);
+            slot = find_macro_slot(table, macro_name, name_len, hash);
+            if (slot -> name && !slot -> macro) { /* cheak if the macro is not named after a directive or an instruction */
+                report_macro_problem(1, file, line_number, "Illegal macro name %s! The program will stop now.\n", macro_name);
+                return 0;  /* indicate main that macro extension failed, go on to next file */
             }
 
 			pos = strstr(next_line, macro_name); /* find the position where the macro name starts */
             pos += strlen(macro_name); /* find the first char after the macro name */
 
             if (!only_space_remain(pos)) { /* text after definetion */
-                printf("error: on line %d Extraneous text after macro def. The program will stop now!\n", line_number);
-                free(first_word); /* free all the memory allocated */
-                free(macro_name);
-                fclose(source_file); /* close the files */
-                fclose(output_file);
-                free_macro_table(&macro_table); /* free the macro table list */
-                return NULL; /* indicate main that macro extension failed, go on to next file */
-            }
-
-			if (!macro_table.head) {
-                macro_table.head = malloc(sizeof(Macro));
-                if (!macro_table.head) {
-                    printf("Memory allocation failed\n");
-                    exit(1);
-                }
-                macro_table.head -> next = NULL;
-                macro_table.head -> name = NULL;
-                macro_table.head -> lines = NULL;
-                macro_table.head -> line_count = 0;
-                macro_table.head -> capacity = 0;
+                report_macro_problem(1, file, line_number, "Extraneous text after macro def. The program will stop now!\n");
+                return 0; /* indicate main that macro extension failed, go on to next file */
             }
 
             inside_macro = 1; /* turn on inside_macro flag */
-            current_macro = macro_table.head; /* add macro to table */
-            while (current_macro -> next)
-                current_macro = current_macro -> next;
-
-            if (current_macro -> name) {
-                current_macro -> next = malloc(sizeof(Macro));
-                if (!current_macro -> next) {
-                    printf("Memory allocation failed\n");
-                    exit(1);
-                }
-                current_macro = current_macro -> next;
-                current_macro -> next = NULL;
+            current_macro = calloc(1, sizeof(Macro)); /* add macro to the end of the list */
+            if (!current_macro) {
+                console_printf("Memory allocation failed\n");
+                fatal_error();
             }
+            if (table -> tail)
+                table -> tail -> next = current_macro;
+            else
+                table -> head = current_macro;
+            table -> tail = current_macro;
 
-            name_len = strlen(macro_name) + 1;
-            current_macro -> name = (char *) malloc(name_len);
+            current_macro -> name = (char *) malloc(name_len + 1);
             if (!current_macro -> name) {
-                printf("Memory allocation failed\n");
-                exit(1);
+                console_printf("Memory allocation failed\n");
+                fatal_error();
             }
-            memcpy(current_macro -> name, macro_name, name_len);
-
-            current_macro -> lines = malloc(sizeof(char *) * 100);
-            if (!current_macro -> lines) {
-                printf("Memory allocation failed\n");
-                exit(1);
+            memcpy(current_macro -> name, macro_name, name_len + 1);
+            current_macro -> line_number = line_number;
+            if (file -> includer) {
+                current_macro -> included_from = malloc(strlen(file -> path) + 1);
+                if (!current_macro -> included_from) {
+                    console_printf("Memory allocation failed\n");
+                    fatal_error();
+                }
+                strcpy(current_macro -> included_from, file -> path);
             }
-            current_macro -> line_count = 0;
-            current_macro -> capacity = 100;
-            free(macro_name);
-            free(first_word);
+            current_macro -> offset = table -> bodies_length; /* its lines come next */
+            if (!slot -> name) /* a macro defined again keeps its first lines, like the first match in the list */
+                add_macro_slot(table, current_macro -> name, name_len, hash, current_macro);
+            continue;
+        }
+
+        if (has_word && word_is(&first_word, INCLUDE_DIRECTIVE)) { /* the lines of another file go here */
+            if (!include_file(ext, file, line_number, next_line + first_word.end))
+                return 0;
             continue;
         }
 
         /* check if the first word is a call to a macro previously defined */
-        current_macro = macro_table.head;
-        while (current_macro != NULL) {
-            if (current_macro -> name && strcmp(first_word, current_macro -> name) == 0) {  /* compare the word to each macro name */
-                for (j = 0; j < current_macro -> line_count; j++) /* found call for macro, replace with macro lines */
-                    fprintf(output_file, "%s", current_macro -> lines[j]);
-                macro_flag = 1;
-                break;
-            }
-            current_macro = current_macro -> next;
+        called = has_word ? find_macro(table, library, first_word.text, first_word.length, &library_body, &library_body_length) : NULL;
+        if (called) { /* found call for macro, replace with its lines and the lines of the macros it calls */
+            if (!flatten_macro(table, library, called, ext -> budget, file, line_number))
+                return 0;
+            if (called -> expanded_length > 0)
+                ext -> write(ext -> data, table -> bodies + called -> expanded_offset, called -> expanded_length);
+            called -> call_sites++;
+            called -> emitted_lines += called -> expanded_lines;
+            called -> emitted_bytes += called -> expanded_length;
+            called -> self_bytes += called -> own_length;
+            if (table -> profiled)
+                count_nested_uses(table, called);
+            continue;
         }
-        if (macro_flag) {
-        	free(first_word);
+        if (library_body) {
+            if (library_body_length > 0)
+                ext -> write(ext -> data, library_body, library_body_length);
+            if (table -> library_uses) {
+                library_macro_use *use = table -> library_uses + macro_library_number(library, first_word.text, first_word.length,
+                                                                                    hash_macro_name(first_word.text, first_word.length)) - 1;
+                use -> call_sites++;
+                use -> emitted_lines += count_lines(library_body, library_body_length);
+                use -> emitted_bytes += library_body_length;
+            }
             continue;
         }
 
-        fprintf(output_file, "%s", next_line); /* copy non-macro lines as is */
-        free(first_word); /* free allocated memory before next iteration */
+        ext -> write(ext -> data, next_line, strlen(next_line)); /* copy non-macro lines as is */
+    }
+    if (inside_macro && file -> includer) { /* the including file does not go on with the macro */
+        report_macro_problem(1, file, line_number, "Macro %s is not closed at the end of the file! The program will stop now.\n", current_macro -> name);
+        return 0;
     }
-    fclose(source_file); /* close both files */
-    fclose(output_file);
-    free_macro_table(&macro_table);
-    return output_file; /* return the output file (a pointer to it) */
+    return 1;
 }
 
-FILE *create_output_file(const char *source_file_name) {
-    FILE *output_file; /* the output file */
-    char *output_file_name; /* name of the output file */
-    int len = strlen(source_file_name) + 1; /* +1 for the null terminator */
-    output_file_name = (char *)malloc(len); /* allocate memory */
-    if (!output_file_name) {
-        printf("Memory allocation failed!\n");
-        exit(1);
+
+
+/* this function is macro_extender_with_writer with the macro table given by the caller, that keeps it
+   and frees it. a call to a macro the source does not define is looked up in the library, if there is one.
+   path is the .as file of the source, the files it includes are found next to it */
+static int extend_macros(const memory_file *source, const char *path, MacroTable *table, const macro_library *library, long budget,
+                         expanded_text_writer write, void *data) {
+    line_index lines; /* the lines of the source, found once for the check and the extension */
+    extended_file file;
+    extension ext;
+    int extended;
+
+    if (!build_line_index(&lines, source -> data, source -> size, MAX_LINE_LENGTH + 2)) {
+        console_printf("Memory allocation failed\n");
+        fatal_error();
+    }
+    if (check_indexed_line_lengths(&lines)) { /* the error is printed by the check */
+        free_line_index(&lines);
+        return 0;
     }
+    file.path = path;
+    file.includer = NULL;
+    file.depth = 0;
+    ext.table = table;
+    ext.library = library;
+    ext.budget = budget;
+    ext.write = write;
+    ext.data = data;
+    extended = extend_lines(&ext, &lines, &file);
+    free_line_index(&lines);
+    return extended; /* the caller closes the output */
+}
 
-    strcpy(output_file_name, source_file_name); /* Copy the source file name to the new memory */
-    strcpy(output_file_name + len - 4, ".am"); /* add ".am" instead of .as */
+/* The writer of a profiled source: it counts the characters of the extended source on their way */
+typedef struct {
+    expanded_text_writer write;
+    void *data;
+    size_t length;
+} counting_writer;
 
-    output_file = fopen(output_file_name, "w"); /* create the file */
-    if (!output_file) {
-        printf("Can not create output file\n");
-        free(output_file_name);
-        return NULL;
+static void write_counted(void *data, const char *text, size_t length) {
+    counting_writer *writer = (counting_writer *) data;
+    writer -> length += length;
+    writer -> write(writer -> data, text, length);
+}
+
+/* A macro in the profile of a source */
+typedef struct {
+    const char *name;
+    int name_length;
+    const char *file;      /* Where it is defined, NULL for a library macro */
+    int line_number;
+    long call_sites;
+    long nested_calls;
+    long emitted_lines;
+    size_t emitted_bytes;
+    size_t self_bytes;
+    long order;            /* Its place in the definitions, ties keep it */
+} profile_entry;
+
+/* this function puts the macros that wrote the most characters first */
+static int compare_profile_entries(const void *first, const void *second) {
+    const profile_entry *a = (const profile_entry *) first, *b = (const profile_entry *) second;
+    if (a -> emitted_bytes != b -> emitted_bytes)
+        return a -> emitted_bytes > b -> emitted_bytes ? -1 : 1;
+    return a -> order < b -> order ? -1 : a -> order > b -> order;
+}
+
+/* this function prints a string as a JSON string, the characters that need no escape a run at a time */
+static void print_json_string(const char *text, int length) {
+    int i, run = 0;
+    console_printf("\"");
+    for (i = 0; i < length; i++) {
+        if (text[i] != '"' && text[i] != '\\' && (unsigned char) text[i] >= 0x20)
+            continue;
+        if (i > run)
+            console_printf("%.*s", i - run, text + run);
+        if (text[i] == '"' || text[i] == '\\')
+            console_printf("\\%c", text[i]);
+        else
+            console_printf("\\u%04x", (unsigned char) text[i]);
+        run = i + 1;
     }
+    console_printf("%.*s\"", length - run, text + run);
+}
+
+/* this function prints the profile of a source: every macro it defines and every library macro it calls,
+   with the calls in its lines, the calls inside the lines of other macros, the lines and characters all
+   of them wrote to the extended source and their share of it (inclusive: the macros they call included,
+   so a nested macro counts for its caller too), then the characters their own lines wrote and the share
+   of those (self: every character counts for one macro, so these add up to at most 100). the macros that
+   wrote the most come first */
+static void print_macro_profile(int format, const char *name, const char *path, const MacroTable *table,
+                                const macro_library *library, size_t total) {
+    const library_macro_use *library_uses = table -> library_uses;
+    unsigned long library_count = library ? library -> macro_count : 0, i;
+    long count = 0, k;
+    profile_entry *entries;
+    Macro *macro;
 
-    free(output_file_name); /* Free allocated memory */
-    return output_file; /* Return the output file (a pointer to it to) */
+    entries = malloc((table -> count + library_count + 1) * sizeof(profile_entry));
+    if (!entries) {
+        console_printf("Memory allocation failed\n");
+        fatal_error();
+    }
+    for (macro = table -> head; macro; macro = macro -> next) {
+        int length = strlen(macro -> name);
+        if (find_macro_slot(table, macro -> name, length, hash_macro_name(macro -> name, length)) -> macro != macro)
+            continue; /* a name defined again is never called */
+        entries[count].name = macro -> name;
+        entries[count].name_length = length;
+        entries[count].file = macro -> included_from ? macro -> included_from : path;
+        entries[count].line_number = macro -> line_number;
+        entries[count].call_sites = macro -> call_sites;
+        entries[count].nested_calls = macro -> nested_calls;
+        entries[count].emitted_lines = macro -> emitted_lines;
+        entries[count].emitted_bytes = macro -> emitted_bytes;
+        entries[count].self_bytes = macro -> self_bytes;
+        entries[count].order = count;
+        count++;
+    }
+    for (i = 0; i < library_count; i++) {
+        size_t length;
+        if (library_uses[i].call_sites == 0 && library_uses[i].nested_calls == 0)
+            continue; /* a library may have many macros, only the ones the source calls are shown */
+        entries[count].name = macro_library_name(library, i, &length);
+        entries[count].name_length = (int) length;
+        entries[count].file = NULL;
+        entries[count].line_number = 0;
+        entries[count].call_sites = library_uses[i].call_sites;
+        entries[count].nested_calls = library_uses[i].nested_calls;
+        entries[count].emitted_lines = library_uses[i].emitted_lines;
+        entries[count].emitted_bytes = library_uses[i].emitted_bytes;
+        entries[count].self_bytes = library_uses[i].emitted_bytes; /* its body was flattened when the library was built */
+        entries[count].order = count;
+        count++;
+    }
+    qsort(entries, count, sizeof(profile_entry), compare_profile_entries);
+
+    if (format == MACRO_PROFILE_JSON) {
+        console_printf("{\"source\":");
+        print_json_string(path, strlen(path));
+        console_printf(",\"extended_bytes\":%lu,\"macros\":[", (unsigned long) total);
+    }
+    for (k = 0; k < count; k++) {
+        profile_entry *entry = &entries[k];
+        double share = total > 0 ? 100.0 * entry -> emitted_bytes / total : 0.0;
+        double self_share = total > 0 ? 100.0 * entry -> self_bytes / total : 0.0;
+        if (format == MACRO_PROFILE_JSON) {
+            console_printf("%s{\"name\":", k > 0 ? "," : "");
+            print_json_string(entry -> name, entry -> name_length);
+            console_printf(",\"defined\":");
+            if (entry -> file) {
+                print_json_string(entry -> file, strlen(entry -> file));
+                console_printf(",\"line\":%d", entry -> line_number);
+            } else {
+                console_printf("\"library\"");
+            }
+            console_printf(",\"calls\":%ld,\"nested\":%ld,\"lines\":%ld,\"bytes\":%lu,\"inclusive_share\":%.1f,\"self_bytes\":%lu,\"self_share\":%.1f}",
+                           entry -> call_sites, entry -> nested_calls, entry -> emitted_lines, (unsigned long) entry -> emitted_bytes, share,
+                           (unsigned long) entry -> self_bytes, self_share);
+        } else {
+            console_printf("macro %s %.*s ", name, entry -> name_length, entry -> name);
+            if (entry -> file)
+                console_printf("%s:%d", entry -> file, entry -> line_number);
+            else
+                console_printf("library");
+            console_printf(" %ld %ld %ld %lu %.1f %lu %.1f\n", entry -> call_sites, entry -> nested_calls, entry -> emitted_lines,
+                           (unsigned long) entry -> emitted_bytes, share, (unsigned long) entry -> self_bytes, self_share);
+        }
+    }
+    if (format == MACRO_PROFILE_JSON)
+        console_printf("]}\n");
+    free(entries);
+}
+
+int macro_extender_with_writer(const memory_file *source, expanded_text_writer write, void *data) {
+    asm_ctx *ctx = current_context();
+    const char *name = ctx && ctx -> name ? ctx -> name : ASM_DEFAULT_NAME;
+    const macro_library *library = ctx ? ctx -> macro_library : NULL;
+    int profile = ctx ? ctx -> macro_profile : MACRO_PROFILE_OFF;
+    MacroTable macro_table; /* the macro_table */
+    counting_writer counter;
+    char *path = malloc(strlen(name) + 4);
+    int extended;
+
+    if (!path) {
+        console_printf("Memory allocation failed\n");
+        fatal_error();
+    }
+    sprintf(path, "%s.as", name);
+    initialize_macro_table(&macro_table);
+    if (profile != MACRO_PROFILE_OFF) { /* the calls are counted by the extension, the characters on their way out */
+        macro_table.profiled = 1;
+        if (library && !(macro_table.library_uses = calloc(library -> macro_count + 1, sizeof(library_macro_use)))) {
+            console_printf("Memory allocation failed\n");
+            fatal_error();
+        }
+        counter.write = write;
+        counter.data = data;
+        counter.length = 0;
+        write = write_counted;
+        data = &counter;
+    }
+    extended = extend_macros(source, path, &macro_table, library, ctx ? ctx -> macro_budget : DEFAULT_MACRO_BUDGET, write, data);
+    if (extended && profile != MACRO_PROFILE_OFF)
+        print_macro_profile(profile, name, path, &macro_table, library, counter.length);
+    free_macro_table(&macro_table); /* free the macro table list */
+    free(path);
+    return extended;
+}
+
+int collect_macros(const memory_file *source, const char *path, MacroTable *table) {
+    return extend_macros(source, path, table, NULL, DEFAULT_MACRO_BUDGET, discard_text, NULL);
+}
+
+int may_include_files(const memory_file *source) {
+    size_t length = strlen(INCLUDE_DIRECTIVE), i;
+    for (i = 0; i + length <= source -> size; i++)
+        if (source -> data[i] == '.' && memcmp(source -> data + i, INCLUDE_DIRECTIVE, length) == 0)
+            return 1;
+    return 0;
 }
 
 /* this function is to check that the macro name is legal
@@ -260,7 +904,9 @@ FILE *create_output_file(const char *source_file_name) {
  * is indeed legal
 */
 int is_legal_macro(const char *macro) {
-    int num_illegal_macros = sizeof(illegal_macro_names) / sizeof(illegal_macro_names[0]), i; /* calculate the number of memebers in matrix */
+    asm_ctx *ctx = current_context();
+    const char *const *illegal_macro_names = ctx ? ctx -> illegal_macro_names : default_illegal_macro_names;
+    int num_illegal_macros = ctx ? ctx -> illegal_macro_count : DEFAULT_ILLEGAL_MACRO_COUNT, i;
     for (i = 0; i < num_illegal_macros; i++)  /* iterate through the matrix */
         if (strcmp(macro, illegal_macro_names[i]) == 0)  /* compare ilegaames) l name with the macro name */
             return 0; /* Macro name is illegal */
@@ -274,16 +920,20 @@ int is_legal_macro(const char *macro) {
 */
 void free_macro_table(MacroTable *macro_table) {
     Macro *current = macro_table -> head; /* to iterate the list take the head */
-    int i;
     while (current) { /* while not at the end */
         Macro *next = current -> next; /* take the next node and keep it */
         free(current -> name); /* free the macro name */
-        for (i = 0; i < current -> line_count; i++) { /* free each macro line */
-            free(current -> lines[i]);
-        }
-        free(current -> lines); /* free the array of lines */
+        free(current -> included_from);
+        free(current -> nested);
         free(current); /* free the node */
         current = next; /* move to next */
     }
+    free(macro_table -> slots); /* the names in it belong to the macros or the context */
+    free(macro_table -> bodies); /* the lines of all the macros */
+    free(macro_table -> library_uses);
     macro_table -> head = NULL; /* the list is emptyt now */
+    macro_table -> tail = NULL;
+    macro_table -> slots = NULL;
+    macro_table -> bodies = NULL;
+    macro_table -> library_uses = NULL;
 }
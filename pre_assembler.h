@@ -5,58 +5,174 @@
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include "memory_file.h"
 
 #define MAX_LINE_LENGTH 80
 
-/* Structure representing a macro with its name, lines of code, line count, and a pointer to the next macro in a linked list. */
+#define MACRO_BODIES_INITIAL_CAPACITY 4096 /* Bytes first allocated for the lines of the macros of a table */
+#define DEFAULT_MACRO_BUDGET 65536         /* Lines one macro call may expand to, calls inside the macro included */
+#define MAX_MACRO_BUDGET 100000000         /* Upper limit for --macro-budget */
+#define INCLUDE_DIRECTIVE ".include"       /* .include "file.as" extends the lines of file.as in its place */
+#define MAX_INCLUDE_DEPTH 16               /* Upper limit for .include files that include other files */
+
+/* What --macro-profile prints after the macros of a source are extended */
+#define MACRO_PROFILE_OFF 0                /* Nothing */
+#define MACRO_PROFILE_TEXT 1               /* A line per macro: "macro prog NAME DEFINITION CALLS NESTED LINES BYTES INCLUSIVE_SHARE SELF_BYTES SELF_SHARE" */
+#define MACRO_PROFILE_JSON 2               /* A JSON object per source, on one line */
+
+struct Macro;
+
+/* With a profile: a macro whose lines end up in the flattened lines of another one, and how many times */
+typedef struct {
+    struct Macro *macro;           /* The macro, NULL for a macro of the library */
+    unsigned long library_macro;   /* The number of the library macro */
+    long times;                    /* Its calls in the flattened lines, through the macros they call too */
+    long lines;                    /* Lines one call of it writes */
+    size_t bytes;                  /* Characters one call of it writes */
+    size_t own_bytes;              /* Characters of them that come from its own lines, not from the macros it calls */
+} nested_use;
+
+/* The calls of one macro of a library, for the profile */
+typedef struct {
+    long call_sites;
+    long nested_calls;     /* Calls of it inside the lines of other macros */
+    long emitted_lines;
+    size_t emitted_bytes;
+    int nested_mark;       /* While a macro is flattened, its nested use of this one + 1 */
+} library_macro_use;
+
+#define MACRO_WORD_FILTER_BITS 128 /* Bits in the prefilter of the first words of the flattened lines of a macro */
+
+/* Structure representing a macro with its name, its lines of code, and a pointer to the next macro in a linked list.
+   The lines are one span of the bodies of the table. A line of the macro may call another macro, so the lines
+   a call writes to the extended source are flattened once (every call inside expanded) and kept as a second span. */
 typedef struct Macro {
     char *name;            /* The name of the macro */
-    char **lines;          /* Array of lines of code in the macro */
-    int line_count;        /* Number of lines in the macro */
-    int capacity;          /* Capacity of the lines array */
+    int line_number;       /* The line of the source the macro is defined on */
+    char *included_from;   /* The included file the macro is defined in, NULL for the source */
+    size_t offset;         /* Where the lines of the macro start in the bodies of the table */
+    size_t length;         /* Number of characters in the lines, new lines included */
+    size_t expanded_offset; /* Where the flattened lines start in the bodies of the table */
+    size_t expanded_length; /* Number of characters in the flattened lines */
+    long expanded_lines;   /* Number of flattened lines */
+    size_t own_length;     /* Characters of the flattened lines that are its own lines, the ones that call no macro */
+    size_t expanded_room;  /* Characters in the span of its own the flattened lines were written to, 0 for none */
+    int expanded;          /* 1 while the flattened lines are good, a new macro one of them calls makes them stale */
+    unsigned char line_words[MACRO_WORD_FILTER_BITS / 8]; /* Prefilter of the first words of the flattened lines */
+    int flattening;        /* 1 while the calls inside the macro are expanded, a call back to it is recursion */
+    long call_sites;       /* Lines of the source (and its included files) that call it, for the profile */
+    long nested_calls;     /* Calls of it inside the lines of the macros those lines call */
+    long emitted_lines;    /* Lines all those calls wrote to the extended source, the macros it calls included */
+    size_t emitted_bytes;  /* Characters those calls wrote */
+    size_t self_bytes;     /* Characters of them its own lines wrote, so every character of the extended source counts once */
+    nested_use *nested;    /* With a profile: the macros its flattened lines come from, once each */
+    int nested_count;
+    int nested_capacity;
+    int nested_mark;       /* While a macro is flattened, its nested use of this one + 1 */
     struct Macro *next;    /* Pointer to the next macro in the list */
 } Macro;
 
-/* Structure representing a table of macros, which is essentially a linked list of Macro structures. */
+#define MACRO_TABLE_INITIAL_CAPACITY 64  /* Slots of a new macro table, a power of 2 */
+#define MACRO_FILTER_BITS 4096           /* Bits in the prefilter of a macro table, a power of 2 */
+
+/* A slot of a macro table: a name and its macro. A reserved name is kept with no macro, so the
+   check of a new macro name is a lookup too. */
+typedef struct {
+    const char *name;      /* The name, NULL for an empty slot */
+    int length;            /* Number of characters in the name */
+    unsigned long hash;    /* The hash of the name */
+    Macro *macro;          /* The macro, NULL for a reserved name */
+} macro_slot;
+
+/* Structure representing a table of macros. The macros are kept in a linked list in the order of their
+   definitions, and found by name in an open addressing hash table (linear probing). The prefilter has
+   two bits set for the hash of each macro name, so most words that are not macros are ruled out
+   without probing the table. */
 typedef struct {
     Macro *head;           /* Head of the linked list of macros */
+    Macro *tail;           /* The last macro in the list */
+    macro_slot *slots;     /* The hash table */
+    int capacity;          /* Number of slots, a power of 2 */
+    int count;             /* Number of slots in use */
+    unsigned char filter[MACRO_FILTER_BITS / 8]; /* The prefilter */
+    char *bodies;          /* The lines of all the macros, one after the other */
+    size_t bodies_length;  /* Number of characters in bodies */
+    size_t bodies_capacity; /* Allocated size of bodies */
+    int profiled;          /* 1 if the calls of the macros are counted for --macro-profile */
+    library_macro_use *library_uses; /* With a profile and a library: the calls of each library macro */
 } MacroTable;
 
-/* Array of reserved macro names that are not allowed as macro names. */
-char *illegal_macro_names[] = {
-    "mov",
-    "cmp",
-    "add",
-    "sub",
-    "lea",
-    "not",
-    "clr",
-    "inc",
-    "dec",
-    "jmp",
-    "bne",
-    "red",
-    "prn",
-    "jsr",
-    "rts",
-    "stop",
-    ".data",
-    ".string",
-    ".extern",
-    ".entry"
-};
-
-/* Create and open an output file with the given filename.
-   @param filename: The name of the file to create.
-   @return: A FILE pointer to the created file, or NULL on failure. */
-FILE *create_output_file(const char *filename);
-
-/* Check if a macro name is legal or not, based on a predefined list of illegal macro names.
+#define DEFAULT_ILLEGAL_MACRO_COUNT 21 /* Number of names in default_illegal_macro_names */
+
+/* Reserved names that are not allowed as macro names, every context starts with these (see context.h). */
+extern const char *const default_illegal_macro_names[];
+
+/* Extend the macros of a source into an output file.
+   @param source: The source (.as), kept in memory. Its lines are found once, for the length check and the extension.
+   @param output_file: Where the extended source (.am) is written, opened by the caller.
+   @return: 1 on success, 0 if the source has errors (they are printed). */
+int macro_extender(const memory_file *source, FILE *output_file);
+
+/* Receives the extended source a line at a time, or all the lines of a macro call at once (the last line may have no new line) */
+typedef void (*expanded_text_writer)(void *data, const char *text, size_t length);
+
+/* Extend the macros of a source, handing the extended source to a writer instead of a stream.
+   A line .include "file.as" is replaced with the extended lines of file.as, found next to the .as file
+   of the current context, and the macros it defines stay defined. The file is added to the dependencies
+   of the context.
+   @param source: The source (.as), kept in memory.
+   @param write: Called with every line of the extended source (.am), in order.
+   @param data: Passed as is to write.
+   @return: 1 on success, 0 if the source has errors (they are printed). */
+int macro_extender_with_writer(const memory_file *source, expanded_text_writer write, void *data);
+
+/* Extend the macros of a source into nothing, only to keep its macro definitions (for a macro library).
+   @param source: The source (.as), kept in memory.
+   @param path: The .as file of the source, the files it includes are found next to it.
+   @param table: Receives the macros, set up by initialize_macro_table. The macros of earlier sources stay in it.
+   @return: 1 on success, 0 if the source has errors (they are printed). */
+int collect_macros(const memory_file *source, const char *path, MacroTable *table);
+
+/* Tell whether a source may include other files, so its outputs depend on more than its own contents.
+   @param source: The source (.as), kept in memory.
+   @return: 1 if .include appears anywhere in it, 0 if it certainly includes nothing. */
+int may_include_files(const memory_file *source);
+
+/* Flatten every macro of a table, so the bodies of a macro library need no more expansion.
+   @param table: The macros, filled by collect_macros.
+   @param budget: Lines one macro may expand to.
+   @return: 1 on success, 0 if a macro calls itself or expands to more lines than the budget (it is printed). */
+int flatten_macros(MacroTable *table, long budget);
+
+/* Set up an empty macro table, with the illegal macro names of the current context (the default ones
+   outside of a context) as reserved names. Runs fatal_error if memory allocation fails.
+   @param table: The table to set up, free it with free_macro_table. */
+void initialize_macro_table(MacroTable *table);
+
+/* Hash a macro name (FNV-1a), the same for the macro tables and the macro libraries.
+   @param name: The name, it does not have to be null terminated.
+   @param length: Number of characters in the name.
+   @return: The hash, 32 bits. */
+unsigned long hash_macro_name(const char *name, int length);
+
+/* Add a name to a prefilter of macro names.
+   @param filter: MACRO_FILTER_BITS bits.
+   @param hash: hash_macro_name of the name. */
+void add_to_macro_filter(unsigned char *filter, unsigned long hash);
+
+/* Check a name against a prefilter of macro names.
+   @param filter: MACRO_FILTER_BITS bits.
+   @param hash: hash_macro_name of the name.
+   @return: 0 if the name is not in the filter, 1 if it may be. */
+int may_be_macro(const unsigned char *filter, unsigned long hash);
+
+/* Check if a macro name is legal or not, based on the illegal macro names of the current context
+   (the default ones outside of a context).
    @param macro_name: The name of the macro to check.
    @return: 1 if the macro name is legal, 0 otherwise. */
 int is_legal_macro(const char *macro_name);
 
-/* Free the memory allocated for a macro table, including all macros and their lines.
+/* Free the memory allocated for a macro table, including all macros, their lines and the hash table.
    @param table: A pointer to the MacroTable to free. */
 void free_macro_table(MacroTable *table);
 
@@ -3,6 +3,8 @@
 #include "parser.h"
 #include "util.h"
 #include "globals.h"
+#include "console.h"
+#include "assembler.h"
 
 /* Find a label in the label table by its name */
 label *find_label(label_table *table, const char *label_name);
@@ -13,77 +15,66 @@ char** extract_labels_from_instruction(const char *directive, const char *operan
 
 /* Parse operands to identify labels and handle them according to whether they are internal or external.
    Updates the instruction encoding and external label table as necessary. */
-void parse_operands_for_labels(const char *operands, label_table *table, label_table *extern_entry, code_conv *instructions, int *IC, location *am_file, external_label_table *externals);
+void parse_operands_for_labels(const token_span *operands, label_table *table, label_table *extern_entry, code_conv *instructions, int *IC, location *am_file, external_label_table *externals);
 
 /* Find the index of an opcode in the opcode list based on the instruction name. */
 int find_opcode_index(const char *instruction_name);
 
-/* Create output files for object code, entry labels, and external labels based on the provided filename and tables. */
-void create_output_files(const char *filename_with_ext, code_conv *instructions, int IC, code_conv *data, int DC, label_table *labels, external_label_table *externals, FILE *am_file, label_table *extern_entry);
+/* Create output files for object code, entry labels, and external labels based on the provided tables. */
+void create_output_files(code_conv *instructions, int IC, code_conv *data, int DC, label_table *labels, external_label_table *externals, label_table *extern_entry, assembly_output *output);
 
-void execute_second_pass(FILE *source_file, code_conv *instructions, code_conv *data, label_table labels, location *am_file, int *cc_capacity, int DC, label_table extern_entry) {
-    char line[MAX_LINE_LENGTH];
-    int IC = 0, errors_found = 0;
+void execute_second_pass(const token_list *tokens, code_conv *instructions, code_conv *data, label_table labels, location *am_file, int *cc_capacity, int DC, label_table extern_entry, assembly_output *output, int mode) {
+    int IC = 0, errors_found = 0, next_token = 0;
     external_label_table externals;
         
-    /* Initialize line counter in the location structure */
+    /* Initialize line counter in the location structure, the tokens are the ones the first pass walked */
     am_file->line = 0;
-    
-    /* Rewind the source file to the beginning */
-    rewind(source_file);
 
     /* Initialize the external label table */
     initialize_external_label_table(&externals);
 
-    /* Process each line from the source file */
-    while (fgets(line, MAX_LINE_LENGTH, source_file)) {
-        char *first_word;
-        char *directive;
-        char *operands;
-        int first_word_len;
+    /* Process the tokens of each line */
+    while (next_token < tokens->count) {
+        token_span statement, operands;
+        word_view first_word, directive;
 		
-        /* Increment the line counter */
-        am_file->line++;
-        
-        /* Find the first word in the line */
-        first_word = find_word(line, 0);
-        if (!first_word) { 
-            continue;
-        }
-        first_word_len = strlen(first_word) - 1;
+        /* Take the tokens of the next line, a line has at least one */
+        next_token = next_statement(tokens, next_token, &statement);
+        am_file->line = statement.tokens[0].line + 1;
+        next_field(&statement, 0, &first_word);
 
         /* If the first word ends with a colon, it's a label; adjust the directive accordingly */
-        if (first_word[first_word_len] == ':') {
-            first_word[first_word_len] = '\0';
-            directive = find_word(line, first_word_len + 2);
+        if (first_word.text[first_word.length - 1] == ':') {
+            if (!next_field(&statement, first_word.end, &directive))
+                continue;
         } else {
             directive = first_word;
         }
 
         /* Skip lines with directives (.data, .string, .extern, .entry) */
-        if (strcmp(directive, ".data") == 0 || strcmp(directive, ".string") == 0 || 
-            strcmp(directive, ".extern") == 0 || strcmp(directive, ".entry") == 0) {
+        if (word_is(&directive, ".data") || word_is(&directive, ".string") || 
+            word_is(&directive, ".extern") || word_is(&directive, ".entry")) {
             continue;
         }
         
-        /* Find operands after the directive */
-        operands = find_position_after_directive(line, directive);
-        if (!operands || only_space_remain(operands)) {
+        /* The operands are the tokens after the directive */
+        sub_span(&statement, directive.end, statement.count, &operands);
+        if (operands.count == 0) {
             IC++;  
             continue;
         }
 
         /* Increment instruction counter and parse operands for labels */
         IC++;
-        parse_operands_for_labels(operands, &labels, &extern_entry, instructions, &IC, am_file, &externals);
+        parse_operands_for_labels(&operands, &labels, &extern_entry, instructions, &IC, am_file, &externals);
     }
 
-    /* Print error message if errors were found; otherwise, create output files */
+    /* Print error message if errors were found; otherwise, create output files (--check only wants the errors) */
     if (errors_found) {
-        printf("Errors were found during the second pass. Assembly process aborted.\n");
-    } else {
-        create_output_files(am_file->file_name, instructions, IC, data, DC, &labels, &externals, source_file, &extern_entry);
-        printf("\nSecond pass completed successfully.\n");
+        console_printf("Errors were found during the second pass. Assembly process aborted.\n");
+    } else if (mode == ASSEMBLE_FULL) {
+        create_output_files(instructions, IC, data, DC, &labels, &externals, &extern_entry, output);
+        console_printf("\nSecond pass completed successfully.\n");
     }
 
     /* Free memory allocated for external labels */
@@ -113,8 +104,6 @@ unsigned short encode_label_address(int address, int is_external) {
 
 /* Check if a given operand is a label, either in the internal label table or the external label table */
 int is_label(const char *operand, label_table *table, label_table *externs) {
-    int i;
-    
     /* Check if the operand starts with an alphabetic character */
     if (!isalpha(operand[0])) {
         return 0;  /* Not a label if it doesn't start with an alphabetic character */
@@ -126,77 +115,52 @@ int is_label(const char *operand, label_table *table, label_table *externs) {
     }
     
     /* Check if the operand matches any label in the internal label table */
-    for (i = 0; i < table->count; i++) {
-        if (strcmp(operand, table->labels[i].name) == 0) {
-            return 1;  /* Operand is a label found in the internal table */
-        }
+    if (lookup_label(table, operand)) {
+        return 1;  /* Operand is a label found in the internal table */
     }
 
     /* Check if the operand matches any label in the external label table */
-    for (i = 0; i < externs->count; i++) {
-        if (strcmp(operand, externs->labels[i].name) == 0) {
-            return 1;  /* Operand is a label found in the external table */
-        }
+    if (lookup_label(externs, operand)) {
+        return 1;  /* Operand is a label found in the external table */
     }
     
     return 0;  /* Operand is not a label in either table */
 }
 
-/* Check if a given string represents a register */
-int is_register(const char *str) {
-    /* Check if the input string is NULL or too short to be a register */
-    if (str == NULL || strlen(str) < 2) {
-        return 0;  /* Not a register if the string is NULL or too short */
-    }
-
-    /* Check if the string matches the format for a register (e.g., r0 to r7) */
-    if (str[0] == 'r' && isdigit(str[1]) && str[2] == '\0') {
-        return 1;  /* The string is a valid register (e.g., r0, r1, ..., r7) */
-    } 
-    /* Check if the string matches the format for an indirect register (e.g., *r0) */
-    else if (str[0] == '*' && str[1] == 'r' && isdigit(str[2]) && str[3] == '\0') {
-        return 1;  /* The string is a valid indirect register (e.g., *r0, *r1, ..., *r7) */
-    }
-
-    return 0;  /* The string does not match any register format */
-}
-
 /* Parse operands for labels, update instruction encoding, and handle external labels */
-void parse_operands_for_labels(const char *operands, label_table *table, label_table *extern_entry, code_conv *instructions, int *IC, location *am_file, external_label_table *externals) {
-    char *operand_copy;
-    char *token;
+void parse_operands_for_labels(const token_span *operands, label_table *table, label_table *extern_entry, code_conv *instructions, int *IC, location *am_file, external_label_table *externals) {
+    char name[MAX_LINE_LENGTH + 2]; /* an operand as a string, to look it up. it is a part of one line */
     label *label_info, *is_extern;
-    size_t operands_len;
-    int operand_count = 0, register_found = 0;
-
-    /* Get the length of the operands string */
-    operands_len = strlen(operands);
-    
-    /* Allocate memory for a copy of the operands string */
-    operand_copy = (char *)malloc(operands_len + 1);
-    if (operand_copy == NULL) {
-        printf("Memory allocation failed\n");
-        return;  /* Exit if memory allocation fails */
-    }
-    strcpy(operand_copy, operands);
-
-    /* Tokenize the operands string by commas */
-    token = strtok(operand_copy, ",");
-    while (token != NULL) {
-        /* Remove leading and trailing whitespace from the token */
-        token = trim_whitespace(token);
+    int operand_count = 0, register_found = 0, first = 0;
+
+    /* The operands are the tokens between the commas */
+    while (first < operands->count) {
+        token_span operand_tokens;
+        word_view operand_text;
+        int end = first, kind;
+
+        while (end < operands->count && operands->tokens[end].kind != TOKEN_COMMA)
+            end++;
+        if (end == first) { /* nothing between two commas */
+            first = end + 1;
+            continue;
+        }
+        sub_span(operands, first, end, &operand_tokens);
+        span_text(&operand_tokens, &operand_text);
+        kind = operands->tokens[first].kind;
+        first = end + 1;
         
-        /* Check if the token is a label */
-        if (is_label(token, table, extern_entry)) {
+        /* Check if the operand is a label, only a word that starts with a letter may be one */
+        if ((kind == TOKEN_IDENTIFIER || kind == TOKEN_REGISTER) && is_label(copy_word(&operand_text, operand_text.length, name), table, extern_entry)) {
             int is_external = 0;
 
             /* Find label information in the internal label table */
-            label_info = find_label(table, token);
+            label_info = find_label(table, name);
             /* Find label information in the external label table */
-            is_extern = find_label(extern_entry, token);
+            is_extern = find_label(extern_entry, name);
             
             /* If the label is external, add it to the external label table */
-            if (is_extern && is_extern->is_external) {
+            if (is_extern && is_extern->flags & LABEL_EXTERNAL) {
                 is_external = 1;
 
                 /* Resize the external labels table if needed */
@@ -204,16 +168,15 @@ void parse_operands_for_labels(const char *operands, label_table *table, label_t
                     externals->capacity *= 2;
                     externals->labels = realloc(externals->labels, externals->capacity * sizeof(label));
                     if (externals->labels == NULL) {
-                        printf("Memory allocation failed\n");
-                        free(operand_copy);
+                        console_printf("Memory allocation failed\n");
                         return;  /* Exit if memory reallocation fails */
                     }
                 }
 
                 /* Add the external label to the table */
                 externals->labels[externals->count].address = *IC + 100 + operand_count;
-                strcpy(externals->labels[externals->count].name, token);
-                externals->labels[externals->count].is_external = 1;
+                strcpy(externals->labels[externals->count].name, name);
+                externals->labels[externals->count].flags = LABEL_EXTERNAL;
                 externals->count++;
             }
 
@@ -224,12 +187,12 @@ void parse_operands_for_labels(const char *operands, label_table *table, label_t
                 instructions[*IC + operand_count].binary_repres = encode_label_address(is_extern->address, is_external);
             } else {
                 /* Print an error if the label is not found */
-                PRINT_ERROR1(am_file->file_name, am_file->line, "Label '%s' not found in the label table.\n", token);
+                PRINT_ERROR1(am_file->file_name, am_file->line, "Label '%s' not found in the label table.\n", name);
             }
         }
         
-        /* Check if the token is a register */
-        if (is_register(token)) {
+        /* Check if the operand is a register */
+        if (operand_tokens.count == 1 && (kind == TOKEN_REGISTER || kind == TOKEN_INDIRECT)) {
             if (register_found) {
                 /* Decrement operand_count if a second register is found */
                 operand_count--;
@@ -240,19 +203,16 @@ void parse_operands_for_labels(const char *operands, label_table *table, label_t
         
         /* Increment operand count */
         operand_count++;
-        token = strtok(NULL, ",");  /* Get the next token */
     }
 
     /* Update the instruction counter */
     *IC += operand_count;
-
-    /* Free the allocated memory for operand_copy */
-    free(operand_copy);
 }
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 
 int references_external_label(const code_conv *instruction, const char *label_name);
 
@@ -266,7 +226,7 @@ char **get_external_labels(label_table *table, int *external_count) {
 
     /* First, count the number of external labels */
     for (i = 0; i < table->count; i++) {
-        if (table->labels[i].is_external) {
+        if (table->labels[i].flags & LABEL_EXTERNAL) {
             count++;
         }
     }
@@ -274,7 +234,7 @@ char **get_external_labels(label_table *table, int *external_count) {
     /* Allocate memory for the array of strings */
     external_labels = (char **)malloc(count * sizeof(char *));
     if (!external_labels) {
-        printf("Memory allocation failed\n");
+        console_printf("Memory allocation failed\n");
         *external_count = 0;
         return NULL;
     }
@@ -282,11 +242,11 @@ char **get_external_labels(label_table *table, int *external_count) {
     /* Copy the names of external labels */
     count = 0;
     for (i = 0; i < table->count; i++) {
-        if (table->labels[i].is_external) {
+        if (table->labels[i].flags & LABEL_EXTERNAL) {
             external_labels[count] = (char *)malloc(strlen(table->labels[i].name) + 1);
             if (!external_labels[count]) {
                 int j;
-                printf("Memory allocation failed\n");
+                console_printf("Memory allocation failed\n");
                 /* Free previously allocated memory before returning NULL */
                 for (j = 0; j < count; j++) {
                     free(external_labels[j]);
@@ -305,74 +265,22 @@ char **get_external_labels(label_table *table, int *external_count) {
 }
 
 
-char *get_line_from_file(int line_number, FILE *file) {
-    int current_line = 1;
-    char *line = NULL;
-    size_t len = 0;
-    char buffer[1024];
-
-    if (line_number < 1 || file == NULL) {
-        return NULL;
-    }
-
-    /* Move to the beginning of the file */
-    rewind(file);
-
-    /* Read the file line by line until the desired line is found */
-    while (fgets(buffer, sizeof(buffer), file) != NULL) {
-        if (current_line == line_number) {
-            len = strlen(buffer);
-            line = (char *)malloc((len + 1) * sizeof(char));
-            if (line == NULL) {
-                return NULL; /* Memory allocation failed */
-            }
-            strcpy(line, buffer);
-            return line;
-        }
-        current_line++;
-    }
-
-    /* If the function reaches this point, the desired line was not found */
-    return NULL;
-}
-
-/* Create output files for object code, entry labels, and external labels */
-void create_output_files(const char *filename_with_ext, code_conv *instructions, int IC, code_conv *data, int DC, label_table *labels, external_label_table *externals, FILE *am_file, label_table *extern_entry) {
-    char base_filename[FILENAME_MAX];
-    char obj_filename[FILENAME_MAX];
-    char ent_filename[FILENAME_MAX];
-    char ext_filename[FILENAME_MAX];
+/* Create output files for object code, entry labels, and external labels.
+   The files are written into output, the caller decides where they are stored. */
+void create_output_files(code_conv *instructions, int IC, code_conv *data, int DC, label_table *labels, external_label_table *externals, label_table *extern_entry, assembly_output *output) {
     FILE *obj_file, *ent_file, *ext_file;
     int has_entries = 0, has_externals = 0, external_count;
     int i;
     label *lbl, *lbl_copy;
-    size_t len;
     char **external_label_names;
     
     /* Get the list of external label names */
     external_label_names = get_external_labels(extern_entry, &external_count);
-    
-    /* Remove the .am extension to get the base filename */
-    strncpy(base_filename, filename_with_ext, FILENAME_MAX - 1);
-    len = strlen(base_filename);
-    if (len > 3 && strcmp(base_filename + len - 3, ".am") == 0) {
-        base_filename[len - 3] = '\0';  /* Remove the last 3 characters (.am) */
-    }
-
-    /* Create output filenames by appending appropriate extensions */
-    if (strlen(base_filename) + 3 < FILENAME_MAX) {
-        sprintf(obj_filename, "%s.ob", base_filename); /* Object file */
-        sprintf(ent_filename, "%s.ent", base_filename); /* Entries file */
-        sprintf(ext_filename, "%s.ext", base_filename); /* Externals file */
-    } else {
-        fprintf(stderr, "Filename too long\n");
-        return;  /* Exit if the filename is too long */
-    }
 
     /* Create and open the object file for writing */
-    obj_file = fopen(obj_filename, "w");
+    obj_file = open_memory_file_for_writing(&output->object);
     if (!obj_file) {
-        perror("Error creating object file");
+        console_printf("Error creating object file: %s\n", strerror(errno));
         return;  /* Exit if the object file cannot be created */
     }
 
@@ -389,15 +297,16 @@ void create_output_files(const char *filename_with_ext, code_conv *instructions,
         fprintf(obj_file, "%04d %05o\n", 100 + IC + i, data[i].binary_repres);
     }
     fclose(obj_file);
+    output->has_object = 1;
 
     /* Create and open the entries file if there are entries */
     for (i = 0; i < extern_entry->count; i++) {
         lbl = &extern_entry->labels[i];
-        if (lbl->is_entry) {
+        if (lbl->flags & LABEL_ENTRY) {
             if (!has_entries) {
-                ent_file = fopen(ent_filename, "w");
+                ent_file = open_memory_file_for_writing(&output->entries);
                 if (!ent_file) {
-                    perror("Error creating entries file");
+                    console_printf("Error creating entries file: %s\n", strerror(errno));
                     return;  /* Exit if the entries file cannot be created */
                 }
                 has_entries = 1;
@@ -409,9 +318,9 @@ void create_output_files(const char *filename_with_ext, code_conv *instructions,
     }
 	if (externals->count > 0) {
     	/* Create and open the externals file */
-    	ext_file = fopen(ext_filename, "w");
+    	ext_file = open_memory_file_for_writing(&output->externals);
     	if (!ext_file) {
-        	perror("Error creating externals file");
+        	console_printf("Error creating externals file: %s\n", strerror(errno));
         	return;  /* Exit if the externals file cannot be created */
     	}
 		has_externals = 1;
@@ -427,12 +336,15 @@ void create_output_files(const char *filename_with_ext, code_conv *instructions,
     for (i = 0; i < external_count; i++) {
         free(external_label_names[i]);  /* Free each label name */
     }
+    free(external_label_names);
     
     /* Close the entries and externals files if they were created */
     if (has_entries) {
         fclose(ent_file);
+        output->has_entries = 1;
     }
     if (has_externals) {
         fclose(ext_file);
+        output->has_externals = 1;
     }
 }
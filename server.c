@@ -0,0 +1,546 @@
+#define _GNU_SOURCE /* SO_PEERCRED */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "server.h"
+#include "assembler.h"
+#include "console.h"
+#include "batch.h"
+#include "memory_file.h"
+#include "util.h"
+#include "libasm.h"
+
+#define SERVER_PROGRAM_NAME "assembler" /* argv[0] of the command lines run for clients */
+
+/* One frame of a request or a reply */
+typedef struct {
+    char keyword[MAX_FRAME_KEYWORD + 1];
+    char *name;              /* The name after the length, NULL if there is none */
+    memory_file payload;     /* The bytes of the frame (null terminated) */
+} frame;
+
+/* A request, collected from its frames */
+typedef struct {
+    char *directory;          /* Where the request runs, NULL to run where the server started */
+    char **arguments;         /* The command line arguments */
+    int argument_count;
+    memory_file names_input;  /* What "--manifest -" reads */
+    char **source_names;      /* The names of the inline sources */
+    memory_file *sources;     /* The inline sources */
+    int source_count;
+} server_request;
+
+static volatile sig_atomic_t stop_requested = 0;
+static int server_directory = -1; /* The directory the server started in, every request starts there */
+static pthread_mutex_t serve_lock = PTHREAD_MUTEX_INITIALIZER; /* A request changes the directory and the console of the process, so one is served at a time */
+static pthread_mutex_t connections_lock = PTHREAD_MUTEX_INITIALIZER; /* Guards open_connections */
+static pthread_cond_t connections_closed = PTHREAD_COND_INITIALIZER;  /* Signaled when open_connections drops to 0 */
+static int open_connections = 0;  /* Connections whose thread did not finish yet */
+
+static void request_stop(int signal_number) {
+    stop_requested = 1;
+}
+
+/* this function reads one frame, returns 0 at the end of the stream or if the frame is malformed */
+static int read_frame(FILE *stream, frame *next) {
+    char header[MAX_FRAME_HEADER];
+    char *end, *space;
+    unsigned long length;
+
+    next -> name = NULL;
+    next -> payload.data = NULL;
+    next -> payload.size = 0;
+    if (!fgets(header, sizeof(header), stream) || !(end = strchr(header, '\n')))
+        return 0;
+    *end = '\0';
+
+    space = strchr(header, ' ');
+    if (!space || space - header > MAX_FRAME_KEYWORD)
+        return 0;
+    memcpy(next -> keyword, header, space - header);
+    next -> keyword[space - header] = '\0';
+
+    length = strtoul(space + 1, &end, 10);
+    if (end == space + 1 || (*end != '\0' && *end != ' ') || length > (unsigned long) MAX_FRAME_SIZE)
+        return 0;
+    if (*end == ' ' && !(next -> name = my_strdup(end + 1)))
+        return 0;
+
+    next -> payload.data = malloc(length + 1);
+    if (!next -> payload.data || fread(next -> payload.data, 1, length, stream) != length) {
+        free(next -> name);
+        free(next -> payload.data);
+        return 0;
+    }
+    next -> payload.data[length] = '\0';
+    next -> payload.size = length;
+    return 1;
+}
+
+void write_frame(FILE *stream, const char *keyword, const char *name, const char *data, size_t size) {
+    fprintf(stream, "%s %lu%s%s\n", keyword, (unsigned long) size, name ? " " : "", name ? name : "");
+    if (size > 0)
+        fwrite(data, 1, size, stream);
+}
+
+void write_output_frames(FILE *stream, const char *name, assembly_output *output) {
+    int kind;
+    for (kind = 0; kind < OUTPUT_KINDS; kind++) {
+        memory_file *contents = produced_file(output, kind);
+        char *file_name;
+        if (!contents || !(file_name = malloc(strlen(name) + strlen(output_extension(kind)) + 1)))
+            continue;
+        sprintf(file_name, "%s%s", name, output_extension(kind));
+        write_frame(stream, "output", file_name, contents -> data, contents -> size);
+        free(file_name);
+    }
+}
+
+/* this function appends an item to a growing array, returns 0 if memory allocation failed */
+static int append_item(void **items, int count, size_t item_size, const void *item) {
+    char *new_items = realloc(*items, (count + 1) * item_size);
+    if (!new_items)
+        return 0;
+    memcpy(new_items + count * item_size, item, item_size);
+    *items = new_items;
+    return 1;
+}
+
+static void free_request(server_request *request) {
+    int i;
+    free(request -> directory);
+    for (i = 0; i < request -> argument_count; i++)
+        free(request -> arguments[i]);
+    free(request -> arguments);
+    free_memory_file(&request -> names_input);
+    for (i = 0; i < request -> source_count; i++) {
+        free(request -> source_names[i]);
+        free_memory_file(&request -> sources[i]);
+    }
+    free(request -> source_names);
+    free(request -> sources);
+}
+
+/* this function reads the frames of a request up to its "end" frame.
+   returns 1 on success, 0 if the request is malformed or cut short */
+static int read_request(FILE *stream, server_request *request) {
+    frame next;
+
+    memset(request, 0, sizeof(*request));
+    while (read_frame(stream, &next)) {
+        int stored = 1;
+        if (strcmp(next.keyword, "end") == 0) {
+            free(next.name);
+            free_memory_file(&next.payload);
+            return 1;
+        } else if (strcmp(next.keyword, "cwd") == 0 && !request -> directory) {
+            request -> directory = next.payload.data;
+        } else if (strcmp(next.keyword, "arg") == 0) {
+            stored = append_item((void **) &request -> arguments, request -> argument_count, sizeof(char *), &next.payload.data);
+            request -> argument_count += stored;
+        } else if (strcmp(next.keyword, "stdin") == 0) {
+            free_memory_file(&request -> names_input);
+            request -> names_input = next.payload;
+        } else if (strcmp(next.keyword, "source") == 0 && next.name) {
+            stored = append_item((void **) &request -> sources, request -> source_count, sizeof(memory_file), &next.payload) &&
+                     append_item((void **) &request -> source_names, request -> source_count, sizeof(char *), &next.name);
+            if (stored) {
+                request -> source_count++;
+                next.name = NULL; /* now owned by the request */
+            }
+        } else {
+            stored = 0; /* an unknown frame */
+        }
+        free(next.name);
+        if (!stored) {
+            free_memory_file(&next.payload);
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/* this function serves a request: runs its command line and assembles its inline sources.
+   the outputs of the inline sources are stored in outputs. returns the exit code */
+static int serve_request(server_request *request, assembly_output *outputs) {
+    asm_ctx *ctx = NULL;
+    int exit_code = 0, i;
+
+    if (request -> directory && chdir(request -> directory) < 0) {
+        console_printf("Can not change to directory %s: %s\n", request -> directory, strerror(errno));
+        return 1;
+    }
+
+    for (i = 0; i < request -> argument_count; i++) {
+        if (strcmp(request -> arguments[i], "--watch") == 0) { /* it would keep the server busy forever */
+            console_printf("--watch can not be used through the server\n");
+            return 1;
+        }
+        if (strcmp(request -> arguments[i], "-") == 0) { /* the client sends a lone "-" as a source */
+            console_printf("The standard input (-) can not be combined with other arguments through the server\n");
+            return 1;
+        }
+    }
+
+    if (request -> argument_count > 0 || request -> source_count == 0) {
+        char **argv = malloc((request -> argument_count + 2) * sizeof(char *));
+        FILE *names_input = open_memory_file_for_reading(&request -> names_input);
+        if (!argv || !names_input) {
+            console_printf("Memory allocation failed\n");
+            free(argv);
+            if (names_input)
+                fclose(names_input);
+            return 1;
+        }
+        argv[0] = SERVER_PROGRAM_NAME;
+        for (i = 0; i < request -> argument_count; i++)
+            argv[i + 1] = request -> arguments[i];
+        argv[request -> argument_count + 1] = NULL;
+        exit_code = run_command(request -> argument_count + 1, argv, names_input, 0);
+        fclose(names_input);
+        free(argv);
+    }
+
+    if (request -> source_count > 0 && !(ctx = asm_ctx_create())) {
+        console_printf("Memory allocation failed\n");
+        return 1;
+    }
+    if (ctx)
+        asm_ctx_set_emit_am(ctx, 1); /* the clients of inline sources always got the .am output */
+    for (i = 0; i < request -> source_count; i++) {
+        size_t length = strlen(request -> source_names[i]);
+        if (length > 3 && strcmp(request -> source_names[i] + length - 3, ".as") == 0)
+            request -> source_names[i][length - 3] = '\0'; /* like a name on the command line */
+        if (!asm_ctx_set_name(ctx, request -> source_names[i])) {
+            console_printf("Memory allocation failed\n");
+            exit_code = 1;
+            continue;
+        }
+        if (asm_assemble_buffer(ctx, request -> sources[i].data, request -> sources[i].size, &outputs[i]) != FILE_SUCCEEDED)
+            exit_code = 1;
+    }
+    asm_ctx_destroy(ctx);
+    return exit_code;
+}
+
+/* this function reads one request from a client, serves it and sends the reply */
+static void handle_connection(int fd) {
+    server_request request;
+    assembly_output *outputs = NULL;
+    memory_file console_text = {NULL, 0};
+    FILE *input, *output, *console_stream;
+    char status[16];
+    int exit_code = 1, i;
+
+    input = fdopen(fd, "r");
+    output = fdopen(dup(fd), "w");
+    if (!input || !output) {
+        if (input)
+            fclose(input);
+        else
+            close(fd);
+        if (output)
+            fclose(output);
+        return;
+    }
+
+    console_stream = open_memory_file_for_writing(&console_text);
+    if (!read_request(input, &request)) {
+        if (console_stream)
+            fprintf(console_stream, "Malformed request\n");
+    } else if (console_stream) {
+        outputs = calloc(request.source_count ? request.source_count : 1, sizeof(assembly_output));
+        if (outputs) {
+            /* everything printed while the request is served goes to the client */
+            pthread_mutex_lock(&serve_lock);
+            console_set_stream(console_stream);
+            exit_code = serve_request(&request, outputs);
+            if (fchdir(server_directory) < 0) /* a request without a cwd frame must not run in this one's */
+                console_printf("Can not change back to the directory of the server: %s\n", strerror(errno));
+            console_set_stream(NULL);
+            pthread_mutex_unlock(&serve_lock);
+        } else {
+            fprintf(console_stream, "Memory allocation failed\n");
+        }
+    }
+    if (console_stream)
+        fclose(console_stream);
+
+    write_frame(output, "console", NULL, console_text.data, console_text.size);
+    for (i = 0; outputs && i < request.source_count; i++) {
+        write_output_frames(output, request.source_names[i], &outputs[i]);
+        free_assembly_output(&outputs[i]);
+    }
+    sprintf(status, "%d", exit_code);
+    write_frame(output, "status", NULL, status, strlen(status));
+
+    free(outputs);
+    free_request(&request);
+    free_memory_file(&console_text);
+    fclose(output);
+    fclose(input);
+}
+
+/* this function reads, serves and answers one connection, then counts it as closed */
+static void *connection_thread(void *argument) {
+    handle_connection((int) (long) argument);
+    pthread_mutex_lock(&connections_lock);
+    if (--open_connections == 0)
+        pthread_cond_signal(&connections_closed);
+    pthread_mutex_unlock(&connections_lock);
+    return NULL;
+}
+
+/* this function hands a connection to a thread of its own, so a client that is slow to send its request
+   or to read the reply does not hold up the others. SIGINT and SIGTERM stay with the thread in accept.
+   if no thread can be started, the connection is handled right here */
+static void start_connection(int fd) {
+    pthread_attr_t attributes;
+    pthread_t thread;
+    sigset_t signals, old_signals;
+    int started;
+
+    pthread_mutex_lock(&connections_lock);
+    open_connections++;
+    pthread_mutex_unlock(&connections_lock);
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    started = pthread_create(&thread, &attributes, connection_thread, (void *) (long) fd) == 0;
+    pthread_attr_destroy(&attributes);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (!started)
+        connection_thread((void *) (long) fd);
+}
+
+/* this function connects to the server at socket_path, returns the socket or -1 */
+static int connect_to_server(const char *socket_path) {
+    struct sockaddr_un address;
+    int fd;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+/* this function binds the socket with a file only its owner can use: a client can make the
+   server read and write files, so no other user may connect */
+static int bind_private(int fd, const struct sockaddr_un *address) {
+    mode_t old_mask = umask(0177);
+    int result = bind(fd, (const struct sockaddr *) address, sizeof(*address));
+    umask(old_mask);
+    return result;
+}
+
+/* this function returns 1 if the process at the other end of a connection runs as the user of the server */
+static int peer_is_owner(int fd) {
+#ifdef SO_PEERCRED
+    struct ucred credentials;
+    socklen_t length = sizeof(credentials);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0 && credentials.uid == getuid();
+#else
+    (void) fd;
+    return 1; /* the socket file is 0600, that is all this system offers */
+#endif
+}
+
+/* this function creates the listening socket, returns it or -1 (the error was printed) */
+static int open_listening_socket(const char *socket_path) {
+    struct sockaddr_un address;
+    int fd, result;
+
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        printf("Socket path is too long: %s\n", socket_path);
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        printf("Can not create a socket: %s\n", strerror(errno));
+        return -1;
+    }
+    result = bind_private(fd, &address);
+    if (result < 0 && errno == EADDRINUSE) {
+        /* either another server is running, or one that is gone left its socket file behind */
+        int probe = connect_to_server(socket_path);
+        if (probe >= 0) {
+            close(probe);
+            close(fd);
+            printf("Another server is already listening on %s\n", socket_path);
+            return -1;
+        }
+        unlink(socket_path);
+        result = bind_private(fd, &address);
+    }
+    if (result < 0 || listen(fd, SERVER_BACKLOG) < 0) {
+        printf("Can not listen on %s: %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int run_server(const char *socket_path) {
+    struct sigaction action;
+    struct timeval timeout;
+    int listen_fd;
+
+    server_directory = open(".", O_RDONLY);
+    if (server_directory < 0) {
+        printf("Can not open the current directory: %s\n", strerror(errno));
+        return 1;
+    }
+    listen_fd = open_listening_socket(socket_path);
+    if (listen_fd < 0) {
+        close(server_directory);
+        return 1;
+    }
+
+    /* no SA_RESTART, so a signal interrupts accept and the loop can end */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN); /* a client that went away must not stop the server */
+
+    timeout.tv_sec = SERVER_TIMEOUT_SECONDS;
+    timeout.tv_usec = 0;
+
+    printf("Assembler server listening on %s\n", socket_path);
+    fflush(stdout);
+    while (!stop_requested) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            printf("Can not accept a connection: %s\n", strerror(errno));
+            break;
+        }
+        if (!peer_is_owner(fd)) {
+            close(fd); /* another user, it gets no reply at all */
+            continue;
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        start_connection(fd);
+    }
+
+    /* the requests that were accepted are still answered */
+    pthread_mutex_lock(&connections_lock);
+    while (open_connections > 0)
+        pthread_cond_wait(&connections_closed, &connections_lock);
+    pthread_mutex_unlock(&connections_lock);
+    close(listen_fd);
+    close(server_directory);
+    unlink(socket_path);
+    printf("Assembler server stopped\n");
+    return stop_requested ? 0 : 1;
+}
+
+int run_client(const char *socket_path, int argc, char *argv[]) {
+    char directory[FILENAME_MAX];
+    memory_file names_input = {NULL, 0};
+    FILE *input, *output, *messages;
+    frame reply;
+    int fd, i, exit_code = -1, uses_stdin = 0;
+    int is_filter = argc == 1 && strcmp(argv[0], "-") == 0; /* the source on stdin, the frames on stdout */
+
+    messages = is_filter ? stderr : stdout;
+    fd = connect_to_server(socket_path);
+    if (fd < 0) {
+        fprintf(messages, "Can not connect to the assembler server at %s: %s\n", socket_path, strerror(errno));
+        return 1;
+    }
+    input = fdopen(fd, "r");
+    output = fdopen(dup(fd), "w");
+    if (!input || !output) {
+        fprintf(messages, "Can not connect to the assembler server at %s: %s\n", socket_path, strerror(errno));
+        if (input)
+            fclose(input);
+        else
+            close(fd);
+        if (output)
+            fclose(output);
+        return 1;
+    }
+
+    /* send the command line, the server runs it in our directory */
+    if (getcwd(directory, sizeof(directory)))
+        write_frame(output, "cwd", NULL, directory, strlen(directory));
+    for (i = 0; i < argc && !is_filter; i++) {
+        write_frame(output, "arg", NULL, argv[i], strlen(argv[i]));
+        if (strcmp(argv[i], "--manifest") == 0 && i + 1 < argc && strcmp(argv[i + 1], "-") == 0)
+            uses_stdin = 1;
+    }
+    if (uses_stdin || is_filter) {
+        if (!read_memory_file(stdin, &names_input)) {
+            fprintf(messages, "Can not read the standard input\n");
+            fclose(output);
+            fclose(input);
+            return 1;
+        }
+        if (is_filter)
+            write_frame(output, "source", STANDARD_INPUT_NAME, names_input.data, names_input.size);
+        else
+            write_frame(output, "stdin", NULL, names_input.data, names_input.size);
+        free_memory_file(&names_input);
+    }
+    write_frame(output, "end", NULL, NULL, 0);
+    fflush(output);
+
+    /* print the reply as if we assembled the files ourselves */
+    while (exit_code < 0 && read_frame(input, &reply)) {
+        if (strcmp(reply.keyword, "console") == 0) {
+            fwrite(reply.payload.data, 1, reply.payload.size, messages);
+            fflush(messages);
+        } else if (strcmp(reply.keyword, "output") == 0 && is_filter) {
+            write_frame(stdout, "output", reply.name, reply.payload.data, reply.payload.size);
+        } else if (strcmp(reply.keyword, "status") == 0) {
+            exit_code = atoi(reply.payload.data);
+            if (is_filter)
+                write_frame(stdout, "status", NULL, reply.payload.data, reply.payload.size);
+        }
+        free(reply.name);
+        free_memory_file(&reply.payload);
+    }
+    if (exit_code < 0) {
+        fprintf(messages, "The assembler server closed the connection before it replied\n");
+        exit_code = 1;
+    }
+
+    fclose(output);
+    fclose(input);
+    return exit_code;
+}
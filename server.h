@@ -0,0 +1,88 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include "memory_file.h"
+
+#define SERVER_ENVIRONMENT_VARIABLE "ASSEMBLER_SERVER" /* When set, the assembler is a client of the server at this socket */
+#define SERVER_BACKLOG 64                              /* Connections that may wait to be accepted */
+#define SERVER_TIMEOUT_SECONDS 30                      /* A client that is silent this long is dropped */
+#define MAX_FRAME_HEADER 4096                          /* Upper limit for the header line of a frame */
+#define MAX_FRAME_KEYWORD 15                           /* Upper limit for the keyword of a frame */
+#define MAX_FRAME_SIZE (64L * 1024 * 1024)             /* Upper limit for the payload of a frame */
+
+/*
+ * The server and its clients talk in frames. A frame is a header line
+ * "<keyword> <length>[ <name>]\n" followed by exactly <length> bytes.
+ *
+ * A request is a sequence of frames ending with "end 0":
+ *   cwd     - the directory relative paths are resolved in.
+ *   arg     - one command line argument, as for a normal run (repeated).
+ *   stdin   - what "--manifest -" reads the file names from.
+ *   source  - an inline source, named by the frame's name (repeated).
+ *             Its outputs are sent back instead of being written to disk.
+ *
+ * The reply is a sequence of frames ending with "status":
+ *   console - everything the assembler printed.
+ *   output  - an output of an inline source, named "<name>.am", "<name>.ob", ...
+ *   status  - the exit code, as text.
+ *
+ * Each connection is read and answered on a thread of its own, so a slow client does
+ * not hold up the others. The requests are served one after the other, each in its
+ * own directory: the one of its cwd frame, or the one the server started in if it
+ * has none.
+ *
+ * A run on the standard input (the input file "-") writes the same output and
+ * status frames to the standard output, and its messages to the standard error.
+ */
+
+/*
+ * Writes one frame.
+ *
+ * Parameters:
+ *   stream - Where the frame goes.
+ *   keyword - The keyword of the frame.
+ *   name - The name after the length, or NULL.
+ *   data - The payload.
+ *   size - Number of bytes in the payload.
+ */
+void write_frame(FILE *stream, const char *keyword, const char *name, const char *data, size_t size);
+
+/*
+ * Writes an "output" frame for each file a source produced.
+ *
+ * Parameters:
+ *   stream - Where the frames go.
+ *   name - The name of the source, without the .as extension.
+ *   output - What the source produced.
+ */
+void write_output_frames(FILE *stream, const char *name, assembly_output *output);
+
+/*
+ * Listens on a Unix domain socket and serves requests until SIGINT or SIGTERM.
+ * A socket file left over by a server that is gone is replaced. The socket file is created
+ * with mode 0600 and connections from processes of other users are closed unanswered.
+ *
+ * Parameters:
+ *   socket_path - Where to create the socket.
+ *
+ * Returns:
+ *   The exit code: 0 after a clean stop, 1 if the socket could not be set up.
+ */
+int run_server(const char *socket_path);
+
+/*
+ * Sends a command line to the server and prints its reply as if the
+ * assembler ran in this process.
+ *
+ * Parameters:
+ *   socket_path - The socket of the server.
+ *   argc - Number of arguments.
+ *   argv - The arguments, without the program name.
+ *
+ * Returns:
+ *   The exit code the server reported, 1 if the server could not be reached.
+ */
+int run_client(const char *socket_path, int argc, char *argv[]);
+
+#endif
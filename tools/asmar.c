@@ -0,0 +1,181 @@
+/* asmar - lists and extracts the archives written by "assembler --archive".
+ *
+ * Usage: asmar list ARCHIVE
+ *        asmar extract ARCHIVE [-C DIR] [MODULE...]
+ *
+ * extract writes the output files of the modules (all of them if none is named)
+ * exactly as a run without --archive would have, prog.am, prog.ob, prog.ent and
+ * prog.ext next to where prog.as was, or under DIR. Named modules are found
+ * through the archive's hash index, without reading the rest of the archive.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "../archive.h"
+#include "../io_backend.h"
+
+/* this function prints every module and the outputs it has */
+static int list_modules(const archive_reader *reader) {
+    unsigned long module;
+    memory_file contents;
+    size_t length;
+    int kind;
+
+    for (module = 0; module < reader -> module_count; module++) {
+        const char *name = archive_module_name(reader, module, &length);
+        printf("%.*s", (int) length, name);
+        for (kind = 0; kind < ARCHIVE_OUTPUT_KINDS; kind++)
+            if (archive_module_output(reader, module, kind, &contents))
+                printf(" %s", output_extension(kind));
+        printf("\n");
+    }
+    return 0;
+}
+
+/* this function creates the directories above path, the last one created is remembered
+   in previous so a run over many modules in one directory does not ask again */
+static void create_parent_directories(char *path, char **previous) {
+    char *slash = strrchr(path, '/'), *p;
+
+    if (!slash || slash == path)
+        return;
+    *slash = '\0';
+    if (!*previous || strcmp(*previous, path) != 0) {
+        for (p = path + 1; *p; p++) {
+            if (*p == '/') {
+                *p = '\0';
+                mkdir(path, 0777);
+                *p = '/';
+            }
+        }
+        mkdir(path, 0777);
+        free(*previous);
+        *previous = malloc(strlen(path) + 1);
+        if (*previous)
+            strcpy(*previous, path);
+    }
+    *slash = '/';
+}
+
+/* this function adds the outputs of one module to the files to write.
+   returns 0 if memory allocation failed */
+static int add_module_files(const archive_reader *reader, unsigned long module, const char *directory, io_file *files, int *count, char **previous) {
+    size_t length;
+    const char *name = archive_module_name(reader, module, &length);
+    int kind;
+
+    for (kind = 0; kind < ARCHIVE_OUTPUT_KINDS; kind++) {
+        io_file *file = &files[*count];
+        char *path;
+        memset(file, 0, sizeof(io_file));
+        if (!archive_module_output(reader, module, kind, &file -> contents))
+            continue;
+        path = malloc((directory ? strlen(directory) + 1 : 0) + length + strlen(output_extension(kind)) + 1);
+        if (!path)
+            return 0;
+        if (directory)
+            sprintf(path, "%s/%.*s%s", directory, (int) length, name, output_extension(kind));
+        else
+            sprintf(path, "%.*s%s", (int) length, name, output_extension(kind));
+        create_parent_directories(path, previous);
+        file -> path = path;
+        (*count)++;
+    }
+    return 1;
+}
+
+/* this function writes one batch of files and reports the ones that failed, returns the number of failures */
+static int write_files(io_backend *backend, io_file *files, int count) {
+    io_batch batch;
+    int i, failed = 0;
+
+    batch.files = files;
+    batch.count = count;
+    io_batch_start_write(backend, &batch);
+    io_batch_finish(backend, &batch);
+    for (i = 0; i < count; i++) {
+        if (files[i].error) {
+            fprintf(stderr, "Can not create output file %s: %s\n", files[i].path, strerror(files[i].error));
+            failed++;
+        }
+        free((char *) files[i].path);
+    }
+    return failed;
+}
+
+/* this function extracts the named modules, or all of them, DEFAULT_IO_BATCH modules at a time */
+static int extract_modules(const archive_reader *reader, const char *directory, char **names, int name_count) {
+    io_file *files = malloc(DEFAULT_IO_BATCH * ARCHIVE_OUTPUT_KINDS * sizeof(io_file));
+    unsigned long total = name_count > 0 ? (unsigned long) name_count : reader -> module_count, i;
+    char *previous = NULL;
+    io_backend backend;
+    int count = 0, modules = 0, failed = 0;
+
+    if (!files) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    io_backend_open(&backend, IO_BACKEND_AUTO);
+    for (i = 0; i < total; i++) {
+        long module = (long) i;
+        if (name_count > 0 && (module = archive_find(reader, names[i])) < 0) {
+            fprintf(stderr, "Module %s is not in the archive\n", names[i]);
+            failed++;
+            continue;
+        }
+        if (!add_module_files(reader, (unsigned long) module, directory, files, &count, &previous)) {
+            fprintf(stderr, "Memory allocation failed\n");
+            failed++;
+            break;
+        }
+        if (++modules == DEFAULT_IO_BATCH) {
+            failed += write_files(&backend, files, count);
+            count = modules = 0;
+        }
+    }
+    if (count > 0)
+        failed += write_files(&backend, files, count);
+    io_backend_close(&backend);
+
+    free(previous);
+    free(files);
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char *argv[]) {
+    archive_reader reader;
+    const char *directory = NULL;
+    char **names;
+    int is_list, i, name_count = 0, exit_code;
+
+    if (argc < 3 || (strcmp(argv[1], "list") != 0 && strcmp(argv[1], "extract") != 0) || (strcmp(argv[1], "list") == 0 && argc != 3)) {
+        printf("Usage: %s list ARCHIVE\n", argv[0]);
+        printf("       %s extract ARCHIVE [-C DIR] [MODULE...]\n", argv[0]);
+        return 1;
+    }
+    is_list = strcmp(argv[1], "list") == 0;
+
+    names = malloc(argc * sizeof(char *));
+    if (!names) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    for (i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "-C") == 0 && i + 1 < argc)
+            directory = argv[++i];
+        else
+            names[name_count++] = argv[i];
+    }
+
+    if (!archive_open(&reader, argv[2])) {
+        fprintf(stderr, "Can not read archive %s: %s\n", argv[2], errno == EINVAL ? "not an archive or damaged" : strerror(errno));
+        free(names);
+        return 1;
+    }
+    exit_code = is_list ? list_modules(&reader) : extract_modules(&reader, directory, names, name_count);
+    archive_close(&reader);
+    free(names);
+    return exit_code;
+}
@@ -0,0 +1,95 @@
+/* asmlib - compiles macro definitions into a macro library for "assembler --macro-lib".
+ *
+ * Usage: asmlib build LIBRARY SOURCE...
+ *        asmlib list LIBRARY
+ *
+ * build reads the macro definitions of the sources (whole file names, e.g. common.as)
+ * and writes them to LIBRARY, a file that the assembler maps into memory and uses
+ * without parsing it again. The other lines of the sources are ignored. A macro that
+ * is defined twice keeps its first definition, like it does in a source. A macro
+ * that calls other macros of the sources is stored with those calls expanded.
+ * list prints every macro of a library with the number of lines it has.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "../macro_library.h"
+#include "../pre_assembler.h"
+#include "../memory_file.h"
+
+/* this function prints every macro of a library and the number of its lines */
+static int list_macros(const macro_library *library) {
+    unsigned long macro;
+    size_t name_length, body_length, i;
+
+    for (macro = 0; macro < library -> macro_count; macro++) {
+        const char *name = macro_library_name(library, macro, &name_length);
+        const char *body = macro_library_body(library, macro, &body_length);
+        int line_count = 0;
+        for (i = 0; i < body_length; i++)
+            if (body[i] == '\n')
+                line_count++;
+        if (body_length > 0 && body[body_length - 1] != '\n')
+            line_count++;
+        printf("%.*s %d\n", (int) name_length, name, line_count);
+    }
+    return 0;
+}
+
+/* this function reads the macro definitions of the sources into one table and writes it as a library */
+static int build_library(const char *path, char **sources, int source_count) {
+    MacroTable table;
+    int i, failed = 0;
+
+    initialize_macro_table(&table);
+    for (i = 0; i < source_count; i++) {
+        memory_file source = {NULL, 0};
+        FILE *file = fopen(sources[i], "rb");
+        if (!file || !read_memory_file(file, &source)) {
+            fprintf(stderr, "Can not read %s: %s\n", sources[i], strerror(errno));
+            if (file)
+                fclose(file);
+            failed = 1;
+            continue;
+        }
+        fclose(file);
+        if (!collect_macros(&source, sources[i], &table)) {
+            fflush(stdout); /* the errors were printed there */
+            fprintf(stderr, "The macro definitions of %s have errors\n", sources[i]);
+            failed = 1;
+        }
+        free_memory_file(&source);
+    }
+    if (!failed && !flatten_macros(&table, DEFAULT_MACRO_BUDGET)) {
+        fflush(stdout);
+        fprintf(stderr, "The macros of %s can not be expanded\n", path);
+        failed = 1;
+    }
+    if (!failed && !macro_library_write(path, &table)) {
+        fprintf(stderr, "Can not write macro library %s: %s\n", path, strerror(errno));
+        failed = 1;
+    }
+    free_macro_table(&table);
+    return failed;
+}
+
+int main(int argc, char *argv[]) {
+    macro_library library;
+    int exit_code;
+
+    if (argc >= 4 && strcmp(argv[1], "build") == 0)
+        return build_library(argv[2], argv + 3, argc - 3);
+    if (argc != 3 || strcmp(argv[1], "list") != 0) {
+        printf("Usage: %s build LIBRARY SOURCE...\n", argv[0]);
+        printf("       %s list LIBRARY\n", argv[0]);
+        return 1;
+    }
+    if (!macro_library_open(&library, argv[2])) {
+        fprintf(stderr, "Can not read macro library %s: %s\n", argv[2], errno == EINVAL ? "not a macro library or damaged" : strerror(errno));
+        return 1;
+    }
+    exit_code = list_macros(&library);
+    macro_library_close(&library);
+    return exit_code;
+}
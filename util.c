@@ -3,18 +3,20 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdarg.h>
+#include "util.h"
+#include "console.h"
+#include "fatal.h"
+#include "context.h"
 
 #define MAX_LINE_LENGTH 80
 
-/* this function finds the next word in a line from a given index */
-char *find_word(char *line, int start) {
+/* this function finds the next word in a line from a given index, the word stays in the line */
+int next_word(const char *line, int start, word_view *word) {
     int end;
-    char *word;
-    int word_length;
 
     /* Check if the input line is NULL */
     if (line == NULL) 
-        return NULL;
+        return 0;
 
     /* Skip leading whitespace from the start index */
     while (line[start] != '\0' && isspace((unsigned char)line[start])) 
@@ -22,28 +24,48 @@ char *find_word(char *line, int start) {
     
     /* If the end of the line is reached, no word found */
     if (line[start] == '\0') 
-        return NULL;
+        return 0;
 
     /* Find the end of the word by scanning until a whitespace or end of line is encountered */
     end = start;
     while (line[end] != '\0' && !isspace((unsigned char)line[end])) 
         end++;
-    
-    /* Calculate the length of the word */
-    word_length = end - start;
+
+    word -> text = line + start;
+    word -> length = end - start;
+    word -> end = end;
+    return 1;
+}
+
+/* this function checks if a word is the given string */
+int word_is(const word_view *word, const char *text) {
+    return strncmp(word -> text, text, word -> length) == 0 && text[word -> length] == '\0';
+}
+
+/* this function copies (a prefix of) a word into a buffer as a string */
+char *copy_word(const word_view *word, int length, char *buffer) {
+    if (length > word -> length)
+        length = word -> length;
+    memcpy(buffer, word -> text, length);
+    buffer[length] = '\0';
+    return buffer;
+}
+
+/* this function finds the next word in a line from a given index and returns a copy of it */
+char *find_word(const char *line, int start) {
+    word_view found;
+    char *word;
+
+    if (!next_word(line, start, &found))
+        return NULL;
 
     /* Allocate memory for the word, including space for the null terminator */
-    word = (char *) malloc(word_length + 1);
+    word = (char *) malloc(found.length + 1);
     if (!word) {
-        printf("MEMORY_ALLOCATION_FAILED");
-        return NULL;
+        console_printf("MEMORY_ALLOCATION_FAILED");
+        fatal_error(); /* the callers take NULL as "no word", do not let them go on */
     }
-    
-    /* Copy the word from the line to the allocated memory */
-    memcpy(word, line + start, word_length);
-    word[word_length] = '\0'; /* Null-terminate the copied word */
-
-    return word;
+    return copy_word(&found, found.length, word);
 }
 
 /* this function checks if from a point in a line there is no other chars */
@@ -84,25 +106,41 @@ void remove_leading_whitespace(char *str) {
 
 /* this function will check if there is a line that is too long in the file */
 int check_line_lengths(const char *file_name) {
-	char line[MAX_LINE_LENGTH + 2]; /* +2 for null and \n */
-    int line_number = 0; /* to count lines */
-    
+    int result;
     FILE *file = fopen(file_name, "r"); /* open to read */
     if (!file) {
-        printf("Cannot open file %s\n", file_name);
+        console_printf("Cannot open file %s\n", file_name);
         return -1;
     }
-   
+    result = check_stream_line_lengths(file);
+    fclose(file);
+    return result;
+}
+
+/* this function will check if there is a line that is too long in an open file,
+   reading it from the current position to the end */
+int check_stream_line_lengths(FILE *file) {
+	char line[MAX_LINE_LENGTH + 2]; /* +2 for null and \n */
+    int line_number = 0; /* to count lines */
+
     /* get lines */
     while (fgets(line, sizeof(line), file)) {
         line_number++; /* count for error printing */
         if (strchr(line, '\n') == NULL && !feof(file)) { /* a line which is too long detcted */
-            printf("Error on line %d: to much charchters. the maximum line length is 80!\n", line_number); /* print error */
-            fclose(file);
+            console_printf("Error on line %d: to much charchters. the maximum line length is 80!\n", line_number); /* print error */
             return 1;
         }
     }
-    fclose(file);
+    return 0;
+}
+
+/* this function will check if there is a line that is too long in an indexed text,
+   the same check as check_stream_line_lengths, the index found the long lines while scanning */
+int check_indexed_line_lengths(const line_index *lines) {
+    if (lines -> first_long_line >= 0) { /* a line which is too long detcted */
+        console_printf("Error on line %d: to much charchters. the maximum line length is 80!\n", lines -> first_long_line + 1); /* print error */
+        return 1;
+    }
     return 0;
 }
 
@@ -126,40 +164,63 @@ char *trim_whitespace(char *str) {
 }
 
 
+/* This function hands an error or warning to the sink of the current context, the message is formatted first */
+static void report_to_sink(asm_diagnostic_sink sink, void *data, const char *file, int line, const char *format, va_list args) {
+    char message[MAX_DIAGNOSTIC_LENGTH];
+    vsnprintf(message, sizeof(message), format, args);
+    sink(data, file, line, message);
+}
+
 /* This function prints an error message to the standard output with the file name and line number where the error occurred.
-   The error message is formatted using the provided format string and additional arguments. */
+   The error message is formatted using the provided format string and additional arguments.
+   If the current context has an error sink, the message goes there instead. */
 void print_error(const char *file, int line, const char *format, ...) {
     va_list args;  /* Variable to hold the list of arguments */
+    asm_ctx *ctx = current_context();
     
     va_start(args, format);  /* Initialize the argument list */
+
+    if (ctx && ctx -> error_sink) {
+        report_to_sink(ctx -> error_sink, ctx -> sink_data, file, line, format, args);
+        va_end(args);
+        return;
+    }
     
     /* Print the error message header in red text */
-    printf("\033[1;31m~~ERROR: File: %s, Line: %d, ", file, line);
+    console_printf("\033[1;31m~~ERROR: File: %s, Line: %d, ", file, line);
     
     /* Print the formatted error message */
-    vprintf(format, args);
+    console_vprintf(format, args);
     
     /* End the error message with a footer in red text */
-    printf("~~\033[0m\n");
+    console_printf("~~\033[0m\n");
     
     va_end(args);  /* Clean up the argument list */
 }
 
 /* This function prints a warning message to the standard output with the file name and line number where the warning occurred.
-   The warning message is formatted using the provided format string and additional arguments. */
+   The warning message is formatted using the provided format string and additional arguments.
+   If the current context has a warning sink, the message goes there instead. */
 void print_warning(const char *file, int line, const char *format, ...) {
     va_list args;  /* Variable to hold the list of arguments */
+    asm_ctx *ctx = current_context();
     
     va_start(args, format);  /* Initialize the argument list */
+
+    if (ctx && ctx -> warning_sink) {
+        report_to_sink(ctx -> warning_sink, ctx -> sink_data, file, line, format, args);
+        va_end(args);
+        return;
+    }
     
     /* Print the warning message header in blue text */
-    printf("\033[1;34m~~WARNING: File: %s, Line: %d, ", file, line);
+    console_printf("\033[1;34m~~WARNING: File: %s, Line: %d, ", file, line);
     
     /* Print the formatted warning message */
-    vprintf(format, args);
+    console_vprintf(format, args);
     
     /* End the warning message with a footer in blue text */
-    printf("~~\033[0m\n");
+    console_printf("~~\033[0m\n");
     
     va_end(args);  /* Clean up the argument list */
 }
@@ -1,6 +1,56 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdio.h>
+#include "line_index.h"
+
+/* A word of a line: where it starts and how long it is. The word is not copied,
+   it points into the line and is only valid while the line is. */
+typedef struct {
+    const char *text;   /* The first character of the word */
+    int length;         /* Number of characters in the word */
+    int end;            /* The index in the line just after the word */
+} word_view;
+
+/* 
+ * Finds the next word in a string starting from a given index, without copying it.
+ * The word is defined as a sequence of non-whitespace characters.
+ * 
+ * Parameters:
+ *   line - The string to search within.
+ *   start - The index to start searching from.
+ *   word - Receives the word.
+ * 
+ * Returns:
+ *   1 if a word was found, 0 otherwise.
+ */
+int next_word(const char *line, int start, word_view *word);
+
+/* 
+ * Checks if a word is a given string.
+ * 
+ * Parameters:
+ *   word - The word.
+ *   text - The string to compare with.
+ * 
+ * Returns:
+ *   1 if they are the same, 0 otherwise.
+ */
+int word_is(const word_view *word, const char *text);
+
+/* 
+ * Copies at most length characters of a word into a buffer and null terminates it.
+ * 
+ * Parameters:
+ *   word - The word.
+ *   length - The number of characters to copy, the buffer must have room for length + 1.
+ *   buffer - Receives the string.
+ * 
+ * Returns:
+ *   The buffer.
+ */
+char *copy_word(const word_view *word, int length, char *buffer);
+
 /* 
  * Finds the next word in a string starting from a given index.
  * The word is defined as a sequence of non-whitespace characters.
@@ -55,6 +105,30 @@ void remove_leading_whitespace(char *str);
  */
 int check_line_lengths(const char *line);
 
+/* 
+ * Checks if an open file has a line that exceeds the length limit,
+ * reading it from the current position to the end.
+ * 
+ * Parameters:
+ *   file - The file to check.
+ * 
+ * Returns:
+ *   1 if a line length exceeds the limit, 0 otherwise.
+ */
+int check_stream_line_lengths(FILE *file);
+
+/* 
+ * Checks if an indexed text has a line that exceeds the length limit,
+ * the index must cut the lines like a buffer of MAX_LINE_LENGTH + 2 bytes.
+ * 
+ * Parameters:
+ *   lines - The lines of the text.
+ * 
+ * Returns:
+ *   1 if a line length exceeds the limit, 0 otherwise.
+ */
+int check_indexed_line_lengths(const line_index *lines);
+
 /* 
  * Trims leading and trailing whitespace characters from a string.
  * 
@@ -0,0 +1,562 @@
+#define _XOPEN_SOURCE 700 /* realpath() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "watch.h"
+#include "assembler.h"
+#include "console.h"
+#include "batch.h"
+#include "util.h"
+#include "libasm.h"
+
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_CREATE | IN_ONLYDIR)
+
+/* Everything the watcher keeps between two changes */
+typedef struct {
+    int inotify_fd;
+    char *root;                       /* The watched directory, without a trailing '/' */
+    watched_directory *directories;   /* The directories being watched */
+    int directory_count;
+    int directory_capacity;
+    watched_file *files;              /* The files assembled so far */
+    int file_count;
+    int file_capacity;
+    io_backend backend;
+    asm_ctx *ctx;                     /* Assembles the files, in the mode of the run */
+} watch_state;
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int signal_number) {
+    stop_requested = 1;
+}
+
+/* this function returns the watched file of a name, adding it if add is set.
+   returns NULL if it is not watched (or memory allocation failed) */
+static watched_file *find_watched_file(watch_state *state, const char *name, int add) {
+    watched_file *file;
+    int i;
+
+    for (i = 0; i < state -> file_count; i++)
+        if (strcmp(state -> files[i].name, name) == 0)
+            return &state -> files[i];
+    if (!add)
+        return NULL;
+
+    if (state -> file_count == state -> file_capacity) {
+        int new_capacity = state -> file_capacity ? state -> file_capacity * 2 : INITIAL_FILE_LIST_SIZE;
+        watched_file *new_files = realloc(state -> files, new_capacity * sizeof(watched_file));
+        if (!new_files)
+            return NULL;
+        state -> files = new_files;
+        state -> file_capacity = new_capacity;
+    }
+    file = &state -> files[state -> file_count];
+    file -> name = my_strdup(name);
+    if (!file -> name)
+        return NULL;
+    file -> source.data = NULL;
+    file -> source.size = 0;
+    initialize_assembly_output(&file -> output);
+    file -> includes.data = NULL;
+    file -> includes.size = 0;
+    file -> assembled = 0;
+    state -> file_count++;
+    return file;
+}
+
+/* this function drops what is kept of a file that was deleted or moved away */
+static void forget_watched_file(watch_state *state, const char *name) {
+    watched_file *file = find_watched_file(state, name, 0);
+
+    if (!file)
+        return;
+    free(file -> name);
+    free_memory_file(&file -> source);
+    free_assembly_output(&file -> output);
+    free_memory_file(&file -> includes);
+    *file = state -> files[--state -> file_count];
+}
+
+/* this function updates the paths of a directory that was moved and of its sub directories */
+static void rename_watched_directories(watch_state *state, const char *old_path, const char *new_path) {
+    char *old_prefix = my_strdup(old_path);
+    size_t old_length = strlen(old_path);
+    int i;
+
+    if (!old_prefix)
+        return;
+    for (i = 0; i < state -> directory_count; i++) {
+        char *path = state -> directories[i].path, *renamed;
+        if (strncmp(path, old_prefix, old_length) != 0 || (path[old_length] != '\0' && path[old_length] != '/'))
+            continue;
+        renamed = malloc(strlen(new_path) + strlen(path + old_length) + 1);
+        if (!renamed)
+            continue;
+        sprintf(renamed, "%s%s", new_path, path + old_length);
+        free(path);
+        state -> directories[i].path = renamed;
+    }
+    free(old_prefix);
+}
+
+/* this function returns the watched directory of an inotify watch descriptor, or NULL if it is not watched anymore */
+static watched_directory *find_watched_directory(const watch_state *state, int descriptor) {
+    int i;
+
+    for (i = 0; i < state -> directory_count; i++)
+        if (state -> directories[i].descriptor == descriptor)
+            return &state -> directories[i];
+    return NULL;
+}
+
+/* this function stops tracking a directory the kernel does not watch anymore (it was deleted) */
+static void forget_watched_directory(watch_state *state, int descriptor) {
+    watched_directory *directory = find_watched_directory(state, descriptor);
+
+    if (!directory)
+        return;
+    free(directory -> path);
+    *directory = state -> directories[--state -> directory_count];
+}
+
+/* this function adds a directory the kernel watches to the list. returns 0 if memory allocation failed */
+static int add_watched_directory(watch_state *state, int descriptor, const char *path, int includes_only) {
+    watched_directory *added;
+
+    if (state -> directory_count == state -> directory_capacity) {
+        int new_capacity = state -> directory_capacity ? state -> directory_capacity * 2 : INITIAL_FILE_LIST_SIZE;
+        watched_directory *new_directories = realloc(state -> directories, new_capacity * sizeof(watched_directory));
+        if (!new_directories) {
+            console_printf("Memory allocation failed\n");
+            return 0;
+        }
+        state -> directories = new_directories;
+        state -> directory_capacity = new_capacity;
+    }
+    added = &state -> directories[state -> directory_count];
+    added -> descriptor = descriptor;
+    added -> path = my_strdup(path);
+    added -> includes_only = includes_only;
+    if (!added -> path) {
+        console_printf("Memory allocation failed\n");
+        return 0;
+    }
+    state -> directory_count++;
+    return 1;
+}
+
+/* this function watches a directory and all of its sub directories.
+   returns 0 if the directory itself could not be watched */
+static int watch_directory_tree(watch_state *state, const char *path) {
+    DIR *directory;
+    struct dirent *entry;
+    watched_directory *watched;
+    int descriptor;
+
+    descriptor = inotify_add_watch(state -> inotify_fd, path, WATCH_EVENTS);
+    if (descriptor < 0) {
+        console_printf("Can not watch directory %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    watched = find_watched_directory(state, descriptor);
+    if (watched && !watched -> includes_only) {
+        rename_watched_directories(state, watched -> path, path); /* moved within the tree */
+        return 1;
+    }
+    if (watched)
+        forget_watched_directory(state, descriptor); /* it held included files, now it is part of the tree */
+    if (!add_watched_directory(state, descriptor, path, 0))
+        return 0;
+
+    directory = opendir(path);
+    if (!directory)
+        return 1;
+    while ((entry = readdir(directory)) != NULL) {
+        struct stat info;
+        char *sub_path;
+
+        if (strcmp(entry -> d_name, ".") == 0 || strcmp(entry -> d_name, "..") == 0)
+            continue;
+        sub_path = malloc(strlen(path) + strlen(entry -> d_name) + 2);
+        if (!sub_path)
+            break;
+        sprintf(sub_path, "%s/%s", path, entry -> d_name);
+        if (lstat(sub_path, &info) == 0 && S_ISDIR(info.st_mode))
+            watch_directory_tree(state, sub_path); /* a sub directory that can not be watched is reported and skipped */
+        free(sub_path);
+    }
+    closedir(directory);
+    return 1;
+}
+
+/* this function returns the real path of a file from the real path of its directory, so the file can be
+   missing, and the same file named in two ways (like "a/../b/x.inc" and "b/x.inc") gives the same path.
+   returns NULL if memory allocation failed */
+static char *real_file_path(const char *path) {
+    const char *slash = strrchr(path, '/'), *name = slash ? slash + 1 : path;
+    size_t directory_length = !slash ? 1 : slash == path ? 1 : (size_t) (slash - path);
+    char *directory = malloc(directory_length + 1), *real_directory, *real;
+
+    if (!directory)
+        return NULL;
+    memcpy(directory, slash ? path : ".", directory_length);
+    directory[directory_length] = '\0';
+    real_directory = realpath(directory, NULL);
+    free(directory);
+    if (!real_directory)
+        return my_strdup(path); /* the directory is gone too */
+    real = malloc(strlen(real_directory) + strlen(name) + 2);
+    if (real)
+        sprintf(real, "%s/%s", strcmp(real_directory, "/") == 0 ? "" : real_directory, name);
+    free(real_directory);
+    return real;
+}
+
+/* this function watches the directory of an included file (a real path), unless it is watched already.
+   one outside the tree is only watched for its included files, its sources are not assembled */
+static void watch_included_directory(watch_state *state, char *path) {
+    char *slash = strrchr(path, '/');
+    int descriptor;
+
+    *slash = '\0';
+    descriptor = inotify_add_watch(state -> inotify_fd, slash == path ? "/" : path, WATCH_EVENTS);
+    if (descriptor >= 0 && !find_watched_directory(state, descriptor))
+        add_watched_directory(state, descriptor, slash == path ? "/" : path, 1);
+    *slash = '/'; /* a directory that does not exist (yet) is not watched, its file can not appear in it */
+}
+
+/* this function keeps the real paths of the files the last source included and watches their directories,
+   so a change to one of them is seen, even outside the tree */
+static void keep_included_files(watch_state *state, watched_file *file) {
+    size_t length;
+    const char *included = asm_ctx_included_files(state -> ctx, &length), *next, *end = included + length;
+    FILE *stream;
+
+    free_memory_file(&file -> includes);
+    if (!included)
+        return;
+    stream = open_memory_file_for_writing(&file -> includes);
+    if (!stream) {
+        console_printf("Memory allocation failed\n");
+        return;
+    }
+    for (next = included; next < end; next = strchr(next, '\n') + 1) {
+        size_t path_length = strchr(next, '\n') - next;
+        char *path = malloc(path_length + 1), *real;
+        if (!path)
+            break;
+        memcpy(path, next, path_length);
+        path[path_length] = '\0';
+        real = real_file_path(path);
+        free(path);
+        if (!real)
+            break;
+        fprintf(stream, "%s\n", real);
+        watch_included_directory(state, real);
+        free(real);
+    }
+    if (fclose(stream) != 0 || next < end) {
+        console_printf("Memory allocation failed\n");
+        free_memory_file(&file -> includes);
+    }
+}
+
+/* this function adds a source to the list of changed files, unless it is already there */
+static void add_changed_file(file_list *changed, const char *path) {
+    size_t name_length = strlen(path) - 3; /* without ".as" */
+    int i;
+
+    for (i = 0; i < changed -> count; i++)
+        if (strlen(changed -> names[i]) == name_length && strncmp(changed -> names[i], path, name_length) == 0)
+            return;
+    if (!add_file_name(changed, path))
+        console_printf("Memory allocation failed\n");
+}
+
+/* this function adds the sources that included a file to the list of changed files */
+static void add_including_files(watch_state *state, file_list *changed, const char *path) {
+    char *real = real_file_path(path);
+    size_t length;
+    int i;
+
+    if (!real) {
+        console_printf("Memory allocation failed\n");
+        return;
+    }
+    length = strlen(real);
+    for (i = 0; i < state -> file_count; i++) {
+        const memory_file *includes = &state -> files[i].includes;
+        size_t start;
+        for (start = 0; start < includes -> size; start += strcspn(includes -> data + start, "\n") + 1) {
+            if (strncmp(includes -> data + start, real, length) == 0 && includes -> data[start + length] == '\n') {
+                char *source = malloc(strlen(state -> files[i].name) + 4);
+                if (!source) {
+                    console_printf("Memory allocation failed\n");
+                    break;
+                }
+                sprintf(source, "%s.as", state -> files[i].name);
+                add_changed_file(changed, source);
+                free(source);
+                break;
+            }
+        }
+    }
+    free(real);
+}
+
+/* this function assembles the changed files that are really different from what was assembled
+   last time (a source that includes files always is), and writes the outputs whose contents changed */
+static void assemble_changed_files(watch_state *state, const file_list *changed) {
+    io_file *sources = calloc(changed -> count, sizeof(io_file));
+    io_file *targets = calloc(changed -> count * OUTPUT_KINDS, sizeof(io_file));
+    io_batch reads, writes;
+    int i, kind;
+
+    if (changed -> count == 0) {
+        free(sources);
+        free(targets);
+        return;
+    }
+    if (!sources || !targets) {
+        console_printf("Memory allocation failed\n");
+        free(sources);
+        free(targets);
+        return;
+    }
+
+    for (i = 0; i < changed -> count; i++) {
+        sources[i].path = malloc(strlen(changed -> names[i]) + 4);
+        if (!sources[i].path) {
+            console_printf("Memory allocation failed\n");
+            while (i-- > 0)
+                free((char *) sources[i].path);
+            free(sources);
+            free(targets);
+            return;
+        }
+        sprintf((char *) sources[i].path, "%s.as", changed -> names[i]);
+    }
+    reads.files = sources;
+    reads.count = changed -> count;
+    io_batch_start_read(&state -> backend, &reads);
+    io_batch_finish(&state -> backend, &reads);
+
+    writes.files = targets;
+    writes.count = 0;
+    for (i = 0; i < changed -> count; i++) {
+        watched_file *file;
+        assembly_output output;
+        int result;
+
+        if (sources[i].error == ENOENT)
+            continue; /* removed again before it was read */
+        if (sources[i].error || !(file = find_watched_file(state, changed -> names[i], 1))) {
+            console_printf("Starting macro extension for file: %s.as\n", changed -> names[i]);
+            console_printf(sources[i].error ? "Can not access source file. Stop!\n" : "Memory allocation failed\n");
+            continue;
+        }
+        if (file -> assembled && file -> includes.size == 0 && file -> source.size == sources[i].contents.size &&
+            memcmp(file -> source.data, sources[i].contents.data, file -> source.size) == 0)
+            continue; /* saved, but not changed */
+
+        if (!asm_ctx_set_name(state -> ctx, file -> name)) {
+            console_printf("Memory allocation failed\n");
+            continue;
+        }
+        result = asm_assemble_buffer(state -> ctx, sources[i].contents.data, sources[i].contents.size, &output);
+
+        /* only the outputs that changed are written, the others are already on disk */
+        for (kind = 0; kind < OUTPUT_KINDS; kind++) {
+            memory_file *contents = produced_file(&output, kind);
+            memory_file *previous = produced_file(&file -> output, kind);
+            io_file *target = &targets[writes.count];
+            if (!contents)
+                continue;
+            if (previous && previous -> size == contents -> size && memcmp(previous -> data, contents -> data, contents -> size) == 0)
+                continue;
+            target -> path = malloc(strlen(file -> name) + strlen(output_extension(kind)) + 1);
+            if (!target -> path) {
+                console_printf("Memory allocation failed, the output files were not written\n");
+                continue;
+            }
+            sprintf((char *) target -> path, "%s%s", file -> name, output_extension(kind));
+            target -> contents = *contents;
+            writes.count++;
+        }
+
+        free_memory_file(&file -> source);
+        file -> source = sources[i].contents;
+        sources[i].contents.data = NULL;
+        free_assembly_output(&file -> output);
+        file -> output = output;
+        file -> assembled = result != FILE_ABORTED; /* an aborted file may do better next time */
+        keep_included_files(state, file);
+    }
+
+    io_batch_start_write(&state -> backend, &writes);
+    io_batch_finish(&state -> backend, &writes);
+    for (i = 0; i < writes.count; i++) {
+        if (targets[i].error)
+            console_printf("Can not create output file %s: %s\n", targets[i].path, strerror(targets[i].error));
+        free((char *) targets[i].path);
+    }
+    for (i = 0; i < changed -> count; i++) {
+        free((char *) sources[i].path);
+        free_memory_file(&sources[i].contents);
+    }
+    free(sources);
+    free(targets);
+    fflush(stdout);
+}
+
+/* this function reads the pending events and adds the files they touch to changed */
+static void read_events(watch_state *state, file_list *changed) {
+    char *buffer = malloc(WATCH_EVENT_BUFFER);
+    ssize_t length;
+    char *position;
+
+    if (!buffer) {
+        console_printf("Memory allocation failed\n");
+        return;
+    }
+    length = read(state -> inotify_fd, buffer, WATCH_EVENT_BUFFER);
+    for (position = buffer; length > 0 && position < buffer + length; ) {
+        struct inotify_event *event = (struct inotify_event *) position;
+        const watched_directory *watched = find_watched_directory(state, event -> wd);
+        const char *directory = watched ? watched -> path : NULL;
+        int includes_only = watched && watched -> includes_only;
+        size_t name_length = event -> len ? strlen(event -> name) : 0;
+        char *path;
+
+        position += sizeof(struct inotify_event) + event -> len;
+        if (event -> mask & IN_Q_OVERFLOW) { /* events were lost, look at everything */
+            add_directory_files(changed, state -> root);
+            continue;
+        }
+        if (event -> mask & IN_IGNORED) {
+            forget_watched_directory(state, event -> wd);
+            continue;
+        }
+        if (!directory || name_length == 0)
+            continue;
+        path = malloc(strlen(directory) + name_length + 2);
+        if (!path) {
+            console_printf("Memory allocation failed\n");
+            continue;
+        }
+        sprintf(path, "%s/%s", directory, event -> name);
+
+        if (event -> mask & IN_ISDIR) {
+            /* a new directory may already hold sources, e.g. when it was moved here */
+            if (!includes_only && (event -> mask & (IN_CREATE | IN_MOVED_TO)) && watch_directory_tree(state, path))
+                add_directory_files(changed, path);
+            free(path);
+            continue;
+        }
+        if (event -> mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM))
+            add_including_files(state, changed, path);
+        if (!includes_only && name_length > 3 && strcmp(event -> name + name_length - 3, ".as") == 0) {
+            if (event -> mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                add_changed_file(changed, path);
+            } else if (event -> mask & (IN_DELETE | IN_MOVED_FROM)) {
+                path[strlen(path) - 3] = '\0';
+                forget_watched_file(state, path);
+            }
+        }
+        free(path);
+    }
+    free(buffer);
+}
+
+int run_watch(const char *directory_name, io_backend_kind backend_kind, int mode, int emit_expanded, const macro_library *library, long macro_budget, int macro_profile) {
+    watch_state state;
+    file_list changed;
+    struct sigaction action;
+    size_t length;
+    int i;
+
+    memset(&state, 0, sizeof(state));
+    initialize_file_list(&changed);
+    state.ctx = asm_ctx_create();
+    state.root = my_strdup(directory_name);
+    state.inotify_fd = inotify_init();
+    if (!state.ctx || !state.root || state.inotify_fd < 0) {
+        console_printf(state.ctx && state.root ? "Can not start watching: %s\n" : "Memory allocation failed\n", strerror(errno));
+        asm_ctx_destroy(state.ctx);
+        free(state.root);
+        if (state.inotify_fd >= 0)
+            close(state.inotify_fd);
+        return 1;
+    }
+    asm_ctx_set_mode(state.ctx, mode);
+    asm_ctx_set_emit_am(state.ctx, emit_expanded);
+    asm_ctx_set_macro_library(state.ctx, library);
+    asm_ctx_set_macro_budget(state.ctx, macro_budget);
+    asm_ctx_set_macro_profile(state.ctx, macro_profile);
+    length = strlen(state.root);
+    while (length > 1 && state.root[length - 1] == '/')
+        state.root[--length] = '\0'; /* "dir/" and "dir" give the same names */
+
+    /* no SA_RESTART, so a signal interrupts poll and the loop can end */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = request_stop;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    io_backend_open(&state.backend, backend_kind);
+    /* the watches are set before the first run, so a save during it is not missed */
+    if (watch_directory_tree(&state, state.root) && add_directory_files(&changed, state.root)) {
+        assemble_changed_files(&state, &changed);
+        free_file_list(&changed);
+        initialize_file_list(&changed);
+        console_printf("Watching %s for changes, press Ctrl-C to stop\n", state.root);
+        fflush(stdout);
+
+        while (!stop_requested) {
+            struct pollfd ready;
+            int count;
+
+            /* once something changed, wait until the changes settle and assemble them together */
+            ready.fd = state.inotify_fd;
+            ready.events = POLLIN;
+            count = poll(&ready, 1, changed.count > 0 ? WATCH_SETTLE_MILLISECONDS : -1);
+            if (count < 0 && errno != EINTR) {
+                console_printf("Can not wait for changes: %s\n", strerror(errno));
+                break;
+            }
+            if (count > 0) {
+                read_events(&state, &changed);
+            } else if (count == 0) {
+                assemble_changed_files(&state, &changed);
+                free_file_list(&changed);
+                initialize_file_list(&changed);
+            }
+        }
+    }
+
+    io_backend_close(&state.backend);
+    close(state.inotify_fd);
+    for (i = 0; i < state.file_count; i++) {
+        free(state.files[i].name);
+        free_memory_file(&state.files[i].source);
+        free_assembly_output(&state.files[i].output);
+        free_memory_file(&state.files[i].includes);
+    }
+    for (i = 0; i < state.directory_count; i++)
+        free(state.directories[i].path);
+    free(state.files);
+    free(state.directories);
+    free(state.root);
+    asm_ctx_destroy(state.ctx);
+    free_file_list(&changed);
+    return stop_requested ? 0 : 1;
+}
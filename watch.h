@@ -0,0 +1,52 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "memory_file.h"
+#include "io_backend.h"
+#include "macro_library.h"
+
+#define WATCH_SETTLE_MILLISECONDS 50  /* Changes this close together are handled together (a save is often several events) */
+#define WATCH_EVENT_BUFFER 65536      /* Bytes of inotify events read at a time */
+
+/* A source file that is being watched, with what the last assembly of it produced.
+   A save that did not change the source is not assembled again, unless it includes
+   files, and only the outputs that changed are written. A source is assembled again
+   when a file it included changes too. Nothing else is kept: a changed source is
+   assembled from scratch, its macro and label tables are built again. */
+typedef struct {
+    char *name;               /* The file name, without the .as extension */
+    memory_file source;       /* The source, as it was last assembled */
+    assembly_output output;   /* What it produced */
+    memory_file includes;     /* The real paths of the files it included, one per line */
+    int assembled;            /* 1 once the file was assembled */
+} watched_file;
+
+/* A watched directory */
+typedef struct {
+    int descriptor;           /* The inotify watch descriptor */
+    char *path;               /* The directory */
+    int includes_only;        /* 1 for a directory outside the tree that only holds included files */
+} watched_directory;
+
+/*
+ * Assembles every .as file in a directory and its sub directories, then keeps
+ * assembling the ones that change (each one from scratch, like a normal run does)
+ * until SIGINT or SIGTERM. New sub directories are watched too, and so are the files
+ * the sources include: a change to one assembles the sources that include it again.
+ * The messages of each file are printed as in a normal run.
+ *
+ * Parameters:
+ *   directory_name - The directory to watch.
+ *   backend_kind - How the files are read and written.
+ *   mode - ASSEMBLE_FULL, or one of the fast modes (--check or --sizes).
+ *   emit_expanded - 1 to write the .am files too (--emit-am).
+ *   library - Macros the files may call without defining them (--macro-lib), or NULL.
+ *   macro_budget - Lines one macro call may expand to (--macro-budget).
+ *   macro_profile - What is printed about the macros of each file (--macro-profile).
+ *
+ * Returns:
+ *   The exit code: 0 after a clean stop, 1 if the directory could not be watched.
+ */
+int run_watch(const char *directory_name, io_backend_kind backend_kind, int mode, int emit_expanded, const macro_library *library, long macro_budget, int macro_profile);
+
+#endif
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "worker_pool.h"
+
+/* One worker's queue of job indices. The owner takes jobs from the head
+   (the heaviest ones first), idle workers steal from the tail. */
+typedef struct {
+    int *jobs;              /* Job indices, ordered from heaviest to lightest */
+    int head;               /* Next job the owner will take */
+    int tail;               /* One past the last job still in the queue */
+    pthread_mutex_t lock;   /* Guards head and tail */
+} job_queue;
+
+/* The state shared by all the workers of one pool run. */
+typedef struct {
+    job_queue *queues;
+    int worker_count;
+    pool_job_function run_job;
+    void *context;
+    const pool_throttle *throttle;
+} worker_pool;
+
+/* A worker's view of the pool */
+typedef struct {
+    worker_pool *pool;
+    int index;
+} worker;
+
+/* A job and its weight, used for sorting */
+typedef struct {
+    long weight;
+    int job;
+} weighted_job;
+
+/* sort heaviest first, equal weights keep their original order */
+static int compare_weighted_jobs(const void *a, const void *b) {
+    const weighted_job *first = a, *second = b;
+    if (first -> weight != second -> weight)
+        return first -> weight > second -> weight ? -1 : 1;
+    return first -> job - second -> job;
+}
+
+/* take the next job from the head of the worker's own queue */
+static int take_own_job(job_queue *queue) {
+    int job = -1;
+    pthread_mutex_lock(&queue -> lock);
+    if (queue -> head < queue -> tail)
+        job = queue -> jobs[queue -> head++];
+    pthread_mutex_unlock(&queue -> lock);
+    return job;
+}
+
+/* steal the lightest job from the tail of another worker's queue */
+static int steal_job(job_queue *queue) {
+    int job = -1;
+    pthread_mutex_lock(&queue -> lock);
+    if (queue -> head < queue -> tail)
+        job = queue -> jobs[--queue -> tail];
+    pthread_mutex_unlock(&queue -> lock);
+    return job;
+}
+
+/* this function finds the next job for a worker: its own first, otherwise a stolen one.
+   returns -1 if no worker has any job left */
+static int find_job(worker *self) {
+    worker_pool *pool = self -> pool;
+    int job, i;
+
+    job = take_own_job(&pool -> queues[self -> index]);
+    for (i = 1; job < 0 && i < pool -> worker_count; i++) /* nothing of our own, go stealing */
+        job = steal_job(&pool -> queues[(self -> index + i) % pool -> worker_count]);
+    return job;
+}
+
+/* this function checks whether any queue still has a job in it */
+static int jobs_left(worker_pool *pool) {
+    int i, left = 0;
+    for (i = 0; i < pool -> worker_count && !left; i++) {
+        pthread_mutex_lock(&pool -> queues[i].lock);
+        left = pool -> queues[i].head < pool -> queues[i].tail;
+        pthread_mutex_unlock(&pool -> queues[i].lock);
+    }
+    return left;
+}
+
+/* this function runs jobs until no worker has any job left.
+   no job is ever added after the start, so once every queue
+   was seen empty the worker is done */
+static void *worker_main(void *arg) {
+    worker *self = arg;
+    worker_pool *pool = self -> pool;
+    const pool_throttle *throttle = self -> index > 0 ? pool -> throttle : NULL; /* the first worker is always allowed to run */
+    int job;
+
+    for (;;) {
+        if (throttle) {
+            if (!jobs_left(pool))
+                break;
+            if (!throttle -> acquire(throttle -> context))
+                continue; /* no slot yet, maybe the others already finished the work */
+        }
+        job = find_job(self);
+        if (job >= 0)
+            pool -> run_job(pool -> context, job);
+        if (throttle)
+            throttle -> release(throttle -> context);
+        if (job < 0)
+            break;
+    }
+    return NULL;
+}
+
+/* this function frees the queues and everything run_worker_pool allocated */
+static void free_worker_pool(worker_pool *pool, worker *workers, pthread_t *threads, int *started, weighted_job *order) {
+    int i;
+    if (pool -> queues) {
+        for (i = 0; i < pool -> worker_count; i++) {
+            if (pool -> queues[i].jobs) {
+                pthread_mutex_destroy(&pool -> queues[i].lock);
+                free(pool -> queues[i].jobs);
+            }
+        }
+    }
+    free(pool -> queues);
+    free(workers);
+    free(threads);
+    free(started);
+    free(order);
+}
+
+int run_worker_pool(int worker_count, const long *job_weights, int job_count, pool_job_function run_job, void *context, const pool_throttle *throttle) {
+    worker_pool pool;
+    worker *workers;
+    pthread_t *threads;
+    weighted_job *order;
+    int *started;
+    int i;
+
+    if (worker_count > job_count)
+        worker_count = job_count; /* no point in idle workers */
+    if (worker_count < 1)
+        worker_count = 1;
+
+    pool.worker_count = worker_count;
+    pool.run_job = run_job;
+    pool.context = context;
+    pool.throttle = throttle;
+    pool.queues = calloc(worker_count, sizeof(job_queue));
+    workers = malloc(worker_count * sizeof(worker));
+    threads = malloc(worker_count * sizeof(pthread_t));
+    started = calloc(worker_count, sizeof(int));
+    order = malloc((job_count ? job_count : 1) * sizeof(weighted_job));
+    if (!pool.queues || !workers || !threads || !started || !order) {
+        free_worker_pool(&pool, workers, threads, started, order);
+        return 0;
+    }
+
+    /* step 1: order the jobs from heaviest to lightest */
+    for (i = 0; i < job_count; i++) {
+        order[i].weight = job_weights ? job_weights[i] : 0;
+        order[i].job = i;
+    }
+    qsort(order, job_count, sizeof(weighted_job), compare_weighted_jobs);
+
+    /* step 2: deal them to the queues like cards, so each worker starts with its share of heavy jobs */
+    for (i = 0; i < worker_count; i++) {
+        pool.queues[i].jobs = malloc((job_count / worker_count + 1) * sizeof(int));
+        if (!pool.queues[i].jobs) {
+            free_worker_pool(&pool, workers, threads, started, order);
+            return 0;
+        }
+        pthread_mutex_init(&pool.queues[i].lock, NULL);
+    }
+    for (i = 0; i < job_count; i++) {
+        job_queue *queue = &pool.queues[i % worker_count];
+        queue -> jobs[queue -> tail++] = order[i].job;
+    }
+
+    /* step 3: start the workers, the calling thread is worker 0.
+       if a thread can not be created its jobs are simply stolen by the others */
+    for (i = 0; i < worker_count; i++) {
+        workers[i].pool = &pool;
+        workers[i].index = i;
+    }
+    for (i = 1; i < worker_count; i++)
+        started[i] = pthread_create(&threads[i], NULL, worker_main, &workers[i]) == 0;
+    worker_main(&workers[0]);
+    for (i = 1; i < worker_count; i++)
+        if (started[i])
+            pthread_join(threads[i], NULL);
+
+    free_worker_pool(&pool, workers, threads, started, order);
+    return 1;
+}
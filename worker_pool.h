@@ -0,0 +1,38 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+/* A job function, called once for every job index on one of the workers. */
+typedef void (*pool_job_function)(void *context, int job);
+
+/* Optional limit on how many workers run a job at the same time.
+   Every worker except the first calls acquire before it takes a job and
+   release once the job is done. acquire may give up after a short wait by
+   returning 0, the worker then checks whether there is work left and tries again. */
+typedef struct {
+    int (*acquire)(void *context);
+    void (*release)(void *context);
+    void *context;
+} pool_throttle;
+
+/*
+ * Runs job_count independent jobs on worker_count workers.
+ * The jobs are sorted by weight (heaviest first) and dealt to the workers'
+ * queues, a worker that runs out of jobs steals from the others.
+ * The calling thread is used as the first worker, so worker_count - 1
+ * threads are created. Returns after all the jobs were run.
+ *
+ * Parameters:
+ *   worker_count - Number of workers to use.
+ *   job_weights - The estimated cost of each job (e.g. the input size).
+ *   job_count - Number of jobs.
+ *   run_job - The function that runs a single job.
+ *   context - Passed as is to run_job.
+ *   throttle - Limits the extra workers, or NULL to let them all run freely.
+ *
+ * Returns:
+ *   1 if all the jobs were run, 0 if the pool could not be set up
+ *   (in which case no job was run).
+ */
+int run_worker_pool(int worker_count, const long *job_weights, int job_count, pool_job_function run_job, void *context, const pool_throttle *throttle);
+
+#endif